@@ -0,0 +1,81 @@
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arith.h"
+#include "error.h"
+#include "operator.h"
+#include "value.h"
+
+static const char* overflow_policy_str[OVERFLOW_POLICY_COUNT] = {
+    [OVERFLOW_ERROR]    = "error",
+    [OVERFLOW_WRAP]     = "wrap",
+    [OVERFLOW_SATURATE] = "saturate",
+    [OVERFLOW_PROMOTE]  = "promote",
+};
+
+enum overflow_policy overflow_policy_parse(const char* name)
+{
+    for (int i = 0; i < OVERFLOW_POLICY_COUNT; i++) {
+        if (strcmp(name, overflow_policy_str[i]) == 0)
+            return i;
+    }
+    return OVERFLOW_POLICY_COUNT;
+}
+
+/* Sign of the exact result of an overflowing operation */
+static bool overflow_negative(enum operator op, int64_t a, int64_t b)
+{
+    switch (op) {
+    case OP_ADD:
+        return a < 0;
+    case OP_SUB:
+        return a < 0;
+    case OP_MUL:
+        return (a < 0) != (b < 0);
+    case OP_DIV:
+        return false; // INT64_MIN / -1
+    default:
+        return false;
+    }
+}
+
+static double promote(enum operator op, int64_t a, int64_t b)
+{
+    switch (op) {
+    case OP_ADD:
+        return (double)a + (double)b;
+    case OP_SUB:
+        return (double)a - (double)b;
+    case OP_MUL:
+        return (double)a * (double)b;
+    case OP_DIV:
+        return (double)a / (double)b;
+    default:
+        return 0.0;
+    }
+}
+
+bool arith_overflow(Error* err, enum overflow_policy policy, enum operator op,
+                    int64_t a, int64_t b, Value* result)
+{
+    switch (policy) {
+    case OVERFLOW_WRAP:
+        return true;
+
+    case OVERFLOW_SATURATE:
+        result->i64 = overflow_negative(op, a, b) ? INT64_MIN : INT64_MAX;
+        return true;
+
+    case OVERFLOW_PROMOTE:
+        result->type = VALUE_FLOATING;
+        result->f64  = promote(op, a, b);
+        return true;
+
+    case OVERFLOW_ERROR:
+    default:
+        error_push(err, "integer overflow: %" PRId64 " %s %" PRId64, a, op_table[op].str, b);
+        return false;
+    }
+}
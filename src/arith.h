@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "operator.h"
+#include "value.h"
+
+/* Parse policy name, returns OVERFLOW_POLICY_COUNT if unknown */
+enum overflow_policy overflow_policy_parse(const char* name);
+
+/* Integer kernels. Each returns true if the operation overflowed, *res holds
+ * the wrapped result either way, so the common case is a single well
+ * predicted branch on the return value */
+static inline bool arith_add_i64(int64_t a, int64_t b, int64_t* res)
+{
+    return __builtin_add_overflow(a, b, res);
+}
+
+static inline bool arith_sub_i64(int64_t a, int64_t b, int64_t* res)
+{
+    return __builtin_sub_overflow(a, b, res);
+}
+
+static inline bool arith_mul_i64(int64_t a, int64_t b, int64_t* res)
+{
+    return __builtin_mul_overflow(a, b, res);
+}
+
+/* b must not be zero. INT64_MIN / -1 is the only overflowing division */
+static inline bool arith_div_i64(int64_t a, int64_t b, int64_t* res)
+{
+    bool ovf = (a == INT64_MIN) & (b == -1);
+    *res = ovf ? a : a / (ovf ? 1 : b);
+    return ovf;
+}
+
+/* Slow path: apply policy to `a op b` that overflowed. result holds the
+ * wrapped result on entry. Returns false and pushes to err if the policy is
+ * OVERFLOW_ERROR */
+bool arith_overflow(Error* err, enum overflow_policy policy, enum operator op,
+                    int64_t a, int64_t b, Value* result);
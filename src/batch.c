@@ -0,0 +1,310 @@
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arith.h"
+#include "batch.h"
+#include "error.h"
+#include "expr.h"
+#include "mem.h"
+#include "operator.h"
+#include "profile.h"
+#include "tokenizer.h"
+#include "trace.h"
+#include "value.h"
+
+#define TOKEN_KEY(t) (uint16_t)((t)->type << 8 | (t)->op)
+
+bool batch_scan(TokenStream* ts, BatchScan* s)
+{
+    s->literals = 0;
+    for (uint32_t k = 0; k <= BATCH_MAX_TOKENS; k++) {
+        const Token* t = tokenstream_peek(ts, k);
+        switch (t->type) {
+        case TOKEN_STATEMENT_END:
+            s->len = k;
+            return k > 0;
+        case TOKEN_INTEGER:
+        case TOKEN_FLOATING:
+            s->literals++;
+            // fallthrough
+        case TOKEN_OPERATOR:
+        case TOKEN_PAREN_OPEN:
+        case TOKEN_PAREN_CLOSE:
+            if (k == BATCH_MAX_TOKENS)
+                return false;
+            s->tokens[k] = TOKEN_KEY(t);
+            break;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+/* ======= Compiling a shape ======= */
+
+struct compiler {
+    Batch* b;
+    const ExprArena* a;
+    uint32_t literals; // columns handed out to literals so far
+    uint32_t max;      // literals of the statement
+};
+
+/* Column holding the value of id, -1 if it can't be batched. Literals are
+ * reached left to right, in the order of their tokens */
+static int compile_node(struct compiler* c, ExprId id)
+{
+    Batch* b = c->b;
+    const ExprNode* n = &c->a->nodes[id];
+    if (n->type != VALUE_INTEGER && n->type != VALUE_FLOATING)
+        return -1;
+    if (n->kind == EXPR_LITERAL) {
+        if (c->literals == c->max)
+            return -1;
+        b->types[c->literals] = n->type;
+        return c->literals++;
+    }
+    // a column runs for every row, && and || would compute their right
+    // operand where it has to be skipped
+    if (n->kind != EXPR_BINARY || (op_table[n->op].flags & OP_SHORT_CIRCUIT))
+        return -1;
+
+    const bool unary = op_table[n->op].flags & OP_UNARY;
+    const int lhs = compile_node(c, n->lhs);
+    const int rhs = unary || lhs < 0 ? lhs : compile_node(c, n->rhs);
+    if (rhs < 0 || b->code_len == BATCH_MAX_TOKENS)
+        return -1;
+    struct batch_insn* in = &b->code[b->code_len];
+    *in = (struct batch_insn){
+        .op     = n->op,
+        .lt     = c->a->nodes[n->lhs].type,
+        .rt     = c->a->nodes[n->rhs].type,
+        .type   = n->type,
+        .lhs    = lhs,
+        .rhs    = rhs,
+        .out    = c->max + b->code_len,
+    };
+    if (n->kernel == OP_KERNEL_DYNAMIC)
+        return -1;
+    in->kernel = op_kernels[n->kernel];
+    b->code_len++;
+    return in->out;
+}
+
+bool batch_compile(Error* err, Batch* b, const ExprArena* a, ExprId root, const BatchScan* s)
+{
+    b->shape.len = 0;
+    b->code_len  = 0;
+    struct compiler c = {.b = b, .a = a, .max = s->literals};
+    const int column = compile_node(&c, root);
+    if (column < 0 || c.literals != s->literals)
+        return false;
+
+    if (!b->cells) {
+        b->cells = mem_alloc(MEM_PARSER, (size_t)2 * BATCH_MAX_TOKENS * BATCH_ROWS * sizeof *b->cells);
+        b->starts = mem_alloc(MEM_PARSER, BATCH_ROWS * sizeof *b->starts);
+        b->ends   = mem_alloc(MEM_PARSER, BATCH_ROWS * sizeof *b->ends);
+        if (!b->cells || !b->starts || !b->ends) {
+            error_push(err, "failed to allocate statement batch: %s", strerror(errno));
+            return false;
+        }
+    }
+    b->shape     = *s;
+    b->columns   = s->literals + b->code_len;
+    b->root      = column;
+    b->root_type = a->nodes[root].type;
+    return true;
+}
+
+/* ======= Gathering literals ======= */
+
+static union batch_cell* column(const Batch* b, uint32_t i)
+{
+    return &b->cells[(size_t)i * BATCH_ROWS];
+}
+
+bool batch_add(Batch* b, TokenStream* ts, uint64_t statement)
+{
+    const uint32_t row = b->rows;
+    uint32_t literal = 0;
+    for (uint32_t k = 0; k < b->shape.len; k++) {
+        const Token* t = tokenstream_peek(ts, k);
+        union batch_cell* cell = &column(b, literal)[row];
+        // parsed as parse_int and parse_floating do
+        errno = 0;
+        if (t->type == TOKEN_INTEGER) {
+            const int64_t v = strtol(t->start, NULL, 10);
+            if (b->types[literal] == VALUE_FLOATING)
+                cell->f = (double)v; // the int literal was converted
+            else
+                cell->i = v;
+        } else if (t->type == TOKEN_FLOATING) {
+            cell->f = strtod(t->start, NULL);
+        } else {
+            continue;
+        }
+        if (errno != 0)
+            return false;
+        literal++;
+    }
+    if (row == 0)
+        b->first = statement;
+    b->starts[row] = tokenstream_cur(ts)->start;
+    b->ends[row] = tokenstream_peek(ts, b->shape.len)->start;
+    b->rows++;
+    return true;
+}
+
+/* ======= Running a batch ======= */
+
+/* in over rows [0, n) with its kernel, one row at a time. Returns n, or the
+ * first row that failed with err set */
+static uint32_t column_scalar(Error* err, const struct batch_insn* in, union batch_cell* o,
+                              const union batch_cell* l, const union batch_cell* r, uint32_t n,
+                              ExprArena* a)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        Value lv = {.type = in->lt, .i64 = l[i].i};
+        Value rv = {.type = in->rt, .i64 = r[i].i};
+        Value out;
+        if (!in->kernel(err, a->overflow, &a->strs, &lv, &rv, &out))
+            return i;
+        o[i].i = out.i64;
+    }
+    return n;
+}
+
+#define COLUMN(expr)                     \
+    do {                                 \
+        for (uint32_t i = 0; i < n; i++) \
+            expr;                        \
+    } while (0)
+
+/* in over rows [0, n). The common operators are plain loops over the
+ * columns, which the release build vectorizes. The int ones only note
+ * whether anything overflowed and leave that rare case to the kernel.
+ * Returns n, or the first row that failed */
+static uint32_t column_run(Error* err, Batch* b, const struct batch_insn* in, uint32_t n,
+                           ExprArena* a)
+{
+    union batch_cell* o = column(b, in->out);
+    const union batch_cell* l = column(b, in->lhs);
+    const union batch_cell* r = column(b, in->rhs);
+    bool ovf = false;
+
+    if (in->lt == VALUE_FLOATING && in->rt == VALUE_FLOATING) {
+        switch (in->op) {
+        case OP_ADD: COLUMN(o[i].f = l[i].f + r[i].f); return n;
+        case OP_SUB: COLUMN(o[i].f = l[i].f - r[i].f); return n;
+        case OP_MUL: COLUMN(o[i].f = l[i].f * r[i].f); return n;
+        case OP_DIV: COLUMN(o[i].f = l[i].f / r[i].f); return n;
+        case OP_EQ:  COLUMN(o[i].i = l[i].f == r[i].f); return n;
+        case OP_NE:  COLUMN(o[i].i = l[i].f != r[i].f); return n;
+        case OP_LT:  COLUMN(o[i].i = l[i].f < r[i].f);  return n;
+        case OP_LE:  COLUMN(o[i].i = l[i].f <= r[i].f); return n;
+        case OP_GT:  COLUMN(o[i].i = l[i].f > r[i].f);  return n;
+        case OP_GE:  COLUMN(o[i].i = l[i].f >= r[i].f); return n;
+        case OP_NOT: COLUMN(o[i].i = l[i].f == 0.0); return n;
+        default:
+            break;
+        }
+    } else if (in->lt == VALUE_INTEGER && in->rt == VALUE_INTEGER) {
+        switch (in->op) {
+        case OP_ADD: COLUMN(ovf |= arith_add_i64(l[i].i, r[i].i, &o[i].i)); goto checked;
+        case OP_SUB: COLUMN(ovf |= arith_sub_i64(l[i].i, r[i].i, &o[i].i)); goto checked;
+        case OP_MUL: COLUMN(ovf |= arith_mul_i64(l[i].i, r[i].i, &o[i].i)); goto checked;
+        case OP_EQ:  COLUMN(o[i].i = l[i].i == r[i].i); return n;
+        case OP_NE:  COLUMN(o[i].i = l[i].i != r[i].i); return n;
+        case OP_LT:  COLUMN(o[i].i = l[i].i < r[i].i);  return n;
+        case OP_LE:  COLUMN(o[i].i = l[i].i <= r[i].i); return n;
+        case OP_GT:  COLUMN(o[i].i = l[i].i > r[i].i);  return n;
+        case OP_GE:  COLUMN(o[i].i = l[i].i >= r[i].i); return n;
+        case OP_BAND: COLUMN(o[i].i = l[i].i & r[i].i); return n;
+        case OP_BOR:  COLUMN(o[i].i = l[i].i | r[i].i); return n;
+        case OP_BXOR: COLUMN(o[i].i = l[i].i ^ r[i].i); return n;
+        case OP_NOT:  COLUMN(o[i].i = l[i].i == 0);    return n;
+        case OP_BNOT: COLUMN(o[i].i = ~l[i].i);        return n;
+        case OP_TO_FLOAT: COLUMN(o[i].f = (double)l[i].i); return n;
+        default:
+            break;
+        }
+    }
+    return column_scalar(err, in, o, l, r, n, a);
+
+checked:
+    // the wrapped results are already right for OVERFLOW_WRAP
+    if (!ovf || a->overflow == OVERFLOW_WRAP)
+        return n;
+    return column_scalar(err, in, o, l, r, n, a);
+}
+
+bool batch_flush(Error* err, Batch* b, ExprArena* a,
+                 void (*on_result)(void* user, uint64_t statement, const Value* v), void* user,
+                 uint64_t* failed, const char** failed_at)
+{
+    if (b->rows == 0)
+        return true;
+    TraceSpan span = trace_begin("batch");
+
+    // a statement that fails stops the batch there. Those after it can be
+    // skipped by the following instructions, the first failure of a
+    // statement is the one it would have reported alone
+    uint32_t n = b->rows;
+    Error first = ERROR_INIT;
+    for (uint32_t k = 0; k < b->code_len && n > 0; k++) {
+        Error e = ERROR_INIT;
+        const uint32_t stop = column_run(&e, b, &b->code[k], n, a);
+        if (stop < n) {
+            error_clear(&first);
+            error_append(&first, &e);
+            n = stop;
+        }
+        if (profile_due())
+            profile_here_("batch");
+    }
+
+    if (on_result) {
+        const union batch_cell* root = column(b, b->root);
+        for (uint32_t i = 0; i < n; i++) {
+            Value v = {.type = b->root_type, .i64 = root[i].i};
+            on_result(user, b->first + i, &v);
+        }
+    }
+    a->batched += n;
+    const bool ok = n == b->rows;
+    if (ok) {
+        b->rows = 0;
+    } else {
+        *failed    = b->first + n;
+        *failed_at = b->ends[n];
+        error_append(err, &first);
+    }
+    trace_end(span);
+    return ok;
+}
+
+void batch_drop(Batch* b, uint32_t n)
+{
+    // only the literal columns move, the others are computed again
+    const uint32_t left = b->rows - n;
+    for (uint32_t i = 0; i < b->shape.literals; i++)
+        memmove(column(b, i), column(b, i) + n, left * sizeof *b->cells);
+    memmove(b->starts, b->starts + n, left * sizeof *b->starts);
+    memmove(b->ends, b->ends + n, left * sizeof *b->ends);
+    b->first += n;
+    b->rows   = left;
+}
+
+void batch_free(Batch* b)
+{
+    mem_free(b->cells);
+    mem_free(b->starts);
+    mem_free(b->ends);
+    b->cells  = NULL;
+    b->starts = NULL;
+    b->ends   = NULL;
+    b->rows  = 0;
+    b->shape.len = 0;
+}
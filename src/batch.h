@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "expr.h"
+#include "operator.h"
+#include "tokenizer.h"
+#include "value.h"
+
+/* Shape-batched evaluation of top level statements. Generated programs
+ * are often long runs of statements like `a + b * c;` that differ only in
+ * their literals. The tokens of such a statement, with literal values left
+ * out, are its shape. The first statement of a shape is parsed and run as
+ * usual, and its tree is compiled into a short program of column
+ * operations. The following statements of the same shape are not parsed:
+ * their literals are appended to one column each, and once the run ends or
+ * BATCH_ROWS statements are waiting, every operation of the program runs
+ * over a whole column in one loop.
+ *
+ * Only statements of int and float literals, operators other than && and
+ * || and parentheses short enough to be seen through the token lookahead
+ * are batched. The
+ * results and errors are those the statements would have had one by one,
+ * see batch_flush. */
+
+#define BATCH_MAX_TOKENS (TOKENSTREAM_LOOKAHEAD - 1) // before the ';'
+#define BATCH_ROWS 1024
+
+/* Tokens of a statement up to its ';', as type and operator */
+typedef struct batch_scan {
+    uint16_t tokens[BATCH_MAX_TOKENS];
+    uint32_t len;
+    uint32_t literals;
+} BatchScan;
+
+/* One column operation, out = lhs op rhs */
+struct batch_insn {
+    uint8_t op;       // enum operator
+    uint8_t lt;       // operand types
+    uint8_t rt;
+    uint8_t type;     // result type
+    uint8_t lhs;      // column indices
+    uint8_t rhs;
+    uint8_t out;
+    op_kernel kernel;
+};
+
+union batch_cell {
+    int64_t i;
+    double f;
+};
+
+/* A Batch starts zeroed, batch_free releases it */
+typedef struct batch {
+    BatchScan shape;   // len is 0 if there is no compiled shape
+    uint8_t types[BATCH_MAX_TOKENS]; // type of each literal column
+    struct batch_insn code[BATCH_MAX_TOKENS];
+    uint32_t code_len;
+    uint32_t columns;  // literals, then one per instruction, at most
+                       // 2 * BATCH_MAX_TOKENS with int to float conversions
+    uint8_t root;      // column of the result
+    uint8_t root_type;
+
+    union batch_cell* cells; // columns * BATCH_ROWS, column-major
+    const char** starts;     // first token of each waiting statement
+    const char** ends;       // and its ';', for errors
+    uint32_t rows;           // statements waiting
+    uint64_t first;          // index of the first of them
+} Batch;
+
+/* Reads the statement starting at the current token of ts without
+ * consuming it. False if it isn't made of literals, operators and
+ * parentheses, or is too long */
+bool batch_scan(TokenStream* ts, BatchScan* s);
+
+/* Compiles root, the tree the statement scanned into s was parsed into, as
+ * the shape of the next statements. False if it can't be batched, like a
+ * tree whose type is only known at run time */
+bool batch_compile(Error* err, Batch* b, const ExprArena* a, ExprId root, const BatchScan* s);
+
+/* True if the statement scanned into s has the compiled shape */
+static inline bool batch_matches(const Batch* b, const BatchScan* s)
+{
+    return b->shape.len != 0 && b->shape.len == s->len
+        && __builtin_memcmp(b->shape.tokens, s->tokens, s->len * sizeof *s->tokens) == 0;
+}
+
+/* Appends the literals of the matching statement at the current token of
+ * ts as statement number statement, the caller then moves ts to its ';'.
+ * False if a literal can't be parsed, the normal path reports that */
+bool batch_add(Batch* b, TokenStream* ts, uint64_t statement);
+
+/* Runs the waiting statements and reports their results in order. If one
+ * fails, the results before it are reported, err says why as evaluating it
+ * alone would have, and *failed and *failed_at are set to its index and to
+ * its ';'. Then the batch is left as it was, for the caller to drop the
+ * failed statement and those before it with batch_drop, or all of them by
+ * setting rows to 0 */
+bool batch_flush(Error* err, Batch* b, ExprArena* a,
+                 void (*on_result)(void* user, uint64_t statement, const Value* v), void* user,
+                 uint64_t* failed, const char** failed_at);
+
+/* Drops the first n waiting statements */
+void batch_drop(Batch* b, uint32_t n);
+
+void batch_free(Batch* b);
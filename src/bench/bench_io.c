@@ -0,0 +1,168 @@
+
+/* Compares the Mfile I/O modes by lexing a file with a cold and a warm page
+ * cache. Each run happens in a forked child so its peak RSS can be reported.
+ *
+ *    bench_io [file]
+ *
+ * Without a file argument a temporary input of BENCH_DEFAULT_MB is generated.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "file_stream.h"
+#include "tokenizer.h"
+
+#define BENCH_DEFAULT_MB 64
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int generate(const char* path, size_t mb)
+{
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror("fopen");
+        return -1;
+    }
+    static const char line[] = "12345 + 678 * (9 - 10.25) / 3;\n";
+    size_t target = mb * 1024 * 1024;
+    for (size_t n = 0; n < target; n += sizeof line - 1) {
+        fputs(line, f);
+    }
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        perror("fflush");
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void drop_cache(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return;
+    }
+    int ok = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    if (ok != 0) {
+        fprintf(stderr, "posix_fadvise: %s\n", strerror(ok));
+    }
+    close(fd);
+}
+
+static int lex_file(const char* path, enum mfile_mode mode)
+{
+    Error err = ERROR_INIT;
+    Mfile* m = mfile_open_mode(&err, (char*)path, mode);
+    if (!error_empty(&err)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    size_t tokens = 0;
+    for (;;) {
+        Token t;
+        token_read_into(&err, m, &t);
+        if (!error_empty(&err)) {
+            error_print(&err);
+            return EXIT_FAILURE;
+        }
+        if (t.type == TOKEN_EOF)
+            break;
+        tokens++;
+    }
+    mfile_close(&err, m);
+    if (!error_empty(&err)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    return tokens > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int run(const char* path, size_t size, enum mfile_mode mode, bool cold)
+{
+    if (cold)
+        drop_cache(path);
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        _exit(lex_file(path, mode));
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1) {
+        perror("wait4");
+        return -1;
+    }
+    double elapsed = now() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "%s run failed\n", mfile_mode_name(mode));
+        return -1;
+    }
+
+    printf("%-12s %-5s %9.3f s %9.1f MiB/s %9ld KiB maxrss %9ld majflt\n",
+           mfile_mode_name(mode), cold ? "cold" : "warm", elapsed,
+           size / (1024.0 * 1024.0) / elapsed, ru.ru_maxrss, ru.ru_majflt);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    char tmp[] = "/tmp/bench_io_XXXXXX";
+    const char* path;
+
+    if (argc > 1) {
+        path = argv[1];
+    } else {
+        int fd = mkstemp(tmp);
+        if (fd == -1) {
+            perror("mkstemp");
+            return EXIT_FAILURE;
+        }
+        close(fd);
+        path = tmp;
+        fprintf(stderr, "generating %d MiB input in %s\n", BENCH_DEFAULT_MB, path);
+        if (generate(path, BENCH_DEFAULT_MB) != 0) {
+            unlink(tmp);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct stat sb;
+    if (stat(path, &sb) == -1) {
+        perror("stat");
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (int mode = 0; mode < MFILE_MODE_COUNT; mode++) {
+        if (run(path, sb.st_size, mode, true) != 0
+         || run(path, sb.st_size, mode, false) != 0)
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    if (path == tmp)
+        unlink(tmp);
+    return status;
+}
@@ -0,0 +1,552 @@
+
+/* Complexity fuzzer: looks for inputs whose cost grows faster than their
+ * size. An input family is a head, a unit repeated to reach the size, a
+ * middle, a closing unit repeated as often and a tail, as in deep nesting
+ * "((((1))))". Every family is generated at doubling sizes and each size is
+ * lexed, run until the first error and run with error recovery. Time and
+ * peak memory per byte are measured for each phase, and a family whose cost
+ * grows faster than linearly is flagged.
+ *
+ * A flagged family is minimized by dropping parts of its unit for as long
+ * as it stays flagged, and the smallest input that shows the growth is
+ * saved to the output directory, next to a .txt with the measurements.
+ *
+ *    fuzz_complexity [-v] [-n RANDOM] [-s SEED] [-m MAX_LOG2] [-o DIR] [-u FILE]...
+ *
+ * Besides the built in families, RANDOM families (default 40) get units
+ * made of random token fragments, and -u adds a family whose unit is the
+ * contents of FILE, so inputs found by AFL or another fuzzer can be checked
+ * for their growth. Sizes go from 4 KiB to 2^MAX_LOG2 bytes (default 20),
+ * and -v prints the measurements of every size.
+ *
+ * Built with -DFUZZ_LIBFUZZER and clang -fsanitize=fuzzer, the libFuzzer
+ * entry point takes each input as the unit of a family, and aborts if it
+ * is flagged so libFuzzer keeps it as a crash. Memory is measured with the
+ * counters of mem.h, so this is built without NDEBUG.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "file_stream.h"
+#include "lang.h"
+#include "mem.h"
+#include "tokenizer.h"
+
+#define MIN_LOG2      12
+#define MAX_SIZES     24
+#define TIMEOUT_MS    4000   // a run this long is flagged by itself
+#define SLOW_SECONDS  0.5    // sizes stop growing past a run this long
+#define MIN_SECONDS   0.002  // shorter runs are too noisy to compare
+#define MIN_PEAK      (1 << 20)
+#define TIME_EXPONENT 1.35   // flagged above these growth exponents
+#define MEM_EXPONENT  1.2
+#define MAX_CHECKS    40     // measurements a minimization may take
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ======= Input families ======= */
+
+#define PART 256
+
+struct family {
+    char name[64];
+    char head[PART];
+    char unit[PART]; // a %u in it is replaced by the repetition number
+    char mid[PART];
+    char close[PART];
+    char tail[PART];
+};
+
+/* Appends s with %u replaced by n, returns the new length */
+static size_t put(char* buf, size_t len, const char* s, uint32_t n)
+{
+    for (; *s; s++) {
+        if (s[0] == '%' && s[1] == 'u') {
+            len += sprintf(buf + len, "%u", n);
+            s++;
+        } else {
+            buf[len++] = *s;
+        }
+    }
+    return len;
+}
+
+/* The input of family f of about size bytes, in a buffer of room bytes */
+static size_t build(const struct family* f, size_t size, char* buf, size_t room)
+{
+    const size_t fixed = strlen(f->head) + strlen(f->mid) + strlen(f->tail);
+    const size_t step  = strlen(f->unit) + strlen(f->close) + 1;
+    size_t len = put(buf, 0, f->head, 0);
+    uint32_t reps = 0;
+    while (len + fixed + step < size && len + 2 * (fixed + step + 16) < room) {
+        len = put(buf, len, f->unit, reps);
+        reps++;
+        // the closing units go at the end, count them in
+        size -= strlen(f->close) < size ? strlen(f->close) : 0;
+    }
+    len = put(buf, len, f->mid, reps);
+    for (uint32_t i = 0; i < reps; i++)
+        len = put(buf, len, f->close, i);
+    len = put(buf, len, f->tail, reps);
+    buf[len] = '\0';
+    return len;
+}
+
+/* ======= Phases ======= */
+
+enum phase { PHASE_LEX, PHASE_RUN, PHASE_RECOVER, PHASE_COUNT };
+
+static const char* const phase_str[PHASE_COUNT] = {
+    [PHASE_LEX]     = "lex",
+    [PHASE_RUN]     = "run",
+    [PHASE_RECOVER] = "recover",
+};
+
+/* Lexes all of src, skipping past lexer errors as error recovery does */
+static void lex(const char* src, size_t len)
+{
+    Error err = ERROR_INIT;
+    Mfile* m = mfile_open_buffer(&err, src, len);
+    if (!m) {
+        error_clear(&err);
+        return;
+    }
+    TokenStream ts = tokenstream_attach(&err, m);
+    while (tokenstream_cur(&ts)->type != TOKEN_EOF) {
+        if (!error_empty(&err)) {
+            error_clear(&err);
+            tokenstream_skip_statement(&err, &ts, 0);
+        } else {
+            tokenstream_advance(&err, &ts);
+        }
+    }
+    error_clear(&err);
+    tokenstream_close(&ts);
+    mfile_close(NULL, m);
+}
+
+/* Formats every diagnostic, as a host reporting them would */
+static void format_error(void* user, const LangDiagnostic* d)
+{
+    char* line = user;
+    snprintf(line, 512, "%d:%d: %s error in statement %llu: %s", d->line, d->col,
+             lang_error_kind_str[d->kind], (unsigned long long)d->statement, d->message);
+}
+
+/* Runs src, returns false if it ran out of time */
+static bool run(const char* src, size_t len, bool recover)
+{
+    LangOptions opts = LANG_OPTIONS_INIT;
+    opts.threads    = 1;
+    opts.timeout_ms = TIMEOUT_MS;
+    opts.max_errors = recover ? UINT32_MAX : 0;
+    LangCtx* ctx = lang_ctx_new(&opts);
+    if (!ctx)
+        return true;
+    char line[512];
+    lang_set_error_handler(ctx, format_error, line);
+    bool timely = true;
+    if (!lang_eval_buffer(ctx, src, len)) {
+        int l, c;
+        lang_error_position(ctx, &l, &c);
+        timely = !strstr(lang_error(ctx), "time budget");
+    }
+    lang_ctx_free(ctx);
+    return timely;
+}
+
+struct sample {
+    size_t len;
+    double seconds; // best of a few runs
+    size_t peak;    // bytes above what was live before
+    bool timed_out;
+};
+
+static struct sample measure(enum phase phase, const char* src, size_t len)
+{
+    struct sample s = {.len = len, .seconds = INFINITY};
+    for (int rep = 0; rep < 3 && (rep == 0 || s.seconds < 0.1); rep++) {
+        mem_peak_reset();
+        const size_t base = mem_peak();
+        const double t0 = now();
+        bool timely = true;
+        if (phase == PHASE_LEX)
+            lex(src, len);
+        else
+            timely = run(src, len, phase == PHASE_RECOVER);
+        const double t = now() - t0;
+        s.seconds   = t < s.seconds ? t : s.seconds;
+        s.peak      = mem_peak() - base;
+        s.timed_out = !timely;
+        if (s.timed_out)
+            break;
+    }
+    return s;
+}
+
+/* ======= Growth ======= */
+
+struct series {
+    struct sample at[MAX_SIZES];
+    uint32_t len;
+    double time_exp; // growth exponents between the two largest usable sizes
+    double mem_exp;
+    bool flagged;
+    uint32_t shown;  // index of the smallest size that shows the growth
+};
+
+static double exponent(double a, double b, size_t na, size_t nb)
+{
+    return log(b / a) / log((double)nb / na);
+}
+
+/* Flags growth that is worse than linear over two steps in a row, and over
+ * all the sizes that were measured long enough, so that noise and a cache
+ * running out at one size don't */
+static void analyze(struct series* s)
+{
+    s->time_exp = s->mem_exp = 0;
+    s->flagged  = false;
+    uint32_t time_run = 0, mem_run = 0;
+    int first_time = -1, first_mem = -1;
+    for (uint32_t i = 1; i < s->len; i++) {
+        const struct sample* a = &s->at[i - 1];
+        const struct sample* b = &s->at[i];
+        if (b->timed_out) {
+            s->flagged  = true;
+            s->shown    = i;
+            s->time_exp = INFINITY;
+            return;
+        }
+        if (a->seconds >= MIN_SECONDS) {
+            first_time = first_time < 0 ? (int)i - 1 : first_time;
+            const double step = exponent(a->seconds, b->seconds, a->len, b->len);
+            time_run = step > TIME_EXPONENT ? time_run + 1 : 0;
+            const struct sample* f = &s->at[first_time];
+            s->time_exp = exponent(f->seconds, b->seconds, f->len, b->len);
+        }
+        if (a->peak >= MIN_PEAK / 4 && b->peak >= MIN_PEAK) {
+            first_mem = first_mem < 0 ? (int)i - 1 : first_mem;
+            const double step = exponent(a->peak, b->peak, a->len, b->len);
+            mem_run = step > MEM_EXPONENT ? mem_run + 1 : 0;
+            const struct sample* f = &s->at[first_mem];
+            s->mem_exp = exponent(f->peak, b->peak, f->len, b->len);
+        }
+        if ((time_run >= 2 && s->time_exp > TIME_EXPONENT)
+         || (mem_run >= 2 && s->mem_exp > MEM_EXPONENT))
+        {
+            s->flagged = true;
+            s->shown   = i;
+            return;
+        }
+    }
+}
+
+static char* input;
+static size_t input_room;
+
+/* Measures phase of f at doubling sizes up to max_size */
+static void grow(const struct family* f, enum phase phase, size_t max_size, struct series* s)
+{
+    s->len = 0;
+    for (size_t size = (size_t)1 << MIN_LOG2; size <= max_size && s->len < MAX_SIZES; size *= 2) {
+        const size_t len = build(f, size, input, input_room);
+        if (s->len > 0 && len <= s->at[s->len - 1].len)
+            break; // the unit is empty
+        s->at[s->len++] = measure(phase, input, len);
+        analyze(s);
+        if (s->flagged || s->at[s->len - 1].seconds > SLOW_SECONDS)
+            break;
+    }
+}
+
+/* Drops parts of the unit of f, halves, then quarters and so on, for as
+ * long as the family stays flagged at sizes up to max_size */
+static void minimize(struct family* f, enum phase phase, size_t max_size, struct series* s)
+{
+    uint32_t checks = 0;
+    for (size_t chunk = strlen(f->unit) / 2; chunk > 0 && checks < MAX_CHECKS; chunk /= 2) {
+        for (size_t at = 0; at < strlen(f->unit) && checks < MAX_CHECKS; ) {
+            struct family g = *f;
+            const size_t len = strlen(g.unit);
+            const size_t n = at + chunk <= len ? chunk : len - at;
+            memmove(g.unit + at, g.unit + at + n, len - at - n + 1);
+            if (g.unit[0] == '\0') {
+                at += n;
+                continue;
+            }
+            struct series t;
+            grow(&g, phase, max_size, &t);
+            checks++;
+            if (t.flagged) {
+                *f = g;
+                *s = t;
+            } else {
+                at += n;
+            }
+        }
+    }
+}
+
+static void write_part(FILE* out, const char* name, const char* s)
+{
+    fprintf(out, "%-5s \"", name);
+    for (; *s; s++) {
+        if (*s == '\n')
+            fprintf(out, "\\n");
+        else if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else
+            fputc(*s, out);
+    }
+    fprintf(out, "\"\n");
+}
+
+/* Saves the smallest input of s that shows the growth, and what was measured */
+static void save(const char* dir, const struct family* f, enum phase phase, const struct series* s)
+{
+    char path[512];
+    const size_t len = build(f, (size_t)1 << (MIN_LOG2 + s->shown), input, input_room);
+    snprintf(path, sizeof path, "%s/%s-%s.lang", dir, f->name, phase_str[phase]);
+    FILE* out = fopen(path, "w");
+    if (!out || fwrite(input, 1, len, out) != len) {
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+        if (out)
+            fclose(out);
+        return;
+    }
+    fclose(out);
+
+    snprintf(path, sizeof path, "%s/%s-%s.txt", dir, f->name, phase_str[phase]);
+    out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(out, "%s grows faster than linearly in phase %s\n", f->name, phase_str[phase]);
+    write_part(out, "head", f->head);
+    write_part(out, "unit", f->unit);
+    write_part(out, "mid", f->mid);
+    write_part(out, "close", f->close);
+    write_part(out, "tail", f->tail);
+    fprintf(out, "%10s %12s %12s %12s\n", "bytes", "ns/byte", "peak bytes", "bytes/byte");
+    for (uint32_t i = 0; i < s->len; i++) {
+        const struct sample* a = &s->at[i];
+        fprintf(out, "%10zu %12.1f %12zu %12.1f%s\n", a->len, a->seconds * 1e9 / a->len,
+                a->peak, (double)a->peak / a->len, a->timed_out ? " timed out" : "");
+    }
+    fclose(out);
+}
+
+static bool verbose;
+
+/* Checks every phase of f, returns the number of phases flagged */
+static int check(struct family* f, size_t max_size, const char* dir)
+{
+    int flagged = 0;
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        struct series s;
+        grow(f, phase, max_size, &s);
+        for (uint32_t i = 0; verbose && i < s.len; i++) {
+            const struct sample* a = &s.at[i];
+            fprintf(stderr, "  %-8s %8zu bytes %8.1f ns/byte %8.1f bytes/byte\n", phase_str[phase],
+                    a->len, a->seconds * 1e9 / a->len, (double)a->peak / a->len);
+        }
+        if (!s.flagged)
+            continue;
+        fprintf(stderr, "%-24s %-8s time x^%.2f, memory x^%.2f at %zu bytes, minimizing\n",
+                f->name, phase_str[phase], s.time_exp, s.mem_exp, s.at[s.shown].len);
+        if (dir) {
+            struct family g = *f;
+            minimize(&g, phase, (size_t)1 << (MIN_LOG2 + s.shown), &s);
+            save(dir, &g, phase, &s);
+        }
+        flagged++;
+    }
+    if (!flagged)
+        fprintf(stderr, "%-24s linear\n", f->name);
+    return flagged;
+}
+
+static bool input_alloc(size_t max_size)
+{
+    input_room = 2 * max_size + 4096;
+    input = malloc(input_room);
+    return input != NULL;
+}
+
+#ifdef FUZZ_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if (!input && !input_alloc((size_t)1 << 18))
+        return 0;
+    struct family f = {.name = "libfuzzer"};
+    if (size == 0 || size >= PART || memchr(data, '\0', size) || memchr(data, '%', size))
+        return 0;
+    memcpy(f.unit, data, size);
+    // libFuzzer minimizes and saves the input itself
+    if (check(&f, (size_t)1 << 18, NULL))
+        abort();
+    return 0;
+}
+
+#else
+
+/* ======= Families ======= */
+
+static const struct family builtin[] = {
+    {"long-chain", "x int = 1; ", "x + ", "1;", "", ""},
+    {"deep-parens", "", "(", "1", ")", ";"},
+    {"deep-parens-error", "", "(", "1 @", ")", ";"},
+    {"nested-calls", "fn f(a int) int { return a; }\n", "f(", "1", ")", ";"},
+    {"nested-calls-error", "fn f(a int) int { return a; }\n", "f(", "1 +", ")", ";"},
+    {"nested-if", "x int = 1;\n", "if x { ", "x;", " }", ""},
+    {"many-statements", "", "1 + 2 * 3;\n", "", "", ""},
+    {"many-lex-errors", "x int = 1;\n", "x + @;\n", "", "", ""},
+    {"many-syntax-errors", "x int = 1;\n", "x + ;\n", "", "", ""},
+    {"many-runtime-errors", "", "1 / 0;\n", "", "", ""},
+    {"many-errors-in-loops", "x int = 1;\n", "while x < 0 { x + ; }\n", "", "", ""},
+    {"error-after-long-line", "", "1 + ", "@;", "", ""},
+    {"error-after-many-lines", "", "1;\n", "@;", "", ""},
+    {"unterminated-string", "\"", "abc; ", "", "", ""},
+    {"unterminated-strings", "", "x + \"abc;\n", "", "", ""},
+    {"escapes", "s str = \"", "\\\"", "\";", "", ""},
+    {"long-identifier", "", "a", " int = 1;", "", ""},
+    {"long-number", "", "7", ";", "", ""},
+    {"long-string", "s str = \"", "a", "\"; s;", "", ""},
+    {"many-variables", "", "v%u int = %u;\n", "", "", ""},
+    {"many-functions", "", "fn f%u(a int) int { return a + %u; }\n", "", "", ""},
+    {"many-calls", "fn f(a int) int { return a + 1; }\n", "f(%u);\n", "", "", ""},
+    {"string-concat", "s str = \"ab\";\n", "s = s + \"cd\";\n", "s;", "", ""},
+    {"unclosed-blocks", "x int = 1;\n", "while x { ", "", "", ""},
+    {"stray-closes", "", "} ", "", "", ""},
+};
+
+#define BUILTIN (sizeof builtin / sizeof *builtin)
+
+/* Fragments the units of random families are made of */
+static const char* const fragments[] = {
+    "1", "2.5", "x", "y", "+", "*", "/", "-", "==", "&&", "(", ")", ";", "\"", "\"s\"",
+    "{", "}", "if x ", "while 0 ", "fn g(a int) int ", "return ", "f(", ",", "@",
+    "\\", " ", "\n", "x int = 1;", "x = 2;", "s str = \"a\";", "s + s", "else ",
+};
+
+#define FRAGMENTS (sizeof fragments / sizeof *fragments)
+
+static uint32_t rng_state;
+
+static uint32_t rng(void)
+{
+    rng_state = rng_state * 1103515245 + 12345;
+    return rng_state >> 16;
+}
+
+static void random_family(struct family* f, uint32_t i)
+{
+    static const char* const heads[] = {
+        "", "x int = 1;\n", "fn f(a int) int { return a; }\nx int = 1;\ns str = \"a\";\n",
+    };
+    *f = (struct family){0};
+    snprintf(f->name, sizeof f->name, "random-%u", i);
+    snprintf(f->head, sizeof f->head, "%s", heads[rng() % 3]);
+    const uint32_t parts = 1 + rng() % 8;
+    for (uint32_t k = 0; k < parts; k++)
+        strncat(f->unit, fragments[rng() % FRAGMENTS], sizeof f->unit - strlen(f->unit) - 1);
+    // some get a closing unit, to nest
+    if (rng() % 4 == 0)
+        snprintf(f->close, sizeof f->close, "%s", fragments[rng() % FRAGMENTS]);
+}
+
+/* ======= Main ======= */
+
+static bool read_unit(const char* path, struct family* f)
+{
+    FILE* in = fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    *f = (struct family){0};
+    const char* base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    snprintf(f->name, sizeof f->name, "%s", base);
+    fread(f->unit, 1, sizeof f->unit - 1, in);
+    fclose(in);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t randoms = 40, seed = 1, max_log = 20;
+    const char* dir = "fuzz_out";
+    const char* units[64];
+    uint32_t units_len = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:m:o:u:v")) != -1) {
+        switch (opt) {
+        case 'n': randoms = strtoul(optarg, NULL, 10); break;
+        case 's': seed    = strtoul(optarg, NULL, 10); break;
+        case 'm': max_log = strtoul(optarg, NULL, 10); break;
+        case 'o': dir     = optarg; break;
+        case 'v': verbose = true; break;
+        case 'u':
+            if (units_len < sizeof units / sizeof *units)
+                units[units_len++] = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-v] [-n RANDOM] [-s SEED] [-m MAX_LOG2] [-o DIR] [-u FILE]...\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (max_log < MIN_LOG2 || max_log >= MIN_LOG2 + MAX_SIZES) {
+        fprintf(stderr, "MAX_LOG2 must be in [%d, %d)\n", MIN_LOG2, MIN_LOG2 + MAX_SIZES);
+        return EXIT_FAILURE;
+    }
+    const size_t max_size = (size_t)1 << max_log;
+    if (!input_alloc(max_size)) {
+        fprintf(stderr, "failed to allocate input: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create %s: %s\n", dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int flagged = 0;
+    for (uint32_t i = 0; i < BUILTIN; i++) {
+        struct family f = builtin[i];
+        flagged += check(&f, max_size, dir);
+    }
+    for (uint32_t i = 0; i < units_len; i++) {
+        struct family f;
+        if (read_unit(units[i], &f))
+            flagged += check(&f, max_size, dir);
+    }
+    rng_state = seed;
+    for (uint32_t i = 0; i < randoms; i++) {
+        struct family f;
+        random_family(&f, i);
+        flagged += check(&f, max_size, dir);
+    }
+    fprintf(stderr, "%d phases grow faster than linearly%s%s\n", flagged,
+            flagged ? ", reproducers are in " : "", flagged ? dir : "");
+    free(input);
+    return flagged ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
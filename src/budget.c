@@ -0,0 +1,50 @@
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "budget.h"
+#include "error.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void budget_start(Budget* b)
+{
+    b->ops        = 0;
+    b->next_check = 0;
+    b->deadline   = b->timeout_ns ? now_ns() + b->timeout_ns : 0;
+    b->exceeded   = false;
+}
+
+bool budget_check_(Error* err, Budget* b)
+{
+    // once a limit is passed next_check stays behind, so every later
+    // charge fails too
+    if (b->max_ops && b->ops > b->max_ops) {
+        error_push(err, "operation budget of %" PRIu64 " exceeded", b->max_ops);
+        b->exceeded = true;
+        return false;
+    }
+    if (b->deadline && now_ns() >= b->deadline) {
+        error_push(err, "time budget of %" PRIu64 " ms exceeded", b->timeout_ns / 1000000);
+        b->exceeded = true;
+        return false;
+    }
+    b->next_check = UINT64_MAX;
+    if (b->deadline)
+        b->next_check = b->ops + BUDGET_INTERVAL;
+    if (b->max_ops && b->max_ops + 1 < b->next_check)
+        b->next_check = b->max_ops + 1;
+    return true;
+}
+
+bool budget_too_deep_(Error* err, Budget* b)
+{
+    error_push(err, "expression nested deeper than the budget of %" PRIu32, b->max_depth);
+    b->exceeded = true;
+    return false;
+}
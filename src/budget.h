@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+
+/* Limits on the work a program may do, so one pathological input can't
+ * starve a worker that runs untrusted programs. A program that runs out
+ * ends with an error like any other failure.
+ *
+ * Evaluators charge the operations they run, flow code one per instruction
+ * and expr_eval one per node. A charge is an add and a compare, the limits
+ * and the clock are only looked at every BUDGET_INTERVAL operations. Memory
+ * is limited by the allocation budget of mem.h, and the nesting of an
+ * expression where the parser stacks up its operands and operators. */
+
+#define BUDGET_INTERVAL 4096
+
+typedef struct budget {
+    // limits, 0 for none
+    uint64_t max_ops;
+    uint64_t timeout_ns; // wall time of a run
+    uint32_t max_depth;  // operands and operators pending in an expression
+
+    // the current run, see budget_start
+    uint64_t ops;
+    uint64_t next_check; // ops at which budget_check_ looks again
+    uint64_t deadline;   // CLOCK_MONOTONIC in ns, 0 for none
+    bool exceeded;       // the run ran out, it must not be recovered from
+} Budget;
+
+/* Starts a run with the full budget */
+void budget_start(Budget* b);
+
+/* Slow path of budget_charge */
+bool budget_check_(Error* err, Budget* b);
+
+/* Counts ops more operations. False with err set once a limit is passed */
+static inline bool budget_charge(Error* err, Budget* b, uint64_t ops)
+{
+    b->ops += ops;
+    return __builtin_expect(b->ops < b->next_check, 1) || budget_check_(err, b);
+}
+
+/* Slow path of budget_depth */
+bool budget_too_deep_(Error* err, Budget* b);
+
+/* False with err set if depth is past max_depth */
+static inline bool budget_depth(Error* err, Budget* b, uint64_t depth)
+{
+    return __builtin_expect(!b->max_depth || depth <= b->max_depth, 1)
+        || budget_too_deep_(err, b);
+}
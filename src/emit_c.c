@@ -0,0 +1,508 @@
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "emit_c.h"
+#include "error.h"
+#include "expr.h"
+#include "mem.h"
+#include "operator.h"
+#include "value.h"
+
+/* Nodes per generated function, so a long program doesn't turn into one
+ * function the C compiler has to optimize as a whole */
+#define EMIT_PART_NODES 4096
+
+bool emit_program_add(Error* err, EmitProgram* p, ExprId root, bool print)
+{
+    if (p->len == p->cap) {
+        uint32_t cap = p->cap ? p->cap * 2 : 64;
+        EmitStatement* stmts = mem_realloc(MEM_PARSER, p->stmts, cap * sizeof *stmts);
+        if (!stmts) {
+            error_push(err, "failed to grow program to %" PRIu32 " statements: %s",
+                    cap, strerror(errno));
+            return false;
+        }
+        p->stmts = stmts;
+        p->cap   = cap;
+    }
+    p->stmts[p->len++] = (EmitStatement){.root = root, .print = print};
+    return true;
+}
+
+void emit_program_free(EmitProgram* p)
+{
+    mem_free(p->stmts);
+    *p = (EmitProgram)EMIT_PROGRAM_INIT;
+}
+
+/* ======= Runtime =======
+
+ Copied into every output. Each helper is the int64_t kernel from
+ operator.c with the error path turned into a message and exit(1).
+ overflow() is emitted separately for the chosen policy.
+
+ ================================ */
+
+static const char emit_prelude[] =
+    "#include <inttypes.h>\n"
+    "#include <math.h>\n"
+    "#include <stdarg.h>\n"
+    "#include <stdint.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "\n"
+    "static void fail(const char* fmt, ...)\n"
+    "{\n"
+    "    va_list args;\n"
+    "    va_start(args, fmt);\n"
+    "    fprintf(stderr, \"error: \");\n"
+    "    vfprintf(stderr, fmt, args);\n"
+    "    fprintf(stderr, \"\\n\");\n"
+    "    va_end(args);\n"
+    "    exit(EXIT_FAILURE);\n"
+    "}\n"
+    "\n";
+
+static const char emit_overflow[OVERFLOW_POLICY_COUNT][160] = {
+    [OVERFLOW_ERROR] =
+        "    (void)wrapped, (void)negative;\n"
+        "    fail(\"integer overflow: %\" PRId64 \" %s %\" PRId64, a, op, b);\n"
+        "    return 0;\n",
+    [OVERFLOW_WRAP] =
+        "    (void)op, (void)a, (void)b, (void)negative;\n"
+        "    return wrapped;\n",
+    [OVERFLOW_SATURATE] =
+        "    (void)op, (void)a, (void)b, (void)wrapped;\n"
+        "    return negative ? INT64_MIN : INT64_MAX;\n",
+    // promoted nodes are emitted as double, this is never reached
+    [OVERFLOW_PROMOTE] =
+        "    (void)wrapped, (void)negative;\n"
+        "    fail(\"integer overflow: %\" PRId64 \" %s %\" PRId64, a, op, b);\n"
+        "    return 0;\n",
+};
+
+static const char emit_kernels[] =
+    "static inline int64_t add_ii(int64_t a, int64_t b)\n"
+    "{\n"
+    "    int64_t r;\n"
+    "    return __builtin_add_overflow(a, b, &r) ? overflow(\"+\", a, b, r, a < 0) : r;\n"
+    "}\n"
+    "\n"
+    "static inline int64_t sub_ii(int64_t a, int64_t b)\n"
+    "{\n"
+    "    int64_t r;\n"
+    "    return __builtin_sub_overflow(a, b, &r) ? overflow(\"-\", a, b, r, a < 0) : r;\n"
+    "}\n"
+    "\n"
+    "static inline int64_t mul_ii(int64_t a, int64_t b)\n"
+    "{\n"
+    "    int64_t r;\n"
+    "    return __builtin_mul_overflow(a, b, &r) ? overflow(\"*\", a, b, r, (a < 0) != (b < 0)) : r;\n"
+    "}\n"
+    "\n"
+    "static inline int64_t div_ii(int64_t a, int64_t b)\n"
+    "{\n"
+    "    if (b == 0)\n"
+    "        fail(\"integer division by zero\");\n"
+    "    if (a == INT64_MIN && b == -1)\n"
+    "        return overflow(\"/\", a, b, a, 0);\n"
+    "    return a / b;\n"
+    "}\n"
+    "\n"
+    "static inline int64_t mod_ii(int64_t a, int64_t b)\n"
+    "{\n"
+    "    if (b == 0)\n"
+    "        fail(\"integer modulo by zero\");\n"
+    "    return b == -1 ? 0 : a % b;\n"
+    "}\n"
+    "\n"
+    "static inline int64_t shl_ii(int64_t a, int64_t b)\n"
+    "{\n"
+    "    if (b < 0 || b > 63)\n"
+    "        fail(\"shift count out of range: %lld\", (long long)b);\n"
+    "    return (int64_t)((uint64_t)a << b);\n"
+    "}\n"
+    "\n"
+    "static inline int64_t shr_ii(int64_t a, int64_t b)\n"
+    "{\n"
+    "    if (b < 0 || b > 63)\n"
+    "        fail(\"shift count out of range: %lld\", (long long)b);\n"
+    "    return a >> b;\n"
+    "}\n"
+    "\n"
+    "static inline void print_i(int64_t v)\n"
+    "{\n"
+    "    fprintf(stderr, \"result: %\" PRId64 \"\\n\", v);\n"
+    "}\n"
+    "\n"
+    "static inline void print_f(double v)\n"
+    "{\n"
+    "    fprintf(stderr, \"result: %lf\\n\", v);\n"
+    "}\n"
+    "\n";
+
+/* ======= Translation ======= */
+
+/* The right operand of a && or || node, emitted in an if block that
+ * reads the left one */
+struct block {
+    ExprId node;
+    uint32_t inner; // where its nodes start in emitter.inner
+};
+
+struct emitter {
+    FILE* out;
+    ExprArena* a;
+    uint8_t* types;   // enum value_type per node, VALUE_TYPE_COUNT if not emitted
+    ExprId* stack;
+    uint32_t stack_cap;
+    uint32_t part_nodes;
+    uint32_t parts;
+
+    // nodes emitted inside open blocks. They are only computed when the
+    // block runs, so they count as not emitted once it is closed
+    struct block* blocks;
+    uint32_t depth;
+    uint32_t blocks_cap;
+    ExprId* inner;
+    uint32_t inner_len;
+    uint32_t inner_cap;
+};
+
+/* Makes room for count more elements of size bytes in *buf */
+static bool reserve(Error* err, void** buf, uint32_t* cap, uint32_t len, uint32_t count,
+                    size_t size)
+{
+    if (len + count <= *cap)
+        return true;
+    uint32_t n = *cap ? *cap : 64;
+    while (n < len + count)
+        n *= 2;
+    void* p = mem_realloc(MEM_EXPR, *buf, (size_t)n * size);
+    if (!p) {
+        error_push(err, "failed to allocate emitter: %s", strerror(errno));
+        return false;
+    }
+    *buf = p;
+    *cap = n;
+    return true;
+}
+
+static void indent(struct emitter* e)
+{
+    fprintf(e->out, "%*s", 4 * (int)(e->depth + 1), "");
+}
+
+/* Node value as an operand: I[id] or F[id], converted to double if asked */
+static void operand(struct emitter* e, ExprId id, bool as_double)
+{
+    if (e->types[id] == VALUE_FLOATING)
+        fprintf(e->out, "F[%" PRIu32 "]", id);
+    else if (as_double)
+        fprintf(e->out, "(double)I[%" PRIu32 "]", id);
+    else
+        fprintf(e->out, "I[%" PRIu32 "]", id);
+}
+
+static void literal(struct emitter* e, ExprId id, const Value* v)
+{
+    indent(e);
+    if (v->type == VALUE_FLOATING) {
+        // hex floats round trip exactly
+        fprintf(e->out, "F[%" PRIu32 "] = %a;\n", id, v->f64);
+    } else if (v->i64 == INT64_MIN) {
+        fprintf(e->out, "I[%" PRIu32 "] = INT64_MIN;\n", id);
+    } else {
+        fprintf(e->out, "I[%" PRIu32 "] = INT64_C(%" PRId64 ");\n", id, v->i64);
+    }
+}
+
+static const char* int_helper(enum operator op)
+{
+    switch (op) {
+    case OP_ADD: return "add_ii";
+    case OP_SUB: return "sub_ii";
+    case OP_MUL: return "mul_ii";
+    case OP_DIV: return "div_ii";
+    case OP_MOD: return "mod_ii";
+    case OP_SHL: return "shl_ii";
+    case OP_SHR: return "shr_ii";
+    default:     return NULL;
+    }
+}
+
+/* Type of an EXPR_DYNAMIC node the interpreter didn't evaluate itself, like
+ * the inner nodes of a chain reduced in parallel. That only happens without
+ * overflow, so the result type follows from the operand types alone */
+static enum value_type static_type(enum operator op, enum value_type l, enum value_type r)
+{
+    switch (op) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+        return l == VALUE_FLOATING || r == VALUE_FLOATING ? VALUE_FLOATING : VALUE_INTEGER;
+    default:
+        return VALUE_INTEGER;
+    }
+}
+
+static bool binary(Error* err, struct emitter* e, ExprId id, const ExprNode* n)
+{
+    const enum operator op = n->op;
+    const enum value_type lt = e->types[n->lhs];
+    const enum value_type rt = e->types[n->rhs];
+    if (!op_kernel_for(op, lt, rt)) {
+        error_push(err, "operator %s is not defined for %s and %s", op_table[op].str,
+                value_type_name(lt), value_type_name(rt));
+        return false;
+    }
+    enum value_type type = n->type;
+    if (type == EXPR_DYNAMIC)
+        type = n->evaluated ? n->value.type : static_type(op, lt, rt);
+    const bool ints = lt == VALUE_INTEGER && rt == VALUE_INTEGER;
+    e->types[id] = type;
+    FILE* out = e->out;
+
+    indent(e);
+    fprintf(out, "%c[%" PRIu32 "] = ", type == VALUE_FLOATING ? 'F' : 'I', id);
+    switch (op) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+        if (ints && type == VALUE_INTEGER) {
+            fprintf(out, "%s(", int_helper(op));
+            operand(e, n->lhs, false);
+            fprintf(out, ", ");
+            operand(e, n->rhs, false);
+            fprintf(out, ")");
+        } else if (op == OP_MOD) {
+            fprintf(out, "fmod(");
+            operand(e, n->lhs, true);
+            fprintf(out, ", ");
+            operand(e, n->rhs, true);
+            fprintf(out, ")");
+        } else {
+            // both double, either because of a float operand or because the
+            // interpreter promoted an overflowing integer operation
+            operand(e, n->lhs, true);
+            fprintf(out, " %s ", op_table[op].str);
+            operand(e, n->rhs, true);
+        }
+        break;
+
+    case OP_TO_FLOAT:
+        operand(e, n->lhs, true);
+        break;
+
+    case OP_SHL:
+    case OP_SHR:
+        fprintf(out, "%s(", int_helper(op));
+        operand(e, n->lhs, false);
+        fprintf(out, ", ");
+        operand(e, n->rhs, false);
+        fprintf(out, ")");
+        break;
+
+    case OP_AND:
+    case OP_OR:
+        // reached with both operands emitted, so the right one is computed
+        // anyway
+        operand(e, n->lhs, false);
+        fprintf(out, " != 0 %s ", op_table[op].str);
+        operand(e, n->rhs, false);
+        fprintf(out, " != 0");
+        break;
+
+    case OP_NOT:
+    case OP_BNOT:
+        fprintf(out, "%s", op_table[op].str);
+        operand(e, n->lhs, false);
+        break;
+
+    default:
+        // comparisons and bitwise operators map to C as they are, a mixed
+        // comparison converts the int to double like the kernels do
+        operand(e, n->lhs, false);
+        fprintf(out, " %s ", op_table[op].str);
+        operand(e, n->rhs, false);
+        break;
+    }
+    fprintf(out, ";\n");
+    return true;
+}
+
+static void part_begin(struct emitter* e)
+{
+    fprintf(e->out, "static void part_%" PRIu32 "(void)\n{\n", e->parts);
+    e->part_nodes = 0;
+}
+
+static void part_end(struct emitter* e)
+{
+    fprintf(e->out, "}\n\n");
+    e->parts++;
+}
+
+/* Opens the block computing the right operand of the && or || node id,
+ * whose left operand is emitted. The node holds the result the left one
+ * gives until the block overwrites it */
+static bool block_open(Error* err, struct emitter* e, ExprId id, const ExprNode* n)
+{
+    if (!reserve(err, (void**)&e->blocks, &e->blocks_cap, e->depth, 1, sizeof *e->blocks))
+        return false;
+    indent(e);
+    fprintf(e->out, "I[%" PRIu32 "] = ", id);
+    operand(e, n->lhs, false);
+    fprintf(e->out, " != 0;\n");
+    indent(e);
+    fprintf(e->out, "if (%sI[%" PRIu32 "]) {\n", n->op == OP_OR ? "!" : "", id);
+    e->blocks[e->depth++] = (struct block){.node = id, .inner = e->inner_len};
+    return true;
+}
+
+/* Closes the block of id once its right operand is emitted */
+static void block_close(struct emitter* e, ExprId id, const ExprNode* n)
+{
+    indent(e);
+    fprintf(e->out, "I[%" PRIu32 "] = ", id);
+    operand(e, n->rhs, false);
+    fprintf(e->out, " != 0;\n");
+    const struct block* b = &e->blocks[--e->depth];
+    for (uint32_t i = b->inner; i < e->inner_len; i++)
+        e->types[e->inner[i]] = VALUE_TYPE_COUNT;
+    e->inner_len = b->inner;
+    indent(e);
+    fprintf(e->out, "}\n");
+    e->types[id] = VALUE_INTEGER;
+}
+
+/* Emits every node below root that isn't emitted yet, children first */
+static bool emit_tree(Error* err, struct emitter* e, ExprId root)
+{
+    uint32_t top = 0;
+    if (!reserve(err, (void**)&e->stack, &e->stack_cap, top, 1, sizeof *e->stack))
+        return false;
+    e->stack[top++] = root;
+    while (top > 0) {
+        const ExprId id = e->stack[top - 1];
+        const ExprNode* n = &e->a->nodes[id];
+        if (e->types[id] != VALUE_TYPE_COUNT) {
+            top--;
+            continue;
+        }
+        if (n->kind == EXPR_BINARY) {
+            const bool l = e->types[n->lhs] != VALUE_TYPE_COUNT;
+            const bool r = e->types[n->rhs] != VALUE_TYPE_COUNT;
+            const bool guarded = op_table[n->op].flags & OP_SHORT_CIRCUIT;
+            if (guarded && e->depth > 0 && e->blocks[e->depth - 1].node == id) {
+                block_close(e, id, n);
+                top--;
+                continue;
+            }
+            if (!reserve(err, (void**)&e->stack, &e->stack_cap, top, 2, sizeof *e->stack))
+                return false;
+            if (guarded && l && !r) {
+                // the right operand of && and || only runs if the left one
+                // doesn't decide the result
+                if (!block_open(err, e, id, n))
+                    return false;
+                e->stack[top++] = n->rhs;
+                continue;
+            }
+            if (!l || !r) {
+                if (!r && !guarded)
+                    e->stack[top++] = n->rhs;
+                if (!l && n->lhs != n->rhs)
+                    e->stack[top++] = n->lhs;
+                continue;
+            }
+        }
+
+        if (n->kind != EXPR_BINARY && n->kind != EXPR_LITERAL) {
+            error_push(err, "calls of functions that aren't inlined can't be translated to C");
+            return false;
+        }
+        if (n->type == VALUE_STRING) {
+            error_push(err, "strings can't be translated to C");
+            return false;
+        }
+        // a block is never split
+        if (e->part_nodes >= EMIT_PART_NODES && e->depth == 0) {
+            part_end(e);
+            part_begin(e);
+        }
+        if (n->kind == EXPR_LITERAL) {
+            e->types[id] = n->value.type;
+            literal(e, id, &n->value);
+        } else if (!binary(err, e, id, n)) {
+            return false;
+        }
+        if (e->depth > 0) {
+            if (!reserve(err, (void**)&e->inner, &e->inner_cap, e->inner_len, 1, sizeof *e->inner))
+                return false;
+            e->inner[e->inner_len++] = id;
+        }
+        e->part_nodes++;
+        top--;
+    }
+    return true;
+}
+
+bool emit_c(Error* err, FILE* out, ExprArena* a, const EmitProgram* p)
+{
+    bool ok = false;
+    struct emitter e = {.out = out, .a = a};
+    e.types = mem_alloc(MEM_EXPR, (size_t)a->len + 1);
+    if (!e.types) {
+        error_push(err, "failed to allocate emitter: %s", strerror(errno));
+        goto out;
+    }
+    memset(e.types, VALUE_TYPE_COUNT, a->len);
+
+    fprintf(out, "/* Generated by lang --emit-c, build with cc -O2 prog.c -lm */\n\n");
+    fputs(emit_prelude, out);
+    fprintf(out, "static int64_t overflow(const char* op, int64_t a, int64_t b,\n"
+                 "                        int64_t wrapped, int negative)\n{\n%s}\n\n",
+            emit_overflow[a->overflow]);
+    fputs(emit_kernels, out);
+    fprintf(out, "static int64_t I[%" PRIu32 "];\n", a->len ? a->len : 1);
+    fprintf(out, "static double F[%" PRIu32 "];\n\n", a->len ? a->len : 1);
+
+    part_begin(&e);
+    for (uint32_t i = 0; i < p->len; i++) {
+        const EmitStatement* s = &p->stmts[i];
+        if (!emit_tree(err, &e, s->root))
+            goto out;
+        if (s->print) {
+            fprintf(out, "    print_%c(", e.types[s->root] == VALUE_FLOATING ? 'f' : 'i');
+            operand(&e, s->root, false);
+            fprintf(out, ");\n");
+        }
+    }
+    part_end(&e);
+
+    fprintf(out, "int main(void)\n{\n    (void)I, (void)F;\n");
+    for (uint32_t i = 0; i < e.parts; i++)
+        fprintf(out, "    part_%" PRIu32 "();\n", i);
+    fprintf(out, "    return 0;\n}\n");
+
+    if (ferror(out)) {
+        error_push(err, "failed to write C output: %s", strerror(errno));
+        goto out;
+    }
+    ok = true;
+out:
+    mem_free(e.types);
+    mem_free(e.stack);
+    mem_free(e.blocks);
+    mem_free(e.inner);
+    return ok;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "error.h"
+#include "expr.h"
+
+/* Translation of a program to standalone C. The statements that ran are
+ * recorded by their root node, and emit_c writes every node reachable from
+ * them as native int64_t/double code, in the order the interpreter computed
+ * them. Shared sub-expressions are computed once, as in the arena. The
+ * output needs nothing but libc and libm:
+ *
+ *     lang --emit-c=prog.c prog.lang && cc -O2 -o prog prog.c -lm */
+
+typedef struct emit_statement {
+    ExprId root;
+    bool print; // expression statement, false for an assignment
+} EmitStatement;
+
+typedef struct emit_program {
+    EmitStatement* stmts;
+    uint32_t len;
+    uint32_t cap;
+} EmitProgram;
+
+#define EMIT_PROGRAM_INIT { 0 }
+
+bool emit_program_add(Error* err, EmitProgram* p, ExprId root, bool print);
+void emit_program_free(EmitProgram* p);
+
+/* Writes p over the nodes of a as a C program that prints the same results
+ * as the interpreter, with a's overflow policy. Every root in p must have
+ * been evaluated */
+bool emit_c(Error* err, FILE* out, ExprArena* a, const EmitProgram* p);
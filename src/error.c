@@ -1,5 +1,6 @@
 
 #include "error.h"
+#include "mem.h"
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -10,7 +11,7 @@ bool error_empty(Error* err)
 {
     if (!err)
         return false;
-    return err->msg == NULL;
+    return err->msg == NULL && !err->oom;
 }
 
 void error_push_(Error* err, const char* fmt, ...)
@@ -20,48 +21,67 @@ void error_push_(Error* err, const char* fmt, ...)
 
     #define MSG_SIZE 128
 
-    // first list element is a dummy element
+    // first list element is a dummy element, the newest message follows it
+    // so that pushing doesn't walk the list
     if (err->msg == NULL) {
-        err->msg = malloc(sizeof *err->msg);
+        err->msg = mem_calloc(MEM_ERROR, 1, sizeof *err->msg);
         if (!(err->msg)) {
-            perror("malloc");
-            exit(EXIT_FAILURE);
+            err->oom = true;
+            return;
         }
     }
 
-    struct error_msg* m = err->msg;
-
-    while (m->next) {
-        m = m->next;
-    }
-    m->next = malloc(sizeof *m);
-    if (m->next == NULL) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
-    m->next->message = malloc(MSG_SIZE);
-    if (!(m->next->message)) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+    struct error_msg* next = mem_calloc(MEM_ERROR, 1, sizeof *next);
+    char* message = mem_alloc(MEM_ERROR, MSG_SIZE);
+    if (!next || !message) {
+        mem_free(next);
+        mem_free(message);
+        err->oom = true;
+        return;
     }
+    next->message = message;
+    next->next    = err->msg->next;
+    err->msg->next = next;
     va_list args;
     va_start(args, fmt);
-    vsnprintf(m->next->message, MSG_SIZE, fmt, args);
+    vsnprintf(next->message, MSG_SIZE, fmt, args);
     va_end(args);
 
     #undef MSG_SIZE
 }
 
-static void error_msg_print(struct error_msg* msg, bool print_colon)
+void error_append(Error* dst, Error* src)
 {
-    if (!msg)
+    if (!dst || !src || error_empty(src))
+        return;
+
+    dst->oom = dst->oom || src->oom;
+    src->oom = false;
+    if (src->msg == NULL)
+        return;
+
+    if (dst->msg == NULL) {
+        dst->msg = src->msg;
+        src->msg = NULL;
         return;
-    error_msg_print(msg->next, true);
-    if (msg->message) {
-        fprintf(stderr, "%s", msg->message);
     }
-    if (print_colon) {
-        fprintf(stderr, "\n - ");
+
+    // the messages of src are newer, they go in front of those of dst
+    struct error_msg* m = src->msg;
+    while (m->next) {
+        m = m->next;
+    }
+    m->next = dst->msg->next;
+    dst->msg->next = src->msg->next;
+    mem_free(src->msg);
+    src->msg = NULL;
+}
+
+/* Newest message first, as the list is kept */
+static void error_msg_print(struct error_msg* msg)
+{
+    for (struct error_msg* m = msg ? msg->next : NULL; m; m = m->next) {
+        fprintf(stderr, "%s\n - ", m->message);
     }
 }
 
@@ -71,19 +91,62 @@ void error_print(Error* err)
         fprintf(stderr, "(empty error)\n");
         return;
     }
-    error_msg_print(err->msg, false);
+    error_msg_print(err->msg);
+    if (err->oom) {
+        fprintf(stderr, "%sout of memory", err->msg ? "\n - " : "");
+    }
     fprintf(stderr, "\n");
 }
 
+struct error_buf {
+    char* buf;
+    size_t size;
+    size_t len;
+};
+
+static void error_buf_add(struct error_buf* b, const char* s)
+{
+    size_t n = strlen(s);
+    if (b->len < b->size) {
+        size_t room = b->size - b->len - 1;
+        memcpy(b->buf + b->len, s, n < room ? n : room);
+        b->buf[b->len + (n < room ? n : room)] = '\0';
+    }
+    b->len += n;
+}
+
+static void error_msg_format(struct error_buf* b, struct error_msg* msg)
+{
+    for (struct error_msg* m = msg ? msg->next : NULL; m; m = m->next) {
+        error_buf_add(b, m->message);
+        error_buf_add(b, "\n - ");
+    }
+}
+
+size_t error_format(Error* err, char* buf, size_t size)
+{
+    struct error_buf b = {.buf = buf, .size = size, .len = 0};
+    if (size)
+        buf[0] = '\0';
+    if (!err) {
+        error_buf_add(&b, "(empty error)");
+        return b.len;
+    }
+    error_msg_format(&b, err->msg);
+    if (err->oom) {
+        error_buf_add(&b, err->msg ? "\n - out of memory" : "out of memory");
+    }
+    return b.len;
+}
+
 static void error_msg_free(struct error_msg* msg)
 {
-    if (!msg)
-        return;
-    error_msg_free(msg->next);
-    free(msg->message);
-    msg->message = NULL;
-    msg->next    = NULL;
-    free(msg);
+    while (msg) {
+        struct error_msg* next = msg->next;
+        mem_free(msg->message);
+        mem_free(msg);
+        msg = next;
+    }
 }
 
 void error_clear(Error* err)
@@ -93,5 +156,6 @@ void error_clear(Error* err)
 
     error_msg_free(err->msg);
     err->msg = NULL;
+    err->oom = false;
 }
 
@@ -11,6 +11,7 @@ struct error_msg {
 
 typedef struct error {
     struct error_msg* msg;
+    bool oom; // a message could not be allocated, err is still non-empty
 } Error;
 
 /* Returns true if there is no error */
@@ -20,10 +21,17 @@ bool error_empty(Error* err);
 void error_push_(Error* err, const char* fmt, ...);
 #define error_push(err, fmt, args...) error_push_(err, "(%s) " fmt, __func__ __VA_OPT__(,) args)
 
+/* Move the messages of src to the end of dst, leaves src empty */
+void error_append(Error* dst, Error* src);
+
 /* Print error */
 void error_print(Error* err);
 
+/* Writes the error as error_print would, without the final newline, into buf
+ * and truncates to size. Returns the length it needed, like snprintf */
+size_t error_format(Error* err, char* buf, size_t size);
+
 /* Frees the internal data structures but leaves err in a usable state  */
 void error_clear(Error* err);
 
-#define ERROR_INIT {.msg = NULL}
+#define ERROR_INIT {.msg = NULL, .oom = false}
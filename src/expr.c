@@ -0,0 +1,412 @@
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "expr.h"
+#include "mem.h"
+#include "operator.h"
+#include "profile.h"
+#include "value.h"
+
+#define EXPR_MIN_BUCKETS 1024
+
+static uint64_t mix(uint64_t h, uint64_t x)
+{
+    h = (h ^ x) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+}
+
+static uint64_t literal_bits(const Value* v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v->i64, sizeof bits);
+    return bits;
+}
+
+/* The bytes of a short string that don't fit in literal_bits. A long
+ * string is told apart by its pointer, parsed literals are interned so
+ * equal ones share it */
+static uint32_t literal_head(const Value* v)
+{
+    if (v->type != VALUE_STRING)
+        return 0;
+    uint32_t head;
+    memcpy(&head, &v->small_len, sizeof head);
+    return head;
+}
+
+static uint64_t expr_hash(const ExprNode* n)
+{
+    uint64_t h = mix(n->kind, n->op);
+    if (n->kind == EXPR_LITERAL) {
+        h = mix(h, n->value.type);
+        h = mix(h, literal_bits(&n->value));
+        h = mix(h, literal_head(&n->value));
+    } else {
+        h = mix(h, ((uint64_t)n->lhs << 32) | n->rhs);
+    }
+    return h;
+}
+
+/* Structural equality, the memoized value of a binary node is not part of it */
+static bool expr_equal(const ExprNode* a, const ExprNode* b)
+{
+    if (a->kind != b->kind || a->op != b->op)
+        return false;
+    if (a->kind == EXPR_LITERAL)
+        return a->value.type == b->value.type
+            && literal_bits(&a->value) == literal_bits(&b->value)
+            && literal_head(&a->value) == literal_head(&b->value);
+    return a->lhs == b->lhs && a->rhs == b->rhs;
+}
+
+static bool expr_rehash(Error* err, ExprArena* a, uint32_t bucket_count)
+{
+    struct expr_bucket* buckets = mem_alloc(MEM_EXPR, bucket_count * sizeof *buckets);
+    if (!buckets) {
+        error_push(err, "failed to allocate expression table: %s", strerror(errno));
+        return false;
+    }
+    for (uint32_t i = 0; i < bucket_count; i++)
+        buckets[i].id = EXPR_NONE;
+
+    const uint32_t mask = bucket_count - 1;
+    for (uint32_t b = 0; b < a->bucket_count; b++) {
+        if (a->buckets[b].id == EXPR_NONE)
+            continue;
+        uint32_t i = a->buckets[b].hash & mask;
+        while (buckets[i].id != EXPR_NONE)
+            i = (i + 1) & mask;
+        buckets[i] = a->buckets[b];
+    }
+
+    mem_free(a->buckets);
+    a->buckets      = buckets;
+    a->bucket_count = bucket_count;
+    return true;
+}
+
+/* Returns the id of a node equal to n, inserting a copy of n if there is none */
+static ExprId expr_intern(Error* err, ExprArena* a, const ExprNode* n)
+{
+    a->requested++;
+
+    if (a->len >= a->bucket_count / 2) {
+        uint32_t count = a->bucket_count ? a->bucket_count * 2 : EXPR_MIN_BUCKETS;
+        if (count == 0 || !expr_rehash(err, a, count)) {
+            error_push(err, "too many expression nodes");
+            return EXPR_NONE;
+        }
+    }
+
+    const uint32_t mask = a->bucket_count - 1;
+    const uint32_t hash = expr_hash(n);
+    uint32_t i = hash & mask;
+    while (a->buckets[i].id != EXPR_NONE) {
+        if (a->buckets[i].hash == hash && expr_equal(&a->nodes[a->buckets[i].id], n))
+            return a->buckets[i].id;
+        i = (i + 1) & mask;
+    }
+
+    if (a->len == a->cap) {
+        uint32_t cap = a->cap ? a->cap * 2 : EXPR_MIN_BUCKETS / 2;
+        ExprNode* nodes = mem_realloc(MEM_EXPR, a->nodes, cap * sizeof *nodes);
+        if (!nodes) {
+            error_push(err, "failed to allocate expression node: %s", strerror(errno));
+            return EXPR_NONE;
+        }
+        a->nodes = nodes;
+        a->cap   = cap;
+    }
+
+    ExprId id = a->len++;
+    a->nodes[id]  = *n;
+    a->buckets[i] = (struct expr_bucket){.id = id, .hash = hash};
+    return id;
+}
+
+ExprId expr_literal(Error* err, ExprArena* a, const Value* v)
+{
+    ExprNode n = {
+        .kind      = EXPR_LITERAL,
+        .op        = OP_NONE,
+        .evaluated = true,
+        .type      = v->type,
+        .lhs       = EXPR_NONE,
+        .rhs       = EXPR_NONE,
+        .value     = *v,
+    };
+    return expr_intern(err, a, &n);
+}
+
+ExprId expr_var(Error* err, ExprArena* a, const Value* v, uint32_t slot)
+{
+    ExprNode n = {
+        .kind      = EXPR_VAR,
+        .op        = OP_NONE,
+        .evaluated = true,
+        .type      = v->type,
+        .lhs       = a->vars++,
+        .rhs       = slot,
+        .value     = *v,
+    };
+    return expr_intern(err, a, &n);
+}
+
+ExprId expr_call(Error* err, ExprArena* a, uint32_t func, ExprId args, uint8_t type)
+{
+    ExprNode n = {
+        .kind      = EXPR_CALL,
+        .op        = OP_NONE,
+        .evaluated = false,
+        .type      = type,
+        .lhs       = func,
+        .rhs       = args,
+    };
+    return expr_intern(err, a, &n);
+}
+
+ExprId expr_arg(Error* err, ExprArena* a, ExprId value, ExprId next)
+{
+    ExprNode n = {
+        .kind      = EXPR_ARG,
+        .op        = OP_NONE,
+        .evaluated = false,
+        .type      = a->nodes[value].type,
+        .lhs       = value,
+        .rhs       = next,
+    };
+    return expr_intern(err, a, &n);
+}
+
+/* Result type of op over operands of one static type */
+static uint8_t result_type(ExprArena* a, enum operator op, enum value_type operands)
+{
+    const uint8_t flags = op_table[op].flags;
+    if (flags & OP_PREDICATE)
+        return VALUE_INTEGER;
+    if (operands == VALUE_INTEGER && (flags & OP_CHECKED) && a->overflow == OVERFLOW_PROMOTE)
+        return EXPR_DYNAMIC;
+    if (op == OP_TO_FLOAT)
+        return VALUE_FLOATING;
+    return operands;
+}
+
+static ExprId node_add(Error* err, ExprArena* a, enum operator op, ExprId lhs, ExprId rhs,
+                       uint8_t type)
+{
+    const uint8_t lt = a->nodes[lhs].type;
+    const uint8_t rt = a->nodes[rhs].type;
+    ExprNode n = {
+        .kind      = EXPR_BINARY,
+        .op        = op,
+        .evaluated = false,
+        .type      = type,
+        .kernel    = lt == EXPR_DYNAMIC || rt == EXPR_DYNAMIC ? OP_KERNEL_DYNAMIC
+                                                               : op_kernel_id(op, lt, rt),
+        .lt        = lt,
+        .rt        = rt,
+        .lhs       = lhs,
+        .rhs       = rhs,
+    };
+    const uint32_t len = a->len;
+    ExprId id = expr_intern(err, a, &n);
+    if (id == EXPR_NONE || a->len == len)
+        return id;
+    if (type == EXPR_DYNAMIC)
+        a->dynamic++;
+    // expr_compile only looks for operands of several nodes among what it
+    // has emitted already
+    if (a->nodes[lhs].parents < 2)
+        a->nodes[lhs].parents++;
+    if (a->nodes[rhs].parents < 2)
+        a->nodes[rhs].parents++;
+    return id;
+}
+
+ExprId expr_to_float(Error* err, ExprArena* a, ExprId id)
+{
+    const ExprNode* n = &a->nodes[id];
+    if (n->type == VALUE_FLOATING)
+        return id;
+    if (n->type != VALUE_INTEGER) {
+        error_push(err, "can't convert an expression of unknown type");
+        return EXPR_NONE;
+    }
+    if (n->kind == EXPR_LITERAL) {
+        const Value v = {.type = VALUE_FLOATING, .f64 = (double)n->value.i64};
+        return expr_literal(err, a, &v);
+    }
+    return node_add(err, a, OP_TO_FLOAT, id, id, VALUE_FLOATING);
+}
+
+ExprId expr_binary(Error* err, ExprArena* a, enum operator op, ExprId lhs, ExprId rhs)
+{
+    if (lhs >= a->len || rhs >= a->len) {
+        error_push(err, "bad operand for %s", op_table[op].str);
+        return EXPR_NONE;
+    }
+    const struct op_info* info = &op_table[op];
+    const uint8_t lt = a->nodes[lhs].type;
+    const uint8_t rt = a->nodes[rhs].type;
+
+    if (lt == EXPR_DYNAMIC || rt == EXPR_DYNAMIC) {
+        if (lt == VALUE_STRING || rt == VALUE_STRING) {
+            error_push(err, "operator %s is not defined for numbers and strings", info->str);
+            return EXPR_NONE;
+        }
+        if ((lt == VALUE_FLOATING || rt == VALUE_FLOATING)
+         && !op_kernel_for(op, VALUE_FLOATING, VALUE_FLOATING))
+        {
+            error_push(err, "operator %s is not defined for %s", info->str,
+                    value_type_name(VALUE_FLOATING));
+            return EXPR_NONE;
+        }
+        // the kernel is picked at run time
+        const uint8_t type = info->flags & OP_PREDICATE ? VALUE_INTEGER
+                           : op_kernel_for(op, VALUE_FLOATING, VALUE_FLOATING) ? EXPR_DYNAMIC
+                           : VALUE_INTEGER;
+        return node_add(err, a, op, lhs, rhs, type);
+    }
+
+    enum value_type operands = lt;
+    if (lt != rt && op_kernel_for(op, lt, rt)) {
+        operands = VALUE_FLOATING;
+        lhs = expr_to_float(err, a, lhs);
+        rhs = lhs == EXPR_NONE ? EXPR_NONE : expr_to_float(err, a, rhs);
+        if (rhs == EXPR_NONE)
+            return EXPR_NONE;
+    } else if (!op_kernel_for(op, lt, rt) && (info->flags & OP_UNARY)) {
+        error_push(err, "operator %s is not defined for %s", info->str, value_type_name(lt));
+        return EXPR_NONE;
+    } else if (!op_kernel_for(op, lt, rt)) {
+        error_push(err, "operator %s is not defined for %s and %s", info->str,
+                value_type_name(lt), value_type_name(rt));
+        return EXPR_NONE;
+    }
+    return node_add(err, a, op, lhs, rhs, result_type(a, op, operands));
+}
+
+static bool stack_reserve(Error* err, ExprArena* a, uint32_t len)
+{
+    if (len <= a->stack_cap)
+        return true;
+    uint32_t cap = a->stack_cap ? a->stack_cap * 2 : 64;
+    ExprId* stack = mem_realloc(MEM_EXPR, a->stack, cap * sizeof *stack);
+    if (!stack) {
+        error_push(err, "failed to allocate evaluation stack: %s", strerror(errno));
+        return false;
+    }
+    a->stack     = stack;
+    a->stack_cap = cap;
+    return true;
+}
+
+bool expr_eval(Error* err, ExprArena* a, ExprId id, Value* out)
+{
+    if (id >= a->len) {
+        error_push(err, "bad expression id %" PRIu32, id);
+        return false;
+    }
+
+    const uint64_t evaluated = a->evaluated;
+    if (!a->nodes[id].evaluated && expr_eval_chain_(a, id, out))
+        return budget_charge(err, &a->budget, a->evaluated - evaluated);
+    if (mem_budget_exceeded()) {
+        // a reduction worker was refused memory
+        error_push(err, "failed to evaluate chain: %s", strerror(ENOMEM));
+        return false;
+    }
+
+    // post-order walk with an explicit stack, a long operator chain is a
+    // left spine as deep as the chain is long
+    uint32_t top = 0;
+    if (!stack_reserve(err, a, 1))
+        return false;
+    if (a->nodes[id].evaluated) {
+        a->memo_hits++;
+    } else {
+        a->stack[top++] = id;
+    }
+    while (top > 0) {
+        ExprNode* n = &a->nodes[a->stack[top - 1]];
+        if (n->evaluated) {
+            // pushed twice, as both operands of x op x
+            top--;
+            continue;
+        }
+        if (n->kind != EXPR_BINARY) {
+            error_push(err, "function calls must be run with flow_eval");
+            return false;
+        }
+        ExprNode* l = &a->nodes[n->lhs];
+        ExprNode* r = &a->nodes[n->rhs];
+        const struct op_info* info = &op_table[n->op];
+        if (l->evaluated && !r->evaluated && op_short_circuit(n->op, &l->value, &n->value)) {
+            // the right operand of && or || is left alone
+        } else if (!l->evaluated || !r->evaluated) {
+            if (!stack_reserve(err, a, top + 2))
+                return false;
+            // && and || only get to their right operand once the left one
+            // is known not to decide the result
+            if (!r->evaluated && (l->evaluated || !(info->flags & OP_SHORT_CIRCUIT)))
+                a->stack[top++] = n->rhs;
+            if (!l->evaluated)
+                a->stack[top++] = n->lhs;
+            continue;
+        } else if (n->kernel != OP_KERNEL_DYNAMIC) {
+            // picked when the node was built, the operand types can't differ
+            if (!op_kernels[n->kernel](err, a->overflow, &a->strs, &l->value, &r->value,
+                                       &n->value))
+            {
+                return false;
+            }
+        } else {
+            const op_kernel kernel = op_kernel_for(n->op, l->value.type, r->value.type);
+            if (!kernel) {
+                error_push(err, "operator %s is not defined for %s and %s", info->str,
+                        value_type_name(l->value.type), value_type_name(r->value.type));
+                return false;
+            }
+            if (!kernel(err, a->overflow, &a->strs, &l->value, &r->value, &n->value))
+                return false;
+        }
+        n->evaluated = true;
+        a->evaluated++;
+        top--;
+        if (!budget_charge(err, &a->budget, 1))
+            return false;
+        if (profile_due())
+            profile_here_(info->str);
+    }
+
+    *out = a->nodes[id].value;
+    return true;
+}
+
+void expr_stats_print(FILE* out, ExprArena* a)
+{
+    const uint64_t dedup = a->requested - a->len;
+    fprintf(out,
+        "expression nodes: %" PRIu64 " requested, %" PRIu32 " created, "
+        "%" PRIu64 " deduplicated (%.1f%%)\n"
+        "evaluations: %" PRIu64 " computed, %" PRIu64 " memoized roots\n"
+        "types: %" PRIu64 " nodes only known at run time\n"
+        "batches: %" PRIu64 " statements run without nodes\n",
+        a->requested, a->len, dedup,
+        a->requested ? 100.0 * dedup / a->requested : 0.0,
+        a->evaluated, a->memo_hits, a->dynamic, a->batched);
+}
+
+void expr_arena_free(ExprArena* a)
+{
+    mem_free(a->nodes);
+    mem_free(a->buckets);
+    mem_free(a->stack);
+    expr_compiler_free(a->compiler);
+    str_table_free(&a->strs);
+    *a = (ExprArena){.overflow = a->overflow, .threads = a->threads, .budget = a->budget};
+}
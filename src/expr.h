@@ -0,0 +1,182 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "budget.h"
+#include "error.h"
+#include "operator.h"
+#include "str.h"
+#include "value.h"
+
+/* Expression DAG. Nodes are hash-consed: asking for a node with the same
+ * kind, operator, children and literal as an existing one returns the
+ * existing id, so repeated sub-expressions, within a statement or across the
+ * whole program, are stored and evaluated once. Results are memoized per
+ * node.
+ *
+ * Types are inferred as nodes are built. Mixed int/float operands get an
+ * explicit OP_TO_FLOAT node on the int side, so statically typed nodes only
+ * ever run the int-int and float-float kernels, and an operator applied to
+ * types it isn't defined for fails when the node is built. The only types
+ * not known statically are those of integer operations that may overflow
+ * under OVERFLOW_PROMOTE, and of what is computed from them.
+ *
+ * Nodes live in one flat array and refer to each other by 32-bit index. A
+ * node can only be built from nodes that already exist, so operands always
+ * have smaller ids than the nodes using them: the array is in post-order,
+ * and evaluating any prefix of it in id order never reads a node that
+ * hasn't been computed. */
+
+typedef uint32_t ExprId;
+
+#define EXPR_NONE UINT32_MAX
+
+/* ExprNode.type of a node whose type is only known once it is evaluated */
+#define EXPR_DYNAMIC VALUE_TYPE_COUNT
+
+enum expr_kind {
+    EXPR_LITERAL,
+    EXPR_BINARY,
+    EXPR_VAR,     // variable of an if or while statement, see flow.h
+    EXPR_CALL,    // call of a function, see func.h
+    EXPR_ARG,     // argument list of a call
+};
+
+typedef struct expr_node {
+    uint8_t kind;      // enum expr_kind
+    uint8_t op;        // enum operator, EXPR_BINARY only
+    uint8_t evaluated; // value holds the result, always set for EXPR_VAR
+    uint8_t type;      // enum value_type, or EXPR_DYNAMIC
+    uint8_t kernel;    // EXPR_BINARY: op_kernels id for the operand types,
+                       // OP_KERNEL_DYNAMIC if one of them is EXPR_DYNAMIC
+    uint8_t lt;        // EXPR_BINARY: types of the operands when the node
+    uint8_t rt;        // was built, or EXPR_DYNAMIC
+    uint8_t parents;   // EXPR_BINARY nodes this one is an operand of, counted
+                       // up to 2
+    ExprId lhs;        // EXPR_VAR: number making the node unique
+                       // EXPR_CALL: index of the function
+                       // EXPR_ARG: the argument
+    ExprId rhs;        // EXPR_VAR: slot of the owning Flow
+                       // EXPR_CALL, EXPR_ARG: first or next EXPR_ARG node,
+                       // EXPR_NONE at the end of the list
+    Value value;       // literal, memoized result, or current value of a
+                       // variable
+} ExprNode;
+
+struct expr_bucket {
+    ExprId id;
+    uint32_t hash;
+};
+
+typedef struct expr_arena {
+    ExprNode* nodes;
+    uint32_t len;
+    uint32_t cap;
+
+    // open addressing, EXPR_NONE marks an empty bucket. Each bucket keeps
+    // the hash of its node, so a probe only reads the node when the hashes
+    // match and growing the table reads no nodes at all
+    struct expr_bucket* buckets;
+    uint32_t bucket_count; // power of two
+
+    // scratch stack for expr_eval
+    ExprId* stack;
+    uint32_t stack_cap;
+
+    struct expr_compiler* compiler; // scratch of expr_compile, see expr_code.h
+
+    StrTable strs; // long strings held by the values of nodes
+
+    // evaluation settings, zero is OVERFLOW_ERROR and one thread per CPU.
+    // overflow must not change once nodes have been added
+    enum overflow_policy overflow;
+    int threads; // for chain reduction, 1 to stay serial
+    Budget budget; // charged by everything that evaluates nodes
+
+    // statistics
+    uint64_t requested;  // expr_literal/expr_binary calls
+    uint64_t evaluated;  // nodes computed by expr_eval
+    uint64_t memo_hits;  // nodes expr_eval found already computed
+    uint64_t dynamic;    // nodes typed EXPR_DYNAMIC
+    uint64_t batched;    // statements run in shape batches, see batch.h
+    uint32_t vars;       // EXPR_VAR nodes created
+} ExprArena;
+
+#define EXPR_ARENA_INIT { 0 }
+
+/* Frees all nodes, the arena stays usable with the same settings and
+ * budget */
+void expr_arena_free(ExprArena* a);
+
+/* Returns the node for a literal value, EXPR_NONE on failure */
+ExprId expr_literal(Error* err, ExprArena* a, const Value* v);
+
+/* Returns a new variable node holding v, with the slot number of its owner.
+ * Variable nodes are never shared, every call creates one, and their value
+ * changes as the program runs. Nodes above them must not be evaluated with
+ * expr_eval, whose memo would keep the first value */
+ExprId expr_var(Error* err, ExprArena* a, const Value* v, uint32_t slot);
+
+/* Returns the node calling function func with the argument list args, made
+ * of expr_arg nodes, and returning type. Calls are hash-consed like any
+ * node, so functions must not have side effects. Nodes above calls must be
+ * evaluated with flow_eval */
+ExprId expr_call(Error* err, ExprArena* a, uint32_t func, ExprId args, uint8_t type);
+
+/* Returns the argument list node holding value in front of the list next,
+ * which is EXPR_NONE for the last argument */
+ExprId expr_arg(Error* err, ExprArena* a, ExprId value, ExprId next);
+
+/* Returns the node for `lhs op rhs`, EXPR_NONE on failure or if op is not
+ * defined for the operand types */
+ExprId expr_binary(Error* err, ExprArena* a, enum operator op, ExprId lhs, ExprId rhs);
+
+/* Returns id converted to float. An int literal becomes a float literal,
+ * id must be statically typed */
+ExprId expr_to_float(Error* err, ExprArena* a, ExprId id);
+
+static inline ExprNode* expr_node(ExprArena* a, ExprId id)
+{
+    return &a->nodes[id];
+}
+
+/* Stores the nodes n reads in out and returns how many there are. x op x
+ * reads x twice */
+static inline uint32_t expr_operands(const ExprNode* n, ExprId out[2])
+{
+    switch (n->kind) {
+    case EXPR_BINARY:
+        out[0] = n->lhs;
+        out[1] = n->rhs;
+        return 2;
+    case EXPR_CALL:
+        out[0] = n->rhs;
+        return n->rhs != EXPR_NONE;
+    case EXPR_ARG:
+        out[0] = n->lhs;
+        out[1] = n->rhs;
+        return n->rhs != EXPR_NONE ? 2 : 1;
+    default:
+        return 0;
+    }
+}
+
+/* Evaluates id into out. Every node reached is computed at most once per
+ * arena, no matter how many statements refer to it. The right operand of
+ * && and || is only reached if the left one doesn't decide the result.
+ * Long +/- or bitwise chains are reduced on several threads, see
+ * expr_parallel.c */
+bool expr_eval(Error* err, ExprArena* a, ExprId id, Value* out);
+
+/* Evaluates a long chain at id in parallel. false if id is not such a chain
+ * or the serial walk has to do it, or if a worker ran out of the memory
+ * budget, which mem_budget_exceeded tells */
+bool expr_eval_chain_(ExprArena* a, ExprId id, Value* out);
+
+/* Frees the scratch of expr_compile */
+void expr_compiler_free(struct expr_compiler* c);
+
+/* Prints node counts and the share of deduplicated nodes */
+void expr_stats_print(FILE* out, ExprArena* a);
@@ -0,0 +1,517 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "expr.h"
+#include "expr_code.h"
+#include "mem.h"
+#include "operator.h"
+#include "profile.h"
+#include "str.h"
+#include "value.h"
+
+/* ======= Compiling expressions to code =======
+
+ The DAG below the root is walked depth first with an explicit stack, a long
+ operator chain is a left spine as deep as the chain is long. A node gets an
+ instruction once its operands are known, so the instructions come out in
+ post-order. Literals, nodes that already hold their value and nodes emitted
+ before are operands as they are, only a node that needs an instruction of
+ its own gets a frame. Only a node that is an operand of several others can
+ be reached twice, those go in a map from node to instruction so they appear
+ once, the rest of a statement is a tree and needs no map.
+
+ The instructions are made in place in the block, after its header, and the
+ literal pool and the bytes are appended to them once the block is done.
+
+ The right operand of && and || is a region, entered by a test on the left
+ one that may jump past it. An instruction emitted inside a region has only
+ run if the region did, so once the region is closed the node counts as not
+ emitted and is emitted again if something after it needs it. Regions nest,
+ the test that opened the one at each depth is kept in open[], and a map
+ entry is valid while the region it was made in is still open at its depth.
+
+ Clearing the map for each root would cost as much as the largest root so
+ far, so entries carry the number of the compile that made them instead.
+
+ ================================ */
+
+struct code_entry {
+    ExprId node;
+    uint32_t gen;    // compile that made the entry
+    uint32_t insn;
+    uint32_t region; // test that opened it, UINT32_MAX outside of regions
+    uint32_t depth;  // of the region
+};
+
+struct code_frame {
+    ExprId node;
+    uint32_t lhs;    // the operands once known, see ExprInsn
+    uint32_t rhs;
+    uint8_t la;
+    uint8_t ra;
+    uint8_t state;   // operands looked at so far
+};
+
+struct expr_compiler {
+    ExprCode* code;         // the block handed out, instructions first
+    uint32_t code_cap;      // bytes
+    uint32_t len;           // instructions in code
+
+    Value* pool;
+    uint32_t literals;
+    uint32_t pool_cap;
+
+    char* bytes;
+    uint32_t bytes_len;
+    uint32_t bytes_cap;
+
+    struct code_entry* map; // open addressing, gen marks the live entries
+    uint32_t map_cap;       // power of two
+    uint32_t map_len;
+    uint32_t gen;
+
+    struct code_frame* stack;
+    uint32_t top;
+    uint32_t stack_cap;
+
+    uint32_t* open;         // test of the region open at each depth
+    uint32_t open_cap;
+    uint32_t depth;
+};
+
+static bool grow(Error* err, void** buf, uint32_t* cap, uint32_t len, uint32_t count,
+                 size_t size)
+{
+    uint64_t n = *cap ? *cap : 64;
+    while (n < (uint64_t)len + count)
+        n *= 2;
+    if (n > UINT32_MAX) {
+        error_push(err, "expression code too large");
+        return false;
+    }
+    void* p = mem_realloc(MEM_EXPR, *buf, n * size);
+    if (!p) {
+        error_push(err, "failed to allocate expression code: %s", strerror(errno));
+        return false;
+    }
+    *buf = p;
+    *cap = n;
+    return true;
+}
+
+/* Makes room for count more elements of size bytes in *buf */
+static inline bool reserve(Error* err, void** buf, uint32_t* cap, uint32_t len,
+                           uint32_t count, size_t size)
+{
+    return (uint64_t)len + count <= *cap || grow(err, buf, cap, len, count, size);
+}
+
+static uint32_t map_index(ExprId node, uint32_t mask)
+{
+    return (node * 2654435761u) & mask;
+}
+
+static bool map_grow(Error* err, struct expr_compiler* c)
+{
+    const uint32_t cap = c->map_cap ? c->map_cap * 2 : 256;
+    struct code_entry* map = mem_calloc(MEM_EXPR, cap, sizeof *map);
+    if (!map) {
+        error_push(err, "failed to allocate expression code: %s", strerror(errno));
+        return false;
+    }
+    // gen 0 is never current, so the zeroed entries are free
+    for (uint32_t i = 0; i < c->map_cap; i++) {
+        const struct code_entry* e = &c->map[i];
+        if (e->gen != c->gen)
+            continue;
+        uint32_t j = map_index(e->node, cap - 1);
+        while (map[j].gen == c->gen)
+            j = (j + 1) & (cap - 1);
+        map[j] = *e;
+    }
+    mem_free(c->map);
+    c->map     = map;
+    c->map_cap = cap;
+    return true;
+}
+
+static struct code_entry* map_slot(struct expr_compiler* c, ExprId node)
+{
+    const uint32_t mask = c->map_cap - 1;
+    uint32_t i = map_index(node, mask);
+    while (c->map[i].gen == c->gen && c->map[i].node != node)
+        i = (i + 1) & mask;
+    return &c->map[i];
+}
+
+/* Instruction of node, UINT32_MAX if it has none that is known to have run
+ * wherever the code is now */
+static uint32_t map_find(struct expr_compiler* c, ExprId node)
+{
+    const struct code_entry* e = map_slot(c, node);
+    if (e->gen != c->gen || e->depth > c->depth || c->open[e->depth] != e->region)
+        return UINT32_MAX;
+    return e->insn;
+}
+
+static inline ExprInsn* code_insns(struct expr_compiler* c)
+{
+    return (ExprInsn*)(c->code + 1);
+}
+
+static bool emit(Error* err, struct expr_compiler* c, const ExprInsn* in)
+{
+    const uint64_t end = sizeof(ExprCode) + ((uint64_t)c->len + 1) * sizeof(ExprInsn);
+    if (end > UINT32_MAX) {
+        error_push(err, "expression code too large");
+        return false;
+    }
+    if (!reserve(err, (void**)&c->code, &c->code_cap, 0, end, 1))
+        return false;
+    code_insns(c)[c->len++] = *in;
+    return true;
+}
+
+/* Notes that node is computed by insn in the region open now */
+static bool map_add(Error* err, struct expr_compiler* c, ExprId node, uint32_t insn)
+{
+    if (c->map_len >= c->map_cap / 2 && !map_grow(err, c))
+        return false;
+    struct code_entry* e = map_slot(c, node);
+    if (e->gen != c->gen)
+        c->map_len++;
+    *e = (struct code_entry){
+        .node   = node,
+        .gen    = c->gen,
+        .insn   = insn,
+        .region = c->open[c->depth],
+        .depth  = c->depth,
+    };
+    return true;
+}
+
+/* The operand for the value node n already holds. A literal goes to the
+ * pool, with the bytes of a long string copied into the block */
+static bool operand_value(Error* err, struct expr_compiler* c, ExprId id, const ExprNode* n,
+                          uint8_t* mode, uint32_t* at)
+{
+    *mode = EXPR_OPERAND_NODE;
+    *at   = id;
+    if (n->kind != EXPR_LITERAL)
+        return true;
+    Value v = n->value;
+    if (v.type == VALUE_STRING && v.small_len == VALUE_LONG_STR) {
+        size_t len;
+        const char* s = v.str->len <= EXPR_CODE_MAX_STR ? str_bytes(err, &v, &len) : NULL;
+        if (!s)
+            return error_empty(err);
+        if (!reserve(err, (void**)&c->bytes, &c->bytes_cap, c->bytes_len, len, 1))
+            return false;
+        memcpy(c->bytes + c->bytes_len, s, len);
+        v.i64 = EXPR_CODE_STR(c->bytes_len, len);
+        c->bytes_len += len;
+    }
+    if (!reserve(err, (void**)&c->pool, &c->pool_cap, c->literals, 1, sizeof *c->pool))
+        return false;
+    *mode = EXPR_OPERAND_LITERAL;
+    *at   = c->literals;
+    c->pool[c->literals++] = v;
+    return true;
+}
+
+/* Sets *mode and *at to the operand node is, *at is UINT32_MAX if it needs
+ * an instruction that hasn't been emitted */
+static inline bool operand(Error* err, struct expr_compiler* c, const ExprArena* a,
+                           ExprId node, uint8_t* mode, uint32_t* at)
+{
+    const ExprNode* n = &a->nodes[node];
+    if (n->evaluated)
+        return operand_value(err, c, node, n, mode, at);
+    *mode = EXPR_OPERAND_INSN;
+    // shared with an operand emitted before
+    *at = n->parents > 1 ? map_find(c, node) : UINT32_MAX;
+    return true;
+}
+
+static inline void operand_done(struct code_frame* f, uint8_t mode, uint32_t at)
+{
+    if (f->state == 1) {
+        f->la  = mode;
+        f->lhs = at;
+    } else {
+        f->ra  = mode;
+        f->rhs = at;
+    }
+}
+
+/* Opens the region entered by the test just emitted */
+static bool region_open(Error* err, struct expr_compiler* c)
+{
+    if (!reserve(err, (void**)&c->open, &c->open_cap, c->depth + 1, 1, sizeof *c->open))
+        return false;
+    c->open[++c->depth] = c->len - 1;
+    return true;
+}
+
+/* Closes the innermost region, its test jumps to the next instruction */
+static void region_close(struct expr_compiler* c)
+{
+    code_insns(c)[c->open[c->depth--]].rhs = c->len;
+}
+
+/* Appends the literal pool and the bytes to the instructions */
+static const ExprCode* assemble(Error* err, struct expr_compiler* c)
+{
+    const size_t insns_end = sizeof(ExprCode) + (size_t)c->len * sizeof(ExprInsn);
+    const size_t pool_at   = (insns_end + 7) & ~(size_t)7;
+    const size_t bytes_at  = pool_at + (size_t)c->literals * sizeof(Value);
+    const size_t size      = bytes_at + c->bytes_len;
+    if (size > UINT32_MAX) {
+        error_push(err, "expression code too large: %zu bytes", size);
+        return NULL;
+    }
+    if (!reserve(err, (void**)&c->code, &c->code_cap, 0, size, 1))
+        return NULL;
+
+    char* base = (char*)c->code;
+    *c->code = (ExprCode){
+        .size     = size,
+        .len      = c->len,
+        .literals = c->literals,
+        .bytes    = c->bytes_len,
+        .insns_at = sizeof(ExprCode),
+        .pool_at  = pool_at,
+        .bytes_at = bytes_at,
+    };
+    memset(base + insns_end, 0, pool_at - insns_end);
+    memcpy(base + pool_at, c->pool, (size_t)c->literals * sizeof(Value));
+    if (c->bytes_len)
+        memcpy(base + bytes_at, c->bytes, c->bytes_len);
+    return c->code;
+}
+
+/* Sets a up to compile id, emitting it at once if it needs no operation */
+static struct expr_compiler* compile_start(Error* err, ExprArena* a, ExprId id)
+{
+    if (id >= a->len) {
+        error_push(err, "bad expression id %" PRIu32, id);
+        return NULL;
+    }
+    if (!a->compiler) {
+        a->compiler = mem_calloc(MEM_EXPR, 1, sizeof *a->compiler);
+        if (!a->compiler) {
+            error_push(err, "failed to allocate expression compiler: %s", strerror(errno));
+            return NULL;
+        }
+    }
+    struct expr_compiler* c = a->compiler;
+    c->len       = 0;
+    c->literals  = 0;
+    c->bytes_len = 0;
+    c->map_len   = 0;
+    c->top       = 0;
+    c->depth     = 0;
+    if (++c->gen == 0)
+        c->gen = 1;
+    if (!c->map && !map_grow(err, c))
+        return NULL;
+    if (!reserve(err, (void**)&c->open, &c->open_cap, 0, 1, sizeof *c->open))
+        return NULL;
+    c->open[0] = UINT32_MAX;
+
+    uint8_t mode;
+    uint32_t at;
+    if (!operand(err, c, a, id, &mode, &at))
+        return NULL;
+    if (at != UINT32_MAX) {
+        const ExprInsn in = {.kind = EXPR_INSN_VALUE, .la = mode, .lhs = at, .node = EXPR_NONE};
+        return emit(err, c, &in) ? c : NULL;
+    }
+    if (!reserve(err, (void**)&c->stack, &c->stack_cap, 0, 1, sizeof *c->stack))
+        return NULL;
+    c->stack[c->top++] = (struct code_frame){.node = id};
+    return c;
+}
+
+/* Emits instructions for the frames on the stack until none is left */
+static const ExprCode* compile(Error* err, ExprArena* a, struct expr_compiler* c)
+{
+    uint32_t top = c->top;
+    while (top > 0) {
+        struct code_frame* f = &c->stack[top - 1];
+        const ExprId cur = f->node;
+        const ExprNode* n = &a->nodes[cur];
+        const bool short_circuit = op_table[n->op].flags & OP_SHORT_CIRCUIT;
+        ExprId next;  // operand to look at next
+        switch (f->state) {
+        case 0:
+            if (n->kind != EXPR_BINARY) {
+                error_push(err, "function calls must be run with flow_eval");
+                return NULL;
+            }
+            f->state = 1;
+            next = n->lhs;
+            break;
+        case 1:
+            if (short_circuit) {
+                // && and || only get to their right operand once the left
+                // one is known not to decide the result
+                const ExprInsn test = {
+                    .kind = EXPR_INSN_TEST,
+                    .op   = n->op,
+                    .la   = f->la,
+                    .lhs  = f->lhs,
+                    .node = EXPR_NONE,
+                };
+                if (!emit(err, c, &test) || !region_open(err, c))
+                    return NULL;
+            }
+            f->state = 2;
+            next = n->rhs;
+            break;
+        default: {
+            const ExprInsn in = {
+                .kind   = EXPR_INSN_OP,
+                .op     = n->op,
+                .lt     = n->lt,
+                .rt     = n->rt,
+                .kernel = n->kernel,
+                .la     = f->la,
+                .ra     = f->ra,
+                .lhs    = f->lhs,
+                .rhs    = f->rhs,
+                .node   = cur,
+            };
+            if (short_circuit)
+                region_close(c);
+            if (!emit(err, c, &in) || (n->parents > 1 && !map_add(err, c, cur, c->len - 1)))
+                return NULL;
+            // hand the instruction to the node the operand belongs to
+            if (--top > 0)
+                operand_done(&c->stack[top - 1], EXPR_OPERAND_INSN, c->len - 1);
+            continue;}
+        }
+
+        uint8_t mode;
+        uint32_t at;
+        if (!operand(err, c, a, next, &mode, &at))
+            return NULL;
+        if (at != UINT32_MAX) {
+            operand_done(f, mode, at);
+        } else {
+            if (!reserve(err, (void**)&c->stack, &c->stack_cap, top, 1, sizeof *c->stack))
+                return NULL;
+            c->stack[top++] = (struct code_frame){.node = next};
+        }
+    }
+    c->top = top;
+    return assemble(err, c);
+}
+
+const ExprCode* expr_compile(Error* err, ExprArena* a, ExprId id)
+{
+    struct expr_compiler* c = compile_start(err, a, id);
+    return c ? compile(err, a, c) : NULL;
+}
+
+/* The value of an operand, NULL on failure. A long string literal is made
+ * in tmp */
+static inline const Value* load(Error* err, const ExprCode* c, ExprArena* a,
+                                const Value* values, uint8_t mode, uint32_t at, Value* tmp)
+{
+    if (mode == EXPR_OPERAND_INSN)
+        return &values[at];
+    if (mode == EXPR_OPERAND_NODE)
+        return &a->nodes[at].value;
+    const Value* v = &expr_code_pool(c)[at];
+    if (v->type != VALUE_STRING || v->small_len != VALUE_LONG_STR)
+        return v;
+    if (!str_make(err, &a->strs, expr_code_bytes(c) + EXPR_CODE_STR_OFFSET(v),
+                  EXPR_CODE_STR_LEN(v), false, tmp))
+    {
+        return NULL;
+    }
+    return tmp;
+}
+
+bool expr_code_run(Error* err, const ExprCode* c, ExprArena* a, Value* values)
+{
+    const ExprInsn* code = expr_code_insns(c);
+    uint32_t pc = 0;
+    for (; pc < c->len; pc++) {
+        const ExprInsn* in = &code[pc];
+        Value lstr, rstr; // long string literals
+        const Value* l = load(err, c, a, values, in->la, in->lhs, &lstr);
+        if (!l)
+            goto fail;
+        Value result;
+        switch (in->kind) {
+        case EXPR_INSN_VALUE:
+            result = *l;
+            break;
+        case EXPR_INSN_TEST:
+            result.type = EXPR_CODE_SKIPPED;
+            if (!op_short_circuit(in->op, l, &result))
+                break;
+            // the result of the && or || is known, its right operand is
+            // skipped
+            for (; pc < in->rhs; pc++)
+                values[pc].type = EXPR_CODE_SKIPPED;
+            pc = in->rhs;
+            in = &code[pc];
+            break;
+        default: {
+            const Value* r = load(err, c, a, values, in->ra, in->rhs, &rstr);
+            if (!r)
+                goto fail;
+            if (in->kernel != OP_KERNEL_DYNAMIC) {
+                // picked when the node was built, the operand types can't
+                // differ
+                if (!op_kernels[in->kernel](err, a->overflow, &a->strs, l, r, &result))
+                    goto fail;
+            } else {
+                const op_kernel kernel = op_kernel_for(in->op, l->type, r->type);
+                if (!kernel) {
+                    error_push(err, "operator %s is not defined for %s and %s",
+                            op_table[in->op].str, value_type_name(l->type),
+                            value_type_name(r->type));
+                    goto fail;
+                }
+                if (!kernel(err, a->overflow, &a->strs, l, r, &result))
+                    goto fail;
+            }
+            break;}
+        }
+
+        values[pc] = result;
+        if (in->kind == EXPR_INSN_OP) {
+            if (!budget_charge(err, &a->budget, 1)) {
+                pc++;
+                goto fail;
+            }
+            if (profile_due())
+                profile_here_(op_table[in->op].str);
+        }
+    }
+    return true;
+
+fail:
+    for (; pc < c->len; pc++)
+        values[pc].type = EXPR_CODE_SKIPPED;
+    return false;
+}
+
+void expr_compiler_free(struct expr_compiler* c)
+{
+    if (!c)
+        return;
+    mem_free(c->code);
+    mem_free(c->pool);
+    mem_free(c->bytes);
+    mem_free(c->map);
+    mem_free(c->stack);
+    mem_free(c->open);
+    mem_free(c);
+}
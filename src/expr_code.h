@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "expr.h"
+#include "value.h"
+
+/* Expression code. What a root still needs is compiled into a flat array of
+ * instructions in post-order, which runs in one forward scan as often as the
+ * caller likes. Instruction i leaves its result in values[i]. Its operands
+ * are earlier instructions, entries of the literal pool or nodes computed by
+ * earlier statements, read from the arena by id, so only operations take an
+ * instruction. A node shared within the statement is computed once.
+ *
+ * expr_eval walks the nodes instead. A root it evaluated is memoized, so its
+ * code would only run once, and compiling a root costs more than walking it.
+ *
+ * The code is a single block without pointers: a header, the instructions,
+ * the literal pool and the bytes of long string literals, each found at an
+ * offset from the start of the block. It can be copied, written out or
+ * mapped, and run wherever the arena it was compiled from is available. The
+ * values of nodes read by id may be strings the block can't hold. */
+
+enum expr_insn_kind {
+    EXPR_INSN_VALUE, // the value of lhs, for a root that needs no operation
+    EXPR_INSN_OP,    // lhs op rhs
+    EXPR_INSN_TEST,  // if the value of lhs decides the && or || at rhs,
+                     // store its result there and go on after it
+};
+
+/* Where an operand is found */
+enum expr_operand {
+    EXPR_OPERAND_INSN,    // result of an earlier instruction
+    EXPR_OPERAND_LITERAL, // entry of the literal pool
+    EXPR_OPERAND_NODE,    // value the node with that id already holds
+};
+
+typedef struct expr_insn {
+    uint8_t kind;   // enum expr_insn_kind
+    uint8_t op;     // EXPR_INSN_OP, EXPR_INSN_TEST: enum operator
+    uint8_t lt;     // EXPR_INSN_OP: operand types, EXPR_DYNAMIC if only
+    uint8_t rt;     // known once they are computed
+    uint8_t kernel; // EXPR_INSN_OP: op_kernels id, OP_KERNEL_DYNAMIC if
+                    // picked by the operand values
+    uint8_t la;     // enum expr_operand of lhs
+    uint8_t ra;     // EXPR_INSN_OP: enum expr_operand of rhs
+    uint32_t lhs;   // the left operand, index or id as la says
+    uint32_t rhs;   // EXPR_INSN_OP: the right operand, as ra says
+                    // EXPR_INSN_TEST: the instruction of the && or ||
+    ExprId node;    // EXPR_INSN_OP: node whose value this is, else EXPR_NONE
+} ExprInsn;
+
+/* A literal pool entry that is a long string has small_len VALUE_LONG_STR
+ * and its bytes in the block, at the offset and length packed in i64 */
+#define EXPR_CODE_STR(offset, len) ((int64_t)(((uint64_t)(len) << 32) | (offset)))
+#define EXPR_CODE_STR_OFFSET(v) ((uint32_t)(uint64_t)(v)->i64)
+#define EXPR_CODE_STR_LEN(v) ((uint32_t)((uint64_t)(v)->i64 >> 32))
+
+/* Longest string literal copied into a block, longer ones are read from
+ * their node */
+#define EXPR_CODE_MAX_STR 4096
+
+/* Value.type of the result of an instruction that was skipped by a test,
+ * or was not reached because an earlier one failed */
+#define EXPR_CODE_SKIPPED VALUE_TYPE_COUNT
+
+typedef struct expr_code {
+    uint32_t size;     // bytes of the block, this header included
+    uint32_t len;      // instructions, the last one computes the root
+    uint32_t literals; // values in the pool
+    uint32_t bytes;    // bytes of long string literals
+    uint32_t insns_at; // offsets of the sections from the start of the block
+    uint32_t pool_at;
+    uint32_t bytes_at;
+    uint32_t reserved;
+} ExprCode;
+
+static inline const ExprInsn* expr_code_insns(const ExprCode* c)
+{
+    return (const ExprInsn*)((const char*)c + c->insns_at);
+}
+
+static inline const Value* expr_code_pool(const ExprCode* c)
+{
+    return (const Value*)((const char*)c + c->pool_at);
+}
+
+static inline const char* expr_code_bytes(const ExprCode* c)
+{
+    return (const char*)c + c->bytes_at;
+}
+
+/* Compiles what evaluating id needs, stopping at nodes that are already
+ * evaluated. The block is owned by a and valid until the next call, NULL on
+ * failure */
+const ExprCode* expr_compile(Error* err, ExprArena* a, ExprId id);
+
+/* Runs c, compiled from a, and stores the result of each instruction in
+ * values, which has room for c->len. Long strings are made in a->strs, and
+ * every operation is charged to a->budget. Nothing is memoized in the
+ * nodes. On failure the instructions not run are EXPR_CODE_SKIPPED */
+bool expr_code_run(Error* err, const ExprCode* c, ExprArena* a, Value* values);
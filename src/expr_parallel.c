@@ -0,0 +1,442 @@
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "expr.h"
+#include "mem.h"
+#include "operator.h"
+#include "trace.h"
+#include "value.h"
+
+/* ======= Parallel chain reduction =======
+
+ A long statement like `t0 + t1 - t2 + ... + tn` is a left spine of binary
+ nodes as deep as the statement is long. The terms are split into one
+ contiguous range per thread. Each thread evaluates its terms and folds the
+ leading run of integer terms. The partial results are then combined in
+ range order, so the outcome does not depend on scheduling.
+
+ The result has to equal the serial left fold exactly, so only operators
+ that reassociate without changing anything are split:
+ - + and - on integers. Partial sums are kept in 128 bits together with the
+   smallest and largest prefix sum. Serial evaluation would overflow exactly
+   when one of the global prefix sums leaves int64_t, and that is checked
+   when the ranges are combined.
+ - &, | and ^ on integers, which can't overflow.
+ From the first float term on, the fold continues serially over the already
+ computed term values with the normal kernels, because float addition does
+ not reassociate and the int to float promotion point must not move.
+
+ Anything unusual, such as an overflow, an evaluation error or a missing
+ kernel, makes the whole chain fall back to expr_eval's serial walk. That
+ produces the same error message and applies the overflow policy.
+
+ ================================ */
+
+#define EXPR_PARALLEL_MIN_TERMS 4096
+#define EXPR_MAX_THREADS 64
+
+typedef __int128 i128;
+
+static int chain_class(enum operator op)
+{
+    switch (op) {
+    case OP_ADD:
+    case OP_SUB:
+        return OP_ADD;
+    case OP_BAND:
+    case OP_BOR:
+    case OP_BXOR:
+        return op;
+    default:
+        return OP_NONE;
+    }
+}
+
+/* Private memo, workers must not write to shared nodes */
+struct memo {
+    ExprId* keys;
+    Value* vals;
+    uint32_t cap;
+    uint32_t len;
+};
+
+struct worker {
+    ExprArena* a;
+    const ExprId* terms;
+    const uint8_t* ops;
+    Value* vals;
+    size_t begin;
+    size_t end;
+    int class;
+    bool ok;
+
+    size_t first_float; // end if all terms in range are integers
+    i128 sum;           // fold of [begin, first_float)
+    i128 prefix_min;    // extreme prefix sums, relative to the range start
+    i128 prefix_max;
+    int64_t bits;
+
+    struct memo memo;
+    ExprId* stack;
+    uint32_t stack_cap;
+    struct mem_budget* budget; // of the calling thread, charged for the above
+};
+
+static Value* memo_find(struct memo* m, ExprId id)
+{
+    if (m->cap == 0)
+        return NULL;
+    uint32_t i = (id * 2654435761u) & (m->cap - 1);
+    while (m->keys[i] != EXPR_NONE) {
+        if (m->keys[i] == id)
+            return &m->vals[i];
+        i = (i + 1) & (m->cap - 1);
+    }
+    return NULL;
+}
+
+static bool memo_insert(struct memo* m, ExprId id, const Value* v)
+{
+    if (m->len >= m->cap / 2) {
+        uint32_t cap = m->cap ? m->cap * 2 : 256;
+        struct memo grown = {
+            .keys = mem_alloc(MEM_EXPR, cap * sizeof *grown.keys),
+            .vals = mem_alloc(MEM_EXPR, cap * sizeof *grown.vals),
+            .cap  = cap,
+        };
+        if (!grown.keys || !grown.vals) {
+            mem_free(grown.keys);
+            mem_free(grown.vals);
+            return false;
+        }
+        memset(grown.keys, 0xff, cap * sizeof *grown.keys); // EXPR_NONE
+        for (uint32_t i = 0; i < m->cap; i++) {
+            if (m->keys[i] != EXPR_NONE)
+                memo_insert(&grown, m->keys[i], &m->vals[i]);
+        }
+        mem_free(m->keys);
+        mem_free(m->vals);
+        *m = grown;
+    }
+    uint32_t i = (id * 2654435761u) & (m->cap - 1);
+    while (m->keys[i] != EXPR_NONE)
+        i = (i + 1) & (m->cap - 1);
+    m->keys[i] = id;
+    m->vals[i] = *v;
+    m->len++;
+    return true;
+}
+
+/* Value of id if it is known, either shared or in the private memo */
+static const Value* known(struct worker* w, ExprId id)
+{
+    const ExprNode* n = &w->a->nodes[id];
+    if (n->evaluated)
+        return &n->value;
+    return memo_find(&w->memo, id);
+}
+
+/* Like expr_eval, but only reads the arena. Errors are dropped, the chain
+ * is redone serially to report them */
+static bool term_eval(struct worker* w, ExprId id, Value* out)
+{
+    const Value* v = known(w, id);
+    if (v) {
+        *out = *v;
+        return true;
+    }
+
+    uint32_t top = 0;
+    for (;;) {
+        if (top + 2 >= w->stack_cap) {
+            uint32_t cap = w->stack_cap ? w->stack_cap * 2 : 64;
+            ExprId* stack = mem_realloc(MEM_EXPR, w->stack, cap * sizeof *stack);
+            if (!stack)
+                return false;
+            w->stack     = stack;
+            w->stack_cap = cap;
+        }
+        if (top == 0) {
+            if (known(w, id))
+                break;
+            w->stack[top++] = id;
+        }
+
+        const ExprId cur = w->stack[top - 1];
+        const ExprNode* n = &w->a->nodes[cur];
+        if (known(w, cur)) {
+            top--;
+            continue;
+        }
+        if (n->kind != EXPR_BINARY)
+            return false;
+        const Value* l = known(w, n->lhs);
+        const Value* r = known(w, n->rhs);
+        Value res;
+        if (l && !r && op_short_circuit(n->op, l, &res)) {
+            if (!memo_insert(&w->memo, cur, &res))
+                return false;
+            top--;
+            continue;
+        }
+        if (!l || !r) {
+            // the right operand of && and || waits for the left one
+            if (!r && (l || !(op_table[n->op].flags & OP_SHORT_CIRCUIT)))
+                w->stack[top++] = n->rhs;
+            if (!l && n->lhs != n->rhs)
+                w->stack[top++] = n->lhs;
+            continue;
+        }
+        // strings are flattened and interned in place, which only the
+        // serial walk may do
+        if (l->type == VALUE_STRING || r->type == VALUE_STRING)
+            return false;
+        const op_kernel kernel = n->kernel != OP_KERNEL_DYNAMIC ? op_kernels[n->kernel]
+                               : op_kernel_for(n->op, l->type, r->type);
+        if (!kernel || !kernel(NULL, w->a->overflow, NULL, l, r, &res))
+            return false;
+        if (!memo_insert(&w->memo, cur, &res))
+            return false;
+        top--;
+    }
+    *out = *known(w, id);
+    return true;
+}
+
+static void* worker_run(void* arg)
+{
+    struct worker* w = arg;
+    w->first_float = w->end;
+    w->sum = w->prefix_min = w->prefix_max = 0;
+    w->bits = 0;
+
+    for (size_t i = w->begin; i < w->end; i++) {
+        if (!term_eval(w, w->terms[i], &w->vals[i]))
+            return NULL;
+    }
+
+    for (size_t i = w->begin; i < w->end; i++) {
+        const Value* v = &w->vals[i];
+        if (v->type != VALUE_INTEGER) {
+            w->first_float = i;
+            break;
+        }
+        if (w->class == OP_ADD) {
+            w->sum += w->ops[i] == OP_SUB ? -(i128)v->i64 : (i128)v->i64;
+            if (i == w->begin || w->sum < w->prefix_min)
+                w->prefix_min = w->sum;
+            if (i == w->begin || w->sum > w->prefix_max)
+                w->prefix_max = w->sum;
+        } else if (i == w->begin) {
+            w->bits = v->i64;
+        } else {
+            switch (w->ops[i]) {
+            case OP_BAND: w->bits &= v->i64; break;
+            case OP_BOR:  w->bits |= v->i64; break;
+            default:      w->bits ^= v->i64; break;
+            }
+        }
+    }
+    w->ok = true;
+    return NULL;
+}
+
+static int thread_count(int threads, size_t terms)
+{
+    long n = threads;
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > EXPR_MAX_THREADS)
+        n = EXPR_MAX_THREADS;
+    if ((size_t)n > terms / (EXPR_PARALLEL_MIN_TERMS / 4))
+        n = terms / (EXPR_PARALLEL_MIN_TERMS / 4);
+    return n < 1 ? 1 : n;
+}
+
+static bool in_chain(ExprArena* a, ExprId id, int class)
+{
+    const ExprNode* node = &a->nodes[id];
+    return node->kind == EXPR_BINARY && chain_class(node->op) == class;
+}
+
+/* Next node down the spine. Where an int chain continues as a float chain,
+ * type inference converted the int part with OP_TO_FLOAT. That node is
+ * skipped, the fold converts by itself at the float term that follows it */
+static ExprId spine_lhs(ExprArena* a, ExprId id, int class)
+{
+    const ExprId lhs = a->nodes[id].lhs;
+    const ExprNode* l = &a->nodes[lhs];
+    if (l->kind == EXPR_BINARY && l->op == OP_TO_FLOAT && in_chain(a, l->lhs, class))
+        return l->lhs;
+    return lhs;
+}
+
+/* Length of the chain below id, counting stops at limit */
+static size_t chain_length(ExprArena* a, ExprId id, int class, size_t limit)
+{
+    size_t n = 1;
+    while (n < limit && in_chain(a, id, class)) {
+        n++;
+        id = spine_lhs(a, id, class);
+    }
+    return n;
+}
+
+/* Combines the workers' results and finishes the fold serially from the
+ * first float term. false if the serial walk must redo the chain */
+static bool chain_combine(struct worker* workers, int count, const uint8_t* ops,
+                          const Value* vals, size_t n, int class,
+                          enum overflow_policy policy, Value* out)
+{
+    i128 sum = 0;
+    int64_t bits = 0;
+    size_t tail = n;
+    for (int t = 0; t < count; t++) {
+        const struct worker* w = &workers[t];
+        if (w->first_float > w->begin) {
+            if (class == OP_ADD) {
+                // every prefix sum is the result of one + or - in the serial
+                // fold, except the first term on its own, which fits anyway
+                if (sum + w->prefix_min < INT64_MIN || sum + w->prefix_max > INT64_MAX)
+                    return false;
+                sum += w->sum;
+            } else if (t == 0) {
+                bits = w->bits;
+            } else {
+                // a bitwise chain repeats a single operator
+                switch (ops[w->begin]) {
+                case OP_BAND: bits &= w->bits; break;
+                case OP_BOR:  bits |= w->bits; break;
+                default:      bits ^= w->bits; break;
+                }
+            }
+        }
+        if (w->first_float < w->end) {
+            tail = w->first_float;
+            break;
+        }
+    }
+
+    Value acc;
+    size_t i = tail;
+    if (tail == 0) {
+        acc = vals[0];
+        i = 1;
+    } else {
+        acc = (Value){.type = VALUE_INTEGER, .i64 = class == OP_ADD ? (int64_t)sum : bits};
+    }
+    for (; i < n; i++) {
+        const op_kernel kernel = op_kernel_for(ops[i], acc.type, vals[i].type);
+        Value res;
+        if (!kernel || !kernel(NULL, policy, NULL, &acc, &vals[i], &res))
+            return false;
+        acc = res;
+    }
+    *out = acc;
+    return true;
+}
+
+/* Entry of the threads started for workers past the first, which runs on
+ * the calling thread */
+static void* worker_thread(void* arg)
+{
+    struct worker* w = arg;
+    mem_budget_share(w->budget);
+    return worker_run(w);
+}
+
+bool expr_eval_chain_(ExprArena* a, ExprId id, Value* out)
+{
+    const ExprNode* root = &a->nodes[id];
+    if (root->kind != EXPR_BINARY || root->type == VALUE_STRING)
+        return false;
+    const int class = chain_class(root->op);
+    if (class == OP_NONE)
+        return false;
+    if (a->threads == 1
+     || chain_length(a, id, class, EXPR_PARALLEL_MIN_TERMS) < EXPR_PARALLEL_MIN_TERMS)
+    {
+        return false;
+    }
+    const size_t n = chain_length(a, id, class, SIZE_MAX);
+    const int count = thread_count(a->threads, n);
+    if (count < 2)
+        return false;
+
+    TraceSpan span = trace_begin("parallel reduce");
+    bool done = false;
+    ExprId* terms = mem_alloc(MEM_EXPR, n * sizeof *terms);
+    uint8_t* ops  = mem_alloc(MEM_EXPR, n * sizeof *ops);
+    Value* vals   = mem_alloc(MEM_EXPR, n * sizeof *vals);
+    struct worker* workers = mem_calloc(MEM_EXPR, count, sizeof *workers);
+    pthread_t threads[EXPR_MAX_THREADS];
+    if (!terms || !ops || !vals || !workers)
+        goto out;
+
+    // terms in source order, ops[i] combines term i with everything before
+    ExprId cur = id;
+    for (size_t i = n - 1; i > 0; i--) {
+        terms[i] = a->nodes[cur].rhs;
+        ops[i]   = a->nodes[cur].op;
+        cur      = spine_lhs(a, cur, class);
+    }
+    terms[0] = cur;
+    ops[0]   = OP_NONE;
+
+    int started = 0;
+    for (int t = 0; t < count; t++) {
+        workers[t] = (struct worker){
+            .a     = a,
+            .terms = terms,
+            .ops   = ops,
+            .vals  = vals,
+            .begin = n * t / count,
+            .end   = n * (t + 1) / count,
+            .class = class,
+            .budget = mem_budget_current(),
+        };
+        if (t > 0 && pthread_create(&threads[t], NULL, worker_thread, &workers[t]) != 0)
+            break;
+        started++;
+    }
+    worker_run(&workers[0]);
+    for (int t = 1; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    bool ok = started == count;
+    for (int t = 0; t < count; t++)
+        ok = ok && workers[t].ok;
+    if (ok && chain_combine(workers, count, ops, vals, n, class, a->overflow, out)) {
+        // keep the terms for later statements, the serial fallback never
+        // gets here so nothing is half written
+        for (size_t i = 0; i < n; i++) {
+            ExprNode* term = &a->nodes[terms[i]];
+            if (!term->evaluated) {
+                term->value     = vals[i];
+                term->evaluated = true;
+                a->evaluated++;
+            }
+        }
+        ExprNode* r = &a->nodes[id];
+        r->value     = *out;
+        r->evaluated = true;
+        a->evaluated++;
+        done = true;
+    }
+
+    for (int t = 0; t < count; t++) {
+        mem_free(workers[t].memo.keys);
+        mem_free(workers[t].memo.vals);
+        mem_free(workers[t].stack);
+    }
+out:
+    mem_free(terms);
+    mem_free(ops);
+    mem_free(vals);
+    mem_free(workers);
+    trace_end(span);
+    return done;
+}
@@ -1,6 +1,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,34 +11,221 @@
 
 #include "error.h"
 #include "file_stream.h"
+#include "file_uring.h"
+#include "mem.h"
+#include "trace.h"
+
+static const char* mfile_mode_str[MFILE_MODE_COUNT] = {
+    [MFILE_MODE_MMAP]       = "mmap",
+    [MFILE_MODE_POPULATE]   = "populate",
+    [MFILE_MODE_SEQUENTIAL] = "sequential",
+    [MFILE_MODE_URING]      = "uring",
+};
+
+enum mfile_mode mfile_mode_parse(const char* name)
+{
+    for (int i = 0; i < MFILE_MODE_COUNT; i++) {
+        if (strcmp(name, mfile_mode_str[i]) == 0)
+            return i;
+    }
+    return MFILE_MODE_COUNT;
+}
+
+const char* mfile_mode_name(enum mfile_mode mode)
+{
+    return mode < MFILE_MODE_COUNT ? mfile_mode_str[mode] : "(bad mode)";
+}
+
+static size_t page_size(void)
+{
+    static size_t page = 0;
+    if (!page)
+        page = sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+/* Copy the whole file into a zero padded heap buffer */
+static char* mfile_copy(Error* err, int fd, size_t size)
+{
+    char* data = mem_alloc(MEM_IO, size + MFILE_PAD);
+    if (!data) {
+        error_push(err, "failed to allocate file buffer: %s", strerror(errno));
+        return NULL;
+    }
+
+    size_t n = 0;
+    while (n < size) {
+        ssize_t got = read(fd, data + n, size - n);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got == -1) {
+            error_push(err, "failed to read file: %s", strerror(errno));
+            mem_free(data);
+            return NULL;
+        }
+        if (got == 0) {
+            error_push(err, "file shrunk while reading");
+            mem_free(data);
+            return NULL;
+        }
+        n += got;
+    }
+    memset(data + size, '\0', MFILE_PAD);
+
+    return data;
+}
+
+/* Map the file followed by at least one page of zeroes. An anonymous mapping
+ * is reserved first and the file is mapped over its beginning, so the bytes
+ * after the last file page are backed by the anonymous zero page instead of
+ * raising SIGBUS */
+static char* mfile_map(Error* err, int fd, size_t size, size_t* map_size, int flags)
+{
+    const size_t page = page_size();
+    const size_t file_pages = (size + page - 1) & ~(page - 1);
+
+    *map_size = file_pages + page;
+    char* data = mmap(NULL, *map_size, PROT_READ,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        error_push(err, "failed to reserve mapping: %s", strerror(errno));
+        return NULL;
+    }
+
+    char* file = mmap(data, size, PROT_READ, MAP_PRIVATE | MAP_FIXED | flags, fd, 0);
+    if (file == MAP_FAILED) {
+        error_push(err, "failed to mmap file: %s", strerror(errno));
+        munmap(data, *map_size);
+        return NULL;
+    }
+
+    return data;
+}
+
+/* Zeroed buffer that the uring reader fills chunk by chunk. mfile_window_
+ * hands what the cursor left behind back to the file */
+static char* mfile_stream(Error* err, Mfile* s)
+{
+    const size_t page = page_size();
+    s->map_size = (s->size + MFILE_PAD + page - 1) & ~(page - 1);
+    char* data = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+        error_push(err, "failed to allocate stream buffer: %s", strerror(errno));
+        s->map_size = 0;
+        return NULL;
+    }
+
+    s->reader = uring_reader_open(err, s->fd, s->size, MFILE_CHUNK);
+    if (!s->reader) {
+        munmap(data, s->map_size);
+        s->map_size = 0;
+        return NULL;
+    }
+    s->avail      = 0;
+    s->checkpoint = 0;
+
+    return data;
+}
+
+/* Zeroed reservation for input of unknown size, filled by mfile_underflow_ */
+static char* mfile_pipe(Error* err, Mfile* s)
+{
+    s->map_size = MFILE_STREAM_RESERVE;
+    char* data = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+        error_push(err, "failed to reserve stream buffer: %s", strerror(errno));
+        s->map_size = 0;
+        return NULL;
+    }
+    s->size  = SIZE_MAX;
+    s->avail = 0;
+
+    return data;
+}
+
+static char* mfile_load(Error* err, Mfile* s)
+{
+    s->avail      = s->size;
+    s->checkpoint = SIZE_MAX;
+
+    if (!S_ISREG(s->sb.st_mode)) {
+        return mfile_pipe(err, s);
+    }
+
+    switch (s->mode) {
+    case MFILE_MODE_MMAP:
+        if (s->size < MFILE_COPY_THRESHOLD)
+            return mfile_copy(err, s->fd, s->size);
+        return mfile_map(err, s->fd, s->size, &s->map_size, 0);
+
+    case MFILE_MODE_POPULATE: {
+        if (s->size < MFILE_COPY_THRESHOLD)
+            return mfile_copy(err, s->fd, s->size);
+        char* data = mfile_map(err, s->fd, s->size, &s->map_size, MAP_POPULATE);
+        if (data) {
+            // only a hint, file backed huge pages depend on the filesystem
+            (void)madvise(data, s->size, MADV_HUGEPAGE);
+        }
+        return data;}
+
+    case MFILE_MODE_SEQUENTIAL: {
+        if (s->size < MFILE_COPY_THRESHOLD)
+            return mfile_copy(err, s->fd, s->size);
+        char* data = mfile_map(err, s->fd, s->size, &s->map_size, 0);
+        if (data) {
+            (void)madvise(data, s->size, MADV_SEQUENTIAL);
+            s->checkpoint = 0;
+        }
+        return data;}
+
+    case MFILE_MODE_URING:
+        return mfile_stream(err, s);
+
+    default:
+        error_push(err, "bad file mode %d", s->mode);
+        return NULL;
+    }
+}
 
 Mfile* mfile_open(Error* err, char* filename)
 {
-	Mfile* s = malloc(sizeof *s);
+    return mfile_open_mode(err, filename, MFILE_MODE_MMAP);
+}
+
+Mfile* mfile_open_mode(Error* err, char* filename, enum mfile_mode mode)
+{
+	Mfile* s = mem_calloc(MEM_IO, 1, sizeof *s);
 	if (!s) {
 		error_push(err, "failed to allocate file stream struct: %s", strerror(errno));
         goto malloc_fail;
 	}
 
-	s->fd = open(filename, O_RDONLY);
+    if (strcmp(filename, "-") == 0) {
+        s->fd = dup(STDIN_FILENO);
+    } else {
+        s->fd = open(filename, O_RDONLY);
+    }
 	if (s->fd == -1) {
 		error_push(err, "failed to open file %s: %s", filename, strerror(errno));
         goto open_fail;
 	}
 
-	struct stat sb;
-	int ok = fstat(s->fd, &sb);
+	int ok = fstat(s->fd, &s->sb);
 	if (ok == -1) {
 		error_push(err, "failed to stat file %s: %s", filename, strerror(errno));
         goto stat_fail;
 	}
-	s->size = sb.st_size;
+	s->size = s->sb.st_size;
+    s->mode = mode;
 
-	s->data = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, s->fd, 0);
-	if (s->data == MAP_FAILED) {
-		error_push(err, "failed to mmap file: %s", strerror(errno));
+    s->data = mfile_load(err, s);
+    if (!s->data) {
+        error_push(err, "failed to load file %s", filename);
         goto mmap_fail;
-	}
+    }
 
     return s;
 
@@ -45,67 +233,143 @@ mmap_fail:
 stat_fail:
     close(s->fd);
 open_fail:
-    free(s);
+    mem_free(s);
 malloc_fail:
     return NULL;
 }
 
-void mfile_close(Error* err, Mfile* s)
+Mfile* mfile_open_buffer(Error* err, const char* src, size_t len)
 {
-    int ok;
-    ok = munmap(s->data, s->size);
-    if (ok == -1) {
-        error_push(err, "failed to munmap file: %s", strerror(errno));
+    if (len > SIZE_MAX - MFILE_PAD) {
+        error_push(err, "buffer too large: %zu bytes", len);
+        return NULL;
     }
-    close(s->fd);
-    if (ok == -1) {
-        error_push(err, "failed to close file: %s", strerror(errno));
+    Mfile* s = mem_calloc(MEM_IO, 1, sizeof *s);
+    if (!s) {
+        error_push(err, "failed to allocate file stream struct: %s", strerror(errno));
+        return NULL;
+    }
+    s->data = mem_alloc(MEM_IO, len + MFILE_PAD);
+    if (!s->data) {
+        error_push(err, "failed to allocate input buffer: %s", strerror(errno));
+        mem_free(s);
+        return NULL;
     }
-    free(s);
+    memcpy(s->data, src, len);
+    memset(s->data + len, '\0', MFILE_PAD);
+    s->fd         = -1;
+    s->mode       = MFILE_MODE_MMAP;
+    s->size       = len;
+    s->avail      = len;
+    s->checkpoint = SIZE_MAX;
+    return s;
 }
 
-inline size_t mfile_inc_pos(Mfile* m)
-{
-    return m->pos++;
-}
-inline size_t mfile_decr_pos(Mfile* m)
+/* Read whatever the pipe has, up to a chunk */
+static size_t mfile_read_pipe(Error* err, Mfile* m)
 {
-    return m->pos--;
+    size_t room = m->map_size - MFILE_PAD - m->avail;
+    if (room == 0) {
+        error_push(err, "input larger than %zu bytes", m->map_size - MFILE_PAD);
+        return 0;
+    }
+    for (;;) {
+        ssize_t got = read(m->fd, m->data + m->avail, room < MFILE_CHUNK ? room : MFILE_CHUNK);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1) {
+            error_push(err, "failed to read: %s", strerror(errno));
+            return 0;
+        }
+        return got;
+    }
 }
 
-inline int mfile_get(Mfile* m)
+void mfile_underflow_(Mfile* m)
 {
-    if (m->pos >= m->size) {
-        return EOF;
+    TraceSpan span = trace_begin("io wait");
+    size_t n;
+    if (m->reader) {
+        n = uring_reader_read(&m->io_err, m->reader, m->data + m->avail);
+    } else {
+        n = mfile_read_pipe(&m->io_err, m);
+        if (n == 0)
+            m->size = m->avail;
     }
-    return m->data[mfile_inc_pos(m)];
+    if (!error_empty(&m->io_err)) {
+        // end the input here, the tokenizer reports io_err at TOKEN_EOF
+        m->size = m->avail;
+        trace_end(span);
+        return;
+    }
+    m->avail += n;
+    trace_end(span);
 }
 
-inline bool mfile_eof(Mfile* m)
+/* Maps the file over the part of the uring buffer before behind. The bytes
+ * are the same, but they are now in the page cache rather than in memory of
+ * our own, and only come back in if something reads them again */
+static void mfile_unload(Mfile* m, size_t behind)
 {
-    return m->pos >= m->size;
+    char* at = m->data + m->released;
+    if (mmap(at, behind - m->released, PROT_READ, MAP_PRIVATE | MAP_FIXED, m->fd,
+             m->released) != MAP_FAILED)
+    {
+        m->released = behind;
+    }
 }
 
-inline char* mfile_cur(Mfile* m)
+void mfile_window_(Mfile* m)
 {
-    static char eof = EOF;
-    if (m->pos >= m->size) {
-        return &eof;
+    const size_t page = page_size();
+
+    if (m->mode != MFILE_MODE_URING) {
+        size_t ahead = m->pos & ~(page - 1);
+        size_t len   = m->size - ahead < 2 * MFILE_WINDOW ? m->size - ahead : 2 * MFILE_WINDOW;
+        (void)madvise(m->data + ahead, len, MADV_WILLNEED);
+    }
+
+    // dropped pages fault back in unchanged if an old token or an error
+    // report looks at them again: the sequential mapping is private and read
+    // only, and the uring buffer is mapped over by the file it was read from
+    if (m->pos > MFILE_WINDOW) {
+        size_t behind = (m->pos - MFILE_WINDOW) & ~(page - 1);
+        if (behind > m->released && m->mode == MFILE_MODE_URING) {
+            mfile_unload(m, behind);
+        } else if (behind > m->released) {
+            (void)madvise(m->data + m->released, behind - m->released, MADV_DONTNEED);
+            m->released = behind;
+        }
     }
-    return m->data + m->pos;
+
+    m->checkpoint = m->pos + MFILE_WINDOW;
 }
 
-inline int mfile_curchar(Mfile* m)
+bool mfile_error(Error* err, Mfile* m)
 {
-    return *(mfile_cur(m));
+    if (error_empty(&m->io_err))
+        return false;
+    error_append(err, &m->io_err);
+    error_push(err, "input truncated at byte %zu", m->size);
+    return true;
 }
 
-void mfile_skip(Mfile* m, int (*f)(int))
+void mfile_close(Error* err, Mfile* s)
 {
-    while (f(mfile_curchar(m)))
-        mfile_inc_pos(m);
+    int ok = 0;
+    mfile_error(err, s);
+    uring_reader_close(s->reader);
+    if (s->map_size) {
+        ok = munmap(s->data, s->map_size);
+        if (ok == -1) {
+            error_push(err, "failed to munmap file: %s", strerror(errno));
+        }
+    } else {
+        mem_free(s->data);
+    }
+    ok = s->fd == -1 ? 0 : close(s->fd);
+    if (ok == -1) {
+        error_push(err, "failed to close file: %s", strerror(errno));
+    }
+    mem_free(s);
 }
-
-
-
-
@@ -1,10 +1,35 @@
 #pragma once
 
 #include <sys/stat.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include "error.h"
 
-extern char* mfile_overflow_slope;
+/* Number of '\0' bytes guaranteed to follow the last byte of data */
+#define MFILE_PAD 64
+
+/* Files smaller than this are copied into a heap buffer instead of mapped */
+#define MFILE_COPY_THRESHOLD (64 * 1024)
+
+/* Readahead/release window for MFILE_MODE_SEQUENTIAL */
+#define MFILE_WINDOW (8 * 1024 * 1024)
+
+/* Chunk size for MFILE_MODE_URING and for reads from pipes */
+#define MFILE_CHUNK (1024 * 1024)
+
+/* Address space reserved for input of unknown size, like stdin */
+#define MFILE_STREAM_RESERVE ((size_t)64 << 30)
+
+enum mfile_mode {
+    MFILE_MODE_MMAP,       // copy small files, plain mmap otherwise
+    MFILE_MODE_POPULATE,   // prefault the whole mapping, ask for huge pages
+    MFILE_MODE_SEQUENTIAL, // readahead in front of the cursor, drop pages behind it
+    MFILE_MODE_URING,      // double buffered io_uring reads into a private buffer
+    MFILE_MODE_COUNT
+};
+
+struct uring_reader;
 
 typedef struct mfile {
 	char* data;
@@ -13,32 +38,103 @@ typedef struct mfile {
 
     // internal
     int fd;
+    enum mfile_mode mode;
+    size_t map_size;   // 0 if data is heap allocated
+    size_t avail;      // bytes of data loaded so far, data[avail] is '\0'
+    size_t checkpoint; // mfile_window_ is called once pos passes this
+    size_t released;   // bytes before this were dropped from memory, see mfile_window_
+    Error io_err;      // failure of a read done by mfile_underflow_
+    struct uring_reader* reader;
     struct stat sb;
     #define mfile_size sb.st_size
 } Mfile;
 
-/* Open memory mapped file */
+/* Open memory mapped file. data[size] and the MFILE_PAD-1 bytes after it are
+ * always '\0', so scanning loops can stop at the sentinel instead of checking
+ * pos against size. "-" opens stdin. Pipes and other files that can't be
+ * mapped are read in chunks as the cursor reaches the end of what has been
+ * read so far, size is SIZE_MAX until their end is seen */
 Mfile* mfile_open(Error* err, char* filename);
 
+/* Open file with the given I/O strategy */
+Mfile* mfile_open_mode(Error* err, char* filename, enum mfile_mode mode);
+
+/* Stream over a copy of len bytes at src, so the caller's buffer needs no
+ * padding and may be reused as soon as this returns */
+Mfile* mfile_open_buffer(Error* err, const char* src, size_t len);
+
+/* Parse mode name, returns MFILE_MODE_COUNT if unknown */
+enum mfile_mode mfile_mode_parse(const char* name);
+const char*     mfile_mode_name(enum mfile_mode mode);
+
+/* Slow paths behind mfile_curchar and mfile_checkpoint */
+void mfile_underflow_(Mfile* m);
+void mfile_window_(Mfile* m);
+
+/* Moves a read error that truncated the input into err. Returns true if there
+ * was one */
+bool mfile_error(Error* err, Mfile* m);
+
 /* Close memory mapped file */
 void mfile_close(Error* err, Mfile* s);
 
-/* Get next byte, returns EOF if end of file */
-int mfile_get(Mfile* s);
-
 /* Returns true if end of file */
-bool mfile_eof(Mfile* s);
+static inline bool mfile_eof(Mfile* m)
+{
+    return m->pos >= m->size;
+}
 
 /* Returns current position */
-char* mfile_cur(Mfile* s);
+static inline char* mfile_cur(Mfile* m)
+{
+    return m->data + m->pos;
+}
 
-/* Skips char until f is false */
-void mfile_skip(Mfile* s, int (*f)(int));
+/* Get current char, '\0' at end of file. Streamed modes keep the bytes past
+ * avail zeroed, so hitting the watermark looks like the sentinel and only
+ * then do we check whether more input has to be read */
+static inline int mfile_curchar(Mfile* m)
+{
+    int c = (unsigned char)m->data[m->pos];
+    if (__builtin_expect(c == '\0', 0) && m->pos == m->avail && m->avail < m->size) {
+        mfile_underflow_(m);
+        c = (unsigned char)m->data[m->pos];
+    }
+    return c;
+}
 
-/* Get current char */
-int mfile_curchar(Mfile* s);
+/* Give the kernel access hints, called once per token */
+static inline void mfile_checkpoint(Mfile* m)
+{
+    if (__builtin_expect(m->pos >= m->checkpoint, 0))
+        mfile_window_(m);
+}
 
 /* Skip the current char */
-size_t mfile_inc_pos(Mfile* m);
+static inline size_t mfile_inc_pos(Mfile* m)
+{
+    return m->pos++;
+}
+
+static inline size_t mfile_decr_pos(Mfile* m)
+{
+    return m->pos--;
+}
+
+/* Get next byte, returns EOF if end of file */
+static inline int mfile_get(Mfile* m)
+{
+    int c = mfile_curchar(m);
+    if (c == '\0' && mfile_eof(m)) {
+        return EOF;
+    }
+    mfile_inc_pos(m);
+    return c;
+}
 
-size_t mfile_decr_pos(Mfile* m);
+/* Skips char until f is false. f must be false for '\0' */
+static inline void mfile_skip(Mfile* m, int (*f)(int))
+{
+    while (f(mfile_curchar(m)))
+        mfile_inc_pos(m);
+}
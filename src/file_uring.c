@@ -0,0 +1,303 @@
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "file_uring.h"
+#include "mem.h"
+
+#define URING_SLOTS 2
+
+struct uring_slot {
+    char* buf;
+    size_t off;
+    size_t len;
+    int res;
+    bool inflight;
+};
+
+struct uring_reader {
+    int fd;
+    size_t size;
+    size_t chunk;
+    size_t submit_off; // offset of the next chunk to submit
+    size_t copy_off;   // offset of the next chunk to hand out
+    unsigned cur;      // slot holding copy_off
+    struct uring_slot slots[URING_SLOTS];
+
+    // ring, ring_fd is -1 when falling back to pread
+    int ring_fd;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static bool uring_setup(UringReader* r)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+
+    r->ring_fd = sys_io_uring_setup(URING_SLOTS, &p);
+    if (r->ring_fd == -1) {
+        return false;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size)
+            r->sq_size = r->cq_size;
+        r->cq_size = 0;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto sq_fail;
+
+    if (r->cq_size) {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto cq_fail;
+    } else {
+        r->cq_ptr = r->sq_ptr;
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto sqes_fail;
+
+    char* sq = r->sq_ptr;
+    char* cq = r->cq_ptr;
+    r->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    return true;
+
+sqes_fail:
+    if (r->cq_size)
+        munmap(r->cq_ptr, r->cq_size);
+cq_fail:
+    munmap(r->sq_ptr, r->sq_size);
+sq_fail:
+    close(r->ring_fd);
+    r->ring_fd = -1;
+    return false;
+}
+
+static bool uring_submit(UringReader* r, unsigned slot)
+{
+    struct uring_slot* s = &r->slots[slot];
+
+    unsigned tail = *r->sq_tail;
+    unsigned idx  = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = r->fd;
+    sqe->addr      = (uintptr_t)s->buf;
+    sqe->len       = s->len;
+    sqe->off       = s->off;
+    sqe->user_data = slot;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int ok;
+    do {
+        ok = sys_io_uring_enter(r->ring_fd, 1, 0, 0);
+    } while (ok == -1 && errno == EINTR);
+    if (ok == -1)
+        return false;
+
+    s->inflight = true;
+    return true;
+}
+
+/* Reap completions until slot is done */
+static bool uring_wait(UringReader* r, unsigned slot)
+{
+    while (r->slots[slot].inflight) {
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            int ok = sys_io_uring_enter(r->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+            if (ok == -1 && errno != EINTR)
+                return false;
+            continue;
+        }
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        struct uring_slot* s = &r->slots[cqe->user_data];
+        s->res      = cqe->res;
+        s->inflight = false;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+/* Queue the next chunk of the file into slot */
+static bool uring_queue(UringReader* r, unsigned slot)
+{
+    struct uring_slot* s = &r->slots[slot];
+    if (r->submit_off >= r->size) {
+        s->len = 0;
+        return true;
+    }
+    s->off = r->submit_off;
+    s->len = r->size - r->submit_off < r->chunk ? r->size - r->submit_off : r->chunk;
+    r->submit_off += s->len;
+    return uring_submit(r, slot);
+}
+
+/* Synchronous read of [off, off+len) into dst */
+static bool pread_all(int fd, char* dst, size_t len, size_t off)
+{
+    while (len > 0) {
+        ssize_t got = pread(fd, dst, len, off);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        dst += got;
+        off += got;
+        len -= got;
+    }
+    return true;
+}
+
+UringReader* uring_reader_open(Error* err, int fd, size_t size, size_t chunk)
+{
+    UringReader* r = mem_calloc(MEM_IO, 1, sizeof *r);
+    if (!r) {
+        error_push(err, "failed to allocate reader: %s", strerror(errno));
+        return NULL;
+    }
+    r->fd    = fd;
+    r->size  = size;
+    r->chunk = chunk;
+
+    if (!uring_setup(r)) {
+        return r;
+    }
+
+    for (unsigned i = 0; i < URING_SLOTS; i++) {
+        r->slots[i].buf = mem_alloc(MEM_IO, chunk);
+        if (!r->slots[i].buf) {
+            error_push(err, "failed to allocate read buffer: %s", strerror(errno));
+            uring_reader_close(r);
+            return NULL;
+        }
+    }
+    for (unsigned i = 0; i < URING_SLOTS; i++) {
+        if (!uring_queue(r, i)) {
+            error_push(err, "failed to submit read: %s", strerror(errno));
+            uring_reader_close(r);
+            return NULL;
+        }
+    }
+
+    return r;
+}
+
+size_t uring_reader_read(Error* err, UringReader* r, char* dst)
+{
+    if (r->copy_off >= r->size) {
+        return 0;
+    }
+
+    if (r->ring_fd == -1) {
+        size_t len = r->size - r->copy_off < r->chunk ? r->size - r->copy_off : r->chunk;
+        if (!pread_all(r->fd, dst, len, r->copy_off)) {
+            error_push(err, "failed to read file: %s", errno ? strerror(errno) : "file truncated");
+            return 0;
+        }
+        r->copy_off += len;
+        return len;
+    }
+
+    struct uring_slot* s = &r->slots[r->cur];
+    if (!uring_wait(r, r->cur)) {
+        error_push(err, "failed to wait for read: %s", strerror(errno));
+        return 0;
+    }
+    if (s->res < 0) {
+        error_push(err, "failed to read file: %s", strerror(-s->res));
+        return 0;
+    }
+
+    size_t len = s->len;
+    size_t got = s->res;
+    memcpy(dst, s->buf, got);
+    if (got < len && !pread_all(r->fd, dst + got, len - got, s->off + got)) {
+        error_push(err, "failed to read file: %s", errno ? strerror(errno) : "file truncated");
+        return 0;
+    }
+    r->copy_off += len;
+
+    if (!uring_queue(r, r->cur)) {
+        error_push(err, "failed to submit read: %s", strerror(errno));
+        return 0;
+    }
+    r->cur = (r->cur + 1) % URING_SLOTS;
+
+    return len;
+}
+
+bool uring_reader_async(UringReader* r)
+{
+    return r->ring_fd != -1;
+}
+
+void uring_reader_close(UringReader* r)
+{
+    if (!r)
+        return;
+    if (r->ring_fd != -1) {
+        // the kernel may still be writing into the buffers
+        for (unsigned i = 0; i < URING_SLOTS; i++)
+            uring_wait(r, i);
+        munmap(r->sqes, r->sqes_size);
+        if (r->cq_size)
+            munmap(r->cq_ptr, r->cq_size);
+        munmap(r->sq_ptr, r->sq_size);
+        close(r->ring_fd);
+    }
+    for (unsigned i = 0; i < URING_SLOTS; i++)
+        mem_free(r->slots[i].buf);
+    mem_free(r);
+}
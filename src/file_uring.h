@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include "error.h"
+
+/* Double buffered chunked file reader. Two chunk reads are kept in flight
+ * through io_uring so the disk works on the next chunk while the previous one
+ * is consumed. Falls back to synchronous pread if io_uring is unavailable. */
+typedef struct uring_reader UringReader;
+
+/* Start reading size bytes of fd in chunks of chunk bytes */
+UringReader* uring_reader_open(Error* err, int fd, size_t size, size_t chunk);
+
+/* Wait for the next chunk in file order and copy it to dst. Returns the number
+ * of bytes copied, 0 at end of file */
+size_t uring_reader_read(Error* err, UringReader* r, char* dst);
+
+/* Returns true if reads go through io_uring rather than the pread fallback */
+bool uring_reader_async(UringReader* r);
+
+void uring_reader_close(UringReader* r);
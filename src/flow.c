@@ -0,0 +1,880 @@
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "expr.h"
+#include "flow.h"
+#include "func.h"
+#include "mem.h"
+#include "operator.h"
+#include "profile.h"
+#include "symbols.h"
+#include "value.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* Makes room for one more element of size bytes in *buf */
+static bool grow(Error* err, void** buf, uint32_t* cap, uint32_t len, size_t size,
+                 const char* what)
+{
+    if (len < *cap)
+        return true;
+    uint32_t n = *cap ? *cap * 2 : 64;
+    void* p = n > *cap ? mem_realloc(MEM_PARSER, *buf, (size_t)n * size) : NULL;
+    if (!p) {
+        error_push(err, "failed to grow %s to %" PRIu32 ": %s", what, n, strerror(errno));
+        return false;
+    }
+    *buf = p;
+    *cap = n;
+    return true;
+}
+
+uint32_t flow_slot(Error* err, Flow* f, ExprArena* a, Symbol* sym)
+{
+    if (sym->var != EXPR_NONE)
+        return a->nodes[sym->var].rhs;
+    if (!grow(err, (void**)&f->vars, &f->vars_cap, f->vars_len, sizeof *f->vars, "variables"))
+        return UINT32_MAX;
+    const Value v = a->nodes[sym->value].value;
+    const ExprId id = expr_var(err, a, &v, f->vars_len);
+    if (id == EXPR_NONE)
+        return UINT32_MAX;
+    f->vars[f->vars_len] = (FlowVar){.sym = sym, .node = id, .written = false};
+    sym->var = id;
+    return f->vars_len++;
+}
+
+uint32_t flow_add(Error* err, Flow* f, const FlowStmt* s)
+{
+    if (!grow(err, (void**)&f->stmts, &f->cap, f->len, sizeof *f->stmts, "statements"))
+        return UINT32_MAX;
+    FlowStmt* t = &f->stmts[f->len];
+    *t = *s;
+    t->body_end = t->else_end = f->len + 1;
+    if (t->kind == FLOW_ASSIGN)
+        f->vars[t->slot].written = true;
+    return f->len++;
+}
+
+void flow_else(Flow* f, uint32_t at)
+{
+    f->stmts[at].body_end = f->stmts[at].else_end = f->len;
+}
+
+void flow_close(Flow* f, uint32_t at)
+{
+    if (f->stmts[at].kind == FLOW_WHILE)
+        f->stmts[at].body_end = f->len;
+    f->stmts[at].else_end = f->len;
+}
+
+/* ======= Lowering =======
+
+ Every node a statement needs that isn't evaluated yet gets an instruction,
+ placed at one of:
+
+    0       the start of the code, run once and memoized
+    1..n    the preheader of the enclosing loop at that depth
+    n + 1   in front of the statement itself
+
+ where n is the number of loops around the statement. The level of a
+ variable is the place nodes over it can go: 0 if the statement never
+ assigns it, 1 if no loop around the statement does, and one more than the
+ depth of the innermost loop around the statement that does. A node goes to
+ the highest level of its operands, or n + 1 if it can fail.
+
+ The right operand of && and || is placed in a region that a FLOW_TEST of
+ the left operand can jump over. What goes in front of the statement while
+ the region is open is in it, and counts as placed only until it closes.
+
+ Instructions are first collected with a key for where they go, in
+ dependency order, then sorted by key and laid out around the jumps.
+
+ ================================ */
+
+/* Instruction collected for key 0 (start), 2i+1 (preheader of statement i)
+ * or 2i+2 (in front of statement i) */
+struct item {
+    uint32_t key;
+    uint32_t stmt;
+    ExprId node;
+    uint8_t op;
+};
+
+/* Placement of a node, hashed by node id */
+struct place {
+    ExprId node;    // EXPR_NONE for an empty bucket
+    uint32_t epoch; // loop nesting the entry is valid for, 0 if unset
+    uint32_t use;   // last use it was placed for
+    uint32_t guard; // region it was placed in, 0 if none
+    uint16_t level;
+    uint16_t at;
+};
+
+/* Region of the right operand of a && or || node */
+struct region {
+    ExprId node;
+    uint32_t id;
+    uint32_t item; // its FLOW_TEST in lower.items
+};
+
+struct lower {
+    Flow* f;
+    ExprArena* a;
+
+    struct place* map;
+    uint32_t map_cap; // power of two
+    uint32_t map_len;
+
+    uint16_t* level;  // by variable slot
+    uint32_t loops[FLOW_MAX_DEPTH + 1]; // statement of the loop at each depth
+    uint32_t n;       // loops around the current statement
+    uint32_t epoch;   // changes whenever n or a level does
+    uint32_t use;     // counts statement roots and conditions
+
+    struct item* items;
+    uint32_t items_len;
+    uint32_t items_cap;
+
+    ExprId* stack;
+    uint32_t stack_len;
+    uint32_t stack_cap;
+
+    struct region* open; // regions open in the current use, innermost last
+    uint32_t open_len;
+    uint32_t open_cap;
+    uint32_t regions;    // ids handed out
+};
+
+static uint32_t place_hash(ExprId id)
+{
+    return (uint32_t)(((uint64_t)id * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static struct place* place_find(struct place* map, uint32_t cap, ExprId id)
+{
+    uint32_t i = place_hash(id) & (cap - 1);
+    while (map[i].node != EXPR_NONE && map[i].node != id)
+        i = (i + 1) & (cap - 1);
+    return &map[i];
+}
+
+/* Makes room for count more entries, so pointers stay valid until then */
+static bool place_reserve(Error* err, struct lower* l, uint32_t count)
+{
+    if (l->map_len + count <= l->map_cap / 2)
+        return true;
+    const uint32_t cap = l->map_cap ? l->map_cap * 2 : 1024;
+    struct place* map = mem_alloc(MEM_PARSER, cap * sizeof *map);
+    if (!map) {
+        error_push(err, "failed to allocate node placement: %s", strerror(errno));
+        return false;
+    }
+    for (uint32_t i = 0; i < cap; i++)
+        map[i].node = EXPR_NONE;
+    for (uint32_t i = 0; i < l->map_cap; i++) {
+        if (l->map[i].node != EXPR_NONE)
+            *place_find(map, cap, l->map[i].node) = l->map[i];
+    }
+    mem_free(l->map);
+    l->map     = map;
+    l->map_cap = cap;
+    return true;
+}
+
+static struct place* place_get(struct lower* l, ExprId id)
+{
+    struct place* p = place_find(l->map, l->map_cap, id);
+    if (p->node == EXPR_NONE) {
+        *p = (struct place){.node = id, .epoch = 0};
+        l->map_len++;
+    }
+    return p;
+}
+
+/* Placed for the current use already, outside of any region that closed
+ * since, or hoisted to where it still holds */
+static bool placed(const struct lower* l, const struct place* p)
+{
+    if (p->epoch != 0 && p->at == 0)
+        return true;
+    if (p->epoch != l->epoch)
+        return false;
+    if (p->at <= l->n)
+        return true;
+    if (p->use != l->use)
+        return false;
+    for (uint32_t i = l->open_len; p->guard != 0; i--) {
+        if (i == 0)
+            return false;
+        if (l->open[i - 1].id == p->guard)
+            break;
+    }
+    return true;
+}
+
+/* Level and place of an operand that needs no instruction */
+static uint16_t leaf_level(const struct lower* l, const ExprNode* n)
+{
+    return n->kind == EXPR_VAR ? l->level[n->rhs] : 0;
+}
+
+static bool may_fail(ExprArena* a, const ExprNode* n)
+{
+    if (n->kind == EXPR_CALL)
+        return true;
+    if (n->kind == EXPR_ARG)
+        return false;
+    const uint8_t lt = a->nodes[n->lhs].type;
+    const uint8_t rt = a->nodes[n->rhs].type;
+    if (lt == EXPR_DYNAMIC || rt == EXPR_DYNAMIC)
+        return true; // the kernel is picked at run time, if there is one
+    if (lt != VALUE_INTEGER)
+        return false;
+    switch (n->op) {
+    case OP_DIV:
+    case OP_MOD:
+    case OP_SHL:
+    case OP_SHR:
+        return true;
+    default:
+        return (op_table[n->op].flags & OP_CHECKED) && a->overflow == OVERFLOW_ERROR;
+    }
+}
+
+static bool item_add(Error* err, struct lower* l, uint32_t key, uint32_t stmt, ExprId node,
+                     uint8_t op)
+{
+    if (!grow(err, (void**)&l->items, &l->items_cap, l->items_len, sizeof *l->items,
+              "instructions"))
+    {
+        return false;
+    }
+    l->items[l->items_len++] = (struct item){.key = key, .stmt = stmt, .node = node, .op = op};
+    return true;
+}
+
+/* Collects the instructions that compute root for statement stmt */
+static bool lower_use(Error* err, struct lower* l, ExprId root, uint32_t stmt)
+{
+    ExprArena* a = l->a;
+    l->use++;
+    if (a->nodes[root].evaluated)
+        return true;
+
+    l->stack_len = 0;
+    if (!grow(err, (void**)&l->stack, &l->stack_cap, 0, sizeof *l->stack, "stack"))
+        return false;
+    l->stack[l->stack_len++] = root;
+    while (l->stack_len > 0) {
+        if (!place_reserve(err, l, 3))
+            return false;
+        const ExprId id = l->stack[l->stack_len - 1];
+        struct place* p = place_get(l, id);
+        if (placed(l, p)) {
+            l->stack_len--;
+            continue;
+        }
+
+        // operands first
+        const ExprNode* n = &a->nodes[id];
+        ExprId ops[2];
+        const uint32_t count = expr_operands(n, ops);
+        const bool open = l->open_len > 0 && l->open[l->open_len - 1].node == id;
+        if (n->kind == EXPR_BINARY && (op_table[n->op].flags & OP_SHORT_CIRCUIT) && !open) {
+            const ExprNode* lhs = &a->nodes[n->lhs];
+            const ExprNode* rhs = &a->nodes[n->rhs];
+            if (!lhs->evaluated && !placed(l, place_get(l, n->lhs))) {
+                if (!grow(err, (void**)&l->stack, &l->stack_cap, l->stack_len, sizeof *l->stack,
+                          "stack"))
+                {
+                    return false;
+                }
+                l->stack[l->stack_len++] = n->lhs;
+                continue;
+            }
+            if (!rhs->evaluated && !placed(l, place_get(l, n->rhs))) {
+                if (!grow(err, (void**)&l->open, &l->open_cap, l->open_len, sizeof *l->open,
+                          "regions")
+                 || !grow(err, (void**)&l->stack, &l->stack_cap, l->stack_len, sizeof *l->stack,
+                          "stack"))
+                {
+                    return false;
+                }
+                l->open[l->open_len++] = (struct region){
+                    .node = id, .id = ++l->regions, .item = l->items_len,
+                };
+                if (!item_add(err, l, 2 * stmt + 2, stmt, id, FLOW_TEST))
+                    return false;
+                l->stack[l->stack_len++] = n->rhs;
+                continue;
+            }
+        }
+        uint16_t level = 0, op_at = 0;
+        bool ready = true;
+        for (uint32_t i = 0; i < count; i++) {
+            const ExprNode* o = &a->nodes[ops[i]];
+            if (o->evaluated) {
+                level = MAX(level, leaf_level(l, o));
+                continue;
+            }
+            const struct place* op = place_get(l, ops[i]);
+            if (!placed(l, op)) {
+                ready = false;
+                continue;
+            }
+            level = MAX(level, op->level);
+            op_at = MAX(op_at, op->at);
+        }
+        if (!ready) {
+            if (!grow(err, (void**)&l->stack, &l->stack_cap, l->stack_len + 1, sizeof *l->stack,
+                      "stack"))
+            {
+                return false;
+            }
+            for (uint32_t i = count; i-- > 0;) {
+                if (!a->nodes[ops[i]].evaluated && !placed(l, place_get(l, ops[i])))
+                    l->stack[l->stack_len++] = ops[i];
+            }
+            continue;
+        }
+
+        uint16_t at = l->n + 1;
+        if (!may_fail(a, n))
+            at = MAX(level, op_at);
+
+        uint32_t key = 2 * stmt + 2;
+        if (at == 0)
+            key = 0;
+        else if (at <= l->n)
+            key = 2 * l->loops[at] + 1;
+
+        if (open) {
+            // the test jumps to right after the node, so it is dropped if the
+            // node was hoisted, or if everything in the region was. Tests
+            // dropped already don't count
+            const struct region* r = &l->open[--l->open_len];
+            bool used = false;
+            for (uint32_t i = r->item + 1; i < l->items_len && !used; i++) {
+                const struct item* it = &l->items[i];
+                used = it->key == 2 * stmt + 2 && it->node != EXPR_NONE;
+            }
+            if (!used || key != 2 * stmt + 2)
+                l->items[r->item].node = EXPR_NONE;
+        }
+        uint8_t op = level == 0 ? FLOW_EVAL_ONCE : FLOW_EVAL;
+        if (n->kind == EXPR_CALL)
+            op = level == 0 ? FLOW_CALL_ONCE : FLOW_CALL;
+        // an argument list only passes its placement on to the call
+        if (n->kind != EXPR_ARG) {
+            if (at <= l->n && l->n > 0)
+                l->f->hoisted++;
+            if (!item_add(err, l, key, stmt, id, op))
+                return false;
+        }
+
+        *p = (struct place){
+            .node  = id,
+            .epoch = l->epoch,
+            .use   = l->use,
+            .guard = l->open_len > 0 ? l->open[l->open_len - 1].id : 0,
+            .level = level,
+            .at    = at,
+        };
+        l->stack_len--;
+    }
+    return true;
+}
+
+/* Moves the variables assigned in loop w to the level of depth */
+static void loop_levels(struct lower* l, uint32_t w, uint16_t level)
+{
+    const Flow* f = l->f;
+    for (uint32_t i = w + 1; i < f->stmts[w].body_end; i++) {
+        if (f->stmts[i].kind == FLOW_ASSIGN)
+            l->level[f->stmts[i].slot] = level;
+    }
+    l->epoch++;
+}
+
+static bool lower_block(Error* err, struct lower* l, uint32_t begin, uint32_t end)
+{
+    const Flow* f = l->f;
+    for (uint32_t i = begin; i < end;) {
+        const FlowStmt* s = &f->stmts[i];
+        switch (s->kind) {
+        case FLOW_EXPR:
+        case FLOW_ASSIGN:
+        case FLOW_RETURN:
+            if (!lower_use(err, l, s->root, i))
+                return false;
+            i++;
+            break;
+
+        case FLOW_IF:
+            if (!lower_use(err, l, s->root, i)
+             || !lower_block(err, l, i + 1, s->body_end)
+             || !lower_block(err, l, s->body_end, s->else_end))
+            {
+                return false;
+            }
+            i = s->else_end;
+            break;
+
+        case FLOW_WHILE:
+            // the condition runs on every iteration, inside the loop
+            l->loops[++l->n] = i;
+            loop_levels(l, i, l->n + 1);
+            if (!lower_use(err, l, s->root, i)
+             || !lower_block(err, l, i + 1, s->body_end))
+            {
+                return false;
+            }
+            loop_levels(l, i, l->n);
+            l->n--;
+            i = s->body_end;
+            break;
+        }
+    }
+    return true;
+}
+
+static uint32_t emit(Error* err, Flow* f, uint8_t op, uint32_t stmt, ExprId node, uint32_t arg)
+{
+    if (!grow(err, (void**)&f->code, &f->code_cap, f->code_len, sizeof *f->code, "code"))
+        return UINT32_MAX;
+    f->code[f->code_len] = (FlowInsn){
+        .op = op, .stmt = stmt, .node = node, .arg = arg, .kernel = NULL,
+    };
+    return f->code_len++;
+}
+
+/* Emits the collected instructions with key k. start[k] is where they begin
+ * in the sorted items */
+static bool emit_items(Error* err, struct lower* l, const uint32_t* start, uint32_t k)
+{
+    ExprArena* a = l->a;
+    FlowInsn* code;
+    // open FLOW_TEST instructions, linked through their arg until the node
+    // they test is computed right before their target
+    uint32_t test = UINT32_MAX;
+    for (uint32_t i = start[k]; i < start[k + 1]; i++) {
+        const struct item* it = &l->items[i];
+        if (it->op == FLOW_TEST && it->node == EXPR_NONE)
+            continue;
+        const uint32_t pc = emit(err, l->f, it->op, it->stmt, it->node, 0);
+        if (pc == UINT32_MAX)
+            return false;
+        code = l->f->code;
+        if (it->op == FLOW_TEST) {
+            code[pc].arg = test;
+            test = pc;
+            continue;
+        }
+        if (test != UINT32_MAX && code[test].node == it->node) {
+            const uint32_t next = code[test].arg;
+            code[test].arg = pc + 1;
+            test = next;
+        }
+        const ExprNode* n = &a->nodes[it->node];
+        if (n->kind == EXPR_BINARY && n->kernel != OP_KERNEL_DYNAMIC)
+            code[pc].kernel = op_kernels[n->kernel];
+    }
+    return true;
+}
+
+static bool emit_block(Error* err, struct lower* l, const uint32_t* start,
+                       uint32_t begin, uint32_t end)
+{
+    Flow* f = l->f;
+    for (uint32_t i = begin; i < end;) {
+        const FlowStmt s = f->stmts[i];
+        if (!emit_items(err, l, start, 2 * i + 1))
+            return false;
+        const uint32_t head = f->code_len;
+        if (!emit_items(err, l, start, 2 * i + 2))
+            return false;
+
+        uint32_t branch, jump;
+        switch (s.kind) {
+        case FLOW_EXPR:
+            if (emit(err, f, FLOW_PRINT, i, s.root, 0) == UINT32_MAX)
+                return false;
+            i++;
+            break;
+
+        case FLOW_ASSIGN:
+            if (emit(err, f, FLOW_STORE, i, f->vars[s.slot].node, s.root) == UINT32_MAX)
+                return false;
+            i++;
+            break;
+
+        case FLOW_RETURN:
+            if (emit(err, f, FLOW_RET, i, s.root, 0) == UINT32_MAX)
+                return false;
+            i++;
+            break;
+
+        case FLOW_IF:
+            branch = emit(err, f, FLOW_BRANCH, i, s.root, 0);
+            if (branch == UINT32_MAX || !emit_block(err, l, start, i + 1, s.body_end))
+                return false;
+            if (s.else_end > s.body_end) {
+                jump = emit(err, f, FLOW_JUMP, i, EXPR_NONE, 0);
+                if (jump == UINT32_MAX)
+                    return false;
+                f->code[branch].arg = f->code_len;
+                if (!emit_block(err, l, start, s.body_end, s.else_end))
+                    return false;
+                f->code[jump].arg = f->code_len;
+            } else {
+                f->code[branch].arg = f->code_len;
+            }
+            i = s.else_end;
+            break;
+
+        case FLOW_WHILE:
+            branch = emit(err, f, FLOW_BRANCH, i, s.root, 0);
+            if (branch == UINT32_MAX || !emit_block(err, l, start, i + 1, s.body_end)
+             || emit(err, f, FLOW_JUMP, i, EXPR_NONE, head) == UINT32_MAX)
+            {
+                return false;
+            }
+            f->code[branch].arg = f->code_len;
+            i = s.body_end;
+            break;
+        }
+    }
+    return true;
+}
+
+/* Fails if a jump goes past the end of the code, which would mean one was
+ * never linked to its target */
+static bool check_jumps(Error* err, const Flow* f)
+{
+    for (uint32_t pc = 0; pc < f->code_len; pc++) {
+        const FlowInsn* in = &f->code[pc];
+        if ((in->op == FLOW_BRANCH || in->op == FLOW_JUMP || in->op == FLOW_TEST)
+         && in->arg > f->code_len)
+        {
+            error_push(err, "internal error: jump at %" PRIu32 " to %" PRIu32 " past the end",
+                    pc, in->arg);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Marks each FLOW_EVAL whose result the next instruction uses right away,
+ * and gives the pair a fused kernel if one was generated. The second one
+ * must not be a jump target, so the pair always runs from its first */
+static bool fuse_pairs(Error* err, Flow* f, const ExprArena* a)
+{
+    bool* target = mem_calloc(MEM_PARSER, f->code_len + 1, sizeof *target);
+    if (!target) {
+        error_push(err, "failed to allocate jump targets: %s", strerror(errno));
+        return false;
+    }
+    for (uint32_t pc = 0; pc < f->code_len; pc++) {
+        const uint8_t op = f->code[pc].op;
+        if (op != FLOW_BRANCH && op != FLOW_JUMP && op != FLOW_TEST)
+            continue;
+        if (f->code[pc].arg > f->code_len) {
+            error_push(err, "jump at %" PRIu32 " to %" PRIu32 " is out of the code", pc,
+                    f->code[pc].arg);
+            mem_free(target);
+            return false;
+        }
+        target[f->code[pc].arg] = true;
+    }
+    for (uint32_t pc = 0; pc + 1 < f->code_len; pc++) {
+        FlowInsn* in = &f->code[pc];
+        const FlowInsn* next = in + 1;
+        if (in->op != FLOW_EVAL || next->op != FLOW_EVAL || !in->kernel || !next->kernel
+         || in->stmt != next->stmt || target[pc + 1])
+        {
+            continue;
+        }
+        const ExprNode* n = &a->nodes[in->node];
+        const ExprNode* o = &a->nodes[next->node];
+        const bool lhs = o->lhs == in->node;
+        if (lhs == (o->rhs == in->node))
+            continue;
+        in->arg = lhs ? FLOW_FEEDS_LHS : FLOW_FEEDS_RHS;
+        if (opcount_enabled)
+            continue;
+        const fused_kernel kernel = fused_find(n->op, a->nodes[n->lhs].type,
+                a->nodes[n->rhs].type, o->op, a->nodes[lhs ? o->rhs : o->lhs].type, !lhs);
+        if (kernel) {
+            in->op    = FLOW_EVAL_FUSED;
+            in->fused = kernel;
+            f->fused++;
+            pc++;
+        }
+    }
+    mem_free(target);
+    return true;
+}
+
+bool flow_compile(Error* err, Flow* f, ExprArena* a)
+{
+    bool ok = false;
+    struct lower l = {.f = f, .a = a, .epoch = 1};
+    struct item* sorted = NULL;
+    uint32_t* start = NULL;
+    const uint32_t keys = 2 * f->len + 1;
+
+    f->code_len = 0;
+    f->hoisted  = 0;
+    f->fused    = 0;
+    l.level = mem_alloc(MEM_PARSER, (f->vars_len + 1) * sizeof *l.level);
+    start   = mem_calloc(MEM_PARSER, keys + 1, sizeof *start);
+    if (!l.level || !start) {
+        error_push(err, "failed to allocate lowering state: %s", strerror(errno));
+        goto out;
+    }
+    for (uint32_t i = 0; i < f->vars_len; i++)
+        l.level[i] = f->vars[i].written ? 1 : 0;
+    if (!place_reserve(err, &l, 0) || !lower_block(err, &l, 0, f->len))
+        goto out;
+
+    // counting sort by key, stable so operands stay before their users
+    sorted = mem_alloc(MEM_PARSER, (l.items_len + 1) * sizeof *sorted);
+    if (!sorted) {
+        error_push(err, "failed to allocate instructions: %s", strerror(errno));
+        goto out;
+    }
+    for (uint32_t i = 0; i < l.items_len; i++)
+        start[l.items[i].key + 1]++;
+    for (uint32_t k = 0; k < keys; k++)
+        start[k + 1] += start[k];
+    for (uint32_t i = 0; i < l.items_len; i++)
+        sorted[start[l.items[i].key]++] = l.items[i];
+    for (uint32_t k = keys; k > 0; k--)
+        start[k] = start[k - 1];
+    start[0] = 0;
+    mem_free(l.items);
+    l.items = sorted;
+    sorted  = NULL;
+
+    ok = emit_items(err, &l, start, 0) && emit_block(err, &l, start, 0, f->len);
+    // falling off the end of a function is an error
+    if (ok && f->function)
+        ok = emit(err, f, FLOW_RET, f->len ? f->len - 1 : 0, EXPR_NONE, 0) != UINT32_MAX;
+    ok = ok && check_jumps(err, f) && fuse_pairs(err, f, a);
+
+out:
+    mem_free(l.level);
+    mem_free(l.map);
+    mem_free(l.items);
+    mem_free(l.stack);
+    mem_free(l.open);
+    mem_free(sorted);
+    mem_free(start);
+    return ok;
+}
+
+/* ======= Execution ======= */
+
+static bool truthy(const Value* v)
+{
+    return v->type == VALUE_FLOATING ? v->f64 != 0.0 : v->i64 != 0;
+}
+
+/* Counts the operator of in for --op-profile, and the pair it forms with
+ * the next instruction if it feeds it */
+static void count_ops(const ExprNode* nodes, const FlowInsn* in, const ExprNode* n,
+                      const Value* l, const Value* r)
+{
+    opcount_op_(n->op, l->type, r->type);
+    if (in->arg) {
+        const ExprNode* o = &nodes[in[1].node];
+        const Value* z = &nodes[in->arg == FLOW_FEEDS_LHS ? o->rhs : o->lhs].value;
+        opcount_pair_(n->op, l->type, r->type, o->op, z->type, in->arg == FLOW_FEEDS_RHS);
+    }
+}
+
+bool flow_run(Error* err, Flow* f, ExprArena* a, struct func_table* funcs,
+              void (*on_result)(void* user, uint64_t statement, const Value* v),
+              void* user)
+{
+    // no nodes are added while the code runs
+    ExprNode* nodes = a->nodes;
+    const Flow* cur = f; // f, or the function a call went to
+    const FlowInsn* in = NULL;
+    const uint32_t frames = funcs ? funcs->frames_len : 0;
+    uint32_t pc = 0;
+    // only a jump back or a call can make code run longer than it is, so
+    // the budget is charged there: a loop for the instructions of each turn,
+    // a call for one. tick counts down to the next charge
+    int64_t tick = BUDGET_INTERVAL;
+
+    while (pc < cur->code_len) {
+        // the instruction about to run gets the ticks since the last one
+        if (profile_due())
+            profile_flow_(funcs, a, cur, pc);
+        in = &cur->code[pc++];
+        ExprNode* n = in->node == EXPR_NONE ? NULL : &nodes[in->node];
+        switch (in->op) {
+        case FLOW_EVAL_ONCE:
+            if (n->evaluated)
+                break;
+            // fallthrough
+        case FLOW_EVAL: {
+            const Value* l = &nodes[n->lhs].value;
+            const Value* r = &nodes[n->rhs].value;
+            op_kernel kernel = in->kernel;
+            if (!kernel) {
+                kernel = op_kernel_for(n->op, l->type, r->type);
+                if (!kernel) {
+                    error_push(err, "operator %s is not defined for %s and %s",
+                            op_table[n->op].str, value_type_name(l->type),
+                            value_type_name(r->type));
+                    goto fail;
+                }
+            }
+            if (__builtin_expect(opcount_enabled, 0))
+                count_ops(nodes, in, n, l, r);
+            if (!kernel(err, a->overflow, &a->strs, l, r, &n->value))
+                goto fail;
+            if (in->op == FLOW_EVAL_ONCE) {
+                n->evaluated = true;
+                a->evaluated++;
+            }
+            break;}
+
+        case FLOW_EVAL_FUSED: {
+            ExprNode* o = &nodes[in[1].node];
+            const Value* z = &nodes[in->arg == FLOW_FEEDS_LHS ? o->rhs : o->lhs].value;
+            if (!in->fused(err, a->overflow, &a->strs, &nodes[n->lhs].value,
+                           &nodes[n->rhs].value, z, &n->value, &o->value))
+            {
+                goto fail;
+            }
+            pc++;
+            break;}
+
+        case FLOW_STORE: {
+            const Value* v = &nodes[in->arg].value;
+            if (v->type == n->type) {
+                n->value = *v;
+            } else if (n->type == VALUE_FLOATING) {
+                n->value = (Value){.type = VALUE_FLOATING, .f64 = (double)v->i64};
+            } else {
+                error_push(err, "can't assign %s to %s", value_type_name(v->type),
+                        value_type_name(n->type));
+                goto fail;
+            }
+            break;}
+
+        case FLOW_PRINT:
+            if (on_result)
+                on_result(user, cur->stmts[in->stmt].statement, &n->value);
+            break;
+
+        case FLOW_BRANCH:
+            if (!truthy(&n->value))
+                pc = in->arg;
+            break;
+
+        case FLOW_TEST:
+            // a memoized node needs nothing from the region either
+            if (n->evaluated) {
+                pc = in->arg;
+            } else if (op_short_circuit(n->op, &nodes[n->lhs].value, &n->value)) {
+                if (cur->code[in->arg - 1].op == FLOW_EVAL_ONCE) {
+                    n->evaluated = true;
+                    a->evaluated++;
+                }
+                pc = in->arg;
+            }
+            break;
+
+        case FLOW_JUMP:
+            if (in->arg < pc && __builtin_expect((tick -= pc - in->arg) <= 0, 0)) {
+                if (!budget_charge(err, &a->budget, BUDGET_INTERVAL - tick))
+                    goto fail;
+                tick = BUDGET_INTERVAL;
+            }
+            pc = in->arg;
+            break;
+
+        case FLOW_CALL_ONCE:
+            if (n->evaluated)
+                break;
+            // fallthrough
+        case FLOW_CALL:
+            if (__builtin_expect(--tick <= 0, 0)) {
+                if (!budget_charge(err, &a->budget, BUDGET_INTERVAL - tick))
+                    goto fail;
+                tick = BUDGET_INTERVAL;
+            }
+            if (!func_enter(err, funcs, a, in->node, cur, pc, in->op == FLOW_CALL_ONCE))
+                goto fail;
+            cur = &funcs->funcs[n->lhs].body;
+            pc  = 0;
+            break;
+
+        case FLOW_RET:
+            if (!func_leave(err, funcs, a, n ? &n->value : NULL, &cur, &pc))
+                goto fail;
+            break;
+        }
+    }
+    return budget_charge(err, &a->budget, BUDGET_INTERVAL - tick);
+
+fail:
+    f->failed_at = in->stmt < cur->len ? cur->stmts[in->stmt].at : NULL;
+    if (funcs && funcs->frames_len > frames) {
+        error_push(err, "in function %s", func_current(funcs, a));
+        func_unwind(funcs, a, frames);
+    }
+    return false;
+}
+
+bool flow_eval(Error* err, ExprArena* a, struct func_table* funcs, ExprId root, Value* out,
+               const char** failed_at)
+{
+    // a top level root depends on no variables, so all of it is memoized
+    Flow f = FLOW_INIT;
+    const FlowStmt s = {.kind = FLOW_EXPR, .root = root};
+    bool ok = flow_add(err, &f, &s) != UINT32_MAX
+           && flow_compile(err, &f, a)
+           && flow_run(err, &f, a, funcs, NULL, NULL);
+    if (ok)
+        *out = a->nodes[root].value;
+    else
+        *failed_at = f.failed_at;
+    flow_free(&f);
+    return ok;
+}
+
+bool flow_finish(Error* err, Flow* f, ExprArena* a)
+{
+    bool ok = true;
+    for (uint32_t i = 0; i < f->vars_len; i++) {
+        FlowVar* v = &f->vars[i];
+        v->sym->var = EXPR_NONE;
+        if (!v->written || !ok)
+            continue;
+        const Value value = a->nodes[v->node].value;
+        const ExprId id = expr_literal(err, a, &value);
+        if (id == EXPR_NONE)
+            ok = false;
+        else
+            v->sym->value = id;
+    }
+    return ok;
+}
+
+void flow_free(Flow* f)
+{
+    mem_free(f->stmts);
+    mem_free(f->vars);
+    mem_free(f->code);
+    *f = (Flow)FLOW_INIT;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "expr.h"
+#include "fuse.h"
+#include "symbols.h"
+#include "value.h"
+
+struct func_table;
+
+/* Control flow. Top level statements run as soon as they are parsed, but an
+ * if or while statement is parsed in full first, into a flat list of
+ * FlowStmt. flow_compile lowers that list to FlowInsn with conditional
+ * jumps and flow_run executes it, so a loop body is lexed and parsed once
+ * however often it runs.
+ *
+ * A variable used inside the statement is an EXPR_VAR node holding its
+ * current value, assignments store into it. Nodes above variables are
+ * recomputed by the instructions rather than memoized. Everything else is
+ * placed as early as it is known not to change:
+ *
+ *  - a node that depends on no variable assigned in the statement runs once
+ *    and stays memoized, like a top level expression
+ *  - a node whose variables are not assigned inside a loop runs once before
+ *    the loop, in its preheader, each time the loop is entered
+ *
+ * Nodes that can fail, like an integer division, are not moved, so a loop
+ * that never runs or an if that is not taken reports no errors. Neither is
+ * the right operand of && or ||, which is skipped when the left one
+ * decides the result.
+ *
+ * The body of a function is a Flow too, see func.h. Calls are instructions
+ * that switch to the code of the callee, so flow_run never recurses. */
+
+enum flow_stmt_kind {
+    FLOW_EXPR,   // root is printed
+    FLOW_ASSIGN, // variable in slot = root
+    FLOW_IF,     // body is the then block, followed by the else block
+    FLOW_WHILE,
+    FLOW_RETURN, // root is the value of the function
+};
+
+/* Statements are stored in source order. The body of an if or while are
+ * the statements after it up to body_end, the else block runs up to
+ * else_end */
+typedef struct flow_stmt {
+    uint8_t kind;       // enum flow_stmt_kind
+    ExprId root;        // value or condition
+    uint32_t slot;      // FLOW_ASSIGN: variable assigned, index in Flow.vars
+    uint32_t body_end;
+    uint32_t else_end;  // == body_end without an else block
+    uint64_t statement; // index passed to the result handler
+    const char* at;     // source position, for errors
+} FlowStmt;
+
+enum flow_op {
+    FLOW_EVAL,      // compute node, which is recomputed every time
+    FLOW_EVAL_ONCE, // compute node unless it has been already and memoize it
+    FLOW_STORE,     // variable node = value of node arg
+    FLOW_PRINT,     // report the value of node
+    FLOW_BRANCH,    // jump to arg if node is zero
+    FLOW_JUMP,      // jump to arg
+    FLOW_CALL,      // run the function of the EXPR_CALL node, which receives
+                    // the result
+    FLOW_CALL_ONCE, // FLOW_CALL unless node has been already, memoize it
+    FLOW_RET,       // return the value of node from the function, which
+                    // fails if node is EXPR_NONE
+    FLOW_EVAL_FUSED, // FLOW_EVAL of node and of the next instruction in one
+                     // kernel, then skip the next instruction. See fuse.h
+    FLOW_TEST,      // node is a && or || node. If its left operand decides
+                    // it, store the result and jump to arg, past the
+                    // instructions computing the right operand and node
+};
+
+/* FlowInsn.arg of a FLOW_EVAL whose node is an operand of the FLOW_EVAL
+ * right after it, in the same statement, which can only be reached from
+ * it */
+#define FLOW_FEEDS_LHS 1
+#define FLOW_FEEDS_RHS 2
+
+typedef struct flow_insn {
+    uint8_t op;        // enum flow_op
+    uint32_t stmt;     // index in Flow.stmts, for errors
+    ExprId node;
+    uint32_t arg;
+    union {
+        op_kernel kernel;   // FLOW_EVAL of a statically typed node, else NULL
+        fused_kernel fused; // FLOW_EVAL_FUSED
+    };
+} FlowInsn;
+
+typedef struct flow_var {
+    Symbol* sym;  // symbols are not added while a Flow is built, so this
+                  // stays valid. NULL in a function, whose locals are
+                  // dropped once it is parsed
+    ExprId node;
+    bool written; // assigned somewhere in the statement
+} FlowVar;
+
+typedef struct flow {
+    FlowStmt* stmts;
+    uint32_t len;
+    uint32_t cap;
+
+    FlowVar* vars;     // indexed by the slot of their node
+    uint32_t vars_len;
+    uint32_t vars_cap;
+
+    FlowInsn* code;
+    uint32_t code_len;
+    uint32_t code_cap;
+
+    uint32_t depth;    // blocks open while parsing
+    bool function;     // body of a function, ending in a failing FLOW_RET
+    const char* failed_at; // source position of the statement flow_run
+                           // stopped at, which may be in a function
+    uint32_t hoisted;  // instructions placed before the loop they belong to
+    uint32_t fused;    // pairs of instructions run by one fused kernel
+} Flow;
+
+#define FLOW_INIT { 0 }
+
+/* Deepest nesting of if and while statements */
+#define FLOW_MAX_DEPTH 256
+
+/* Slot of sym in f->vars, whose variable node is created with the symbol's
+ * current value on first use. UINT32_MAX on failure */
+uint32_t flow_slot(Error* err, Flow* f, ExprArena* a, Symbol* sym);
+
+/* Appends s, returns its index or UINT32_MAX on failure. An if or while is
+ * completed with flow_close once its body has been added */
+uint32_t flow_add(Error* err, Flow* f, const FlowStmt* s);
+
+/* Ends the then block of the if at index at, the else block follows */
+void flow_else(Flow* f, uint32_t at);
+
+/* Ends the if or while at index at. The body of a while ends here too */
+void flow_close(Flow* f, uint32_t at);
+
+/* Lowers the statements to f->code */
+bool flow_compile(Error* err, Flow* f, ExprArena* a);
+
+/* Runs f->code, calls go to the functions of funcs. on_result is called for
+ * FLOW_EXPR statements, may be NULL. On failure f->failed_at is set */
+bool flow_run(Error* err, Flow* f, ExprArena* a, struct func_table* funcs,
+              void (*on_result)(void* user, uint64_t statement, const Value* v),
+              void* user);
+
+/* Evaluates root, a top level expression with calls in it, into out. Its
+ * nodes are memoized as expr_eval would. On failure *failed_at is set like
+ * Flow.failed_at */
+bool flow_eval(Error* err, ExprArena* a, struct func_table* funcs, ExprId root, Value* out,
+               const char** failed_at);
+
+/* Binds every variable assigned in f to a literal of its last value and
+ * detaches the symbols from f. Call once f is done, whether it ran or not */
+bool flow_finish(Error* err, Flow* f, ExprArena* a);
+
+void flow_free(Flow* f);
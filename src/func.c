@@ -0,0 +1,485 @@
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "expr.h"
+#include "flow.h"
+#include "func.h"
+#include "mem.h"
+#include "operator.h"
+#include "symbols.h"
+#include "value.h"
+
+struct func_subst {
+    ExprId from;
+    ExprId to;
+    uint32_t gen;
+};
+
+/* Makes room for n elements of size bytes in *buf */
+static bool reserve(Error* err, void** buf, uint32_t* cap, uint32_t n, size_t size,
+                    const char* what)
+{
+    if (n <= *cap)
+        return true;
+    uint32_t c = *cap ? *cap : 64;
+    while (c < n && c <= UINT32_MAX / 2)
+        c *= 2;
+    void* p = c >= n ? mem_realloc(MEM_PARSER, *buf, (size_t)c * size) : NULL;
+    if (!p) {
+        error_push(err, "failed to grow %s to %" PRIu32 ": %s", what, n, strerror(errno));
+        return false;
+    }
+    *buf = p;
+    *cap = c;
+    return true;
+}
+
+void func_table_free(FuncTable* t)
+{
+    for (uint32_t i = 0; i < t->len; i++) {
+        flow_free(&t->funcs[i].body);
+        mem_free(t->funcs[i].saved);
+    }
+    mem_free(t->funcs);
+    symbol_table_free(&t->names);
+    mem_free(t->frames);
+    mem_free(t->values);
+    mem_free(t->stack);
+    mem_free(t->map);
+    *t = (FuncTable){.max_depth = t->max_depth};
+}
+
+uint32_t func_lookup(FuncTable* t, const char* name, size_t len)
+{
+    Symbol* s = symbol_lookup(&t->names, name, len);
+    return s ? s->value : UINT32_MAX;
+}
+
+uint32_t func_begin(Error* err, FuncTable* t, const char* name, size_t len, enum value_type ret)
+{
+    if (func_lookup(t, name, len) != UINT32_MAX) {
+        error_push(err, "function %.*s is already defined", (int)len, name);
+        return UINT32_MAX;
+    }
+    if (!reserve(err, (void**)&t->funcs, &t->cap, t->len + 1, sizeof *t->funcs, "functions"))
+        return UINT32_MAX;
+    Symbol* s = symbol_define(err, &t->names, name, len);
+    if (!s)
+        return UINT32_MAX;
+    s->value = t->len;
+    t->funcs[t->len] = (Func){
+        .name        = s->name,
+        .len         = s->len,
+        .ret         = ret,
+        .body        = FLOW_INIT,
+        .inline_root = EXPR_NONE,
+    };
+    t->funcs[t->len].body.function = true;
+    return t->len++;
+}
+
+void func_abandon(FuncTable* t, uint32_t f)
+{
+    Func* fn = &t->funcs[f];
+    symbol_lookup(&t->names, fn->name, fn->len)->value = EXPR_NONE;
+    flow_free(&fn->body);
+    fn->inline_root = EXPR_NONE;
+}
+
+/* ======= Inlining ======= */
+
+/* Substitution of the variables below a node */
+struct subst {
+    const ExprId* slots; // substitute of each variable, by slot
+    uint32_t self;       // the function being inlined
+    uint32_t nodes;      // operator and call nodes reached
+    bool calls;          // reached a call
+    bool recursive;      // reached a call of self
+};
+
+static struct func_subst* map_find(FuncTable* t, ExprId id)
+{
+    uint32_t i = (uint32_t)(((uint64_t)id * 0x9E3779B97F4A7C15ull) >> 32) & (t->map_cap - 1);
+    while (t->map[i].gen == t->map_gen && t->map[i].from != id)
+        i = (i + 1) & (t->map_cap - 1);
+    return &t->map[i];
+}
+
+static bool map_put(Error* err, FuncTable* t, ExprId from, ExprId to)
+{
+    if (t->map_len >= t->map_cap / 2) {
+        const uint32_t cap = t->map_cap ? t->map_cap * 2 : 256;
+        struct func_subst* old = t->map;
+        const uint32_t old_cap = t->map_cap;
+        t->map = mem_calloc(MEM_PARSER, cap, sizeof *t->map);
+        if (!t->map) {
+            t->map = old;
+            error_push(err, "failed to allocate inlining map: %s", strerror(errno));
+            return false;
+        }
+        t->map_cap = cap;
+        const uint32_t gen = t->map_gen;
+        t->map_gen = 1;
+        t->map_len = 0;
+        for (uint32_t i = 0; i < old_cap; i++) {
+            if (old[i].gen == gen)
+                *map_find(t, old[i].from) = (struct func_subst){old[i].from, old[i].to, 1};
+            t->map_len += old[i].gen == gen;
+        }
+        mem_free(old);
+    }
+    struct func_subst* e = map_find(t, from);
+    if (e->gen != t->map_gen)
+        t->map_len++;
+    *e = (struct func_subst){from, to, t->map_gen};
+    return true;
+}
+
+/* Starts an empty map */
+static bool map_clear(Error* err, FuncTable* t)
+{
+    t->map_gen++;
+    t->map_len = 0;
+    if (t->map_gen == 0 && t->map) {
+        memset(t->map, 0, t->map_cap * sizeof *t->map);
+        t->map_gen = 1;
+    }
+    // one entry allocates it
+    return map_put(err, t, EXPR_NONE, EXPR_NONE);
+}
+
+/* Rebuilds n over the substitutes of its operands */
+static ExprId rebuild(Error* err, FuncTable* t, ExprArena* a, const ExprNode* n, struct subst* s)
+{
+    ExprId ops[2] = {EXPR_NONE, EXPR_NONE};
+    const uint32_t count = expr_operands(n, ops);
+    for (uint32_t i = 0; i < count; i++)
+        ops[i] = map_find(t, ops[i])->to;
+
+    switch (n->kind) {
+    case EXPR_BINARY:
+        s->nodes++;
+        if (n->op == OP_TO_FLOAT)
+            return expr_to_float(err, a, ops[0]);
+        return expr_binary(err, a, n->op, ops[0], ops[1]);
+    case EXPR_CALL:
+        s->nodes++;
+        s->calls = true;
+        s->recursive = s->recursive || n->lhs == s->self;
+        return expr_call(err, a, n->lhs, ops[0], n->type);
+    default: // EXPR_ARG
+        return expr_arg(err, a, ops[0], ops[1]);
+    }
+}
+
+/* Returns root with every variable replaced by s->slots[slot] */
+static ExprId subst(Error* err, FuncTable* t, ExprArena* a, ExprId root, struct subst* s)
+{
+    if (!map_clear(err, t)) // EXPR_NONE maps to itself, the end of argument lists
+        return EXPR_NONE;
+    uint32_t top = 0;
+    if (!reserve(err, (void**)&t->stack, &t->stack_cap, 1, sizeof *t->stack, "inlining stack"))
+        return EXPR_NONE;
+    t->stack[top++] = root;
+    while (top > 0) {
+        const ExprId id = t->stack[top - 1];
+        if (map_find(t, id)->gen == t->map_gen) {
+            top--;
+            continue;
+        }
+        // copied, building nodes may move them
+        const ExprNode n = a->nodes[id];
+        ExprId to = id;
+        if (n.kind == EXPR_VAR) {
+            to = s->slots[n.rhs];
+        } else if (n.kind != EXPR_LITERAL) {
+            ExprId ops[2];
+            const uint32_t count = expr_operands(&n, ops);
+            if (!reserve(err, (void**)&t->stack, &t->stack_cap, top + 2, sizeof *t->stack,
+                         "inlining stack"))
+            {
+                return EXPR_NONE;
+            }
+            const uint32_t before = top;
+            for (uint32_t i = count; i-- > 0;) {
+                if (map_find(t, ops[i])->gen != t->map_gen)
+                    t->stack[top++] = ops[i];
+            }
+            if (top != before)
+                continue;
+            to = rebuild(err, t, a, &n, s);
+            if (to == EXPR_NONE)
+                return EXPR_NONE;
+        }
+        if (!map_put(err, t, id, to))
+            return EXPR_NONE;
+        top--;
+    }
+    return map_find(t, root)->to;
+}
+
+static ExprId zero(Error* err, ExprArena* a, uint8_t type)
+{
+    const Value v = value_zero(type);
+    return expr_literal(err, a, &v);
+}
+
+/* Sets the template of f if its body is straight-line code returning a
+ * small expression that doesn't call f */
+static bool make_template(Error* err, FuncTable* t, ExprArena* a, uint32_t f)
+{
+    const Flow* b = &t->funcs[f].body;
+    ExprId* env = mem_alloc(MEM_PARSER, (b->vars_len + 1) * sizeof *env);
+    if (!env) {
+        error_push(err, "failed to allocate inlining state: %s", strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    for (uint32_t i = 0; i < b->vars_len && ok; i++) {
+        const ExprNode* v = &a->nodes[b->vars[i].node];
+        env[i] = i < t->funcs[f].params ? b->vars[i].node : zero(err, a, v->type);
+        ok = env[i] != EXPR_NONE;
+    }
+
+    ExprId root = EXPR_NONE;
+    struct subst s = {.slots = env, .self = f};
+    for (uint32_t i = 0; i < b->len && ok && root == EXPR_NONE; i++) {
+        const FlowStmt* st = &b->stmts[i];
+        if (st->kind != FLOW_ASSIGN && st->kind != FLOW_RETURN)
+            break;
+        const ExprId id = subst(err, t, a, st->root, &s);
+        if (id == EXPR_NONE) {
+            ok = false;
+        } else if (st->kind == FLOW_RETURN) {
+            root = id;
+        } else if (a->nodes[id].type != a->nodes[b->vars[st->slot].node].type) {
+            break; // checked at run time
+        } else {
+            env[st->slot] = id;
+        }
+    }
+    if (ok && root != EXPR_NONE && a->nodes[root].type == t->funcs[f].ret) {
+        // count what the template itself holds
+        s = (struct subst){.slots = env, .self = f};
+        ok = subst(err, t, a, root, &s) != EXPR_NONE;
+        if (ok && s.nodes <= FUNC_INLINE_NODES && !s.recursive) {
+            t->funcs[f].inline_root  = root;
+            t->funcs[f].inline_calls = s.calls;
+        }
+    }
+    mem_free(env);
+    return ok;
+}
+
+/* Collects the nodes a call of f writes, so a recursive call can save them */
+static bool collect_saved(Error* err, FuncTable* t, uint32_t f)
+{
+    Func* fn = &t->funcs[f];
+    const Flow* b = &fn->body;
+    fn->saved = mem_alloc(MEM_PARSER, ((size_t)b->vars_len + b->code_len + 1) * sizeof *fn->saved);
+    if (!fn->saved) {
+        error_push(err, "failed to allocate saved nodes: %s", strerror(errno));
+        return false;
+    }
+    if (!map_clear(err, t))
+        return false;
+    for (uint32_t i = 0; i < b->vars_len + b->code_len; i++) {
+        ExprId id = EXPR_NONE;
+        if (i < b->vars_len) {
+            id = b->vars[i].node;
+        } else {
+            const FlowInsn* in = &b->code[i - b->vars_len];
+            if (in->op == FLOW_EVAL || in->op == FLOW_EVAL_FUSED || in->op == FLOW_CALL)
+                id = in->node;
+        }
+        if (id == EXPR_NONE || map_find(t, id)->gen == t->map_gen)
+            continue;
+        if (!map_put(err, t, id, id))
+            return false;
+        fn->saved[fn->saved_len++] = id;
+    }
+    return true;
+}
+
+bool func_end(Error* err, FuncTable* t, ExprArena* a, uint32_t f)
+{
+    Func* fn = &t->funcs[f];
+    for (uint32_t i = 0; i < fn->params; i++)
+        fn->body.vars[i].written = true; // every call changes them
+    if (!flow_compile(err, &fn->body, a)
+     || !collect_saved(err, t, f)
+     || !make_template(err, t, a, f))
+    {
+        func_abandon(t, f);
+        return false;
+    }
+    return true;
+}
+
+ExprId func_call(Error* err, FuncTable* t, ExprArena* a, uint32_t f, const ExprId* args,
+                 uint32_t n, bool* calls)
+{
+    const Func* fn = &t->funcs[f];
+    if (n != fn->params) {
+        error_push(err, "%s takes %" PRIu32 " arguments, not %" PRIu32, fn->name, fn->params, n);
+        return EXPR_NONE;
+    }
+    ExprId conv[FUNC_MAX_PARAMS];
+    bool dynamic = false;
+    for (uint32_t i = 0; i < n; i++) {
+        const uint8_t want = a->nodes[fn->body.vars[i].node].type;
+        const uint8_t have = a->nodes[args[i]].type;
+        conv[i] = args[i];
+        if (have == EXPR_DYNAMIC) {
+            dynamic = true; // checked when the call runs
+        } else if (have != want) {
+            if (want != VALUE_FLOATING || have != VALUE_INTEGER) {
+                error_push(err, "argument %" PRIu32 " of %s must be %s, not %s", i + 1, fn->name,
+                        value_type_name(want), value_type_name(have));
+                return EXPR_NONE;
+            }
+            conv[i] = expr_to_float(err, a, args[i]);
+            if (conv[i] == EXPR_NONE)
+                return EXPR_NONE;
+        }
+    }
+
+    if (fn->inline_root != EXPR_NONE && !dynamic) {
+        struct subst s = {.slots = conv, .self = f};
+        const ExprId id = subst(err, t, a, fn->inline_root, &s);
+        t->inlined++;
+        *calls = fn->inline_calls;
+        return id;
+    }
+    ExprId list = EXPR_NONE;
+    for (uint32_t i = n; i-- > 0;) {
+        list = expr_arg(err, a, conv[i], list);
+        if (list == EXPR_NONE)
+            return EXPR_NONE;
+    }
+    t->calls++;
+    *calls = true;
+    return expr_call(err, a, f, list, fn->ret);
+}
+
+/* ======= Calls ======= */
+
+bool func_enter(Error* err, FuncTable* t, ExprArena* a, ExprId call, const Flow* code,
+                uint32_t pc, bool once)
+{
+    ExprNode* nodes = a->nodes;
+    Func* f = &t->funcs[nodes[call].lhs];
+    const uint32_t max = t->max_depth ? t->max_depth : FUNC_DEFAULT_DEPTH;
+    if (t->frames_len >= max) {
+        error_push(err, "calls nested deeper than %" PRIu32, max);
+        return false;
+    }
+    if (!reserve(err, (void**)&t->frames, &t->frames_cap, t->frames_len + 1, sizeof *t->frames,
+                 "call stack")
+     || !reserve(err, (void**)&t->values, &t->values_cap,
+                 t->values_len + f->saved_len + f->params, sizeof *t->values, "value stack"))
+    {
+        return false;
+    }
+
+    FuncFrame* fr = &t->frames[t->frames_len];
+    *fr = (FuncFrame){.code = code, .pc = pc, .call = call, .saved = UINT32_MAX, .once = once};
+    if (f->active > 0) {
+        fr->saved = t->values_len;
+        for (uint32_t i = 0; i < f->saved_len; i++)
+            t->values[t->values_len++] = nodes[f->saved[i]].value;
+    }
+
+    // arguments are read before any parameter is written, a recursive call
+    // passes values computed from them
+    Value* args = &t->values[t->values_len];
+    uint32_t n = 0;
+    for (ExprId arg = nodes[call].rhs; arg != EXPR_NONE; arg = nodes[arg].rhs)
+        args[n++] = nodes[nodes[arg].lhs].value;
+    for (uint32_t i = 0; i < f->body.vars_len; i++) {
+        ExprNode* v = &nodes[f->body.vars[i].node];
+        if (i >= f->params) {
+            // locals start at zero on every call
+            v->value = value_zero(v->type);
+        } else if (args[i].type == v->type) {
+            v->value = args[i];
+        } else if (v->type == VALUE_FLOATING) {
+            v->value = (Value){.type = VALUE_FLOATING, .f64 = (double)args[i].i64};
+        } else {
+            error_push(err, "argument %" PRIu32 " of %s must be %s, not %s", i + 1, f->name,
+                    value_type_name(v->type), value_type_name(args[i].type));
+            if (fr->saved != UINT32_MAX)
+                t->values_len = fr->saved;
+            return false;
+        }
+    }
+    f->active++;
+    t->frames_len++;
+    return true;
+}
+
+bool func_leave(Error* err, FuncTable* t, ExprArena* a, const Value* v, const Flow** code,
+                uint32_t* pc)
+{
+    const FuncFrame* fr = &t->frames[t->frames_len - 1];
+    ExprNode* nodes = a->nodes;
+    Func* f = &t->funcs[nodes[fr->call].lhs];
+    if (!v) {
+        error_push(err, "%s ended without returning a value", f->name);
+        return false;
+    }
+    Value r = *v;
+    if (r.type != f->ret) {
+        if (f->ret != VALUE_FLOATING) {
+            error_push(err, "can't return %s from %s, which returns %s",
+                    value_type_name(r.type), f->name, value_type_name(f->ret));
+            return false;
+        }
+        r = (Value){.type = VALUE_FLOATING, .f64 = (double)r.i64};
+    }
+
+    if (fr->saved != UINT32_MAX) {
+        for (uint32_t i = 0; i < f->saved_len; i++)
+            nodes[f->saved[i]].value = t->values[fr->saved + i];
+        t->values_len = fr->saved;
+    }
+    f->active--;
+    t->frames_len--;
+
+    // after restoring, the call node may be one of the saved nodes
+    ExprNode* call = &nodes[fr->call];
+    call->value = r;
+    if (fr->once) {
+        call->evaluated = true;
+        a->evaluated++;
+    }
+    *code = fr->code;
+    *pc   = fr->pc;
+    return true;
+}
+
+void func_unwind(FuncTable* t, ExprArena* a, uint32_t frames)
+{
+    while (t->frames_len > frames) {
+        const FuncFrame* fr = &t->frames[--t->frames_len];
+        t->funcs[a->nodes[fr->call].lhs].active--;
+        if (fr->saved != UINT32_MAX)
+            t->values_len = fr->saved;
+    }
+}
+
+const char* func_current(FuncTable* t, ExprArena* a)
+{
+    return t->funcs[a->nodes[t->frames[t->frames_len - 1].call].lhs].name;
+}
+
+void func_stats_print(FILE* out, FuncTable* t)
+{
+    fprintf(out, "functions: %" PRIu32 " defined, %" PRIu64 " call sites inlined, "
+                 "%" PRIu64 " left as calls\n",
+            t->len, t->inlined, t->calls);
+}
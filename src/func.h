@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "error.h"
+#include "expr.h"
+#include "flow.h"
+#include "symbols.h"
+#include "value.h"
+
+/* User-defined functions:
+ *
+ *     fn name(a int, b float) float { ... return expr; }
+ *
+ * The body is compiled to a Flow whose first slots are the parameters. A
+ * body only sees its parameters and its own locals and can't print, so a
+ * function has no side effects and calls are EXPR_CALL nodes, hash-consed
+ * and memoized like any other node.
+ *
+ * Calls run in flow_run on one contiguous frame stack per FuncTable, not on
+ * the C stack. The nodes of a body hold the values of its innermost call,
+ * so entering a function that is already on the stack first saves them to a
+ * contiguous value stack, and returning restores them. Nothing is allocated
+ * per call once the stacks have grown, and recursion is bounded by
+ * max_depth.
+ *
+ * A small function whose body is straight-line code and doesn't call itself
+ * is inlined instead: its return value is kept as a template over the
+ * parameter nodes and a call substitutes the arguments into it, so the
+ * caller gets an ordinary expression. */
+
+/* Most parameters a function can take */
+#define FUNC_MAX_PARAMS 32
+
+/* Largest template, in operator and call nodes, that is inlined */
+#define FUNC_INLINE_NODES 32
+
+/* Deepest nesting of calls if FuncTable.max_depth is 0 */
+#define FUNC_DEFAULT_DEPTH 100000
+
+struct func_subst;
+
+typedef struct func {
+    const char* name;   // NUL terminated, owned by FuncTable.names
+    uint32_t len;
+    uint8_t ret;        // enum value_type
+    uint32_t params;    // slots 0..params-1 of body
+    Flow body;
+
+    ExprId inline_root; // template, EXPR_NONE if calls aren't inlined
+    bool inline_calls;  // the template calls functions that aren't inlined
+
+    ExprId* saved;      // nodes a call writes, saved when it recurses
+    uint32_t saved_len;
+    uint32_t active;    // frames of the function on the stack
+} Func;
+
+typedef struct func_frame {
+    const Flow* code; // caller
+    uint32_t pc;      // return address
+    ExprId call;      // EXPR_CALL node receiving the result
+    uint32_t saved;   // value stack height before the callee's nodes were
+                      // saved, UINT32_MAX if they weren't
+    bool once;        // memoize the result
+} FuncFrame;
+
+typedef struct func_table {
+    Func* funcs;
+    uint32_t len;
+    uint32_t cap;
+    SymbolTable names; // Symbol.value is the index in funcs, EXPR_NONE once
+                       // a definition failed
+
+    FuncFrame* frames;
+    uint32_t frames_len;
+    uint32_t frames_cap;
+    Value* values;
+    uint32_t values_len;
+    uint32_t values_cap;
+    uint32_t max_depth; // deepest nesting of calls, FUNC_DEFAULT_DEPTH if 0
+
+    // scratch for inlining
+    ExprId* stack;
+    uint32_t stack_cap;
+    struct func_subst* map; // node to its substitute, see func.c
+    uint32_t map_cap;       // power of two
+    uint32_t map_len;
+    uint32_t map_gen;       // entries of older generations are empty
+
+    // statistics
+    uint64_t inlined;   // call sites inlined
+    uint64_t calls;     // call sites left as calls
+} FuncTable;
+
+#define FUNC_TABLE_INIT { 0 }
+
+void func_table_free(FuncTable* t);
+
+/* Index of the function called name, UINT32_MAX if there is none */
+uint32_t func_lookup(FuncTable* t, const char* name, size_t len);
+
+/* Adds a function, which can be called, by its own body too, right away.
+ * The parameters are added to its body with flow_slot, then the statements,
+ * then the definition is completed with func_end. Returns the index or
+ * UINT32_MAX on failure */
+uint32_t func_begin(Error* err, FuncTable* t, const char* name, size_t len, enum value_type ret);
+
+/* Compiles the body of function f and decides whether it is inlined. On
+ * failure the function is removed as if func_abandon was called */
+bool func_end(Error* err, FuncTable* t, ExprArena* a, uint32_t f);
+
+/* Removes function f, whose body failed to parse. Its index stays taken */
+void func_abandon(FuncTable* t, uint32_t f);
+
+/* Returns the node for f(args[0], ..., args[n - 1]), converting arguments
+ * to the parameter types. That is the inlined body, or an EXPR_CALL node,
+ * *calls tells whether the result has calls in it */
+ExprId func_call(Error* err, FuncTable* t, ExprArena* a, uint32_t f, const ExprId* args,
+                 uint32_t n, bool* calls);
+
+/* Pushes a frame for the EXPR_CALL node call, made by code at pc, and
+ * passes the arguments. The callee's body runs next */
+bool func_enter(Error* err, FuncTable* t, ExprArena* a, ExprId call, const Flow* code,
+                uint32_t pc, bool once);
+
+/* Pops the innermost frame, whose function returned v, or ended without a
+ * return if v is NULL. *code and *pc are set to where the caller goes on */
+bool func_leave(Error* err, FuncTable* t, ExprArena* a, const Value* v, const Flow** code,
+                uint32_t* pc);
+
+/* Drops the frames above frames after a failure */
+void func_unwind(FuncTable* t, ExprArena* a, uint32_t frames);
+
+/* Name of the function running in the innermost frame */
+const char* func_current(FuncTable* t, ExprArena* a);
+
+/* Prints the number of functions and of inlined call sites */
+void func_stats_print(FILE* out, FuncTable* t);
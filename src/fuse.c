@@ -0,0 +1,210 @@
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "error.h"
+#include "fuse.h"
+#include "mem.h"
+#include "operator.h"
+#include "value.h"
+
+#define TYPES VALUE_TYPE_COUNT
+
+fused_kernel fused_find(enum operator inner, enum value_type lt, enum value_type rt,
+                        enum operator outer, enum value_type zt, bool inner_rhs)
+{
+    for (uint32_t i = 0; i < fused_count; i++) {
+        const struct fused_info* f = &fused_table[i];
+        if (f->inner == inner && f->lt == lt && f->rt == rt && f->outer == outer && f->zt == zt
+         && f->inner_rhs == inner_rhs)
+        {
+            return f->kernel;
+        }
+    }
+    return NULL;
+}
+
+bool fused_slow_(Error* err, enum overflow_policy policy, struct str_table* strs,
+                 const struct fused_info* f, const Value* x, const Value* y, const Value* z,
+                 Value* t, Value* out)
+{
+    if (!op_kernel_for(f->inner, f->lt, f->rt)(err, policy, strs, x, y, t))
+        return false;
+    const Value* l = f->inner_rhs ? z : t;
+    const Value* r = f->inner_rhs ? t : z;
+    return op_kernel_for(f->outer, l->type, r->type)(err, policy, strs, l, r, out);
+}
+
+/* ======= Operator profile ======= */
+
+bool opcount_enabled = false;
+
+static struct opcount {
+    const char* path;
+    uint64_t* ops;   // [op][lt][rt]
+    uint64_t* pairs; // [inner][lt][rt][outer][zt][inner_rhs]
+} counts;
+
+static size_t op_index(enum operator op, enum value_type lt, enum value_type rt)
+{
+    return ((size_t)op * TYPES + lt) * TYPES + rt;
+}
+
+static size_t pair_index(enum operator inner, enum value_type lt, enum value_type rt,
+                         enum operator outer, enum value_type zt, bool inner_rhs)
+{
+    return ((op_index(inner, lt, rt) * OP_COUNT + outer) * TYPES + zt) * 2 + inner_rhs;
+}
+
+#define OPS_LEN   ((size_t)OP_COUNT * TYPES * TYPES)
+#define PAIRS_LEN (OPS_LEN * OP_COUNT * TYPES * 2)
+
+void opcount_op_(enum operator op, enum value_type lt, enum value_type rt)
+{
+    counts.ops[op_index(op, lt, rt)]++;
+}
+
+void opcount_pair_(enum operator inner, enum value_type lt, enum value_type rt,
+                   enum operator outer, enum value_type zt, bool inner_rhs)
+{
+    counts.pairs[pair_index(inner, lt, rt, outer, zt, inner_rhs)]++;
+}
+
+static enum operator op_parse(const char* s)
+{
+    for (int op = OP_NONE + 1; op < OP_COUNT; op++) {
+        if (strcmp(op_table[op].str, s) == 0)
+            return op;
+    }
+    return OP_NONE;
+}
+
+/* Types are named as in source code */
+static const char* type_str[TYPES] = {
+    [VALUE_INTEGER]  = "int",
+    [VALUE_FLOATING] = "float",
+    [VALUE_STRING]   = "str",
+};
+
+static enum value_type type_parse(const char* s)
+{
+    return value_type_parse(s, strlen(s));
+}
+
+/* Adds the counts of the profile at path, which may not exist yet */
+static bool read_profile(Error* err, const char* path)
+{
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        if (errno == ENOENT)
+            return true;
+        error_push(err, "failed to open %s: %s", path, strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    char line[256];
+    for (int n = 1; ok && fgets(line, sizeof line, in); n++) {
+        char kind[8], op[8], lt[8], rt[8], outer[8], side[8], zt[8];
+        uint64_t count;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "op %7s %7s %7s %" SCNu64, op, lt, rt, &count) == 4) {
+            const enum operator o = op_parse(op);
+            const enum value_type l = type_parse(lt), r = type_parse(rt);
+            if (o != OP_NONE && l < TYPES && r < TYPES) {
+                counts.ops[op_index(o, l, r)] += count;
+                continue;
+            }
+        } else if (sscanf(line, "%7s %7s %7s %7s %7s %7s %7s %" SCNu64, kind, op, lt, rt, outer,
+                          side, zt, &count) == 8 && strcmp(kind, "pair") == 0)
+        {
+            const enum operator i = op_parse(op), o = op_parse(outer);
+            const enum value_type l = type_parse(lt), r = type_parse(rt), z = type_parse(zt);
+            const bool rhs = strcmp(side, "rhs") == 0;
+            if (i != OP_NONE && o != OP_NONE && l < TYPES && r < TYPES && z < TYPES
+             && (rhs || strcmp(side, "lhs") == 0))
+            {
+                counts.pairs[pair_index(i, l, r, o, z, rhs)] += count;
+                continue;
+            }
+        }
+        error_push(err, "malformed line %d of operator profile %s", n, path);
+        ok = false;
+    }
+    if (ok && ferror(in)) {
+        error_push(err, "failed to read %s: %s", path, strerror(errno));
+        ok = false;
+    }
+    fclose(in);
+    return ok;
+}
+
+bool opcount_start(Error* err, const char* path)
+{
+    counts.ops   = mem_calloc(MEM_PROFILE, OPS_LEN, sizeof *counts.ops);
+    counts.pairs = mem_calloc(MEM_PROFILE, PAIRS_LEN, sizeof *counts.pairs);
+    if (!counts.ops || !counts.pairs) {
+        error_push(err, "failed to allocate operator counts: %s", strerror(errno));
+        opcount_free();
+        return false;
+    }
+    counts.path     = path;
+    opcount_enabled = true;
+    return true;
+}
+
+bool opcount_write(Error* err)
+{
+    // read last, so that runs writing the same profile one after the other
+    // each add to what the previous one wrote
+    if (!read_profile(err, counts.path))
+        return false;
+    FILE* out = fopen(counts.path, "w");
+    if (!out) {
+        error_push(err, "failed to open %s: %s", counts.path, strerror(errno));
+        return false;
+    }
+    fprintf(out,
+        "# operator profile, see fuse.h\n"
+        "# op OP LT RT RUNS\n"
+        "# pair INNER LT RT OUTER lhs|rhs ZT RUNS: (LT INNER RT) is the lhs or rhs of OUTER,\n"
+        "#   whose other operand is ZT\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        for (int l = 0; l < TYPES; l++) {
+            for (int r = 0; r < TYPES; r++) {
+                const uint64_t c = counts.ops[op_index(op, l, r)];
+                if (c)
+                    fprintf(out, "op %s %s %s %" PRIu64 "\n", op_table[op].str, type_str[l],
+                            type_str[r], c);
+            }
+        }
+    }
+    for (size_t i = 0; i < PAIRS_LEN; i++) {
+        if (!counts.pairs[i])
+            continue;
+        size_t k = i;
+        const bool rhs = k % 2;                   k /= 2;
+        const enum value_type z = k % TYPES;      k /= TYPES;
+        const enum operator outer = k % OP_COUNT; k /= OP_COUNT;
+        const enum value_type r = k % TYPES;      k /= TYPES;
+        const enum value_type l = k % TYPES;      k /= TYPES;
+        fprintf(out, "pair %s %s %s %s %s %s %" PRIu64 "\n", op_table[k].str, type_str[l],
+                type_str[r], op_table[outer].str, rhs ? "rhs" : "lhs", type_str[z], counts.pairs[i]);
+    }
+    bool ok = !ferror(out);
+    if (fclose(out) != 0)
+        ok = false;
+    if (!ok)
+        error_push(err, "failed to write %s: %s", counts.path, strerror(errno));
+    return ok;
+}
+
+void opcount_free(void)
+{
+    mem_free(counts.ops);
+    mem_free(counts.pairs);
+    counts = (struct opcount){0};
+    opcount_enabled = false;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "operator.h"
+#include "value.h"
+
+/* Fused operator pairs. In the code of loops and functions an operator's
+ * result often goes straight into the next one, as in `s + n % 7`. Such a
+ * pair runs as one instruction with one kernel when a fused kernel exists
+ * for its operators and operand types.
+ *
+ * The kernels are generated from an operator profile: lang --op-profile
+ * counts every operator flow code runs by operand types, and every pair of
+ * instructions where one feeds the next, and adds the counts to a profile
+ * file. tools/gen_fused turns the most frequent pairs of one or more
+ * profiles into fused_kernels.c, built from ops.profile by default.
+ *
+ * A fused kernel computes both results, the inner one is stored as its own
+ * instruction would have. Anything rare, like an overflow that isn't
+ * wrapped or a division by zero, goes to fused_slow_, which runs the two
+ * operator kernels one after the other, so errors and results are those of
+ * the unfused instructions. */
+
+struct str_table;
+
+/* Evaluates t = x inner y, then out = t outer z, or z outer t if the inner
+ * result is the right operand */
+typedef bool (*fused_kernel)(Error* err, enum overflow_policy policy, struct str_table* strs,
+                             const Value* x, const Value* y, const Value* z, Value* t, Value* out);
+
+struct fused_info {
+    uint8_t inner;  // enum operator
+    uint8_t lt;     // types of x and y
+    uint8_t rt;
+    uint8_t outer;
+    uint8_t zt;     // type of z
+    bool inner_rhs; // t is the right operand of outer
+    fused_kernel kernel;
+};
+
+/* Generated in fused_kernels.c */
+extern const struct fused_info fused_table[];
+extern const uint32_t fused_count;
+
+/* Kernel for the pair, NULL if none was generated */
+fused_kernel fused_find(enum operator inner, enum value_type lt, enum value_type rt,
+                        enum operator outer, enum value_type zt, bool inner_rhs);
+
+/* Runs the pair f with the operators' own kernels */
+bool fused_slow_(Error* err, enum overflow_policy policy, struct str_table* strs,
+                 const struct fused_info* f, const Value* x, const Value* y, const Value* z,
+                 Value* t, Value* out);
+
+/* ======= Operator profile ======= */
+
+/* True while operators are counted. Code compiled meanwhile isn't fused, so
+ * the profile sees every operator */
+extern bool opcount_enabled;
+
+/* Starts counting, the counts are added to those already in path by
+ * opcount_write */
+bool opcount_start(Error* err, const char* path);
+
+/* Counts one run of `lt op rt` */
+void opcount_op_(enum operator op, enum value_type lt, enum value_type rt);
+
+/* Counts one run of the pair described as in struct fused_info */
+void opcount_pair_(enum operator inner, enum value_type lt, enum value_type rt,
+                   enum operator outer, enum value_type zt, bool inner_rhs);
+
+/* Adds the counts to the profile file given to opcount_start */
+bool opcount_write(Error* err);
+
+void opcount_free(void);
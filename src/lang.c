@@ -0,0 +1,328 @@
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "emit_c.h"
+#include "error.h"
+#include "expr.h"
+#include "budget.h"
+#include "file_stream.h"
+#include "func.h"
+#include "lang.h"
+#include "mem.h"
+#include "parser.h"
+#include "profile.h"
+#include "symbols.h"
+#include "tokenizer.h"
+#include "trace.h"
+
+struct lang_ctx {
+    LangOptions opts;
+    ExprArena exprs;
+    SymbolTable syms;
+    FuncTable funcs;
+    EmitProgram program; // statements run, if opts.keep_program
+    Mfile** sources;     // inputs that string literals point into
+    uint32_t sources_len;
+    uint32_t sources_cap;
+
+    lang_result_fn on_result;
+    void* user;
+    lang_error_fn on_error;
+    void* error_user;
+    lang_dynamic_fn on_dynamic;
+    void* dynamic_user;
+    uint64_t statements;
+
+    // last failure, message is NULL if it could not be allocated
+    bool failed;
+    char* message;
+    int line;
+    int col;
+};
+
+LangCtx* lang_ctx_new(const LangOptions* opts)
+{
+    LangCtx* ctx = mem_calloc(MEM_PARSER, 1, sizeof *ctx);
+    if (!ctx)
+        return NULL;
+    ctx->opts  = opts ? *opts : (LangOptions)LANG_OPTIONS_INIT;
+    ctx->exprs = (ExprArena)EXPR_ARENA_INIT;
+    ctx->syms  = (SymbolTable)SYMBOL_TABLE_INIT;
+    ctx->funcs = (FuncTable)FUNC_TABLE_INIT;
+    ctx->funcs.max_depth = ctx->opts.call_depth;
+    ctx->program = (EmitProgram)EMIT_PROGRAM_INIT;
+    ctx->exprs.overflow = ctx->opts.overflow;
+    ctx->exprs.threads  = ctx->opts.threads;
+    ctx->exprs.budget   = (Budget){
+        .max_ops    = ctx->opts.max_ops,
+        .timeout_ns = (uint64_t)ctx->opts.timeout_ms * 1000000,
+        .max_depth  = ctx->opts.max_depth,
+    };
+    return ctx;
+}
+
+static void error_forget(LangCtx* ctx)
+{
+    mem_free(ctx->message);
+    ctx->message = NULL;
+    ctx->failed = false;
+    ctx->line = 0;
+    ctx->col  = 0;
+}
+
+/* Closes the inputs kept for their string literals, once nothing refers to
+ * them anymore */
+static void sources_close(LangCtx* ctx)
+{
+    for (uint32_t i = 0; i < ctx->sources_len; i++)
+        mfile_close(NULL, ctx->sources[i]);
+    ctx->sources_len = 0;
+}
+
+void lang_ctx_free(LangCtx* ctx)
+{
+    if (!ctx)
+        return;
+    error_forget(ctx);
+    expr_arena_free(&ctx->exprs);
+    symbol_table_free(&ctx->syms);
+    func_table_free(&ctx->funcs);
+    emit_program_free(&ctx->program);
+    sources_close(ctx);
+    mem_free(ctx->sources);
+    mem_free(ctx);
+}
+
+void lang_ctx_reset(LangCtx* ctx)
+{
+    error_forget(ctx);
+    expr_arena_free(&ctx->exprs);
+    symbol_table_free(&ctx->syms);
+    func_table_free(&ctx->funcs);
+    emit_program_free(&ctx->program);
+    sources_close(ctx);
+    ctx->statements = 0;
+}
+
+void lang_set_result_handler(LangCtx* ctx, lang_result_fn fn, void* user)
+{
+    ctx->on_result = fn;
+    ctx->user      = user;
+}
+
+const char* const lang_error_kind_str[LANG_ERROR_KIND_COUNT] = {
+    [LANG_ERROR_LEX]     = "lex",
+    [LANG_ERROR_SYNTAX]  = "syntax",
+    [LANG_ERROR_RUNTIME] = "runtime",
+};
+
+void lang_set_error_handler(LangCtx* ctx, lang_error_fn fn, void* user)
+{
+    ctx->on_error   = fn;
+    ctx->error_user = user;
+}
+
+void lang_set_dynamic_handler(LangCtx* ctx, lang_dynamic_fn fn, void* user)
+{
+    ctx->on_dynamic   = fn;
+    ctx->dynamic_user = user;
+}
+
+struct error_relay {
+    LangCtx* ctx;
+    const char* data; // of the input, for offsets
+};
+
+_Static_assert((int)LANG_ERROR_LEX == PARSE_ERROR_LEX
+            && (int)LANG_ERROR_SYNTAX == PARSE_ERROR_SYNTAX
+            && (int)LANG_ERROR_RUNTIME == PARSE_ERROR_RUNTIME, "error kinds differ");
+
+static void relay_error(void* user, const ParseError* e)
+{
+    const struct error_relay* r = user;
+    if (!r->ctx->on_error)
+        return;
+    const LangDiagnostic d = {
+        .kind      = (enum lang_error_kind)e->kind,
+        .statement = e->statement,
+        .begin     = e->begin - r->data,
+        .end       = e->end - r->data,
+        .line      = e->line,
+        .col       = e->col,
+        .message   = e->message,
+    };
+    r->ctx->on_error(r->ctx->error_user, &d);
+}
+
+/* Takes over the messages in err */
+static void error_keep(LangCtx* ctx, Error* err)
+{
+    ctx->failed = true;
+    size_t len = error_format(err, NULL, 0);
+    ctx->message = mem_alloc(MEM_ERROR, len + 1);
+    if (ctx->message)
+        error_format(err, ctx->message, len + 1);
+    error_clear(err);
+}
+
+const char* lang_error(LangCtx* ctx)
+{
+    if (ctx->message)
+        return ctx->message;
+    return ctx->failed ? "out of memory" : "";
+}
+
+uint64_t lang_statement_count(LangCtx* ctx)
+{
+    return ctx->statements;
+}
+
+void lang_error_position(LangCtx* ctx, int* line, int* col)
+{
+    *line = ctx->line;
+    *col  = ctx->col;
+}
+
+bool lang_emit_c(LangCtx* ctx, FILE* out)
+{
+    error_forget(ctx);
+    Error err = ERROR_INIT;
+    if (!ctx->opts.keep_program) {
+        error_push(&err, "the context was not created with keep_program");
+    } else if (emit_c(&err, out, &ctx->exprs, &ctx->program)) {
+        return true;
+    }
+    error_keep(ctx, &err);
+    return false;
+}
+
+static bool keep_statement(Error* err, void* user, ExprId root, bool print)
+{
+    LangCtx* ctx = user;
+    if (root == EXPR_NONE) {
+        error_push(err, "if and while statements can't be translated to C");
+        return false;
+    }
+    return emit_program_add(err, &ctx->program, root, print);
+}
+
+void lang_stats_print(LangCtx* ctx, FILE* out)
+{
+    expr_stats_print(out, &ctx->exprs);
+    str_stats_print(out, &ctx->exprs.strs);
+    func_stats_print(out, &ctx->funcs);
+}
+
+/* Makes room to keep one more input open */
+static bool sources_reserve(LangCtx* ctx, Error* err)
+{
+    if (ctx->sources_len < ctx->sources_cap)
+        return true;
+    const uint32_t cap = ctx->sources_cap ? ctx->sources_cap * 2 : 8;
+    Mfile** sources = mem_realloc(MEM_IO, ctx->sources, cap * sizeof *sources);
+    if (!sources) {
+        error_push(err, "failed to allocate input list: %s", strerror(errno));
+        return false;
+    }
+    ctx->sources     = sources;
+    ctx->sources_cap = cap;
+    return true;
+}
+
+/* Parses and runs all of m, then closes it. If string literals point into
+ * m it is kept open until the context is reset instead */
+static bool eval_mfile(LangCtx* ctx, Error* err, Mfile* m)
+{
+    if (!sources_reserve(ctx, err)) {
+        mfile_close(NULL, m);
+        return false;
+    }
+    // before the lexer thread starts, which shares it
+    mem_budget_start(ctx->opts.max_memory);
+    TokenStream ts = ctx->opts.pipeline ? tokenstream_attach_pipelined(err, m)
+                                        : tokenstream_attach(err, m);
+    // with max_errors the parser recovers from a bad first token
+    const bool recover = ts.failed && ctx->opts.max_errors
+                      && tokenstream_cur(&ts)->type != TOKEN_EOF;
+    if (!error_empty(err) && !recover) {
+        error_push(err, "tokenstream_attach");
+        mem_budget_stop();
+        tokenstream_detach(&ts);
+        parser_position(&ts, &ctx->line, &ctx->col);
+        tokenstream_close(&ts);
+        mfile_close(NULL, m);
+        return false;
+    }
+
+    struct error_relay relay = {.ctx = ctx, .data = m->data};
+    Parser p = {
+        .ts             = &ts,
+        .exprs          = &ctx->exprs,
+        .syms           = &ctx->syms,
+        .funcs          = &ctx->funcs,
+        .on_result      = ctx->on_result,
+        .user           = ctx->user,
+        .on_statement   = ctx->opts.keep_program ? keep_statement : NULL,
+        .statement_user = ctx,
+        .statement      = ctx->statements,
+        .print_tokens   = ctx->opts.print_tokens,
+        .on_dynamic     = ctx->on_dynamic,
+        .dynamic_user   = ctx->dynamic_user,
+        .max_errors     = ctx->opts.max_errors,
+        .on_error       = relay_error,
+        .error_user     = &relay,
+    };
+    budget_start(&ctx->exprs.budget);
+    bool ok = parser_run(err, &p);
+    if (mem_budget_stop() && !ok)
+        error_push(err, "memory budget of %" PRIu64 " bytes exceeded", ctx->opts.max_memory);
+    ctx->statements = p.statement;
+    if (!ok) {
+        tokenstream_detach(&ts);
+        parser_error_position(&p, &ctx->line, &ctx->col);
+    }
+    tokenstream_close(&ts);
+    profile_resolve(m->data, m->data + m->pos);
+
+    // literals parsed before a failure are still in the arena
+    if (p.borrowed) {
+        ctx->sources[ctx->sources_len++] = m;
+        return ok;
+    }
+    mfile_close(ok ? err : NULL, m);
+    if (ok && !error_empty(err)) {
+        error_push(err, "mfile_close");
+        ok = false;
+    }
+    return ok;
+}
+
+bool lang_eval_buffer(LangCtx* ctx, const char* src, size_t len)
+{
+    error_forget(ctx);
+    Error err = ERROR_INIT;
+    Mfile* m = mfile_open_buffer(&err, src, len);
+    if (m && eval_mfile(ctx, &err, m))
+        return true;
+    error_keep(ctx, &err);
+    return false;
+}
+
+bool lang_eval_file(LangCtx* ctx, const char* path)
+{
+    error_forget(ctx);
+    Error err = ERROR_INIT;
+    TraceSpan span = trace_begin("mfile_open");
+    Mfile* m = mfile_open_mode(&err, (char*)path, ctx->opts.io_mode);
+    trace_end(span);
+    if (!m) {
+        error_push(&err, "mfile_open");
+    } else if (eval_mfile(ctx, &err, m)) {
+        return true;
+    }
+    error_keep(ctx, &err);
+    return false;
+}
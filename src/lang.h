@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "file_stream.h"
+#include "operator.h"
+#include "value.h"
+
+/* Embedding interface, built as liblang.a and liblang.so. A context owns the
+ * variables and expressions of one program and keeps them across calls, so a
+ * host can feed it input piece by piece. No call exits the process, failures
+ * are reported through the return value and lang_error. A context must only
+ * be used by one thread at a time, separate contexts may run concurrently.
+ * The budgets of LangOptions end a call that does too much with an error */
+
+typedef struct lang_ctx LangCtx;
+
+typedef struct lang_options {
+    enum overflow_policy overflow;
+    int threads;             // chain reduction threads, 0 for one per CPU
+    enum mfile_mode io_mode; // used by lang_eval_file
+    bool pipeline;           // lex on a separate thread
+    bool print_tokens;       // dump the tokens of each expression to stderr
+    bool keep_program;       // record statements for lang_emit_c
+    uint32_t call_depth;     // deepest nesting of function calls, 0 for
+                             // FUNC_DEFAULT_DEPTH
+    uint32_t max_errors;     // failed statements to report to the error
+                             // handler and skip before a run stops, 0 to
+                             // stop at the first
+
+    // budgets of each lang_eval_* call, see budget.h. 0 for no limit
+    uint64_t max_ops;        // instructions and expression nodes run
+    uint64_t max_memory;     // bytes allocated for the program
+    uint32_t max_depth;      // operands and operators pending in an
+                             // expression
+    uint32_t timeout_ms;     // wall time
+} LangOptions;
+
+#define LANG_OPTIONS_INIT {                                  \
+    .overflow = OVERFLOW_ERROR, .threads = 0,                \
+    .io_mode = MFILE_MODE_MMAP, .pipeline = false,           \
+    .print_tokens = false, .keep_program = false,            \
+    .call_depth = 0, .max_errors = 0,                        \
+    .max_ops = 0, .max_memory = 0, .max_depth = 0,           \
+    .timeout_ms = 0,                                         \
+}
+
+/* Called with the value of every expression statement. Statements are
+ * counted from 0 across all calls on a context, assignments included */
+typedef void (*lang_result_fn)(void* user, uint64_t statement, const Value* v);
+
+/* NULL opts for the defaults. Returns NULL if out of memory */
+LangCtx* lang_ctx_new(const LangOptions* opts);
+void     lang_ctx_free(LangCtx* ctx);
+
+/* Forgets all variables, functions and expressions, the options stay */
+void     lang_ctx_reset(LangCtx* ctx);
+
+void     lang_set_result_handler(LangCtx* ctx, lang_result_fn fn, void* user);
+
+enum lang_error_kind {
+    LANG_ERROR_LEX,     // a character or literal that can't be read
+    LANG_ERROR_SYNTAX,  // a statement that can't be parsed, or is mistyped
+    LANG_ERROR_RUNTIME, // a statement that failed while it ran
+    LANG_ERROR_KIND_COUNT
+};
+
+extern const char* const lang_error_kind_str[LANG_ERROR_KIND_COUNT];
+
+/* A failed statement that was skipped, see LangOptions.max_errors */
+typedef struct lang_diagnostic {
+    enum lang_error_kind kind;
+    uint64_t statement;  // its index, counted as for results
+    uint64_t begin;      // its byte span in the input, up to where parsing
+    uint64_t end;        // resumed after it
+    int line;            // where the error was found, counted from 1
+    int col;
+    const char* message; // valid during the call
+} LangDiagnostic;
+
+/* Called in input order with every statement that failed, and was skipped
+ * because max_errors allows more errors */
+typedef void (*lang_error_fn)(void* user, const LangDiagnostic* d);
+
+void     lang_set_error_handler(LangCtx* ctx, lang_error_fn fn, void* user);
+
+/* Called once for every operation whose operand types are only known when it
+ * runs, like integer arithmetic under OVERFLOW_PROMOTE, with the line and
+ * column of its operator. Those pick their kernel by type each time rather
+ * than once when parsed */
+typedef void (*lang_dynamic_fn)(void* user, int line, int col, enum operator op);
+
+void     lang_set_dynamic_handler(LangCtx* ctx, lang_dynamic_fn fn, void* user);
+
+/* Runs len bytes of source. The buffer is copied, it needs no terminator and
+ * may be reused once this returns. Returns false on the first error, or
+ * with max_errors after the whole input if any statement failed */
+bool     lang_eval_buffer(LangCtx* ctx, const char* src, size_t len);
+
+/* Runs a source file, "-" for stdin */
+bool     lang_eval_file(LangCtx* ctx, const char* path);
+
+/* Message of the last failed call, "" if it succeeded. Valid until the next
+ * call on ctx. With max_errors it is the first error of the call */
+const char* lang_error(LangCtx* ctx);
+
+/* Statements run to completion so far. After a failure this is the index
+ * of the statement that failed, unless the run went on past it with
+ * max_errors */
+uint64_t lang_statement_count(LangCtx* ctx);
+
+/* Line and column, counted from 1, where the last failed call stopped. 0 if
+ * the error is not tied to a position, like a file that can't be opened */
+void     lang_error_position(LangCtx* ctx, int* line, int* col);
+
+/* Writes everything run so far as a standalone C program, see emit_c.h.
+ * Needs keep_program */
+bool     lang_emit_c(LangCtx* ctx, FILE* out);
+
+/* Prints expression deduplication and inlining statistics */
+void     lang_stats_print(LangCtx* ctx, FILE* out);
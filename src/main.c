@@ -0,0 +1,431 @@
+
+#include "arith.h"
+#include "error.h"
+#include "file_stream.h"
+#include "fuse.h"
+#include "lang.h"
+#include "mem.h"
+#include "profile.h"
+#include "results.h"
+#include "trace.h"
+#include "value.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [options] <file>\n"
+        "  <file>      source file, - for stdin\n"
+        "  --io=MODE   input strategy: mmap (default), populate, sequential, uring\n"
+        "  --pipeline  lex on a separate thread\n"
+        "  --overflow=POLICY\n"
+        "              integer overflow: error (default), wrap, saturate, promote\n"
+        "  --stats     print expression deduplication statistics\n"
+        "  --warn-dynamic\n"
+        "              report each operation whose operand types are only known\n"
+        "              at run time, as with --overflow=promote\n"
+        "  --trace-out=FILE\n"
+        "              write a Chrome trace-event timeline to FILE\n"
+        "  --profile[=FILE]\n"
+        "              sample the CPU time spent on each statement and print\n"
+        "              the hottest ones, FILE gets the stacks for flamegraph.pl\n"
+        "  --profile-hz=N\n"
+        "              samples per second of CPU time, default 1000, at most\n"
+        "              one per kernel tick\n"
+        "  --op-profile=FILE\n"
+        "              count the operators loops and functions run, and the\n"
+        "              pairs tools/gen_fused can fuse, adding to those in FILE\n"
+        "  --threads=N evaluation threads for long expressions, 0 (default) for\n"
+        "              one per CPU\n"
+        "  --call-depth=N\n"
+        "              deepest nesting of function calls, default 100000\n"
+        "  --max-errors=N\n"
+        "              report a failed statement, skip it and go on, stop after\n"
+        "              N errors. 0 (default) stops at the first\n"
+        "  --max-ops=N, --max-memory=BYTES, --max-depth=N, --timeout=MS\n"
+        "              budgets for untrusted programs: instructions and nodes\n"
+        "              run, bytes allocated, nesting of an expression and wall\n"
+        "              time. A program that runs out fails. 0 (default) for no\n"
+        "              limit\n"
+        "  --mem-report\n"
+        "              print memory usage by category and outstanding allocations\n"
+        "  --print-tokens\n"
+        "              print the tokens of each expression as it is parsed\n"
+        "  --results-out=FILE\n"
+        "              write results to FILE in the binary column format of\n"
+        "              results.h instead of printing them\n"
+        "  --emit-c=FILE\n"
+        "              translate the program to C in FILE instead of printing\n"
+        "              results, the program still runs once to check it\n",
+        argv0);
+}
+
+/* Tracing problems are reported but don't change the exit status */
+static void trace_finish(const char* path)
+{
+    if (!path)
+        return;
+    Error err = ERROR_INIT;
+    if (!trace_write(&err, path)) {
+        error_print(&err);
+        error_clear(&err);
+    }
+    trace_free();
+}
+
+/* Operator profile problems are reported but don't change the exit status */
+static void opcount_finish(void)
+{
+    if (!opcount_enabled)
+        return;
+    Error err = ERROR_INIT;
+    if (!opcount_write(&err)) {
+        error_print(&err);
+        error_clear(&err);
+    }
+    opcount_free();
+}
+
+/* Profiling problems are reported but don't change the exit status */
+static void profile_finish(bool enabled, const char* path)
+{
+    if (!enabled)
+        return;
+    profile_stop();
+    Error err = ERROR_INIT;
+    if (!profile_write(&err, stderr, path)) {
+        error_print(&err);
+        error_clear(&err);
+    }
+    profile_free();
+}
+
+static bool emit_c_file(LangCtx* ctx, const char* path)
+{
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    bool ok = lang_emit_c(ctx, out);
+    if (!ok)
+        fprintf(stderr, "%s\n", lang_error(ctx));
+    if (fclose(out) != 0 && ok) {
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+        ok = false;
+    }
+    return ok;
+}
+
+/* A budget limit, 0 to max */
+static bool parse_limit(const char* s, uint64_t max, uint64_t* out)
+{
+    char* end;
+    errno = 0;
+    const unsigned long long n = strtoull(s, &end, 10);
+    if (*s == '-' || *end != '\0' || errno != 0 || n > max)
+        return false;
+    *out = n;
+    return true;
+}
+
+struct results_out {
+    ResultWriter* w;
+    Error err; // first write failure, later results are dropped
+};
+
+static void write_result(void* user, uint64_t statement, const Value* v)
+{
+    struct results_out* r = user;
+    if (error_empty(&r->err))
+        result_write_value(&r->err, r->w, statement, v);
+}
+
+struct errors {
+    struct results_out* results; // NULL unless results are written
+    uint64_t counts[LANG_ERROR_KIND_COUNT];
+};
+
+static void report_error(void* user, const LangDiagnostic* d)
+{
+    struct errors* e = user;
+    e->counts[d->kind]++;
+    fprintf(stderr, "%d:%d: %s error in statement %" PRIu64 " (bytes %" PRIu64 "-%" PRIu64 "): %s\n",
+            d->line, d->col, lang_error_kind_str[d->kind], d->statement, d->begin, d->end,
+            d->message);
+    struct results_out* r = e->results;
+    if (r && error_empty(&r->err))
+        result_write_error(&r->err, r->w, d->statement, d->line, d->col);
+}
+
+static void report_dynamic(void* user, int line, int col, enum operator op)
+{
+    (void)user;
+    fprintf(stderr, "%d:%d: operator %s has operand types only known at run time\n", line, col,
+            op_table[op].str);
+}
+
+static void print_result(void* user, uint64_t statement, const Value* v)
+{
+    (void)user, (void)statement;
+    fprintf(stderr, "result: ");
+    value_print(stderr, v);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv)
+{
+    int status = EXIT_SUCCESS;
+    LangOptions opts = LANG_OPTIONS_INIT;
+    bool stats = false;
+    bool warn_dynamic = false;
+    const char* trace_out = NULL;
+    bool mem_stats = false;
+    const char* emit_out = NULL;
+    struct results_out results = {.w = NULL, .err = ERROR_INIT};
+    const char* results_path = NULL;
+    bool profile = false;
+    const char* profile_out = NULL;
+    int profile_hz = PROFILE_DEFAULT_HZ;
+    const char* op_profile = NULL;
+    struct errors errors = {0};
+
+    static const struct option options[] = {
+        {"io",       required_argument, NULL, 'i'},
+        {"pipeline", no_argument,       NULL, 'p'},
+        {"overflow", required_argument, NULL, 'o'},
+        {"stats",    no_argument,       NULL, 's'},
+        {"warn-dynamic", no_argument,   NULL, 'w'},
+        {"trace-out", required_argument, NULL, 't'},
+        {"profile",  optional_argument, NULL, 'P'},
+        {"profile-hz", required_argument, NULL, 'H'},
+        {"op-profile", required_argument, NULL, 'O'},
+        {"mem-report", no_argument,      NULL, 'm'},
+        {"threads",  required_argument, NULL, 'j'},
+        {"call-depth", required_argument, NULL, 'd'},
+        {"max-errors", required_argument, NULL, 'e'},
+        {"max-ops",  required_argument, NULL, 'x'},
+        {"max-memory", required_argument, NULL, 'M'},
+        {"max-depth", required_argument, NULL, 'D'},
+        {"timeout",  required_argument, NULL, 'W'},
+        {"print-tokens", no_argument,   NULL, 'T'},
+        {"emit-c",   required_argument, NULL, 'c'},
+        {"results-out", required_argument, NULL, 'r'},
+        {"help",     no_argument,       NULL, 'h'},
+        {0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            opts.io_mode = mfile_mode_parse(optarg);
+            if (opts.io_mode == MFILE_MODE_COUNT) {
+                fprintf(stderr, "unknown io mode: %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            opts.pipeline = true;
+            break;
+        case 's':
+            stats = true;
+            break;
+        case 'w':
+            warn_dynamic = true;
+            break;
+        case 't':
+            trace_out = optarg;
+            break;
+        case 'P':
+            profile = true;
+            profile_out = optarg;
+            break;
+        case 'H': {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (*end != '\0' || n <= 0 || n > 1000000) {
+                fprintf(stderr, "bad profile rate: %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            profile_hz = n;
+            break;}
+        case 'O':
+            op_profile = optarg;
+            break;
+        case 'm':
+            mem_stats = true;
+            break;
+        case 'T':
+            opts.print_tokens = true;
+            break;
+        case 'r':
+            results_path = optarg;
+            break;
+        case 'c':
+            emit_out = optarg;
+            opts.keep_program = true;
+            break;
+        case 'j': {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (*end != '\0' || n < 0 || n > INT_MAX) {
+                fprintf(stderr, "bad thread count: %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            opts.threads = n;
+            break;}
+        case 'd': {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (*end != '\0' || n <= 0 || n > UINT32_MAX) {
+                fprintf(stderr, "bad call depth: %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            opts.call_depth = n;
+            break;}
+        case 'e': {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (*end != '\0' || n < 0 || n > UINT32_MAX) {
+                fprintf(stderr, "bad error count: %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            opts.max_errors = n;
+            break;}
+        case 'x':
+        case 'M':
+        case 'D':
+        case 'W': {
+            uint64_t n;
+            const uint64_t max = opt == 'x' || opt == 'M' ? UINT64_MAX : UINT32_MAX;
+            if (!parse_limit(optarg, max, &n)) {
+                fprintf(stderr, "bad budget: %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            if (opt == 'x')
+                opts.max_ops = n;
+            else if (opt == 'M')
+                opts.max_memory = n;
+            else if (opt == 'D')
+                opts.max_depth = n;
+            else
+                opts.timeout_ms = n;
+            break;}
+        case 'o':
+            opts.overflow = overflow_policy_parse(optarg);
+            if (opts.overflow == OVERFLOW_POLICY_COUNT) {
+                fprintf(stderr, "unknown overflow policy: %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (trace_out) {
+        trace_start();
+        trace_thread_name("parser");
+    }
+
+    LangCtx* ctx = lang_ctx_new(&opts);
+    if (!ctx) {
+        fprintf(stderr, "failed to allocate interpreter context\n");
+        return EXIT_FAILURE;
+    }
+    if (results_path) {
+        results.w = result_writer_open(&results.err, results_path);
+        if (!results.w) {
+            error_print(&results.err);
+            lang_ctx_free(ctx);
+            return EXIT_FAILURE;
+        }
+        lang_set_result_handler(ctx, write_result, &results);
+        errors.results = &results;
+    } else if (!emit_out) {
+        lang_set_result_handler(ctx, print_result, NULL);
+    }
+    lang_set_error_handler(ctx, report_error, &errors);
+    if (warn_dynamic)
+        lang_set_dynamic_handler(ctx, report_dynamic, NULL);
+
+    Error err = ERROR_INIT;
+    if (profile && !profile_start(&err, profile_hz)) {
+        error_print(&err);
+        error_clear(&err);
+        profile = false;
+    }
+    if (op_profile && !opcount_start(&err, op_profile)) {
+        error_print(&err);
+        error_clear(&err);
+    }
+
+    bool ok = lang_eval_file(ctx, argv[optind]);
+    trace_finish(trace_out);
+    int line = 0, col = 0;
+    uint64_t reported = 0;
+    for (int k = 0; k < LANG_ERROR_KIND_COUNT; k++)
+        reported += errors.counts[k];
+    if (opts.max_errors) {
+        fprintf(stderr, "errors: %" PRIu64 " lex, %" PRIu64 " syntax, %" PRIu64 " runtime%s\n",
+                errors.counts[LANG_ERROR_LEX], errors.counts[LANG_ERROR_SYNTAX],
+                errors.counts[LANG_ERROR_RUNTIME],
+                reported == opts.max_errors ? ", stopped at --max-errors" : "");
+    }
+    if (!ok && reported) {
+        // each was printed as it was found
+        status = EXIT_FAILURE;
+    } else if (!ok) {
+        fprintf(stderr, "%s\n", lang_error(ctx));
+        lang_error_position(ctx, &line, &col);
+        if (line) {
+            fprintf(stderr, "\nLine: %d\nCol: %d\n", line, col);
+        }
+        status = EXIT_FAILURE;
+    }
+    profile_finish(profile, profile_out);
+    opcount_finish();
+    if (results.w) {
+        if (!ok && !reported && error_empty(&results.err))
+            result_write_error(&results.err, results.w, lang_statement_count(ctx), line, col);
+        result_writer_close(&results.err, results.w);
+        if (!error_empty(&results.err)) {
+            error_print(&results.err);
+            error_clear(&results.err);
+            status = EXIT_FAILURE;
+        }
+    }
+    if (ok && emit_out && !emit_c_file(ctx, emit_out)) {
+        status = EXIT_FAILURE;
+    } else if (ok && stats) {
+        lang_stats_print(ctx, stderr);
+    }
+    lang_ctx_free(ctx);
+
+    if (mem_stats) {
+        mem_report(stderr);
+    }
+
+    return status;
+}
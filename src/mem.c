@@ -0,0 +1,245 @@
+
+#include <errno.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+static const char* mem_category_str[MEM_CATEGORY_COUNT] = {
+    [MEM_TOKEN]   = "token",
+    [MEM_EXPR]    = "expr",
+    [MEM_ERROR]   = "error",
+    [MEM_IO]      = "io",
+    [MEM_LEXER]   = "lexer",
+    [MEM_TRACE]   = "trace",
+    [MEM_SYMBOL]  = "symbol",
+    [MEM_PARSER]  = "parser",
+    [MEM_STRING]  = "string",
+    [MEM_PROFILE] = "profile",
+};
+
+_Thread_local struct mem_budget* mem_budget_;
+
+// started by mem_budget_start, other threads point at it while they share it
+static _Thread_local struct mem_budget mem_budget_own;
+
+bool mem_budget_charge_(enum mem_category c, size_t size)
+{
+    switch (c) {
+    case MEM_ERROR:
+    case MEM_IO:
+    case MEM_LEXER:
+    case MEM_TRACE:
+    case MEM_PROFILE:
+        return true;
+    default:
+        break;
+    }
+    struct mem_budget* b = mem_budget_;
+    if (!atomic_load_explicit(&b->on, memory_order_relaxed))
+        return true;
+    size_t left = atomic_load_explicit(&b->left, memory_order_relaxed);
+    do {
+        if (size > left) {
+            // whoever sees it first, the rest of the run gets nothing more
+            atomic_store_explicit(&b->left, 0, memory_order_relaxed);
+            atomic_store_explicit(&b->exceeded, true, memory_order_relaxed);
+            errno = ENOMEM;
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&b->left, &left, left - size,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+void mem_budget_start(size_t limit)
+{
+    atomic_store_explicit(&mem_budget_own.left, limit, memory_order_relaxed);
+    atomic_store_explicit(&mem_budget_own.exceeded, false, memory_order_relaxed);
+    atomic_store_explicit(&mem_budget_own.on, limit != 0, memory_order_relaxed);
+    mem_budget_ = limit ? &mem_budget_own : NULL;
+}
+
+bool mem_budget_stop(void)
+{
+    const bool exceeded = atomic_load_explicit(&mem_budget_own.exceeded, memory_order_relaxed);
+    atomic_store_explicit(&mem_budget_own.on, false, memory_order_relaxed);
+    mem_budget_ = NULL;
+    return exceeded;
+}
+
+#ifdef MEM_TRACKING
+
+/* Sits right before the pointer handed out, offset bytes after the start of
+ * the underlying block */
+struct mem_header {
+    size_t size;
+    uint32_t category;
+    uint32_t offset;
+};
+
+#define MEM_HEADER sizeof(struct mem_header)
+
+_Static_assert(MEM_HEADER % alignof(max_align_t) == 0,
+               "header must keep malloc's alignment");
+
+/* Counters are shared with the lexer thread, and only ever need to be
+ * individually consistent */
+struct mem_counters {
+    _Atomic size_t bytes;
+    _Atomic size_t objects;
+    _Atomic size_t peak;
+    _Atomic size_t allocs;
+};
+
+static struct mem_counters mem_stats[MEM_CATEGORY_COUNT];
+static struct mem_counters mem_total;
+
+static void peak_update(_Atomic size_t* peak, size_t now)
+{
+    size_t old = atomic_load_explicit(peak, memory_order_relaxed);
+    while (now > old
+        && !atomic_compare_exchange_weak_explicit(peak, &old, now,
+                memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void account(enum mem_category c, ptrdiff_t bytes, ptrdiff_t objects)
+{
+    struct mem_counters* counters[] = {&mem_stats[c], &mem_total};
+    for (int i = 0; i < 2; i++) {
+        struct mem_counters* s = counters[i];
+        size_t now = atomic_fetch_add_explicit(&s->bytes, bytes, memory_order_relaxed) + bytes;
+        atomic_fetch_add_explicit(&s->objects, objects, memory_order_relaxed);
+        if (objects > 0)
+            atomic_fetch_add_explicit(&s->allocs, 1, memory_order_relaxed);
+        if (bytes > 0)
+            peak_update(&s->peak, now);
+    }
+}
+
+static struct mem_header* header_of(void* p)
+{
+    return (struct mem_header*)((char*)p - MEM_HEADER);
+}
+
+static void* mem_track(enum mem_category c, char* block, size_t offset, size_t size)
+{
+    if (!block)
+        return NULL;
+    char* p = block + offset;
+    *header_of(p) = (struct mem_header){
+        .size     = size,
+        .category = c,
+        .offset   = offset,
+    };
+    account(c, size, 1);
+    return p;
+}
+
+void* mem_alloc(enum mem_category c, size_t size)
+{
+    if (size > SIZE_MAX - MEM_HEADER || !mem_budget_ok_(c, size))
+        return NULL;
+    return mem_track(c, malloc(MEM_HEADER + size), MEM_HEADER, size);
+}
+
+void* mem_calloc(enum mem_category c, size_t n, size_t size)
+{
+    if (size && n > (SIZE_MAX - MEM_HEADER) / size)
+        return NULL;
+    if (!mem_budget_ok_(c, n * size))
+        return NULL;
+    return mem_track(c, calloc(1, MEM_HEADER + n * size), MEM_HEADER, n * size);
+}
+
+void* mem_aligned_alloc(enum mem_category c, size_t align, size_t size)
+{
+    // the header goes in a whole alignment unit in front of the block
+    size_t offset = align < MEM_HEADER ? MEM_HEADER : align;
+    if (size > SIZE_MAX - offset || !mem_budget_ok_(c, size))
+        return NULL;
+    return mem_track(c, aligned_alloc(align, offset + size), offset, size);
+}
+
+void* mem_realloc(enum mem_category c, void* p, size_t size)
+{
+    if (!p)
+        return mem_alloc(c, size);
+    if (size > SIZE_MAX - MEM_HEADER)
+        return NULL;
+
+    struct mem_header h = *header_of(p);
+    if (h.offset != MEM_HEADER) {
+        // aligned blocks can't go through realloc
+        return NULL;
+    }
+    if (!mem_budget_ok_(h.category, size))
+        return NULL;
+    char* block = realloc((char*)p - MEM_HEADER, MEM_HEADER + size);
+    if (!block)
+        return NULL;
+    account(h.category, -(ptrdiff_t)h.size, -1);
+    return mem_track(h.category, block, MEM_HEADER, size);
+}
+
+void mem_free(void* p)
+{
+    if (!p)
+        return;
+    struct mem_header* h = header_of(p);
+    account(h->category, -(ptrdiff_t)h->size, -1);
+    free((char*)p - h->offset);
+}
+
+size_t mem_report(FILE* out)
+{
+    fprintf(out, "%-8s %12s %12s %12s %12s\n",
+            "memory", "live bytes", "live objects", "peak bytes", "allocations");
+    for (int i = 0; i <= MEM_CATEGORY_COUNT; i++) {
+        struct mem_counters* s = i < MEM_CATEGORY_COUNT ? &mem_stats[i] : &mem_total;
+        fprintf(out, "%-8s %12zu %12zu %12zu %12zu\n",
+                i < MEM_CATEGORY_COUNT ? mem_category_str[i] : "total",
+                atomic_load(&s->bytes), atomic_load(&s->objects),
+                atomic_load(&s->peak), atomic_load(&s->allocs));
+    }
+    size_t live = atomic_load(&mem_total.objects);
+    if (live) {
+        fprintf(out, "%zu allocations outstanding at exit\n", live);
+    }
+    return live;
+}
+
+size_t mem_peak(void)
+{
+    return atomic_load(&mem_total.peak);
+}
+
+void mem_peak_reset(void)
+{
+    atomic_store(&mem_total.peak, atomic_load(&mem_total.bytes));
+}
+
+#else
+
+size_t mem_report(FILE* out)
+{
+    (void)mem_category_str;
+    fprintf(out, "memory tracking is compiled out of this build\n");
+    return 0;
+}
+
+size_t mem_peak(void)
+{
+    return 0;
+}
+
+void mem_peak_reset(void)
+{
+}
+
+#endif
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* All heap allocations go through here. Unless NDEBUG is defined, each block
+ * carries a small header with its size and category, and live bytes, live
+ * objects and the high-water mark are counted per category. Release builds
+ * (make RELEASE=1) compile this down to plain malloc and free. */
+
+#ifndef NDEBUG
+#define MEM_TRACKING 1
+#endif
+
+enum mem_category {
+    MEM_TOKEN,
+    MEM_EXPR,  // expression nodes and their values
+    MEM_ERROR,
+    MEM_IO,    // Mfile, input buffers, io_uring
+    MEM_LEXER, // lexer thread and token ring
+    MEM_TRACE,
+    MEM_SYMBOL,
+    MEM_PARSER,
+    MEM_STRING,
+    MEM_PROFILE,
+    MEM_CATEGORY_COUNT
+};
+
+/* Allocation budget for running untrusted programs. While it is on, the
+ * bytes requested for what a program builds (tokens, expressions, symbols,
+ * parser state and strings) are counted, and once they pass the limit such
+ * allocations fail as if out of memory. Errors, input buffers and tooling
+ * are never refused. Growing a block counts its whole new size.
+ *
+ * A budget is started on one thread. Threads working on its behalf, like
+ * the lexer thread or chain reduction workers, share it and charge the same
+ * count */
+struct mem_budget {
+    _Atomic size_t left;
+    atomic_bool on;
+    atomic_bool exceeded;
+};
+
+/* Budget the calling thread charges, NULL for none */
+extern _Thread_local struct mem_budget* mem_budget_;
+
+/* Slow path of mem_budget_ok_, only called while a budget is shared */
+bool mem_budget_charge_(enum mem_category c, size_t size);
+
+static inline bool mem_budget_ok_(enum mem_category c, size_t size)
+{
+    return __builtin_expect(!mem_budget_, 1) || mem_budget_charge_(c, size);
+}
+
+/* Turns the budget of the calling thread on with limit bytes, 0 turns it
+ * off */
+void mem_budget_start(size_t limit);
+
+/* Turns the budget off. Returns true if an allocation was refused. Threads
+ * still sharing it are no longer limited */
+bool mem_budget_stop(void);
+
+/* Budget of the calling thread, to hand to a thread started on its behalf.
+ * NULL if it has none */
+static inline struct mem_budget* mem_budget_current(void)
+{
+    return mem_budget_;
+}
+
+/* Charges the allocations of the calling thread to b, NULL to stop. b is
+ * owned by the thread that started it and must outlive the calling thread */
+static inline void mem_budget_share(struct mem_budget* b)
+{
+    mem_budget_ = b;
+}
+
+static inline bool mem_budget_exceeded(void)
+{
+    return mem_budget_ && atomic_load_explicit(&mem_budget_->exceeded, memory_order_relaxed);
+}
+
+#ifdef MEM_TRACKING
+
+void* mem_alloc(enum mem_category c, size_t size);
+void* mem_calloc(enum mem_category c, size_t n, size_t size);
+void* mem_realloc(enum mem_category c, void* p, size_t size);
+void* mem_aligned_alloc(enum mem_category c, size_t align, size_t size);
+void  mem_free(void* p);
+
+#else
+
+static inline void* mem_alloc(enum mem_category c, size_t size)
+{
+    if (!mem_budget_ok_(c, size))
+        return NULL;
+    return malloc(size);
+}
+
+static inline void* mem_calloc(enum mem_category c, size_t n, size_t size)
+{
+    if (!mem_budget_ok_(c, size && n > SIZE_MAX / size ? SIZE_MAX : n * size))
+        return NULL;
+    return calloc(n, size);
+}
+
+static inline void* mem_realloc(enum mem_category c, void* p, size_t size)
+{
+    if (!mem_budget_ok_(c, size))
+        return NULL;
+    return realloc(p, size);
+}
+
+/* size must be a multiple of align */
+static inline void* mem_aligned_alloc(enum mem_category c, size_t align, size_t size)
+{
+    if (!mem_budget_ok_(c, size))
+        return NULL;
+    return aligned_alloc(align, size);
+}
+
+static inline void mem_free(void* p)
+{
+    free(p);
+}
+
+#endif
+
+/* Prints live and peak usage per category. Returns the number of live
+ * objects, 0 if tracking is compiled out */
+size_t mem_report(FILE* out);
+
+/* Peak of the live bytes of all categories since the last mem_peak_reset,
+ * 0 if tracking is compiled out */
+size_t mem_peak(void);
+void   mem_peak_reset(void);
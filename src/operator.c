@@ -0,0 +1,342 @@
+
+#include <math.h>
+#include <stdint.h>
+
+#include "arith.h"
+#include "error.h"
+#include "operator.h"
+#include "str.h"
+#include "value.h"
+
+/* ======= Lexing ======= */
+
+static const uint8_t operator_1[256] = {
+    ['+'] = OP_ADD,  ['-'] = OP_SUB, ['*'] = OP_MUL, ['/'] = OP_DIV,
+    ['%'] = OP_MOD,  ['<'] = OP_LT,  ['>'] = OP_GT,  ['&'] = OP_BAND,
+    ['|'] = OP_BOR,  ['^'] = OP_BXOR, ['='] = OP_ASSIGN, ['!'] = OP_NOT,
+    ['~'] = OP_BNOT,
+};
+
+#define PAIR(a, b) (((a) << 8) | (b))
+
+enum operator operator_lex(int a, int b, int* len)
+{
+    enum operator op = OP_NONE;
+    switch (PAIR(a, b)) {
+    case PAIR('=', '='): op = OP_EQ;  break;
+    case PAIR('!', '='): op = OP_NE;  break;
+    case PAIR('<', '='): op = OP_LE;  break;
+    case PAIR('>', '='): op = OP_GE;  break;
+    case PAIR('&', '&'): op = OP_AND; break;
+    case PAIR('|', '|'): op = OP_OR;  break;
+    case PAIR('<', '<'): op = OP_SHL; break;
+    case PAIR('>', '>'): op = OP_SHR; break;
+    }
+    if (op != OP_NONE) {
+        *len = 2;
+        return op;
+    }
+    *len = 1;
+    return operator_1[(unsigned char)a];
+}
+
+#undef PAIR
+
+/* ======= Kernels =======
+
+ Every kernel handles exactly one (operator, left type, right type) and
+ knows its operand types, so none of them test types at run time. Mixed
+ int/float variants convert the int operand and call the float kernel.
+
+ ================================ */
+
+#define KERNEL_PARAMS                                                        \
+    Error* err, enum overflow_policy policy, struct str_table* strs,         \
+    const Value* l, const Value* r, Value* out
+
+#define MIXED_VARIANTS(name)                                                 \
+    static bool name##_if(KERNEL_PARAMS)                                     \
+    {                                                                        \
+        const Value a = {.type = VALUE_FLOATING, .f64 = (double)l->i64};     \
+        return name##_ff(err, policy, strs, &a, r, out);                     \
+    }                                                                        \
+    static bool name##_fi(KERNEL_PARAMS)                                     \
+    {                                                                        \
+        const Value b = {.type = VALUE_FLOATING, .f64 = (double)r->i64};     \
+        return name##_ff(err, policy, strs, l, &b, out);                     \
+    }
+
+#define CHECKED_INT_KERNEL(name, op, kernel)                                 \
+    static bool name##_ii(KERNEL_PARAMS)                                     \
+    {                                                                        \
+        (void)strs;                                                          \
+        out->type = VALUE_INTEGER;                                           \
+        if (__builtin_expect(kernel(l->i64, r->i64, &out->i64), 0))          \
+            return arith_overflow(err, policy, op, l->i64, r->i64, out);     \
+        return true;                                                         \
+    }
+
+#define FLOAT_KERNEL(name, expr)                                             \
+    static bool name##_ff(KERNEL_PARAMS)                                     \
+    {                                                                        \
+        (void)err, (void)policy, (void)strs;                                 \
+        const double a = l->f64, b = r->f64;                                 \
+        out->type = VALUE_FLOATING;                                          \
+        out->f64  = (expr);                                                  \
+        return true;                                                         \
+    }                                                                        \
+    MIXED_VARIANTS(name)
+
+/* Result is an integer 0 or 1 for any operand types */
+#define PREDICATE_KERNEL(name, expr)                                         \
+    static bool name##_ii(KERNEL_PARAMS)                                     \
+    {                                                                        \
+        (void)err, (void)policy, (void)strs;                                 \
+        const int64_t a = l->i64, b = r->i64;                                \
+        out->type = VALUE_INTEGER;                                           \
+        out->i64  = (expr);                                                  \
+        return true;                                                         \
+    }                                                                        \
+    static bool name##_ff(KERNEL_PARAMS)                                     \
+    {                                                                        \
+        (void)err, (void)policy, (void)strs;                                 \
+        const double a = l->f64, b = r->f64;                                 \
+        out->type = VALUE_INTEGER;                                           \
+        out->i64  = (expr);                                                  \
+        return true;                                                         \
+    }                                                                        \
+    MIXED_VARIANTS(name)
+
+#define INT_KERNEL(name, expr)                                               \
+    static bool name##_ii(KERNEL_PARAMS)                                     \
+    {                                                                        \
+        (void)err, (void)policy, (void)strs;                                 \
+        const int64_t a = l->i64, b = r->i64;                                \
+        out->type = VALUE_INTEGER;                                           \
+        out->i64  = (expr);                                                  \
+        return true;                                                         \
+    }
+
+CHECKED_INT_KERNEL(add, OP_ADD, arith_add_i64)
+CHECKED_INT_KERNEL(sub, OP_SUB, arith_sub_i64)
+CHECKED_INT_KERNEL(mul, OP_MUL, arith_mul_i64)
+FLOAT_KERNEL(add, a + b)
+FLOAT_KERNEL(sub, a - b)
+FLOAT_KERNEL(mul, a * b)
+FLOAT_KERNEL(div, a / b)
+FLOAT_KERNEL(mod, fmod(a, b))
+
+static bool div_ii(KERNEL_PARAMS)
+{
+    (void)strs;
+    out->type = VALUE_INTEGER;
+    if (__builtin_expect(r->i64 == 0, 0)) {
+        error_push(err, "integer division by zero");
+        return false;
+    }
+    if (__builtin_expect(arith_div_i64(l->i64, r->i64, &out->i64), 0))
+        return arith_overflow(err, policy, OP_DIV, l->i64, r->i64, out);
+    return true;
+}
+
+static bool mod_ii(KERNEL_PARAMS)
+{
+    (void)policy, (void)strs;
+    out->type = VALUE_INTEGER;
+    if (__builtin_expect(r->i64 == 0, 0)) {
+        error_push(err, "integer modulo by zero");
+        return false;
+    }
+    // INT64_MIN % -1 traps on x86, the result is 0 for any a % -1
+    out->i64 = r->i64 == -1 ? 0 : l->i64 % r->i64;
+    return true;
+}
+
+PREDICATE_KERNEL(eq, a == b)
+PREDICATE_KERNEL(ne, a != b)
+PREDICATE_KERNEL(lt, a < b)
+PREDICATE_KERNEL(le, a <= b)
+PREDICATE_KERNEL(gt, a > b)
+PREDICATE_KERNEL(ge, a >= b)
+PREDICATE_KERNEL(and, a != 0 && b != 0)
+PREDICATE_KERNEL(or, a != 0 || b != 0)
+
+INT_KERNEL(band, a & b)
+INT_KERNEL(bor, a | b)
+INT_KERNEL(bxor, a ^ b)
+
+static bool shift_count(Error* err, const Value* r)
+{
+    if (__builtin_expect(r->i64 < 0 || r->i64 > 63, 0)) {
+        error_push(err, "shift count out of range: %lld", (long long)r->i64);
+        return false;
+    }
+    return true;
+}
+
+static bool shl_ii(KERNEL_PARAMS)
+{
+    (void)policy, (void)strs;
+    out->type = VALUE_INTEGER;
+    if (!shift_count(err, r))
+        return false;
+    out->i64 = (int64_t)((uint64_t)l->i64 << r->i64);
+    return true;
+}
+
+static bool shr_ii(KERNEL_PARAMS)
+{
+    (void)policy, (void)strs;
+    out->type = VALUE_INTEGER;
+    if (!shift_count(err, r))
+        return false;
+    out->i64 = l->i64 >> r->i64;
+    return true;
+}
+
+/* Unary kernels, only the left operand is used */
+static bool not_ii(KERNEL_PARAMS)
+{
+    (void)err, (void)policy, (void)strs, (void)r;
+    *out = (Value){.type = VALUE_INTEGER, .i64 = l->i64 == 0};
+    return true;
+}
+
+static bool not_ff(KERNEL_PARAMS)
+{
+    (void)err, (void)policy, (void)strs, (void)r;
+    *out = (Value){.type = VALUE_INTEGER, .i64 = l->f64 == 0.0};
+    return true;
+}
+
+static bool bnot_ii(KERNEL_PARAMS)
+{
+    (void)err, (void)policy, (void)strs, (void)r;
+    *out = (Value){.type = VALUE_INTEGER, .i64 = ~l->i64};
+    return true;
+}
+
+/* Conversion node, only the left operand is used */
+static bool to_float_ii(KERNEL_PARAMS)
+{
+    (void)err, (void)policy, (void)strs, (void)r;
+    out->type = VALUE_FLOATING;
+    out->f64  = (double)l->i64;
+    return true;
+}
+
+/* ======= String kernels, see str.h ======= */
+
+static bool add_ss(KERNEL_PARAMS)
+{
+    (void)policy;
+    return str_concat(err, strs, l, r, out);
+}
+
+static bool eq_ss(KERNEL_PARAMS)
+{
+    (void)policy, (void)strs;
+    bool eq;
+    if (!str_equal(err, l, r, &eq))
+        return false;
+    *out = (Value){.type = VALUE_INTEGER, .i64 = eq};
+    return true;
+}
+
+static bool ne_ss(KERNEL_PARAMS)
+{
+    if (!eq_ss(err, policy, strs, l, r, out))
+        return false;
+    out->i64 = !out->i64;
+    return true;
+}
+
+#define STRING_ORDER_KERNEL(name, expr)                                      \
+    static bool name##_ss(KERNEL_PARAMS)                                     \
+    {                                                                        \
+        (void)policy, (void)strs;                                            \
+        int cmp;                                                             \
+        if (!str_compare(err, l, r, &cmp))                                   \
+            return false;                                                    \
+        *out = (Value){.type = VALUE_INTEGER, .i64 = (expr)};                \
+        return true;                                                         \
+    }
+
+STRING_ORDER_KERNEL(lt, cmp < 0)
+STRING_ORDER_KERNEL(le, cmp <= 0)
+STRING_ORDER_KERNEL(gt, cmp > 0)
+STRING_ORDER_KERNEL(ge, cmp >= 0)
+
+/* ======= Dispatch table ======= */
+
+#define KERNEL(op, lt, rt) [OP_KERNEL_ID(op, VALUE_##lt, VALUE_##rt)]
+
+#define ALL_TYPES(op, name)                                                  \
+    KERNEL(op, INTEGER, INTEGER)   = name##_ii,                              \
+    KERNEL(op, INTEGER, FLOATING)  = name##_if,                              \
+    KERNEL(op, FLOATING, INTEGER)  = name##_fi,                              \
+    KERNEL(op, FLOATING, FLOATING) = name##_ff
+
+#define WITH_STRINGS(op, name)                                               \
+    ALL_TYPES(op, name),                                                     \
+    KERNEL(op, STRING, STRING)     = name##_ss
+
+/* A unary node has the same type on both sides */
+#define UNARY(op, name)                                                      \
+    KERNEL(op, INTEGER, INTEGER)   = name##_ii,                              \
+    KERNEL(op, FLOATING, FLOATING) = name##_ff
+
+#define INT_ONLY(op, name)                                                   \
+    KERNEL(op, INTEGER, INTEGER)   = name##_ii
+
+_Static_assert(OP_KERNEL_COUNT <= OP_KERNEL_DYNAMIC, "kernel ids fit in a byte");
+
+const op_kernel op_kernels[OP_KERNEL_COUNT] = {
+    UNARY(OP_NOT, not),
+    INT_ONLY(OP_BNOT, bnot),
+    ALL_TYPES(OP_MUL, mul),
+    ALL_TYPES(OP_DIV, div),
+    ALL_TYPES(OP_MOD, mod),
+    WITH_STRINGS(OP_ADD, add),
+    ALL_TYPES(OP_SUB, sub),
+    INT_ONLY(OP_SHL, shl),
+    INT_ONLY(OP_SHR, shr),
+    WITH_STRINGS(OP_LT, lt),
+    WITH_STRINGS(OP_LE, le),
+    WITH_STRINGS(OP_GT, gt),
+    WITH_STRINGS(OP_GE, ge),
+    WITH_STRINGS(OP_EQ, eq),
+    WITH_STRINGS(OP_NE, ne),
+    INT_ONLY(OP_BAND, band),
+    INT_ONLY(OP_BXOR, bxor),
+    INT_ONLY(OP_BOR, bor),
+    ALL_TYPES(OP_AND, and),
+    ALL_TYPES(OP_OR, or),
+    INT_ONLY(OP_TO_FLOAT, to_float),
+};
+
+const struct op_info op_table[OP_COUNT] = {
+    [OP_NONE]     = {"(none)", 0,  false, 0},
+    [OP_NOT]      = {"!",      11, true,  OP_UNARY | OP_PREDICATE},
+    [OP_BNOT]     = {"~",      11, true,  OP_UNARY},
+    [OP_MUL]      = {"*",      10, false, OP_CHECKED},
+    [OP_DIV]      = {"/",      10, false, OP_CHECKED},
+    [OP_MOD]      = {"%",      10, false, 0},
+    [OP_ADD]      = {"+",      9,  false, OP_CHECKED},
+    [OP_SUB]      = {"-",      9,  false, OP_CHECKED},
+    [OP_SHL]      = {"<<",     8,  false, 0},
+    [OP_SHR]      = {">>",     8,  false, 0},
+    [OP_LT]       = {"<",      7,  false, OP_PREDICATE},
+    [OP_LE]       = {"<=",     7,  false, OP_PREDICATE},
+    [OP_GT]       = {">",      7,  false, OP_PREDICATE},
+    [OP_GE]       = {">=",     7,  false, OP_PREDICATE},
+    [OP_EQ]       = {"==",     6,  false, OP_PREDICATE},
+    [OP_NE]       = {"!=",     6,  false, OP_PREDICATE},
+    [OP_BAND]     = {"&",      5,  false, 0},
+    [OP_BXOR]     = {"^",      4,  false, 0},
+    [OP_BOR]      = {"|",      3,  false, 0},
+    [OP_AND]      = {"&&",     2,  false, OP_PREDICATE | OP_SHORT_CIRCUIT},
+    [OP_OR]       = {"||",     1,  false, OP_PREDICATE | OP_SHORT_CIRCUIT},
+    [OP_ASSIGN]   = {"=",      0,  true,  0},
+    [OP_TO_FLOAT] = {"float",  0,  false, OP_UNARY},
+};
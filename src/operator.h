@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "value.h"
+
+/* Operators, resolved by the tokenizer and stored in Token.op */
+enum operator {
+    OP_NONE,
+    OP_ADD,    // +
+    OP_SUB,    // -
+    OP_MUL,    // *
+    OP_DIV,    // /
+    OP_MOD,    // %
+    OP_EQ,     // ==
+    OP_NE,     // !=
+    OP_LT,     // <
+    OP_LE,     // <=
+    OP_GT,     // >
+    OP_GE,     // >=
+    OP_AND,    // &&
+    OP_OR,     // ||
+    OP_BAND,   // &
+    OP_BOR,    // |
+    OP_BXOR,   // ^
+    OP_SHL,    // <<
+    OP_SHR,    // >>
+    OP_ASSIGN, // =
+    OP_NOT,    // !
+    OP_BNOT,   // ~
+    OP_TO_FLOAT, // int to float, inserted by type inference, rhs repeats lhs
+    OP_COUNT
+};
+
+/* What to do when an integer operation does not fit in int64_t */
+enum overflow_policy {
+    OVERFLOW_ERROR,    // fail the expression
+    OVERFLOW_WRAP,     // two's complement wraparound
+    OVERFLOW_SATURATE, // clamp to INT64_MIN/INT64_MAX
+    OVERFLOW_PROMOTE,  // redo the operation in double
+    OVERFLOW_POLICY_COUNT
+};
+
+struct str_table;
+
+/* Evaluates `l op r` into out. Returns false and pushes to err on failure.
+ * Strings the kernel makes are added to strs */
+typedef bool (*op_kernel)(Error* err, enum overflow_policy policy, struct str_table* strs,
+                          const Value* l, const Value* r, Value* out);
+
+/* op_info.flags */
+#define OP_PREDICATE     1 // result is an int 0 or 1 for any operand types
+#define OP_CHECKED       2 // the int kernel can overflow
+#define OP_UNARY         4 // prefix operator, its node repeats the operand as
+                           // rhs and the kernels ignore r
+#define OP_SHORT_CIRCUIT 8 // r is only evaluated if l doesn't decide the
+                           // result, see op_short_circuit
+
+struct op_info {
+    const char* str;
+    int8_t precedence;  // higher binds tighter, 0 if not usable in source
+    bool right_assoc;
+    uint8_t flags;
+};
+
+/* Everything the parser needs to know about an operator */
+extern const struct op_info op_table[OP_COUNT];
+
+/* Kernels are numbered by operator and operand types, so a node can keep
+ * the one it runs in a byte */
+#define OP_KERNEL_ID(op, lt, rt) (((op) * VALUE_TYPE_COUNT + (lt)) * VALUE_TYPE_COUNT + (rt))
+#define OP_KERNEL_COUNT OP_KERNEL_ID(OP_COUNT, 0, 0)
+#define OP_KERNEL_DYNAMIC UINT8_MAX // picked from the operand values at run time
+
+/* Kernel of each id, NULL where the operator is not defined for the types */
+extern const op_kernel op_kernels[OP_KERNEL_COUNT];
+
+static inline uint8_t op_kernel_id(enum operator op, enum value_type lt, enum value_type rt)
+{
+    return OP_KERNEL_ID(op, lt, rt);
+}
+
+/* Kernel of `l op r` for operands of types lt and rt, NULL if there is none */
+static inline op_kernel op_kernel_for(enum operator op, enum value_type lt, enum value_type rt)
+{
+    return op_kernels[op_kernel_id(op, lt, rt)];
+}
+
+/* True if the left operand l of a && or || node decides its result, which
+ * is then stored in out. The right operand must not be evaluated, it may
+ * fail where the left one guards against that, as in `x != 0 && 1 / x` */
+static inline bool op_short_circuit(enum operator op, const Value* l, Value* out)
+{
+    if (!(op_table[op].flags & OP_SHORT_CIRCUIT))
+        return false;
+    const bool truth = l->type == VALUE_FLOATING ? l->f64 != 0.0 : l->i64 != 0;
+    if (truth != (op == OP_OR))
+        return false;
+    *out = (Value){.type = VALUE_INTEGER, .i64 = truth};
+    return true;
+}
+
+/* Operator spelled by the one or two chars a, b. *len is set to the number of
+ * chars used, OP_NONE if a does not start an operator */
+enum operator operator_lex(int a, int b, int* len);
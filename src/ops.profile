@@ -0,0 +1,25 @@
+# operator profile, see fuse.h
+# op OP LT RT RUNS
+# pair INNER LT RT OUTER lhs|rhs ZT RUNS: (LT INNER RT) is the lhs or rhs of OUTER,
+#   whose other operand is ZT
+op + int int 10000000
+op + float float 4000000
+op - int int 6000000
+op * int int 4000000
+op * float float 2000000
+op / float float 2000001
+op % int int 8000000
+op == int int 4000000
+op < int int 2000001
+op > int int 6000003
+op & int int 2000000
+op float int int 1
+pair + int int % lhs int 2000000
+pair * int int + lhs int 2000000
+pair * float float + lhs float 2000000
+pair / float float + rhs float 2000000
+pair % int int + rhs int 2000000
+pair % int int == lhs int 2000000
+pair == int int + rhs int 4000000
+pair & int int == lhs int 2000000
+pair float int int / rhs float 1
@@ -1,25 +1,26 @@
 
-#include "common.h"
+#include "batch.h"
 #include "error.h"
-#include "file_stream.h"
-#include "printable.h"
+#include "expr.h"
+#include "flow.h"
+#include "func.h"
+#include "mem.h"
+#include "operator.h"
+#include "profile.h"
+#include "parser.h"
 #include "stack.h"
+#include "str.h"
+#include "symbols.h"
 #include "tokenizer.h"
+#include "trace.h"
+#include "value.h"
 
-#include <assert.h>
-#include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
-#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <unistd.h>
-
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 /* ======= Grammar Rules =======
 
@@ -28,290 +29,426 @@ statement:
     | statement;
 statement
     : expr
-    | assignment;
+    | assignment
+    | if_statement
+    | while_statement
+    | function
+    | RETURN expr;
 assignment
     : IDENTIFIER TYPE ASSIGNMENT expr
+    | IDENTIFIER ASSIGNMENT expr
+if_statement
+    : IF expr block
+    | IF expr block ELSE block
+    | IF expr block ELSE if_statement
+while_statement
+    : WHILE expr block
+block
+    : '{' statements '}'
+    | '{' '}'
+function
+    : FN IDENTIFIER '(' params ')' TYPE block
+    | FN IDENTIFIER '(' ')' TYPE block
+params
+    : params ',' IDENTIFIER TYPE
+    | IDENTIFIER TYPE
+call
+    : IDENTIFIER '(' args ')'
+    | IDENTIFIER '(' ')'
+args
+    : args ',' expr
+    | expr
 
-expr : <implemented without BNF or recursion, standard mathematics rules>
+expr : <implemented without BNF or recursion, standard mathematics rules,
+        a call's arguments are parsed recursively>
 
  ================================ */
 
-void parser_print_position(TokenStream* ts)
+static void count_position(const char* data, const char* end, int* line, int* col)
 {
-    Mfile m = *(ts->m);
-
-    m.pos = 0;
-    int linecount = 0;
-    int col = 0;
-    while (!mfile_eof(&m) && m.pos <= ts->m->pos) {
-        char c = mfile_get(&m);
-        if (c == '\n') {
-            linecount++;
-            col = 0;
+    *line = 1;
+    *col  = 0;
+    for (const char* p = data; p <= end && *p; p++) {
+        if (*p == '\n') {
+            (*line)++;
+            *col = 0;
         } else {
-            col++;
+            (*col)++;
         }
     }
+}
 
-    fprintf(stderr, "\nLine: %d\nCol: %d\n", linecount, col);
+void parser_position(TokenStream* ts, int* line, int* col)
+{
+    // the lexer thread of a pipelined stream may be far ahead of the parser,
+    // so count up to the current token rather than the file cursor
+    const char* data = ts->m->data;
+    const char* end  = tokenstream_cur(ts)->start ? tokenstream_cur(ts)->start : data + ts->m->pos;
+    count_position(data, end, line, col);
 }
 
-enum value_type {
-    VALUE_INTEGER,
-    VALUE_FLOATING,
-};
-
-static const char* value_type_str[] = {
-    [VALUE_INTEGER]  = "VALUE_INTEGER",
-    [VALUE_FLOATING] = "VALUE_FLOATING",
-};
-
-typedef struct value {
-    const char* debug_name;
-    enum value_type type;
-    union {
-        int64_t i64;
-        double f64;
-    };
-} Value;
+void parser_error_position(Parser* p, int* line, int* col)
+{
+    if (p->errors) {
+        *line = p->first_line;
+        *col  = p->first_col;
+    } else if (p->error_at)
+        count_position(p->ts->m->data, p->error_at, line, col);
+    else
+        parser_position(p->ts, line, col);
+}
 
-static void value_print(FILE* out, Value* v)
+/* Like count_position, but for errors and dynamic nodes that come one after
+ * the other in a large input, counts on from the last one */
+static void cursor_position(Parser* p, const char* at, int* line, int* col)
 {
-    switch (v->type) {
-    case VALUE_INTEGER:
-        fprintf(out, "%" PRId64, v->i64);
-        break;
-    case VALUE_FLOATING:
-        fprintf(out, "%lf", v->f64);
-        break;
-    default:
-        fprintf(out, "(bad value)");
-        break;
+    if (!p->cursor.at || at < p->cursor.at) {
+        count_position(p->ts->m->data, at, line, col);
+    } else {
+        *line = p->cursor.line;
+        *col  = p->cursor.col;
+        for (const char* c = p->cursor.at + 1; c <= at && *c; c++) {
+            if (*c == '\n') {
+                (*line)++;
+                *col = 0;
+            } else {
+                (*col)++;
+            }
+        }
     }
+    p->cursor.at   = at;
+    p->cursor.line = *line;
+    p->cursor.col  = *col;
 }
 
-static Value* parse_int(Error* err, TokenStream* ts)
+static bool parse_int(Error* err, TokenStream* ts, Value* v)
 {
-    Token* t = tokenstream_get(err, ts);
-    if (!error_empty(err)) {
-        return NULL;
-    }
-    if (t->type != TOKEN_INTEGER) {
-        error_push(err, "unexpected token type: %s", token_type_str[t->type]);
-        return NULL;
-    }
-    Value* v = calloc(1, sizeof *v);
-    if (!v) {
-        error_push(err, "failed to allocate value: %s", strerror(errno));
-        return NULL;
+    if (tokenstream_cur(ts)->type != TOKEN_INTEGER) {
+        error_push(err, "unexpected token type: %s", token_type_str[tokenstream_cur(ts)->type]);
+        return false;
     }
     v->type = VALUE_INTEGER;
-    assert(errno == 0);
     errno = 0;
-    v->i64= strtol(t->start, NULL, 10);
+    v->i64= strtol(tokenstream_cur(ts)->start, NULL, 10);
     if (errno != 0) {
         error_push(err, "failed to parse int: %s", strerror(errno));
-        return NULL;
+        return false;
     }
-    return v;
+    return tokenstream_advance(err, ts);
 }
 
-static Value* parse_floating(Error* err, TokenStream* ts)
+static bool parse_floating(Error* err, TokenStream* ts, Value* v)
 {
-    Token* t = tokenstream_get(err, ts);
-    if (!error_empty(err))
-        return NULL;
-    if (t->type != TOKEN_FLOATING) {
-        error_push(err, "unexpected token type: %s", token_type_str[t->type]);
-        return NULL;
-    }
-    Value* v = calloc(1, sizeof *v);
-    if (!v) {
-        error_push(err, "failed to allocate value: %s", strerror(errno));
-        return NULL;
+    if (tokenstream_cur(ts)->type != TOKEN_FLOATING) {
+        error_push(err, "unexpected token type: %s", token_type_str[tokenstream_cur(ts)->type]);
+        return false;
     }
     v->type = VALUE_FLOATING;
-    assert(errno == 0);
     errno = 0;
-    v->f64= strtod(t->start, NULL);
+    v->f64= strtod(tokenstream_cur(ts)->start, NULL);
     if (errno != 0) {
         error_push(err, "failed to parse float: %s", strerror(errno));
-        return NULL;
+        return false;
     }
-    return v;
+    return tokenstream_advance(err, ts);
 }
 
-static void conv_int_to_float(Error* err, Value* val)
+/* A string literal without escapes is referenced where it is in the
+ * source, one with escapes is decoded into a copy */
+static bool parse_string(Error* err, Parser* p, Value* v)
 {
-    if (val->type != VALUE_INTEGER) {
-        error_push(err, "conversion from %s to float not implemented", value_type_str[val->type]);
-        return;
+    const Token* t = tokenstream_cur(p->ts);
+    const char* s = t->start + 1; // without the quotes
+    const size_t len = t->end - t->start - 2;
+    if (!memchr(s, '\\', len)) {
+        if (!str_make(err, &p->exprs->strs, s, len, true, v))
+            return false;
+        p->borrowed = p->borrowed || len > VALUE_SMALL_STR;
+        return tokenstream_advance(err, p->ts);
     }
-    val->f64 = (double)val->i64; 
-    val->type = VALUE_FLOATING;
-}
 
-static Value* binary_op(Error* err, Value* lval, Value* rval, Token* op)
-{
-    if ((lval->type != VALUE_INTEGER && lval->type != VALUE_FLOATING)
-     || (rval->type != VALUE_INTEGER && rval->type != VALUE_FLOATING)
-     || op->type    != TOKEN_OPERATOR)
-    {
-        error_push(err, "unexpected token types: %s %s %s",
-                value_type_str[lval->type], value_type_str[rval->type],
-                token_type_str[op->type]);
-        goto fail;
-    }
-
-    if (lval->type == VALUE_FLOATING && rval->type == VALUE_INTEGER) {
-        conv_int_to_float(err, rval);
-    } else if (lval->type == VALUE_INTEGER && rval->type == VALUE_FLOATING) {
-        conv_int_to_float(err, lval);
-    }
-    if (!error_empty(err)) {
-        error_push(err, "binary expression failed");
-        goto fail;
-    }
-
-    Value* result = calloc(1, sizeof *result);
-    if (!result) {
-        error_push(err, "failed to allocate value: %s", strerror(errno));
-        goto fail;
-    }
-
-    //fprintf(stderr, "\ndoing op: %s %c %s", value_type_str[lval->type], op->start[0], value_type_str[rval->type]);
-    if (rval->type == VALUE_INTEGER && lval->type == VALUE_INTEGER) {
-        result->type = VALUE_INTEGER;
-        switch (op->start[0]) {
-        case '+':
-            result->i64 = lval->i64 + rval->i64;
-            break;
-        case '*':
-            result->i64 = lval->i64 * rval->i64;
-            break;
-        case '-':
-            result->i64 = lval->i64 - rval->i64;
-            break;
-        case '/':
-            result->i64 = lval->i64 / rval->i64;
-            break;
+    char* buf = mem_alloc(MEM_PARSER, len);
+    if (!buf) {
+        error_push(err, "failed to allocate string: %s", strerror(errno));
+        return false;
+    }
+    size_t n = 0;
+    bool ok = true;
+    for (size_t i = 0; i < len && ok; i++) {
+        if (s[i] != '\\') {
+            buf[n++] = s[i];
+            continue;
         }
-    } else if (rval->type == VALUE_FLOATING && lval->type == VALUE_FLOATING) {
-        result->type = VALUE_FLOATING;
-        switch (op->start[0]) {
-        case '+':
-            result->f64 = lval->f64 + rval->f64;
-            break;
-        case '*':
-            result->f64 = lval->f64 * rval->f64;
-            break;
-        case '-':
-            result->f64 = lval->f64 - rval->f64;
-            break;
-        case '/':
-            result->f64 = lval->f64 / rval->f64;
-            break;
+        switch (s[++i]) {
+        case 'n':  buf[n++] = '\n'; break;
+        case 't':  buf[n++] = '\t'; break;
+        case 'r':  buf[n++] = '\r'; break;
+        case '0':  buf[n++] = '\0'; break;
+        case '\\': buf[n++] = '\\'; break;
+        case '"':  buf[n++] = '"';  break;
+        default:
+            error_push(err, "unknown escape \\%c in string", s[i]);
+            ok = false;
         }
     }
-    free(op);
-    return result;
+    ok = ok && str_make(err, &p->exprs->strs, buf, n, false, v);
+    mem_free(buf);
+    return ok && tokenstream_advance(err, p->ts);
+}
+
+// pushes return false if the stack could not grow
+#define push_expr(s, id) stack_push((s), (uintptr_t)(id))
+#define pop_expr(s) ((ExprId)(uintptr_t)stack_pop(s))
 
-fail:
-    return NULL;
+// the operator stack holds enum operator values, OP_NONE marks a '('
+#define push_op(s, op) stack_push((s), (uintptr_t)(op))
+#define pop_op(s) ((enum operator)(uintptr_t)stack_pop(s))
+#define top_op(s) ((enum operator)(uintptr_t)stack_top(s))
+#define PAREN_MARK OP_NONE
+
+static bool push_value(Error* err, Stack* value_stack, ExprId id)
+{
+    if (!push_expr(value_stack, id)) {
+        error_push(err, "expression too deep: %zu values", stack_len(value_stack));
+        return false;
+    }
+    return true;
 }
 
-static inline int8_t operator_precedence(Token* op)
+/* at_stack holds the source position of each operator on op_stack, NULL
+ * for a '(' */
+static bool push_operator(Error* err, Stack* op_stack, Stack* at_stack, enum operator op,
+                          const char* at)
 {
-    // wrapped in a function for now because operators longer than 1 char might
-    // be implemented
-    static const int8_t lookup[256] = {
-        ['+'] = -20, ['-'] = -20,
-        ['*'] = -10, ['/'] = -10,
-        ['('] = 128, [')'] = 128
-    };
-    return lookup[(size_t)(op->start[0])];
+    if (!push_op(op_stack, op) || !stack_push(at_stack, at)) {
+        if (stack_len(op_stack) > stack_len(at_stack))
+            (void)pop_op(op_stack);
+        error_push(err, "expression too deep: %zu operators", stack_len(op_stack));
+        return false;
+    }
+    return true;
 }
 
-static Value* parse_expr(Error* err, TokenStream* ts)
+/* Pops an operator and its operands, one for a prefix operator and two
+ * otherwise, and pushes the node combining them. A new node of a type only
+ * known at run time is reported to p->on_dynamic */
+static bool reduce(Error* err, Parser* p, Stack* value_stack, Stack* op_stack, Stack* at_stack)
 {
-    FixedStack op_stack = STACK_INIT;
-    FixedStack value_stack = STACK_INIT;
+    ExprArena* exprs = p->exprs;
+    const enum operator op = pop_op(op_stack);
+    const char* at = stack_pop(at_stack);
+    const size_t operands = op_table[op].flags & OP_UNARY ? 1 : 2;
+    if (stack_len(value_stack) < operands) {
+        error_push(err, "missing operand for %s", op_table[op].str);
+        return false;
+    }
+    ExprId rhs = pop_expr(value_stack);
+    ExprId lhs = operands == 2 ? pop_expr(value_stack) : rhs;
+    const uint32_t len = exprs->len;
+    ExprId id  = expr_binary(err, exprs, op, lhs, rhs);
+    if (id == EXPR_NONE)
+        return false;
+    if (p->on_dynamic && id >= len && exprs->nodes[id].type == EXPR_DYNAMIC) {
+        int line, col;
+        cursor_position(p, at, &line, &col);
+        p->on_dynamic(p->dynamic_user, line, col, op);
+    }
+    return push_value(err, value_stack, id);
+}
 
-    fprintf(stderr, "EXPR START\n");
+/* Pushes the literal node for the current token */
+static bool shift_literal(Error* err, Parser* p, Stack* value_stack)
+{
+    Value v;
+    bool ok;
+    switch (tokenstream_cur(p->ts)->type) {
+    case TOKEN_INTEGER: ok = parse_int(err, p->ts, &v);      break;
+    case TOKEN_STRING:  ok = parse_string(err, p, &v);       break;
+    default:            ok = parse_floating(err, p->ts, &v); break;
+    }
+    if (!ok)
+        return false;
+    ExprId id = expr_literal(err, p->exprs, &v);
+    if (id == EXPR_NONE)
+        return false;
+    return push_value(err, value_stack, id);
+}
+
+/* Pushes the node the variable named by the current token is bound to, or
+ * inside an if or while its variable node */
+static bool shift_variable(Error* err, Parser* p, Stack* value_stack)
+{
+    Token* t = tokenstream_cur(p->ts);
+    Symbol* s = symbol_lookup(p->syms, t->start, t->end - t->start);
+    if (!s || s->value == EXPR_NONE) {
+        error_push(err, "undefined variable " TOKEN_FMT, TOKEN_ARG(t));
+        return false;
+    }
+    ExprId id = s->value;
+    if (p->flow) {
+        const uint32_t slot = flow_slot(err, p->flow, p->exprs, s);
+        if (slot == UINT32_MAX)
+            return false;
+        id = p->flow->vars[slot].node;
+    }
+    if (!push_value(err, value_stack, id))
+        return false;
+    return tokenstream_advance(err, p->ts);
+}
+
+static ExprId parse_expr(Error* err, Parser* p);
+
+/* call : IDENTIFIER '(' [args] ')', of a function defined before or of the
+ * one being defined */
+static bool shift_call(Error* err, Parser* p, Stack* value_stack)
+{
+    TokenStream* ts = p->ts;
+    Token name = *tokenstream_cur(ts);
+    const uint32_t f = func_lookup(p->funcs, name.start, name.end - name.start);
+    if (f == UINT32_MAX) {
+        error_push(err, "undefined function " TOKEN_FMT, TOKEN_ARG(&name));
+        return false;
+    }
+    if (p->call_depth == FLOW_MAX_DEPTH) {
+        error_push(err, "calls nested deeper than %d", FLOW_MAX_DEPTH);
+        return false;
+    }
+    if (!tokenstream_advance(err, ts) || !tokenstream_advance(err, ts)) // name '('
+        return false;
+
+    ExprId args[FUNC_MAX_PARAMS];
+    uint32_t n = 0;
+    bool ok = true;
+    p->call_depth++;
+    if (tokenstream_cur(ts)->type != TOKEN_PAREN_CLOSE) {
+        do {
+            if (n == FUNC_MAX_PARAMS) {
+                error_push(err, "more than %d arguments", FUNC_MAX_PARAMS);
+                ok = false;
+                break;
+            }
+            args[n] = parse_expr(err, p);
+            ok = args[n++] != EXPR_NONE;
+        } while (ok && tokenstream_cur(ts)->type == TOKEN_COMMA && tokenstream_advance(err, ts));
+        ok = ok && error_empty(err);
+    }
+    p->call_depth--;
+    if (!ok)
+        return false;
+    if (tokenstream_cur(ts)->type != TOKEN_PAREN_CLOSE) {
+        error_push(err, "expected , or ) after argument %" PRIu32, n);
+        return false;
+    }
+
+    bool calls;
+    const ExprId id = func_call(err, p->funcs, p->exprs, f, args, n, &calls);
+    if (id == EXPR_NONE)
+        return false;
+    p->calls = p->calls || calls;
+    if (!push_value(err, value_stack, id))
+        return false;
+    return tokenstream_advance(err, ts);
+}
+
+static ExprId parse_expr(Error* err, Parser* p)
+{
+    ExprArena* exprs = p->exprs;
+    TokenStream* ts = p->ts;
+    Stack op_stack = STACK_INIT;
+    Stack at_stack = STACK_INIT;
+    Stack value_stack = STACK_INIT;
+    ExprId result = EXPR_NONE;
+    bool operand = false; // the last token ended an operand
+
+    if (p->print_tokens)
+        fprintf(stderr, "EXPR START\n");
 
     while (1) {
+        if (profile_due())
+            profile_here_("parse");
+        if (!budget_depth(err, &exprs->budget, stack_len(&op_stack) + stack_len(&value_stack)))
+            goto out;
         Token* cur = tokenstream_cur(ts);
-        token_print(err, cur);
-        if (!error_empty(err)) {
-            fprintf(stderr, "failed to print error");
-            exit(1);
+        if (p->print_tokens) {
+            token_print(err, cur);
+            if (!error_empty(err))
+                goto out;
         }
         switch (cur->type) {
         case TOKEN_INTEGER:
-            stack_push(&value_stack, parse_int(err, ts));
-            if (!error_empty(err))
-                goto fail;
-            break;
-
         case TOKEN_FLOATING:
-            stack_push(&value_stack, parse_floating(err, ts));
-            if (!error_empty(err))
-                goto fail;
+        case TOKEN_STRING:
+            if (!shift_literal(err, p, &value_stack))
+                goto out;
+            operand = true;
             break;
 
         case TOKEN_IDENTIFIER:
-            fprintf(stderr, "identifiers not implemented yet\n");
-            exit(FATAL_NOT_IMPLEMENTED);
+            if (tokenstream_peek(ts, 1)->type == TOKEN_PAREN_OPEN) {
+                if (!shift_call(err, p, &value_stack))
+                    goto out;
+            } else if (!shift_variable(err, p, &value_stack)) {
+                goto out;
+            }
+            operand = true;
             break;
 
         case TOKEN_PAREN_OPEN:
-            stack_push(&op_stack, tokenstream_get(err, ts));
-            if (!error_empty(err))
-                goto fail;
+            if (!push_operator(err, &op_stack, &at_stack, PAREN_MARK, NULL))
+                goto out;
+            if (!tokenstream_advance(err, ts))
+                goto out;
+            operand = false;
             break;
 
         case TOKEN_PAREN_CLOSE:
-            while (!stack_empty(&op_stack)
-               && ((Token*)stack_top(&op_stack))->type != TOKEN_PAREN_OPEN)
-            {
-                Value* rval = stack_pop(&value_stack);
-                Value* lval = stack_pop(&value_stack);
-                Token* op   = stack_pop(&op_stack);
-                Value* result = binary_op(err, lval, rval, op);
-                if (!error_empty(err))
-                    goto fail;
-                stack_push(&value_stack, result);
+            while (!stack_empty(&op_stack) && top_op(&op_stack) != PAREN_MARK) {
+                if (!reduce(err, p, &value_stack, &op_stack, &at_stack))
+                    goto out;
             }
-            if (((Token*)stack_top(&op_stack))->type != TOKEN_PAREN_OPEN) {
+            if (stack_empty(&op_stack) && p->call_depth > 0)
+                goto end; // closes the argument list
+            if (stack_empty(&op_stack)) {
                 error_push(err, "mismatched parentheses");
-                return NULL;
-            } else {
-                stack_pop(&op_stack);
+                goto out;
             }
-            tokenstream_advance(err, ts);
-            if (!error_empty(err))
-                goto fail;
-
+            (void)pop_op(&op_stack);
+            (void)stack_pop(&at_stack);
+            if (!tokenstream_advance(err, ts))
+                goto out;
+            operand = true;
             break;
 
         case TOKEN_OPERATOR: {
-            Token* new_op = tokenstream_get(err, ts);
-            if (!error_empty(err))
-                goto fail;
-            if (!stack_empty(&op_stack)) {
-                while (operator_precedence(new_op)
-                     < operator_precedence(stack_top(&op_stack)))
+            const struct op_info* info = &op_table[cur->op];
+            if (info->precedence == 0) {
+                error_push(err, "operator %s can't be used in an expression", info->str);
+                goto out;
+            }
+            if ((info->flags & OP_UNARY) && operand) {
+                error_push(err, "operator %s can't follow an operand", info->str);
+                goto out;
+            }
+            // reduce everything that binds tighter, and equal precedence too
+            // unless the new operator is right associative. A prefix
+            // operator has nothing to its left to reduce
+            while (!(info->flags & OP_UNARY) && !stack_empty(&op_stack)
+                && top_op(&op_stack) != PAREN_MARK)
+            {
+                const int8_t top_precedence = op_table[top_op(&op_stack)].precedence;
+                if (top_precedence < info->precedence
+                 || (top_precedence == info->precedence && info->right_assoc))
                 {
-                    Value* rval   = stack_pop(&value_stack);
-                    Value* lval   = stack_pop(&value_stack);
-                    Token* op     = stack_pop(&op_stack);
-                    Value* result = binary_op(err, lval, rval, op);
-                    if (!error_empty(err))
-                        goto fail;
-                    stack_push(&value_stack, result);
+                    break;
                 }
+                if (!reduce(err, p, &value_stack, &op_stack, &at_stack))
+                    goto out;
             }
-            stack_push(&op_stack, new_op);
+            if (!push_operator(err, &op_stack, &at_stack, cur->op, cur->start))
+                goto out;
+            if (!tokenstream_advance(err, ts))
+                goto out;
+            operand = false;
             break;}
 
         default:
@@ -319,109 +456,691 @@ static Value* parse_expr(Error* err, TokenStream* ts)
         }
     }
 end:
-    while (!stack_empty(&value_stack) && !stack_empty(&op_stack)) {
-        Token* op     = stack_pop(&op_stack);
-        Value* rval   = stack_pop(&value_stack);
-        Value* lval   = stack_pop(&value_stack);
-        Value* result = binary_op(err, lval, rval, op);
-        if (!error_empty(err))
-            goto fail;
-        stack_push(&value_stack, result);
-    }
-    if (stack_len(&value_stack) != 1 && stack_len(&op_stack) != 0) {
+    while (!stack_empty(&op_stack)) {
+        if (top_op(&op_stack) == PAREN_MARK) {
+            error_push(err, "mismatched parentheses");
+            goto out;
+        }
+        if (!reduce(err, p, &value_stack, &op_stack, &at_stack))
+            goto out;
+    }
+    if (stack_len(&value_stack) != 1) {
         error_push(err, "bad expression");
-        goto fail;
+        goto out;
     }
-    fprintf(stderr, "EXPR END\n");
-    return stack_top(&value_stack);
-    
-fail:
-    return NULL;
+    if (p->print_tokens)
+        fprintf(stderr, "EXPR END\n");
+    result = pop_expr(&value_stack);
+
+out:
+    stack_free(&op_stack);
+    stack_free(&at_stack);
+    stack_free(&value_stack);
+    return result;
 }
 
-static Value* parse_statement(Error* err, TokenStream* ts)
+/* Evaluates the root of a top level statement. One with calls in it runs
+ * as code, expr_eval can't follow them */
+static bool eval_root(Error* err, Parser* p, ExprId root, Value* out)
 {
-    if (tokenstream_cur(ts)->type == TOKEN_EOF || !error_empty(err)) {
+    TraceSpan span = trace_begin("eval");
+    const bool ok = p->calls ? flow_eval(err, p->exprs, p->funcs, root, out, &p->error_at)
+                             : expr_eval(err, p->exprs, root, out);
+    trace_end(span);
+    p->calls   = false;
+    p->running = !ok;
+    return ok;
+}
+
+/* Statements of the same shape are batched at the top level only, where
+ * nothing but their results is observed */
+static bool can_batch(const Parser* p)
+{
+    return !p->flow && !p->on_statement && !p->print_tokens;
+}
+
+/* Makes the statement that was just run as root the shape of a new batch */
+static bool batch_begin(Error* err, Parser* p, ExprId root, const BatchScan* scan)
+{
+    if (!p->batch) {
+        p->batch = mem_calloc(MEM_PARSER, 1, sizeof *p->batch);
+        if (!p->batch) {
+            error_push(err, "failed to allocate statement batch: %s", strerror(errno));
+            return false;
+        }
+    }
+    (void)batch_compile(err, p->batch, p->exprs, root, scan);
+    return error_empty(err);
+}
+
+static bool report(Error* err, Parser* p, const char* begin, const char* end);
+
+/* Runs the statements waiting in the batch. If one fails, the error is at
+ * its position and the statement count stops at it. When recovering, it is
+ * reported and the rest of the batch runs */
+static bool batch_run(Error* err, Parser* p)
+{
+    Batch* b = p->batch;
+    const uint64_t next = p->statement;
+    if (b && b->rows > 0 && !budget_charge(err, &p->exprs->budget, (uint64_t)b->rows * b->code_len)) {
+        b->rows = 0;
+        return false;
+    }
+    while (b && b->rows > 0) {
+        uint64_t failed;
+        const char* failed_at;
+        if (batch_flush(err, b, p->exprs, p->on_result, p->user, &failed, &failed_at))
+            break;
+        const uint32_t row = failed - b->first;
+        p->statement = failed;
+        p->error_at  = failed_at;
+        p->running   = true;
+        if (!p->max_errors || !report(err, p, b->starts[row], failed_at + 1)) {
+            b->rows = 0;
+            return false;
+        }
+        batch_drop(b, row + 1);
+    }
+    p->statement = next;
+    return true;
+}
+
+/* Declares a local of a function in locals, which is zero until it is
+ * assigned */
+static Symbol* declare_local(Error* err, ExprArena* exprs, SymbolTable* locals, const Token* name,
+                             enum value_type type)
+{
+    Symbol* s = symbol_define(err, locals, name->start, name->end - name->start);
+    if (!s)
         return NULL;
+    const Value zero = value_zero(type);
+    s->type  = type;
+    s->value = expr_literal(err, exprs, &zero);
+    return s->value == EXPR_NONE ? NULL : s;
+}
+
+/* IDENTIFIER [TYPE] '=' ..., decided without consuming anything */
+static bool is_assignment(TokenStream* ts)
+{
+    Token* next = tokenstream_peek(ts, 1);
+    if (next->type == TOKEN_IDENTIFIER)
+        next = tokenstream_peek(ts, 2);
+    return next->type == TOKEN_OPERATOR && next->op == OP_ASSIGN;
+}
+
+/* assignment : IDENTIFIER [TYPE] ASSIGNMENT expr
+
+ With a type the variable is (re)declared, without one it must exist and the
+ value must fit its type. An int assigned to a float variable is converted */
+static bool parse_assignment(Error* err, Parser* p)
+{
+    ExprArena* exprs = p->exprs;
+    SymbolTable* syms = p->syms;
+    TokenStream* ts = p->ts;
+    Token name = *tokenstream_cur(ts);
+    if (!tokenstream_advance(err, ts))
+        return false;
+
+    Symbol* s = symbol_lookup(syms, name.start, name.end - name.start);
+    enum value_type type = s ? s->type : VALUE_TYPE_COUNT;
+    if (tokenstream_cur(ts)->type == TOKEN_IDENTIFIER) {
+        Token* t = tokenstream_cur(ts);
+        type = value_type_parse(t->start, t->end - t->start);
+        if (type == VALUE_TYPE_COUNT) {
+            error_push(err, "unknown type " TOKEN_FMT, TOKEN_ARG(t));
+            return false;
+        }
+        if (!tokenstream_advance(err, ts))
+            return false;
+    } else if (!s) {
+        error_push(err, "assignment to undeclared variable " TOKEN_FMT, TOKEN_ARG(&name));
+        return false;
+    }
+    // code inside an if, while or function is typed before it runs, so its
+    // variables keep their type. Those of an if or while must exist before
+    // it, a function declares its locals anywhere
+    if (p->flow && !p->func && (!s || s->value == EXPR_NONE)) {
+        error_push(err, TOKEN_FMT " must be declared before the if or while statement",
+                TOKEN_ARG(&name));
+        return false;
+    }
+    if (p->flow && s && type != s->type) {
+        error_push(err, "can't change the type of " TOKEN_FMT " inside an if, while or function",
+                TOKEN_ARG(&name));
+        return false;
+    }
+    if (!tokenstream_advance(err, ts)) // '='
+        return false;
+
+    TraceSpan span = trace_begin("parse");
+    ExprId root = parse_expr(err, p);
+    trace_end(span);
+    if (root == EXPR_NONE)
+        return false;
+
+    // a statically typed value is checked and converted before it runs, one
+    // typed at run time once it is computed
+    const uint8_t root_type = expr_node(exprs, root)->type;
+    if (root_type != EXPR_DYNAMIC && root_type != type) {
+        if (type != VALUE_FLOATING || root_type != VALUE_INTEGER) {
+            error_push(err, "can't assign %s to %s", value_type_name(root_type), value_type_name(type));
+            return false;
+        }
+        root = expr_to_float(err, exprs, root);
+        if (root == EXPR_NONE)
+            return false;
+    }
+
+    if (p->flow) {
+        if (!s && !(s = declare_local(err, exprs, syms, &name, type)))
+            return false;
+        const FlowStmt st = {
+            .kind      = FLOW_ASSIGN,
+            .root      = root,
+            .slot      = flow_slot(err, p->flow, exprs, s),
+            .statement = p->statement,
+            .at        = name.start,
+        };
+        return st.slot != UINT32_MAX && flow_add(err, p->flow, &st) != UINT32_MAX;
+    }
+
+    Value v;
+    if (!eval_root(err, p, root, &v))
+        return false;
+    if (p->on_statement && !p->on_statement(err, p->statement_user, root, false))
+        return false;
+    if (v.type != type) {
+        if (type != VALUE_FLOATING) {
+            error_push(err, "can't assign %s to %s", value_type_name(v.type), value_type_name(type));
+            return false;
+        }
+        v = (Value){.type = VALUE_FLOATING, .f64 = (double)v.i64};
+        root = expr_literal(err, exprs, &v);
+        if (root == EXPR_NONE)
+            return false;
+    }
+
+    if (!s) {
+        s = symbol_define(err, syms, name.start, name.end - name.start);
+        if (!s)
+            return false;
+    }
+    s->type  = type;
+    s->value = root;
+    return true;
+}
+
+static bool parse_statement(Error* err, Parser* p);
+
+/* block : '{' statements '}' */
+static bool parse_block(Error* err, Parser* p)
+{
+    TokenStream* ts = p->ts;
+    if (tokenstream_cur(ts)->type != TOKEN_BLOCK_OPEN) {
+        error_push(err, "expected {");
+        return false;
+    }
+    p->blocks++;
+    p->closed = false;
+    if (!tokenstream_advance(err, ts))
+        return false;
+    while (tokenstream_cur(ts)->type != TOKEN_BLOCK_CLOSE) {
+        if (tokenstream_cur(ts)->type == TOKEN_EOF) {
+            error_push(err, "expected }");
+            return false;
+        }
+        if (!parse_statement(err, p))
+            return false;
+    }
+    p->closed = --p->blocks == 0;
+    return tokenstream_advance(err, ts);
+}
+
+/* if_statement or while_statement, added to p->flow without running */
+static bool parse_control(Error* err, Parser* p)
+{
+    TokenStream* ts = p->ts;
+    Flow* f = p->flow;
+    if (f->depth == FLOW_MAX_DEPTH) {
+        error_push(err, "if and while statements nested deeper than %d", FLOW_MAX_DEPTH);
+        return false;
+    }
+    const bool is_while = tokenstream_cur(ts)->type == TOKEN_WHILE;
+    FlowStmt s = {
+        .kind      = is_while ? FLOW_WHILE : FLOW_IF,
+        .statement = p->statement,
+        .at        = tokenstream_cur(ts)->start,
+    };
+    if (!tokenstream_advance(err, ts))
+        return false;
+    s.root = parse_expr(err, p);
+    if (s.root == EXPR_NONE)
+        return false;
+    if (expr_node(p->exprs, s.root)->type == VALUE_STRING) {
+        error_push(err, "the condition must be a number, not a string");
+        return false;
+    }
+    const uint32_t at = flow_add(err, f, &s);
+    if (at == UINT32_MAX)
+        return false;
+
+    f->depth++;
+    bool ok = parse_block(err, p);
+    if (ok && !is_while) {
+        flow_else(f, at);
+        if (tokenstream_cur(ts)->type == TOKEN_ELSE) {
+            ok = tokenstream_advance(err, ts);
+            if (ok && tokenstream_cur(ts)->type == TOKEN_IF)
+                ok = parse_control(err, p);
+            else if (ok)
+                ok = parse_block(err, p);
+        }
+    }
+    f->depth--;
+    flow_close(f, at);
+    return ok;
+}
+
+/* IDENTIFIER TYPE, a parameter declared in locals */
+static bool parse_param(Error* err, Parser* p, SymbolTable* locals, Token* name)
+{
+    TokenStream* ts = p->ts;
+    *name = *tokenstream_cur(ts);
+    if (name->type != TOKEN_IDENTIFIER || symbol_lookup(locals, name->start, name->end - name->start)) {
+        error_push(err, "bad parameter " TOKEN_FMT, TOKEN_ARG(name));
+        return false;
+    }
+    if (!tokenstream_advance(err, ts))
+        return false;
+    const Token* t = tokenstream_cur(ts);
+    const enum value_type type = value_type_parse(t->start, t->end - t->start);
+    if (t->type != TOKEN_IDENTIFIER || type == VALUE_TYPE_COUNT) {
+        error_push(err, "unknown type " TOKEN_FMT, TOKEN_ARG(t));
+        return false;
+    }
+    return declare_local(err, p->exprs, locals, name, type) && tokenstream_advance(err, ts);
+}
+
+/* function, defined at the top level. Its body sees its parameters and
+ * locals only */
+static bool parse_function(Error* err, Parser* p)
+{
+    TokenStream* ts = p->ts;
+    if (p->flow) {
+        error_push(err, "functions can only be defined at the top level");
+        return false;
+    }
+    if (!tokenstream_advance(err, ts)) // fn
+        return false;
+    Token name = *tokenstream_cur(ts);
+    if (name.type != TOKEN_IDENTIFIER) {
+        error_push(err, "expected a function name");
+        return false;
+    }
+    if (!tokenstream_advance(err, ts))
+        return false;
+    if (tokenstream_cur(ts)->type != TOKEN_PAREN_OPEN) {
+        error_push(err, "expected (");
+        return false;
+    }
+
+    // parameters are declared as locals before the function exists, their
+    // nodes are made once it does
+    SymbolTable locals = SYMBOL_TABLE_INIT;
+    Token params[FUNC_MAX_PARAMS];
+    uint32_t n = 0;
+    bool ok = tokenstream_advance(err, ts);
+    while (ok && tokenstream_cur(ts)->type != TOKEN_PAREN_CLOSE) {
+        if (n > 0 && tokenstream_cur(ts)->type != TOKEN_COMMA) {
+            error_push(err, "expected , or ) after parameter %" PRIu32, n);
+            ok = false;
+        } else if (n == FUNC_MAX_PARAMS) {
+            error_push(err, "more than %d parameters", FUNC_MAX_PARAMS);
+            ok = false;
+        } else {
+            ok = (n == 0 || tokenstream_advance(err, ts))
+              && parse_param(err, p, &locals, &params[n++]);
+        }
+    }
+    ok = ok && tokenstream_advance(err, ts); // ')'
+    const Token* t = tokenstream_cur(ts);
+    const enum value_type ret = value_type_parse(t->start, t->end - t->start);
+    if (ok && (t->type != TOKEN_IDENTIFIER || ret == VALUE_TYPE_COUNT)) {
+        error_push(err, "unknown return type " TOKEN_FMT, TOKEN_ARG(t));
+        ok = false;
     }
+    ok = ok && tokenstream_advance(err, ts);
 
-    Value* result;
+    const uint32_t f = ok ? func_begin(err, p->funcs, name.start, name.end - name.start, ret)
+                          : UINT32_MAX;
+    if (f == UINT32_MAX) {
+        symbol_table_free(&locals);
+        return false;
+    }
+    Func* fn = &p->funcs->funcs[f];
+    for (uint32_t i = 0; i < n && ok; i++) {
+        Symbol* s = symbol_lookup(&locals, params[i].start, params[i].end - params[i].start);
+        ok = flow_slot(err, &fn->body, p->exprs, s) != UINT32_MAX;
+    }
+    fn->params = n;
+
+    SymbolTable* globals = p->syms;
+    p->syms = &locals;
+    p->flow = &fn->body;
+    p->func = fn;
+    TraceSpan span = trace_begin("parse");
+    ok = ok && parse_block(err, p);
+    trace_end(span);
+    p->syms = globals;
+    p->flow = NULL;
+    p->func = NULL;
+    p->calls = false; // calls in the body don't concern the top level
+    for (uint32_t i = 0; i < fn->body.vars_len; i++)
+        fn->body.vars[i].sym = NULL;
+    symbol_table_free(&locals);
+
+    if (!ok) {
+        func_abandon(p->funcs, f);
+        return false;
+    }
+    span = trace_begin("compile");
+    ok = func_end(err, p->funcs, p->exprs, f);
+    trace_end(span);
+    return ok;
+}
+
+/* Parses a whole if or while statement, then compiles and runs it */
+static bool run_control(Error* err, Parser* p)
+{
+    Flow flow = FLOW_INIT;
+    p->flow = &flow;
+    TraceSpan span = trace_begin("parse");
+    bool ok = parse_control(err, p);
+    trace_end(span);
+    p->flow = NULL;
+
+    if (ok && p->on_statement)
+        ok = p->on_statement(err, p->statement_user, EXPR_NONE, false);
+    if (ok) {
+        span = trace_begin("compile");
+        ok = flow_compile(err, &flow, p->exprs);
+        trace_end(span);
+    }
+    if (ok) {
+        span = trace_begin("eval");
+        ok = flow_run(err, &flow, p->exprs, p->funcs, p->on_result, p->user);
+        trace_end(span);
+        if (!ok) {
+            p->error_at = flow.failed_at;
+            p->running  = true;
+        }
+    }
+    if (!flow_finish(err, &flow, p->exprs))
+        ok = false;
+    flow_free(&flow);
+    return ok;
+}
+
+static bool parse_statement(Error* err, Parser* p)
+{
+    TokenStream* ts = p->ts;
+    if (tokenstream_cur(ts)->type == TOKEN_EOF || !error_empty(err)) {
+        return false;
+    }
+
+    TraceSpan span;
+    ExprId root;
+    Value result;
     Token* t = tokenstream_cur(ts);
+    const char* at = t->start;
+    BatchScan scan;
+    bool batchable = false;
+    if (!p->flow) {
+        // parsing is charged too, a long input of functions that are never
+        // called must still end by the deadline
+        if (!budget_charge(err, &p->exprs->budget, 1))
+            return false;
+        p->statement_at = at;
+        p->blocks       = 0;
+        p->closed       = false;
+        p->running      = false;
+        profile_statement(at);
+        // a statement of the shape of the batch joins it, anything else
+        // runs the waiting statements first
+        batchable = can_batch(p) && batch_scan(ts, &scan);
+        if (batchable && p->batch && batch_matches(p->batch, &scan)
+         && batch_add(p->batch, ts, p->statement))
+        {
+            for (uint32_t k = 0; k < scan.len; k++) {
+                if (!tokenstream_advance(err, ts))
+                    return false;
+            }
+            if (p->batch->rows == BATCH_ROWS && !batch_run(err, p))
+                return false;
+            goto statement_end;
+        }
+        if (!batch_run(err, p))
+            return false;
+    }
     switch (t->type) {
+    case TOKEN_IDENTIFIER:
+        if (is_assignment(ts)) {
+            if (!parse_assignment(err, p))
+                return false;
+            break;
+        }
+        // fallthrough
+    case TOKEN_OPERATOR:
+        // only a prefix operator can start an expression
+        if (t->type == TOKEN_OPERATOR && !(op_table[t->op].flags & OP_UNARY))
+            goto syntax_error;
+        // fallthrough
     case TOKEN_INTEGER:
     case TOKEN_FLOATING:
-    case TOKEN_IDENTIFIER:
-        result = parse_expr(err, ts);
-        if (!error_empty(err) || result == NULL) {
+    case TOKEN_STRING:
+    case TOKEN_PAREN_OPEN:
+        if (p->func) {
+            error_push(err, "a function can't print, its expression statements have no effect");
+            return false;
+        }
+        span = trace_begin("parse");
+        root = parse_expr(err, p);
+        trace_end(span);
+        if (!error_empty(err) || root == EXPR_NONE) {
             goto syntax_error;
         }
-        fprintf(stderr, "result: ");
-        value_print(stderr, result);
-        fprintf(stderr, "\n");
+        if (p->flow) {
+            const FlowStmt st = {
+                .kind      = FLOW_EXPR,
+                .root      = root,
+                .statement = p->statement,
+                .at        = at,
+            };
+            if (flow_add(err, p->flow, &st) == UINT32_MAX)
+                return false;
+            break;
+        }
+        if (!eval_root(err, p, root, &result))
+            return false;
+        if (p->on_statement && !p->on_statement(err, p->statement_user, root, true))
+            return false;
+        if (p->on_result)
+            p->on_result(p->user, p->statement, &result);
+        if (batchable && !batch_begin(err, p, root, &scan))
+            return false;
         break;
 
     case TOKEN_IF:
-        fprintf(stderr, "if statements not implemented");
-        exit(FATAL_NOT_IMPLEMENTED);
-        break;
+    case TOKEN_WHILE:
+        // no semicolon after the block
+        return p->flow ? parse_control(err, p) : run_control(err, p);
+
+    case TOKEN_FN:
+        return parse_function(err, p);
+
+    case TOKEN_RETURN: {
+        if (!p->func) {
+            error_push(err, "return outside a function");
+            return false;
+        }
+        if (!tokenstream_advance(err, ts))
+            return false;
+        root = parse_expr(err, p);
+        if (root == EXPR_NONE)
+            return false;
+        const uint8_t type = expr_node(p->exprs, root)->type;
+        if (type != EXPR_DYNAMIC && type != p->func->ret) {
+            if (p->func->ret != VALUE_FLOATING || type != VALUE_INTEGER) {
+                error_push(err, "can't return %s from %s, which returns %s",
+                        value_type_name(type), p->func->name, value_type_name(p->func->ret));
+                return false;
+            }
+            root = expr_to_float(err, p->exprs, root);
+            if (root == EXPR_NONE)
+                return false;
+        }
+        const FlowStmt st = {
+            .kind      = FLOW_RETURN,
+            .root      = root,
+            .statement = p->statement,
+            .at        = at,
+        };
+        if (flow_add(err, p->flow, &st) == UINT32_MAX)
+            return false;
+        break;}
 
     default: syntax_error:
-        error_push(err, "syntax error: unexpected token %s (%s)",
+        error_push(err, "syntax error: unexpected token %s (" TOKEN_FMT ")",
                 token_type_str[tokenstream_cur(ts)->type],
-                token_str(tokenstream_cur(ts)));
-        return NULL;
+                TOKEN_ARG(tokenstream_cur(ts)));
+        return false;
     }
 
+statement_end:
     if (tokenstream_cur(ts)->type != TOKEN_STATEMENT_END) {
         error_push(err, "expected semicolon");
-        return NULL;
+        return false;
     }
-    tokenstream_advance(err, ts);
-
-    return result;
+    p->statement++;
+    if (!p->flow)
+        p->statement_at = NULL;
+    return tokenstream_advance(err, ts);
 }
 
-/* ========================================================================= */
-
-int main(int argc, char** argv)
+/* Hands the error in err of the statement that began at begin to
+ * p->on_error, parsing resumes at end. Keeps the first error and clears
+ * the others. False once max_errors is reached */
+static bool report(Error* err, Parser* p, const char* begin, const char* end)
 {
-    int status = EXIT_SUCCESS;
-
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <file>\n", argv[0]);
-        return EXIT_FAILURE;
+    const char* at = p->error_at ? p->error_at : tokenstream_cur(p->ts)->start;
+    ParseError e = {
+        .kind      = p->ts->failed ? PARSE_ERROR_LEX
+                   : p->running    ? PARSE_ERROR_RUNTIME
+                                   : PARSE_ERROR_SYNTAX,
+        .statement = p->statement,
+        .begin     = begin ? begin : at,
+        .end       = end,
+    };
+    cursor_position(p, at, &e.line, &e.col);
+    if (p->on_error) {
+        // on one line, without the separator an empty last message leaves
+        char buf[512];
+        size_t len = error_format(err, buf, sizeof buf);
+        len = len < sizeof buf ? len : sizeof buf - 1;
+        while (len > 0 && (buf[len - 1] == ' ' || buf[len - 1] == '-' || buf[len - 1] == '\n'))
+            len--;
+        buf[len] = '\0';
+        for (char* c = buf; (c = strchr(c, '\n')); )
+            *c = ' ';
+        e.message = buf;
+        p->on_error(p->error_user, &e);
     }
-
-    Error err = ERROR_INIT;
-    Mfile* m = mfile_open(&err, argv[1]);
-    if (!error_empty(&err)) {
-        error_push(&err, "mfile_open");
-        error_print(&err);
-        return EXIT_FAILURE;
+    if (p->errors++ == 0) {
+        error_append(&p->first, err);
+        p->first_line = e.line;
+        p->first_col  = e.col;
     }
+    error_clear(err);
+    p->error_at = NULL;
+    p->running  = false;
+    return p->errors < p->max_errors;
+}
 
-    TokenStream ts = tokenstream_attach(&err, m);
-    if (!error_empty(&err)) {
-        error_push(&err, "tokenstream_attach");
-        error_print(&err);
-        return EXIT_FAILURE;
+/* Panic mode: reports the statement that failed with err and skips the
+ * rest of it. A statement whose last block was closed already is over.
+ * False if the run has to stop */
+static bool recover(Error* err, Parser* p)
+{
+    TokenStream* ts = p->ts;
+    for (;;) {
+        const bool lexed  = ts->failed;
+        const char* at    = p->error_at ? p->error_at : tokenstream_cur(ts)->start;
+        const char* begin = lexed && p->closed ? at : p->statement_at;
+        Error e = ERROR_INIT;
+        error_append(&e, err);
+        bool skipped = true;
+        if (lexed || p->blocks > 0 || !p->closed) {
+            skipped = tokenstream_skip_statement(err, ts, p->blocks);
+            if (!skipped && !ts->failed) {
+                error_clear(&e);
+                return false;
+            }
+        }
+        // expression statements are counted, an if or while statement or a
+        // function that failed once its last block was closed isn't
+        const bool counted = p->closed;
+        const bool next_failed = ts->failed;
+        ts->failed  = lexed;
+        p->error_at = at;
+        if (!report(&e, p, begin, tokenstream_cur(ts)->start))
+            return false;
+        ts->failed = next_failed;
+        if (!counted)
+            p->statement++;
+        p->statement_at = NULL;
+        p->blocks       = 0;
+        p->closed       = false;
+        p->call_depth   = 0;
+        p->calls        = false;
+        if (skipped)
+            return true;
+        // the lexer failed on the first token after the skipped statement,
+        // which fails with it
     }
+}
 
-    while (!mfile_eof(m)) {
-        parse_statement(&err, &ts);
-        if (!error_empty(&err)) {
-            error_print(&err);
-            parser_print_position(&ts);
-            return EXIT_FAILURE;
+bool parser_run(Error* err, Parser* p)
+{
+    bool ok = true;
+    while (ok && tokenstream_cur(p->ts)->type != TOKEN_EOF) {
+        ok = parse_statement(err, p) && error_empty(err);
+        // running out of a budget ends the run, whatever max_errors says
+        if (!ok && p->errors < p->max_errors && !p->exprs->budget.exceeded
+         && !mem_budget_exceeded())
+        {
+            ok = recover(err, p);
         }
     }
 
-    mfile_close(&err, m);
-    if (!error_empty(&err)) {
-        error_push(&err, "mfile_close");
-        error_print(&err);
-        return EXIT_FAILURE;
+    // statements still waiting came before whatever stopped the run, if
+    // one of them fails that is the error to report
+    Error batch_err = ERROR_INIT;
+    if (!batch_run(&batch_err, p)) {
+        error_clear(err);
+        error_append(err, &batch_err);
+        ok = false;
     }
-
-    return status;
+    if (p->batch) {
+        batch_free(p->batch);
+        mem_free(p->batch);
+        p->batch = NULL;
+    }
+    if (p->errors) {
+        if (error_empty(err))
+            error_append(err, &p->first);
+        error_clear(&p->first);
+        ok = false;
+    }
+    return ok;
 }
+
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "expr.h"
+#include "symbols.h"
+#include "value.h"
+
+struct token_stream;
+struct flow;
+struct func;
+struct func_table;
+struct batch;
+
+/* Kinds of errors parser_run can recover from */
+enum parse_error_kind {
+    PARSE_ERROR_LEX,     // the lexer failed on a token
+    PARSE_ERROR_SYNTAX,  // a statement can't be parsed, or its types don't fit
+    PARSE_ERROR_RUNTIME, // a statement failed while it ran
+    PARSE_ERROR_KIND_COUNT
+};
+
+/* A failed statement that parser_run skipped */
+typedef struct parse_error {
+    enum parse_error_kind kind;
+    uint64_t statement;  // its index
+    const char* begin;   // its first byte
+    const char* end;     // where parsing resumed after it
+    int line;            // where the error was found
+    int col;
+    const char* message;
+} ParseError;
+
+/* Everything a run of the parser reads and writes. Nothing is kept in globals,
+ * so parsers with their own arena and symbol table can run on separate
+ * threads */
+typedef struct parser {
+    struct token_stream* ts;
+    ExprArena* exprs;
+    SymbolTable* syms;
+
+    // called with the value of every expression statement, may be NULL
+    void (*on_result)(void* user, uint64_t statement, const Value* v);
+    void* user;
+
+    uint64_t statement; // index of the current statement, counted up from
+                        // where the caller left it
+
+    // called with the root of every statement once it has been evaluated,
+    // print is false for assignments. root is EXPR_NONE for an if or while
+    // statement, before it runs. May be NULL
+    bool (*on_statement)(Error* err, void* user, ExprId root, bool print);
+    void* statement_user;
+
+    bool print_tokens; // dump the tokens of each expression to stderr
+
+    // called once for every node created whose operand types are only known
+    // when it runs, see EXPR_DYNAMIC, with the position of its operator.
+    // May be NULL
+    void (*on_dynamic)(void* user, int line, int col, enum operator op);
+    void* dynamic_user;
+
+    struct func_table* funcs; // functions defined so far
+
+    struct flow* flow;    // if, while or function being parsed, else NULL
+    struct func* func;    // function being parsed, else NULL
+    bool calls;           // a call that wasn't inlined was parsed since the
+                          // last top level statement ran
+    uint32_t call_depth;  // calls whose arguments are being parsed
+    const char* error_at; // where a statement inside an if, while or
+                          // function failed
+    bool borrowed;        // a string literal points into the input of ts,
+                          // which must stay open as long as exprs is used
+    struct batch* batch;  // top level statements waiting to run together,
+                          // see batch.h. Owned by parser_run
+
+    // panic mode recovery, see parser_run. Errors past max_errors stop the
+    // run, 0 stops at the first one without calling on_error
+    uint32_t max_errors;
+    void (*on_error)(void* user, const ParseError* e);
+    void* error_user;
+    uint32_t errors;            // statements skipped so far
+    Error first;                // the first of their errors
+    int first_line, first_col;
+    const char* statement_at;   // top level statement being parsed, NULL
+                                // once it is complete
+    uint32_t blocks;            // '{' open in it
+    bool closed;                // its last block was closed
+    bool running;               // the error happened while it ran
+    struct {
+        const char* at;
+        int line, col;
+    } cursor;                   // position of the last error or dynamic
+                                // node, counted on from there for the next
+} Parser;
+
+/* Parses and runs statements until TOKEN_EOF. Stops at the first error, the
+ * current token of p->ts is where it happened.
+ * With max_errors set, a failed statement is reported to on_error and
+ * skipped up to its ';', or the '}' of its outermost block, and parsing
+ * resumes after it. Once max_errors statements failed the run stops. The
+ * run fails with the first error if there was any */
+bool parser_run(Error* err, Parser* p);
+
+/* Line and column, both counted from 1, of the current token of ts */
+void parser_position(struct token_stream* ts, int* line, int* col);
+
+/* Line and column of the error parser_run stopped at. That is the current
+ * token, unless the error happened while an if or while statement or a
+ * function ran, or the run recovered from errors and this is the first */
+void parser_error_position(Parser* p, int* line, int* col);
@@ -0,0 +1,599 @@
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "error.h"
+#include "expr.h"
+#include "flow.h"
+#include "func.h"
+#include "mem.h"
+#include "operator.h"
+#include "profile.h"
+
+#define PROFILE_MAX_DEPTH 64    // innermost frames kept per sample
+#define PROFILE_TEXT 40         // bytes of statement text or function name
+#define PROFILE_REPORT_ROWS 20
+#define PROFILE_MIN_BUCKETS 256
+#define PROFILE_WHAT 3          // operators listed per statement
+#define PROFILE_MIN_CPU 0.1     // seconds before a low sample rate is reported
+
+/* A function or a statement. Samples refer to them by index */
+struct site {
+    const char* ptr;         // source position until it is resolved, else NULL
+    bool func;               // text is a function name
+    int line;                // 0 if the position is unknown
+    int col;
+    char text[PROFILE_TEXT];
+};
+
+/* A distinct stack and how often it was sampled. Its frames are pairs of
+ * function and statement sites, outermost first */
+struct stack {
+    uint32_t first; // in frames
+    uint32_t depth;
+    const char* what;
+    uint64_t count;
+};
+
+/* Pointer to site index, or a hash of frames to stack index */
+struct bucket {
+    uint64_t key;
+    uint32_t index;
+};
+
+struct table {
+    struct bucket* buckets; // index UINT32_MAX marks an empty bucket
+    uint32_t cap;           // power of two
+    uint32_t len;
+};
+
+bool profile_enabled = false;
+_Atomic uint32_t profile_ticks_;
+const char* profile_at_;
+
+static struct profile {
+    int hz;            // requested, the timer may deliver fewer
+    double cpu;        // seconds of CPU time while the timer ran
+    uint64_t samples;
+    uint64_t dropped; // lost to failed allocations
+
+    struct site* sites;
+    uint32_t sites_len;
+    uint32_t sites_cap;
+    struct table site_map; // sites not resolved yet, by pointer
+    uint32_t main;         // site of the top level, UINT32_MAX until needed
+
+    struct stack* stacks;
+    uint32_t stacks_len;
+    uint32_t stacks_cap;
+    struct table stack_map;
+    uint32_t* frames;
+    uint32_t frames_len;
+    uint32_t frames_cap;
+
+    struct sigaction old_action;
+} prof = {.main = UINT32_MAX};
+
+static double cpu_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void on_sigprof(int sig)
+{
+    (void)sig;
+    atomic_fetch_add_explicit(&profile_ticks_, 1, memory_order_relaxed);
+}
+
+bool profile_start(Error* err, int hz)
+{
+    prof.hz = hz;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = on_sigprof;
+    sa.sa_flags   = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &prof.old_action) == -1) {
+        error_push(err, "failed to install SIGPROF handler: %s", strerror(errno));
+        return false;
+    }
+    const long us = 1000000 / hz > 0 ? 1000000 / hz : 1;
+    const struct itimerval it = {
+        .it_interval = {.tv_sec = us / 1000000, .tv_usec = us % 1000000},
+        .it_value    = {.tv_sec = us / 1000000, .tv_usec = us % 1000000},
+    };
+    if (setitimer(ITIMER_PROF, &it, NULL) == -1) {
+        error_push(err, "failed to start profiling timer: %s", strerror(errno));
+        sigaction(SIGPROF, &prof.old_action, NULL);
+        return false;
+    }
+    prof.cpu        = cpu_seconds();
+    profile_enabled = true;
+    return true;
+}
+
+void profile_stop(void)
+{
+    if (!profile_enabled)
+        return;
+    const struct itimerval off = {0};
+    setitimer(ITIMER_PROF, &off, NULL);
+    prof.cpu = cpu_seconds() - prof.cpu;
+    sigaction(SIGPROF, &prof.old_action, NULL);
+    atomic_store_explicit(&profile_ticks_, 0, memory_order_relaxed);
+    profile_enabled = false;
+}
+
+/* ======= Recording ======= */
+
+static uint64_t mix(uint64_t h, uint64_t x)
+{
+    h = (h ^ x) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+}
+
+static bool grow(void** buf, uint32_t* cap, uint32_t len, size_t size)
+{
+    if (len < *cap)
+        return true;
+    const uint32_t n = *cap ? *cap * 2 : 64;
+    void* p = mem_realloc(MEM_PROFILE, *buf, (size_t)n * size);
+    if (!p)
+        return false;
+    *buf = p;
+    *cap = n;
+    return true;
+}
+
+/* Bucket holding key, or the empty one where it goes. The table must have
+ * room */
+static struct bucket* table_find(struct table* t, uint64_t key,
+                                 bool (*same)(uint32_t index, const void* arg), const void* arg)
+{
+    uint32_t i = mix(0, key) & (t->cap - 1);
+    while (t->buckets[i].index != UINT32_MAX
+       && !(t->buckets[i].key == key && same(t->buckets[i].index, arg)))
+    {
+        i = (i + 1) & (t->cap - 1);
+    }
+    return &t->buckets[i];
+}
+
+static bool table_reserve(struct table* t)
+{
+    if (t->len < t->cap / 2)
+        return true;
+    const uint32_t cap = t->cap ? t->cap * 2 : PROFILE_MIN_BUCKETS;
+    struct bucket* buckets = mem_alloc(MEM_PROFILE, cap * sizeof *buckets);
+    if (!buckets)
+        return false;
+    for (uint32_t i = 0; i < cap; i++)
+        buckets[i].index = UINT32_MAX;
+    for (uint32_t i = 0; i < t->cap; i++) {
+        const struct bucket* b = &t->buckets[i];
+        if (b->index == UINT32_MAX)
+            continue;
+        uint32_t j = mix(0, b->key) & (cap - 1);
+        while (buckets[j].index != UINT32_MAX)
+            j = (j + 1) & (cap - 1);
+        buckets[j] = *b;
+    }
+    mem_free(t->buckets);
+    t->buckets = buckets;
+    t->cap     = cap;
+    return true;
+}
+
+static bool any_site(uint32_t index, const void* arg)
+{
+    (void)index, (void)arg;
+    return true;
+}
+
+static uint32_t site_add(const char* ptr, bool func, const char* text)
+{
+    if (!grow((void**)&prof.sites, &prof.sites_cap, prof.sites_len, sizeof *prof.sites))
+        return UINT32_MAX;
+    struct site* s = &prof.sites[prof.sites_len];
+    *s = (struct site){.ptr = func ? NULL : ptr, .func = func};
+    if (text)
+        snprintf(s->text, sizeof s->text, "%s", text);
+    return prof.sites_len++;
+}
+
+/* Site of a source position, or of the function called name. Names are
+ * copied right away, the function table may be gone by the time the
+ * profile is written */
+static uint32_t site_of(const char* ptr, bool func)
+{
+    if (!ptr)
+        return site_add(NULL, func, func ? "?" : NULL);
+    if (!table_reserve(&prof.site_map))
+        return UINT32_MAX;
+    struct bucket* b = table_find(&prof.site_map, (uintptr_t)ptr, any_site, NULL);
+    if (b->index == UINT32_MAX) {
+        b->index = site_add(ptr, func, func ? ptr : NULL);
+        if (b->index == UINT32_MAX)
+            return UINT32_MAX;
+        b->key = (uintptr_t)ptr;
+        prof.site_map.len++;
+    }
+    return b->index;
+}
+
+struct stack_key {
+    const uint32_t* frames;
+    uint32_t depth;
+    const char* what;
+};
+
+static bool same_stack(uint32_t index, const void* arg)
+{
+    const struct stack_key* k = arg;
+    const struct stack* s = &prof.stacks[index];
+    return s->depth == k->depth && s->what == k->what
+        && memcmp(&prof.frames[s->first], k->frames, 2 * k->depth * sizeof *k->frames) == 0;
+}
+
+static void record(const uint32_t* frames, uint32_t depth, const char* what, uint32_t ticks)
+{
+    prof.samples += ticks;
+    uint64_t h = mix((uintptr_t)what, depth);
+    for (uint32_t i = 0; i < 2 * depth; i++) {
+        if (frames[i] == UINT32_MAX) {
+            prof.dropped += ticks;
+            return;
+        }
+        h = mix(h, frames[i]);
+    }
+    if (!table_reserve(&prof.stack_map)) {
+        prof.dropped += ticks;
+        return;
+    }
+    const struct stack_key k = {frames, depth, what};
+    struct bucket* b = table_find(&prof.stack_map, h, same_stack, &k);
+    if (b->index == UINT32_MAX) {
+        while (prof.frames_len + 2 * depth > prof.frames_cap) {
+            if (!grow((void**)&prof.frames, &prof.frames_cap, prof.frames_cap,
+                      sizeof *prof.frames))
+            {
+                prof.dropped += ticks;
+                return;
+            }
+        }
+        if (!grow((void**)&prof.stacks, &prof.stacks_cap, prof.stacks_len, sizeof *prof.stacks)) {
+            prof.dropped += ticks;
+            return;
+        }
+        memcpy(&prof.frames[prof.frames_len], frames, 2 * depth * sizeof *frames);
+        prof.stacks[prof.stacks_len] = (struct stack){
+            .first = prof.frames_len,
+            .depth = depth,
+            .what  = what,
+        };
+        prof.frames_len += 2 * depth;
+        b->key   = h;
+        b->index = prof.stacks_len++;
+        prof.stack_map.len++;
+    }
+    prof.stacks[b->index].count += ticks;
+}
+
+static uint32_t main_site(void)
+{
+    if (prof.main == UINT32_MAX)
+        prof.main = site_add(NULL, true, "main");
+    return prof.main;
+}
+
+void profile_here_(const char* what)
+{
+    const uint32_t ticks = atomic_exchange_explicit(&profile_ticks_, 0, memory_order_relaxed);
+    if (ticks == 0 || !profile_enabled)
+        return;
+    const uint32_t frames[2] = {main_site(), site_of(profile_at_, false)};
+    record(frames, 1, what, ticks);
+}
+
+/* Position of the statement instruction pc of code belongs to, that of the
+ * top level statement for the code flow_eval makes */
+static const char* statement_at(const Flow* code, uint32_t pc)
+{
+    if (pc < code->code_len && code->code[pc].stmt < code->len && code->stmts[code->code[pc].stmt].at)
+        return code->stmts[code->code[pc].stmt].at;
+    return profile_at_;
+}
+
+static const char* insn_what(const ExprArena* a, const FlowInsn* in)
+{
+    switch (in->op) {
+    case FLOW_EVAL:
+    case FLOW_EVAL_ONCE:
+    case FLOW_EVAL_FUSED:
+        return op_table[a->nodes[in->node].op].str;
+    case FLOW_STORE:
+        return "store";
+    case FLOW_PRINT:
+        return "print";
+    case FLOW_BRANCH:
+    case FLOW_JUMP:
+    case FLOW_TEST:
+        return "branch";
+    case FLOW_CALL:
+    case FLOW_CALL_ONCE:
+        return "call";
+    default:
+        return "return";
+    }
+}
+
+void profile_flow_(const FuncTable* funcs, const ExprArena* a, const Flow* code, uint32_t pc)
+{
+    const uint32_t ticks = atomic_exchange_explicit(&profile_ticks_, 0, memory_order_relaxed);
+    if (ticks == 0 || !profile_enabled)
+        return;
+
+    // frame 0 is the top level, frame i the function frames[i - 1] called.
+    // Each runs the statement of its call, the innermost one pc
+    uint32_t frames[2 * PROFILE_MAX_DEPTH];
+    const uint32_t n = funcs ? funcs->frames_len : 0;
+    const uint32_t skip = n + 1 > PROFILE_MAX_DEPTH ? n + 1 - PROFILE_MAX_DEPTH : 0;
+    uint32_t depth = 0;
+    for (uint32_t i = skip; i <= n; i++) {
+        const Flow* c = i < n ? funcs->frames[i].code : code;
+        const uint32_t at = i < n ? funcs->frames[i].pc - 1 : pc;
+        frames[2 * depth]     = i == 0 ? main_site()
+                              : site_of(funcs->funcs[a->nodes[funcs->frames[i - 1].call].lhs].name, true);
+        frames[2 * depth + 1] = site_of(statement_at(c, at), false);
+        depth++;
+    }
+    record(frames, depth, insn_what(a, &code->code[pc]), ticks);
+}
+
+/* ======= Positions ======= */
+
+static int by_ptr(const void* a, const void* b)
+{
+    const char* x = prof.sites[*(const uint32_t*)a].ptr;
+    const char* y = prof.sites[*(const uint32_t*)b].ptr;
+    return (x > y) - (x < y);
+}
+
+/* Copies the statement at s to text, up to its end or the end of the line,
+ * with runs of blanks as one space */
+static void statement_text(char* text, const char* s, const char* end)
+{
+    size_t n = 0;
+    bool blank = false;
+    for (; s < end && *s != '\n' && *s != '{' && n < PROFILE_TEXT - 1; s++) {
+        if (*s == ' ' || *s == '\t' || *s == '\r') {
+            blank = n > 0;
+            continue;
+        }
+        if (blank && n < PROFILE_TEXT - 2)
+            text[n++] = ' ';
+        blank = false;
+        text[n++] = *s;
+        if (*s == ';')
+            break;
+    }
+    text[n] = '\0';
+}
+
+void profile_resolve(const char* begin, const char* end)
+{
+    if (prof.site_map.len == 0)
+        return;
+    uint32_t* order = mem_alloc(MEM_PROFILE, prof.site_map.len * sizeof *order);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < prof.site_map.cap && order; i++) {
+        const uint32_t s = prof.site_map.buckets[i].index;
+        if (s != UINT32_MAX && !prof.sites[s].func && prof.sites[s].ptr >= begin
+         && prof.sites[s].ptr < end)
+        {
+            order[n++] = s;
+        }
+    }
+    if (order) {
+        // one pass over the source for all positions
+        qsort(order, n, sizeof *order, by_ptr);
+        const char* p = begin;
+        const char* line_start = begin;
+        int line = 1;
+        for (uint32_t i = 0; i < n; i++) {
+            struct site* s = &prof.sites[order[i]];
+            const char* nl;
+            while ((nl = memchr(p, '\n', s->ptr - p))) {
+                line++;
+                p = line_start = nl + 1;
+            }
+            p = s->ptr;
+            s->line = line;
+            s->col  = s->ptr - line_start + 1;
+            statement_text(s->text, s->ptr, end);
+        }
+        mem_free(order);
+    }
+
+    // positions elsewhere can't be looked at anymore either, whatever
+    // comes next may reuse the addresses
+    for (uint32_t i = 0; i < prof.site_map.cap; i++) {
+        const uint32_t s = prof.site_map.buckets[i].index;
+        if (s != UINT32_MAX)
+            prof.sites[s].ptr = NULL;
+        prof.site_map.buckets[i].index = UINT32_MAX;
+    }
+    prof.site_map.len = 0;
+}
+
+/* ======= Output ======= */
+
+struct row {
+    uint32_t site;
+    uint32_t func;
+    uint64_t self;
+    uint64_t total;
+    uint64_t seen; // stack that last counted total
+};
+
+static int by_self(const void* a, const void* b)
+{
+    const struct row* x = a;
+    const struct row* y = b;
+    if (x->self != y->self)
+        return x->self < y->self ? 1 : -1;
+    if (x->total != y->total)
+        return x->total < y->total ? 1 : -1;
+    return (x->site > y->site) - (x->site < y->site);
+}
+
+static void print_position(FILE* out, const struct site* s)
+{
+    if (s->line)
+        fprintf(out, "%d:%d", s->line, s->col);
+    else
+        fprintf(out, "?");
+}
+
+/* Operators the samples of the statement at site were spent in */
+static void print_what(FILE* out, uint32_t site, uint64_t self)
+{
+    struct { const char* what; uint64_t count; } top[PROFILE_WHAT + 1] = {{0}};
+    uint32_t len = 0;
+    // stacks are few compared to samples, a scan per row is cheap
+    for (uint32_t i = 0; i < prof.stacks_len; i++) {
+        const struct stack* s = &prof.stacks[i];
+        if (prof.frames[s->first + 2 * s->depth - 1] != site)
+            continue;
+        uint32_t j = 0;
+        while (j < len && top[j].what != s->what)
+            j++;
+        if (j == len) {
+            if (len == PROFILE_WHAT + 1)
+                continue;
+            top[len++] = (typeof(top[0])){s->what, 0};
+        }
+        top[j].count += s->count;
+    }
+    for (uint32_t i = 0; i < len && i < PROFILE_WHAT; i++) {
+        uint32_t max = i;
+        for (uint32_t j = i + 1; j < len; j++) {
+            if (top[j].count > top[max].count)
+                max = j;
+        }
+        const typeof(top[0]) t = top[i];
+        top[i]   = top[max];
+        top[max] = t;
+        fprintf(out, "%s%s %.0f%%", i ? ", " : "  ", top[i].what, 100.0 * top[i].count / self);
+    }
+}
+
+static bool write_report(Error* err, FILE* out)
+{
+    struct row* rows = mem_calloc(MEM_PROFILE, prof.sites_len + 1, sizeof *rows);
+    if (!rows) {
+        error_push(err, "failed to allocate profile report: %s", strerror(errno));
+        return false;
+    }
+    for (uint32_t i = 0; i < prof.sites_len; i++)
+        rows[i] = (struct row){.site = i, .func = UINT32_MAX, .seen = UINT64_MAX};
+    for (uint32_t i = 0; i < prof.stacks_len; i++) {
+        const struct stack* s = &prof.stacks[i];
+        const uint32_t* f = &prof.frames[s->first];
+        for (uint32_t d = 0; d < s->depth; d++) {
+            struct row* r = &rows[f[2 * d + 1]];
+            r->func = f[2 * d];
+            if (r->seen != i) {
+                // a recursive call counts once
+                r->total += s->count;
+                r->seen   = i;
+            }
+        }
+        rows[f[2 * s->depth - 1]].self += s->count;
+    }
+    qsort(rows, prof.sites_len, sizeof *rows, by_self);
+
+    const double samples = prof.samples ? prof.samples : 1;
+    // the timer fires at most once per kernel tick, so the rate that was
+    // asked for may not be the one samples were taken at
+    const double rate = prof.cpu > 0 ? prof.samples / prof.cpu : 0.0;
+    fprintf(out, "profile: %" PRIu64 " samples over %.2f s of CPU time, %.0f per second",
+            prof.samples, prof.cpu, rate);
+    if (prof.cpu >= PROFILE_MIN_CPU && rate < 0.8 * prof.hz)
+        fprintf(out, " (the timer can't deliver the %d asked for)", prof.hz);
+    if (prof.dropped)
+        fprintf(out, ", %" PRIu64 " dropped", prof.dropped);
+    fprintf(out, "\n   self  total  position  function      statement\n");
+    for (uint32_t i = 0; i < prof.sites_len && i < PROFILE_REPORT_ROWS; i++) {
+        const struct row* r = &rows[i];
+        const struct site* s = &prof.sites[r->site];
+        if (s->func || r->total == 0)
+            continue;
+        fprintf(out, " %5.1f%% %5.1f%%  ", 100.0 * r->self / samples, 100.0 * r->total / samples);
+        char pos[32];
+        if (s->line)
+            snprintf(pos, sizeof pos, "%d:%d", s->line, s->col);
+        else
+            snprintf(pos, sizeof pos, "?");
+        fprintf(out, "%-8s  %-12s  %-*s", pos,
+                r->func != UINT32_MAX ? prof.sites[r->func].text : "?",
+                PROFILE_TEXT, s->text[0] ? s->text : "?");
+        if (r->self)
+            print_what(out, r->site, r->self);
+        fprintf(out, "\n");
+    }
+    mem_free(rows);
+    return true;
+}
+
+static bool write_folded(Error* err, const char* path)
+{
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        error_push(err, "failed to open %s: %s", path, strerror(errno));
+        return false;
+    }
+    for (uint32_t i = 0; i < prof.stacks_len; i++) {
+        const struct stack* s = &prof.stacks[i];
+        const uint32_t* f = &prof.frames[s->first];
+        for (uint32_t d = 0; d < s->depth; d++) {
+            fprintf(out, "%s:", prof.sites[f[2 * d]].text);
+            print_position(out, &prof.sites[f[2 * d + 1]]);
+            fputc(';', out);
+        }
+        fprintf(out, "%s %" PRIu64 "\n", s->what, s->count);
+    }
+    bool ok = !ferror(out);
+    if (fclose(out) != 0)
+        ok = false;
+    if (!ok)
+        error_push(err, "failed to write %s: %s", path, strerror(errno));
+    return ok;
+}
+
+bool profile_write(Error* err, FILE* report, const char* folded_path)
+{
+    if (!write_report(err, report))
+        return false;
+    return !folded_path || write_folded(err, folded_path);
+}
+
+void profile_free(void)
+{
+    profile_stop();
+    mem_free(prof.sites);
+    mem_free(prof.site_map.buckets);
+    mem_free(prof.stacks);
+    mem_free(prof.stack_map.buckets);
+    mem_free(prof.frames);
+    prof = (struct profile){.main = UINT32_MAX};
+    profile_at_ = NULL;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "error.h"
+
+/* Sampling profiler for lang --profile. A SIGPROF interval timer runs on
+ * the CPU time of the process, and its handler does nothing but count a
+ * tick. The interpreter polls the count between instructions, so the
+ * sample is taken on its own thread with everything in a consistent state:
+ * the statement running in every function frame, from the top level
+ * statement down, plus the operator being computed. Ticks that arrive while
+ * a statement is parsed are counted as "parse".
+ *
+ * Source positions are kept as pointers until profile_resolve turns them
+ * into line, column and statement text, which must happen before the
+ * source is closed.
+ *
+ * When the profiler is off a poll is one load and a predictable branch. */
+
+#define PROFILE_DEFAULT_HZ 1000
+
+extern bool profile_enabled;
+extern _Atomic uint32_t profile_ticks_;
+extern const char* profile_at_;
+
+struct expr_arena;
+struct flow;
+struct func_table;
+
+/* Starts sampling hz times per second of CPU time. The timer fires at most
+ * once per kernel tick, so the rate may be lower, and the report gives the
+ * rate samples were actually taken at */
+bool profile_start(Error* err, int hz);
+
+/* Stops the timer, the samples are kept until profile_free */
+void profile_stop(void);
+
+/* Called by the parser with the position of each top level statement it
+ * runs */
+static inline void profile_statement(const char* at)
+{
+    if (__builtin_expect(profile_enabled, 0))
+        profile_at_ = at;
+}
+
+static inline bool profile_due(void)
+{
+    return __builtin_expect(atomic_load_explicit(&profile_ticks_, memory_order_relaxed) != 0, 0);
+}
+
+/* Records the pending ticks at the top level statement, what is a string
+ * literal naming the work being done */
+void profile_here_(const char* what);
+
+/* Records the pending ticks at instruction pc of code, with the call stack
+ * of funcs, which may be NULL */
+void profile_flow_(const struct func_table* funcs, const struct expr_arena* a,
+                   const struct flow* code, uint32_t pc);
+
+/* Gives the positions in [begin, end) their line, column and text, counted
+ * from begin */
+void profile_resolve(const char* begin, const char* end);
+
+/* Prints the statements with the most samples to report, and writes every
+ * sampled stack to folded_path in the collapsed format of flamegraph.pl if
+ * it isn't NULL */
+bool profile_write(Error* err, FILE* report, const char* folded_path);
+
+void profile_free(void);
@@ -0,0 +1,210 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "mem.h"
+#include "results.h"
+#include "value.h"
+
+_Static_assert(sizeof(struct result_header) % 8 == 0, "header keeps 8-byte alignment");
+_Static_assert(sizeof(struct result_block_header) % 8 == 0, "header keeps 8-byte alignment");
+
+struct result_writer {
+    int fd;
+    uint32_t rows;
+    uint64_t payload[RESULT_BLOCK_ROWS];
+    uint64_t statement[RESULT_BLOCK_ROWS];
+    uint8_t tag[RESULT_BLOCK_ROWS];
+};
+
+static size_t pad8(size_t n)
+{
+    return (8 - n % 8) % 8;
+}
+
+/* Writes all of iov, retrying short writes */
+static bool write_all(Error* err, int fd, struct iovec* iov, int count)
+{
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            error_push(err, "failed to write results: %s", strerror(errno));
+            return false;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static bool result_flush(Error* err, ResultWriter* w)
+{
+    if (w->rows == 0)
+        return true;
+    static const uint8_t zeros[8];
+    struct result_block_header h = {.magic = RESULT_BLOCK_MAGIC, .rows = w->rows};
+    struct iovec iov[] = {
+        {&h, sizeof h},
+        {w->payload, w->rows * sizeof *w->payload},
+        {w->statement, w->rows * sizeof *w->statement},
+        {w->tag, w->rows * sizeof *w->tag},
+        {(void*)zeros, pad8(w->rows)},
+    };
+    w->rows = 0;
+    return write_all(err, w->fd, iov, sizeof iov / sizeof *iov);
+}
+
+ResultWriter* result_writer_open(Error* err, const char* path)
+{
+    ResultWriter* w = mem_alloc(MEM_IO, sizeof *w);
+    if (!w) {
+        error_push(err, "failed to allocate result writer: %s", strerror(errno));
+        return NULL;
+    }
+    w->rows = 0;
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd == -1) {
+        error_push(err, "failed to open %s: %s", path, strerror(errno));
+        mem_free(w);
+        return NULL;
+    }
+    struct result_header h = {.magic = RESULT_MAGIC, .version = RESULT_VERSION,
+                              .endian = RESULT_ENDIAN};
+    struct iovec iov = {&h, sizeof h};
+    if (!write_all(err, w->fd, &iov, 1)) {
+        close(w->fd);
+        mem_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+static bool result_add(Error* err, ResultWriter* w, uint64_t statement, uint8_t tag,
+                       uint64_t payload)
+{
+    w->payload[w->rows]   = payload;
+    w->statement[w->rows] = statement;
+    w->tag[w->rows]       = tag;
+    if (++w->rows == RESULT_BLOCK_ROWS)
+        return result_flush(err, w);
+    return true;
+}
+
+bool result_write_value(Error* err, ResultWriter* w, uint64_t statement, const Value* v)
+{
+    if (v->type == VALUE_STRING) {
+        error_push(err, "strings can't be written to a result file");
+        return false;
+    }
+    uint64_t bits;
+    memcpy(&bits, &v->i64, sizeof bits);
+    return result_add(err, w, statement,
+                      v->type == VALUE_FLOATING ? RESULT_FLOATING : RESULT_INTEGER, bits);
+}
+
+bool result_write_error(Error* err, ResultWriter* w, uint64_t statement, int line, int col)
+{
+    return result_add(err, w, statement, RESULT_ERROR,
+                      (uint64_t)(uint32_t)line << 32 | (uint32_t)col);
+}
+
+bool result_writer_close(Error* err, ResultWriter* w)
+{
+    bool ok = result_flush(err, w);
+    if (close(w->fd) == -1 && ok) {
+        error_push(err, "failed to close results: %s", strerror(errno));
+        ok = false;
+    }
+    mem_free(w);
+    return ok;
+}
+
+bool result_file_map(Error* err, ResultFile* f, const char* path)
+{
+    *f = (ResultFile){.data = NULL, .size = 0, .pos = sizeof(struct result_header)};
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        error_push(err, "failed to open %s: %s", path, strerror(errno));
+        return false;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        error_push(err, "failed to stat %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    struct result_header h;
+    if ((size_t)sb.st_size < sizeof h) {
+        error_push(err, "%s is not a result file", path);
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        error_push(err, "failed to map %s: %s", path, strerror(errno));
+        return false;
+    }
+    f->data = data;
+    f->size = sb.st_size;
+
+    memcpy(&h, f->data, sizeof h);
+    if (memcmp(h.magic, RESULT_MAGIC, sizeof h.magic) != 0) {
+        error_push(err, "%s is not a result file", path);
+    } else if (h.endian != RESULT_ENDIAN) {
+        error_push(err, "%s was written with a different byte order", path);
+    } else if (h.version != RESULT_VERSION) {
+        error_push(err, "%s has unsupported version %u", path, h.version);
+    } else {
+        return true;
+    }
+    result_file_unmap(f);
+    return false;
+}
+
+void result_file_unmap(ResultFile* f)
+{
+    if (f->data)
+        munmap((void*)f->data, f->size);
+    f->data = NULL;
+}
+
+bool result_file_next(Error* err, ResultFile* f, ResultBlock* b)
+{
+    if (f->pos == f->size)
+        return false;
+    struct result_block_header h;
+    if (f->size - f->pos < sizeof h) {
+        error_push(err, "truncated block header at byte %zu", f->pos);
+        return false;
+    }
+    memcpy(&h, f->data + f->pos, sizeof h);
+    const size_t rows = h.rows;
+    const size_t len  = sizeof h + rows * (2 * sizeof(uint64_t) + 1) + pad8(rows);
+    if (h.magic != RESULT_BLOCK_MAGIC || f->size - f->pos < len) {
+        error_push(err, "bad or truncated block at byte %zu", f->pos);
+        return false;
+    }
+    const char* p = f->data + f->pos + sizeof h;
+    b->rows      = h.rows;
+    b->payload   = (const uint64_t*)p;
+    b->statement = (const uint64_t*)(p + rows * sizeof(uint64_t));
+    b->tag       = (const uint8_t*)(p + rows * 2 * sizeof(uint64_t));
+    f->pos += len;
+    return true;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "error.h"
+#include "value.h"
+
+/* Binary result file, written by lang --results-out and read by mapping it.
+ *
+ *     file   : header block*
+ *     header : struct result_header
+ *     block  : struct result_block_header
+ *              uint64_t payload[rows]   int64_t, double bits, or for an error
+ *                                       the line << 32 | column it stopped at
+ *              uint64_t statement[rows] index of the statement, from 0
+ *              uint8_t  tag[rows]       enum result_tag
+ *              zero padding to a multiple of 8 bytes
+ *
+ * Rows are collected into blocks of up to RESULT_BLOCK_ROWS and each block
+ * is appended with one writev. All integers are in the writer's byte order,
+ * which readers check against RESULT_ENDIAN. Every array starts 8-byte
+ * aligned relative to the start of the file, so a mapped file is read in
+ * place. */
+
+#define RESULT_MAGIC   "LANGRES"   // 8 bytes with the terminator
+#define RESULT_VERSION 1
+#define RESULT_ENDIAN  0x01020304u
+#define RESULT_BLOCK_MAGIC 0x4b4c4252u // "RBLK" read as little endian
+
+#define RESULT_BLOCK_ROWS (64 * 1024)
+
+enum result_tag {
+    RESULT_INTEGER,
+    RESULT_FLOATING,
+    RESULT_ERROR,
+};
+
+struct result_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+};
+
+struct result_block_header {
+    uint32_t magic;
+    uint32_t rows;
+};
+
+/* ======= Writing ======= */
+
+typedef struct result_writer ResultWriter;
+
+/* Creates or truncates path */
+ResultWriter* result_writer_open(Error* err, const char* path);
+
+/* Fails for a string, the format has no place for its bytes */
+bool result_write_value(Error* err, ResultWriter* w, uint64_t statement, const Value* v);
+bool result_write_error(Error* err, ResultWriter* w, uint64_t statement, int line, int col);
+
+/* Writes what is buffered and closes. w is freed even if that fails */
+bool result_writer_close(Error* err, ResultWriter* w);
+
+/* ======= Reading ======= */
+
+typedef struct result_file {
+    const char* data;
+    size_t size;
+    size_t pos; // next block
+} ResultFile;
+
+/* One block of a mapped file, the arrays point into the mapping */
+typedef struct result_block {
+    uint32_t rows;
+    const uint64_t* payload;
+    const uint64_t* statement;
+    const uint8_t* tag;
+} ResultBlock;
+
+bool result_file_map(Error* err, ResultFile* f, const char* path);
+void result_file_unmap(ResultFile* f);
+
+/* Moves to the next block. Returns false at the end or, with err set, if the
+ * file is malformed */
+bool result_file_next(Error* err, ResultFile* f, ResultBlock* b);
+
+/* Row i of a block that isn't RESULT_ERROR as a value */
+static inline Value result_value(const ResultBlock* b, uint32_t i)
+{
+    Value v;
+    v.type = b->tag[i] == RESULT_FLOATING ? VALUE_FLOATING : VALUE_INTEGER;
+    memcpy(&v.i64, &b->payload[i], sizeof v.i64);
+    return v;
+}
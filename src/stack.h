@@ -1,44 +1,77 @@
 
 #pragma once
 
-#include <stdlib.h>
-#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
 
-#define STACK_MAX 256
+#include "mem.h"
 
-typedef struct fixed_stack {
-	void* vals[STACK_MAX];
+#define STACK_INLINE 256
+
+/* Pointer stack. The first STACK_INLINE entries live in the struct, beyond
+ * that it moves to the heap and grows without limit. Call stack_free once
+ * done with it */
+typedef struct stack {
+	void** vals; // NULL while the inline entries suffice
 	size_t top;
-} FixedStack;
+	size_t cap;
+	void* inline_vals[STACK_INLINE];
+} Stack;
 
 #define STACK_INIT { 0 }
 
+static inline void** stack_vals(Stack* s)
+{
+	return s->vals ? s->vals : s->inline_vals;
+}
+
+static inline bool stack_grow_(Stack* s)
+{
+	size_t cap = s->vals ? s->cap * 2 : STACK_INLINE * 2;
+	void** vals = mem_realloc(MEM_PARSER, s->vals, cap * sizeof *vals);
+	if (!vals)
+		return false;
+	if (!s->vals)
+		memcpy(vals, s->inline_vals, sizeof s->inline_vals);
+	s->vals = vals;
+	s->cap  = cap;
+	return true;
+}
+
+/* Returns false if the stack could not grow, s is unchanged then */
 #define stack_push(s, v) stack_push_((s), (void*)(v))
-static inline void stack_push_(FixedStack* s, void* val)
+static inline bool stack_push_(Stack* s, void* val)
 {
-	if (s->top >= STACK_MAX) {
-		fprintf(stderr, "static stack capacity exceeded");
-		exit(EXIT_FAILURE);
-	}
-	s->vals[s->top++] = val;
+	if (s->top == (s->vals ? s->cap : STACK_INLINE) && !stack_grow_(s))
+		return false;
+	stack_vals(s)[s->top++] = val;
+	return true;
 }
 
-static inline void* stack_top(FixedStack* s)
+static inline void* stack_top(Stack* s)
 {
-	return s->vals[s->top - 1];
+	return stack_vals(s)[s->top - 1];
 }
 
-static inline void* stack_pop(FixedStack* s)
+static inline void* stack_pop(Stack* s)
 {
-	return s->vals[--s->top];
+	return stack_vals(s)[--s->top];
 }
 
-static inline bool stack_empty(FixedStack* s)
+static inline bool stack_empty(Stack* s)
 {
 	return s->top == 0;
 }
 
-static inline size_t stack_len(FixedStack* s)
+static inline size_t stack_len(Stack* s)
 {
 	return s->top;
 }
+
+static inline void stack_free(Stack* s)
+{
+	mem_free(s->vals);
+	s->vals = NULL;
+	s->top  = 0;
+	s->cap  = 0;
+}
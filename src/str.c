@@ -0,0 +1,329 @@
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "error.h"
+#include "mem.h"
+#include "str.h"
+#include "value.h"
+
+#define STR_MIN_CAP 256
+#define STR_CHUNK (64 * 1024)
+
+_Static_assert(offsetof(Value, small) + VALUE_SMALL_STR == sizeof(Value),
+               "a short string runs from Value.small to the end of the Value");
+
+struct str_chunk {
+    struct str_chunk* next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static char* small_bytes(const Value* v)
+{
+    return (char*)v + offsetof(Value, small);
+}
+
+static size_t value_len(const Value* v)
+{
+    return v->small_len == VALUE_LONG_STR ? v->str->len : v->small_len;
+}
+
+/* FNV-1a */
+static uint32_t str_hash(const char* s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* size bytes that live as long as t, 8-byte aligned */
+static void* str_alloc(Error* err, StrTable* t, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    struct str_chunk* c = t->chunks;
+    if (!c || c->size - c->used < size) {
+        const size_t cap = size > STR_CHUNK / 4 ? size : STR_CHUNK;
+        struct str_chunk* n = mem_alloc(MEM_STRING, sizeof *n + cap);
+        if (!n) {
+            error_push(err, "failed to allocate string: %s", strerror(errno));
+            return NULL;
+        }
+        n->used = 0;
+        n->size = cap;
+        if (c && cap != STR_CHUNK) {
+            // a big string gets a chunk of its own, the current one keeps
+            // taking the small allocations
+            n->next = c->next;
+            c->next = n;
+        } else {
+            n->next   = c;
+            t->chunks = n;
+        }
+        c = n;
+    }
+    void* p = c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+static Str** str_slot(Str** slots, uint32_t cap, const char* s, size_t len, uint32_t hash)
+{
+    uint32_t i = hash & (cap - 1);
+    while (slots[i]
+       && !(slots[i]->hash == hash && slots[i]->len == len
+            && memcmp(slots[i]->bytes, s, len) == 0))
+    {
+        i = (i + 1) & (cap - 1);
+    }
+    return &slots[i];
+}
+
+static bool str_grow(Error* err, StrTable* t)
+{
+    uint32_t cap = t->cap ? t->cap * 2 : STR_MIN_CAP;
+    Str** slots = mem_calloc(MEM_STRING, cap, sizeof *slots);
+    if (!slots) {
+        error_push(err, "failed to allocate string table: %s", strerror(errno));
+        return false;
+    }
+    for (uint32_t i = 0; i < t->cap; i++) {
+        const Str* s = t->slots[i];
+        if (s)
+            *str_slot(slots, cap, s->bytes, s->len, s->hash) = t->slots[i];
+    }
+    mem_free(t->slots);
+    t->slots = slots;
+    t->cap   = cap;
+    return true;
+}
+
+/* The interned string with the len bytes at s, added if there is none */
+static Str* str_intern_bytes(Error* err, StrTable* t, const char* s, size_t len, bool borrow)
+{
+    if (t->len >= t->cap / 2 && !str_grow(err, t))
+        return NULL;
+    const uint32_t hash = str_hash(s, len);
+    Str** slot = str_slot(t->slots, t->cap, s, len, hash);
+    if (*slot)
+        return *slot;
+
+    Str* n = str_alloc(err, t, sizeof *n + (borrow ? 0 : len));
+    if (!n)
+        return NULL;
+    const char* bytes = s;
+    if (borrow) {
+        t->borrowed += len;
+    } else {
+        memcpy(n + 1, s, len);
+        bytes = (const char*)(n + 1);
+    }
+    *n = (Str){.len = len, .hash = hash, .bytes = bytes, .owner = t};
+    n->interned = n;
+    *slot = n;
+    t->len++;
+    return n;
+}
+
+static bool buf_reserve(Error* err, StrTable* t, size_t len)
+{
+    if (len <= t->buf_cap)
+        return true;
+    size_t cap = t->buf_cap ? t->buf_cap : 256;
+    while (cap < len)
+        cap *= 2;
+    char* buf = mem_realloc(MEM_STRING, t->buf, cap);
+    if (!buf) {
+        error_push(err, "failed to allocate string: %s", strerror(errno));
+        return false;
+    }
+    t->buf     = buf;
+    t->buf_cap = cap;
+    return true;
+}
+
+static bool stack_reserve(Error* err, StrTable* t, uint32_t len)
+{
+    if (len <= t->stack_cap)
+        return true;
+    uint32_t cap = t->stack_cap ? t->stack_cap * 2 : 64;
+    Str** stack = mem_realloc(MEM_STRING, t->stack, cap * sizeof *stack);
+    if (!stack) {
+        error_push(err, "failed to allocate string stack: %s", strerror(errno));
+        return false;
+    }
+    t->stack     = stack;
+    t->stack_cap = cap;
+    return true;
+}
+
+/* The interned string with the bytes of s, flattening s if it is a rope */
+static Str* str_intern(Error* err, Str* s)
+{
+    if (s->interned)
+        return s->interned;
+    StrTable* t = s->owner;
+    if (!buf_reserve(err, t, s->len) || !stack_reserve(err, t, 1))
+        return NULL;
+
+    // the bytes are put together back to front, so a string built by
+    // appending, whose rope is a left spine, keeps the stack short
+    size_t pos = s->len;
+    uint32_t top = 0;
+    t->stack[top++] = s;
+    while (top > 0) {
+        const Str* n = t->stack[--top];
+        const Str* flat = n->bytes ? n : n->interned;
+        if (flat) {
+            pos -= n->len;
+            memcpy(t->buf + pos, flat->bytes, n->len);
+            continue;
+        }
+        if (!stack_reserve(err, t, top + 2))
+            return NULL;
+        t->stack[top++] = n->left;
+        t->stack[top++] = n->right;
+    }
+
+    Str* in = str_intern_bytes(err, t, t->buf, s->len, false);
+    if (!in)
+        return NULL;
+    t->flattened++;
+    s->interned = in;
+    return in;
+}
+
+/* Str with the bytes of v, to go into a rope */
+static Str* str_node(Error* err, StrTable* t, const Value* v)
+{
+    if (v->small_len == VALUE_LONG_STR)
+        return v->str;
+    Str* n = str_alloc(err, t, sizeof *n + v->small_len);
+    if (!n)
+        return NULL;
+    memcpy(n + 1, small_bytes(v), v->small_len);
+    *n = (Str){.len = v->small_len, .bytes = (const char*)(n + 1), .owner = t};
+    return n;
+}
+
+bool str_make(Error* err, StrTable* t, const char* s, size_t len, bool borrow, Value* v)
+{
+    if (len <= VALUE_SMALL_STR) {
+        *v = (Value){.type = VALUE_STRING, .small_len = len};
+        memcpy(small_bytes(v), s, len);
+        return true;
+    }
+    if (len > UINT32_MAX) {
+        error_push(err, "string too long: %zu bytes", len);
+        return false;
+    }
+    Str* n = str_intern_bytes(err, t, s, len, borrow);
+    if (!n)
+        return false;
+    *v = (Value){.type = VALUE_STRING, .small_len = VALUE_LONG_STR, .str = n};
+    return true;
+}
+
+bool str_concat(Error* err, StrTable* t, const Value* l, const Value* r, Value* out)
+{
+    const size_t ll = value_len(l);
+    const size_t rl = value_len(r);
+    if (ll == 0 || rl == 0) {
+        *out = ll == 0 ? *r : *l;
+        return true;
+    }
+    if (ll + rl <= VALUE_SMALL_STR) {
+        Value v = {.type = VALUE_STRING, .small_len = ll + rl};
+        memcpy(small_bytes(&v), small_bytes(l), ll);
+        memcpy(small_bytes(&v) + ll, small_bytes(r), rl);
+        *out = v;
+        return true;
+    }
+    if (ll + rl > UINT32_MAX) {
+        error_push(err, "string too long: %zu bytes", ll + rl);
+        return false;
+    }
+    Str* left  = str_node(err, t, l);
+    Str* right = left ? str_node(err, t, r) : NULL;
+    Str* n     = right ? str_alloc(err, t, sizeof *n) : NULL;
+    if (!n)
+        return false;
+    *n = (Str){.len = ll + rl, .left = left, .right = right, .owner = t};
+    t->ropes++;
+    *out = (Value){.type = VALUE_STRING, .small_len = VALUE_LONG_STR, .str = n};
+    return true;
+}
+
+const char* str_bytes(Error* err, const Value* v, size_t* len)
+{
+    if (v->small_len != VALUE_LONG_STR) {
+        *len = v->small_len;
+        return small_bytes(v);
+    }
+    const Str* s = str_intern(err, v->str);
+    if (!s)
+        return NULL;
+    *len = s->len;
+    return s->bytes;
+}
+
+bool str_equal(Error* err, const Value* l, const Value* r, bool* eq)
+{
+    // a string is short exactly if it fits, so equal lengths are stored
+    // the same way
+    const size_t len = value_len(l);
+    if (len != value_len(r)) {
+        *eq = false;
+        return true;
+    }
+    if (l->small_len != VALUE_LONG_STR) {
+        *eq = memcmp(small_bytes(l), small_bytes(r), len) == 0;
+        return true;
+    }
+    const Str* a = str_intern(err, l->str);
+    const Str* b = a ? str_intern(err, r->str) : NULL;
+    if (!b)
+        return false;
+    *eq = a == b;
+    return true;
+}
+
+bool str_compare(Error* err, const Value* l, const Value* r, int* cmp)
+{
+    size_t ll, rl;
+    const char* a = str_bytes(err, l, &ll);
+    const char* b = a ? str_bytes(err, r, &rl) : NULL;
+    if (!b)
+        return false;
+    const int c = memcmp(a, b, ll < rl ? ll : rl);
+    *cmp = c != 0 ? c : (ll > rl) - (ll < rl);
+    return true;
+}
+
+void str_stats_print(FILE* out, StrTable* t)
+{
+    fprintf(out,
+        "strings: %" PRIu32 " interned, %" PRIu64 " ropes, %" PRIu64 " flattened, "
+        "%" PRIu64 " literal bytes not copied\n",
+        t->len, t->ropes, t->flattened, t->borrowed);
+}
+
+void str_table_free(StrTable* t)
+{
+    struct str_chunk* c = t->chunks;
+    while (c) {
+        struct str_chunk* next = c->next;
+        mem_free(c);
+        c = next;
+    }
+    mem_free(t->slots);
+    mem_free(t->buf);
+    mem_free(t->stack);
+    *t = (StrTable)STR_TABLE_INIT;
+}
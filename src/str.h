@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "error.h"
+#include "value.h"
+
+/* String values.
+ *
+ * A string of up to VALUE_SMALL_STR bytes is stored in the Value itself.
+ * A longer one is a Str owned by a StrTable and freed with it, which is
+ * either
+ * - flat, holding its bytes. A literal without escapes points into the
+ *   source it was read from, which must stay open as long as the table.
+ * - a rope, the concatenation of two strings. Building a string piece by
+ *   piece adds a node per piece instead of copying everything so far, and
+ *   the rope is flattened the first time its bytes are needed.
+ *
+ * Long strings are interned once their bytes are known: the table keeps one
+ * flat string per content and every string with those bytes points to it,
+ * so two interned strings are equal exactly if they are the same Str. */
+
+typedef struct str {
+    uint32_t len;
+    uint32_t hash;          // of the bytes, once interned
+    struct str* left;       // rope: the two halves, NULL for a flat string
+    struct str* right;
+    struct str* interned;   // flat string with the same bytes in the table,
+                            // NULL until the bytes have been needed
+    const char* bytes;      // flat string only
+    struct str_table* owner;
+} Str;
+
+struct str_chunk;
+
+typedef struct str_table {
+    // open addressing over interned strings, NULL marks an empty slot
+    Str** slots;
+    uint32_t cap; // power of two
+    uint32_t len;
+
+    struct str_chunk* chunks; // Str nodes and copied bytes
+
+    // scratch for flattening
+    char* buf;
+    size_t buf_cap;
+    Str** stack;
+    uint32_t stack_cap;
+
+    // statistics
+    uint64_t ropes;     // concatenations that made a rope
+    uint64_t flattened; // ropes whose bytes were put together
+    uint64_t borrowed;  // bytes of literals referenced in place
+} StrTable;
+
+#define STR_TABLE_INIT { 0 }
+
+void str_table_free(StrTable* t);
+
+/* Sets v to the len bytes at s. A long string is interned, and if borrow
+ * is set its bytes are referenced instead of copied, so they must outlive
+ * t */
+bool str_make(Error* err, StrTable* t, const char* s, size_t len, bool borrow, Value* v);
+
+/* out = l + r, a rope if it doesn't fit in out */
+bool str_concat(Error* err, StrTable* t, const Value* l, const Value* r, Value* out);
+
+/* Bytes of the string v, flattening a rope, NULL on failure. They are
+ * stored in v itself if it is short */
+const char* str_bytes(Error* err, const Value* v, size_t* len);
+
+/* Sets *eq to whether strings l and r are equal */
+bool str_equal(Error* err, const Value* l, const Value* r, bool* eq);
+
+/* Sets *cmp to a negative number, 0 or a positive number as l sorts before,
+ * with or after r, byte by byte */
+bool str_compare(Error* err, const Value* l, const Value* r, int* cmp);
+
+/* Prints the number of interned strings and ropes */
+void str_stats_print(FILE* out, StrTable* t);
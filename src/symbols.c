@@ -0,0 +1,97 @@
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "error.h"
+#include "mem.h"
+#include "symbols.h"
+
+#define SYMBOL_MIN_CAP 64
+
+/* FNV-1a */
+static uint32_t symbol_hash(const char* name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static Symbol* symbol_slot(Symbol* slots, uint32_t cap, const char* name, size_t len)
+{
+    uint32_t i = symbol_hash(name, len) & (cap - 1);
+    while (slots[i].name
+       && !(slots[i].len == len && memcmp(slots[i].name, name, len) == 0))
+    {
+        i = (i + 1) & (cap - 1);
+    }
+    return &slots[i];
+}
+
+static bool symbol_grow(Error* err, SymbolTable* t)
+{
+    uint32_t cap = t->cap ? t->cap * 2 : SYMBOL_MIN_CAP;
+    Symbol* slots = mem_calloc(MEM_SYMBOL, cap, sizeof *slots);
+    if (!slots) {
+        error_push(err, "failed to allocate symbol table: %s", strerror(errno));
+        return false;
+    }
+    for (uint32_t i = 0; i < t->cap; i++) {
+        if (t->slots[i].name)
+            *symbol_slot(slots, cap, t->slots[i].name, t->slots[i].len) = t->slots[i];
+    }
+    mem_free(t->slots);
+    t->slots = slots;
+    t->cap   = cap;
+    return true;
+}
+
+Symbol* symbol_lookup(SymbolTable* t, const char* name, size_t len)
+{
+    if (t->len == 0)
+        return NULL;
+    Symbol* s = symbol_slot(t->slots, t->cap, name, len);
+    return s->name ? s : NULL;
+}
+
+Symbol* symbol_define(Error* err, SymbolTable* t, const char* name, size_t len)
+{
+    if (len > UINT32_MAX) {
+        error_push(err, "name too long");
+        return NULL;
+    }
+    if (t->len >= t->cap / 2 && !symbol_grow(err, t))
+        return NULL;
+
+    Symbol* s = symbol_slot(t->slots, t->cap, name, len);
+    if (s->name)
+        return s;
+
+    char* copy = mem_alloc(MEM_SYMBOL, len + 1);
+    if (!copy) {
+        error_push(err, "failed to allocate symbol name: %s", strerror(errno));
+        return NULL;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    *s = (Symbol){
+        .name  = copy,
+        .len   = len,
+        .type  = VALUE_INTEGER,
+        .value = EXPR_NONE,
+        .var   = EXPR_NONE,
+    };
+    t->len++;
+    return s;
+}
+
+void symbol_table_free(SymbolTable* t)
+{
+    for (uint32_t i = 0; i < t->cap; i++)
+        mem_free(t->slots[i].name);
+    mem_free(t->slots);
+    memset(t, 0, sizeof *t);
+}
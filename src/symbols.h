@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "expr.h"
+#include "value.h"
+
+/* Variables. A name is bound to the expression node of the value last
+ * assigned to it, so reading a variable costs nothing at run time and
+ * expressions over variables are deduplicated and memoized like any other.
+ * Assigning again rebinds the name to a new node, earlier statements keep
+ * the node they already refer to. */
+
+typedef struct symbol {
+    char* name;          // NUL terminated, NULL for an empty slot
+    uint32_t len;
+    enum value_type type;
+    ExprId value;
+    ExprId var;          // EXPR_VAR node while an if or while statement
+                         // that uses it is compiled, EXPR_NONE otherwise
+} Symbol;
+
+typedef struct symbol_table {
+    Symbol* slots; // open addressing
+    uint32_t cap;  // power of two
+    uint32_t len;
+} SymbolTable;
+
+#define SYMBOL_TABLE_INIT { 0 }
+
+void symbol_table_free(SymbolTable* t);
+
+/* NULL if name is not defined */
+Symbol* symbol_lookup(SymbolTable* t, const char* name, size_t len);
+
+/* Returns the symbol for name, adding an unbound one if there is none. NULL
+ * on failure */
+Symbol* symbol_define(Error* err, SymbolTable* t, const char* name, size_t len);
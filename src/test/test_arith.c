@@ -0,0 +1,85 @@
+
+#include "arith.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct overflow_case {
+    enum overflow_policy policy;
+    enum operator op;
+    int64_t a;
+    int64_t b;
+    bool ok;
+    enum value_type type;
+    int64_t i64;
+    double f64;
+};
+
+static const struct overflow_case cases[] = {
+    {OVERFLOW_WRAP,     OP_ADD, INT64_MAX, 1,  true,  VALUE_INTEGER,  INT64_MIN, 0},
+    {OVERFLOW_SATURATE, OP_ADD, INT64_MAX, 1,  true,  VALUE_INTEGER,  INT64_MAX, 0},
+    {OVERFLOW_SATURATE, OP_SUB, INT64_MIN, 1,  true,  VALUE_INTEGER,  INT64_MIN, 0},
+    {OVERFLOW_SATURATE, OP_MUL, INT64_MAX, -2, true,  VALUE_INTEGER,  INT64_MIN, 0},
+    {OVERFLOW_SATURATE, OP_DIV, INT64_MIN, -1, true,  VALUE_INTEGER,  INT64_MAX, 0},
+    {OVERFLOW_PROMOTE,  OP_MUL, INT64_MAX, 2,  true,  VALUE_FLOATING, 0, 2.0 * (double)INT64_MAX},
+    {OVERFLOW_PROMOTE,  OP_DIV, INT64_MIN, -1, true,  VALUE_FLOATING, 0, -(double)INT64_MIN},
+    {OVERFLOW_ERROR,    OP_ADD, INT64_MAX, 1,  false, VALUE_INTEGER,  0, 0},
+};
+
+static bool kernel(enum operator op, int64_t a, int64_t b, int64_t* res)
+{
+    switch (op) {
+    case OP_ADD: return arith_add_i64(a, b, res);
+    case OP_SUB: return arith_sub_i64(a, b, res);
+    case OP_MUL: return arith_mul_i64(a, b, res);
+    case OP_DIV: return arith_div_i64(a, b, res);
+    default: break;
+    }
+    return false;
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+
+    fprintf(stderr, "checking kernels without overflow\n");
+    int64_t res;
+    if (kernel(OP_ADD, 2, 3, &res) || res != 5
+     || kernel(OP_SUB, 2, 3, &res) || res != -1
+     || kernel(OP_MUL, -4, 3, &res) || res != -12
+     || kernel(OP_DIV, -7, 2, &res) || res != -3
+     || kernel(OP_DIV, INT64_MIN, 1, &res) || res != INT64_MIN)
+    {
+        fprintf(stderr, "kernel returned wrong result\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "checking overflow policies\n");
+    for (size_t i = 0; i < sizeof cases / sizeof *cases; i++) {
+        const struct overflow_case* c = &cases[i];
+        Error err = ERROR_INIT;
+        Value v = {.type = VALUE_INTEGER};
+        if (!kernel(c->op, c->a, c->b, &v.i64)) {
+            fprintf(stderr, "case %zu: overflow not detected\n", i);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        bool ok = arith_overflow(&err, c->policy, c->op, c->a, c->b, &v);
+        if (ok != c->ok || ok != error_empty(&err)) {
+            fprintf(stderr, "case %zu: wrong error state\n", i);
+            status = EXIT_FAILURE;
+        } else if (ok && (v.type != c->type
+                      || (v.type == VALUE_INTEGER && v.i64 != c->i64)
+                      || (v.type == VALUE_FLOATING && v.f64 != c->f64)))
+        {
+            fprintf(stderr, "case %zu: wrong result\n", i);
+            status = EXIT_FAILURE;
+        }
+        error_clear(&err);
+    }
+    if (status == EXIT_SUCCESS)
+        fprintf(stderr, "OK\n");
+
+    return status;
+}
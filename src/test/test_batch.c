@@ -0,0 +1,145 @@
+
+#include "lang.h"
+#include "value.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_RESULTS 20000
+
+struct results {
+    uint64_t statements[MAX_RESULTS];
+    Value values[MAX_RESULTS];
+    uint32_t len;
+};
+
+static void keep_result(void* user, uint64_t statement, const Value* v)
+{
+    struct results* r = user;
+    if (r->len < MAX_RESULTS) {
+        r->statements[r->len] = statement;
+        r->values[r->len++]   = *v;
+    }
+}
+
+/* Runs src, with shape batches unless keep_program turns them off */
+static bool run(const char* src, bool keep_program, struct results* r, LangCtx** out)
+{
+    LangOptions opts = LANG_OPTIONS_INIT;
+    opts.keep_program = keep_program;
+    LangCtx* ctx = lang_ctx_new(&opts);
+    r->len = 0;
+    lang_set_result_handler(ctx, keep_result, r);
+    const bool ok = lang_eval_buffer(ctx, src, strlen(src));
+    *out = ctx;
+    return ok;
+}
+
+static bool same(const struct results* a, const struct results* b)
+{
+    if (a->len != b->len)
+        return false;
+    for (uint32_t i = 0; i < a->len; i++) {
+        if (a->statements[i] != b->statements[i] || a->values[i].type != b->values[i].type
+         || a->values[i].i64 != b->values[i].i64)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct results batched, single;
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+
+    fprintf(stderr, "running runs of statements of one shape as batches\n");
+    static const char* shapes[] = {
+        "%d + %d * %d;\n",
+        "(%d - %d) * %d.5 / 3;\n",
+        "%d < %d == %d > 7;\n",
+        "(%d & 255) ^ %d | %d;\n",
+        "%d %% 7 + %d / 3 + %d;\n",
+        "(%d + 1) + %d.25 + %d;\n",
+        "!%d + ~%d * !(%d > 7);\n",
+    };
+    size_t cap = 1 << 20, len = 0;
+    char* src = malloc(cap);
+    srand(44);
+    for (int i = 0; i < 12000 && len + 128 < cap; i++) {
+        const char* shape = shapes[(i / 500 + (rand() % 50 == 0)) % 7];
+        len += snprintf(src + len, cap - len, shape, rand() % 2000, rand() % 1000 + 1,
+                        rand() % 100);
+        if (i % 3000 == 2999)
+            len += snprintf(src + len, cap - len, "x int = %d;\n", i);
+    }
+    LangCtx* a;
+    LangCtx* b;
+    const bool ok_a = run(src, false, &batched, &a);
+    const bool ok_b = run(src, true, &single, &b);
+    char stats[4096] = "";
+    FILE* f = tmpfile();
+    lang_stats_print(a, f);
+    rewind(f);
+    stats[fread(stats, 1, sizeof stats - 1, f)] = '\0';
+    fclose(f);
+    unsigned long runs = 0;
+    const char* line = strstr(stats, "batches: ");
+    if (!ok_a || !ok_b || !same(&batched, &single) || batched.len != 12000) {
+        fprintf(stderr, "batched results differ: %s%s\n", lang_error(a), lang_error(b));
+        status = EXIT_FAILURE;
+    } else if (!line || sscanf(line, "batches: %lu", &runs) != 1 || runs < 11000) {
+        fprintf(stderr, "statements not batched: %s", stats);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    lang_ctx_free(a);
+    lang_ctx_free(b);
+
+    fprintf(stderr, "failing in the middle of a batch\n");
+    len = 0;
+    for (int i = 0; i < 20; i++) {
+        len += snprintf(src + len, cap - len, "%s * 2 + 1;\n",
+                        i == 13 ? "9223372036854775807" : "5");
+    }
+    const bool ran_a = run(src, false, &batched, &a);
+    const bool ran_b = run(src, true, &single, &b);
+    int line_a, col_a, line_b, col_b;
+    lang_error_position(a, &line_a, &col_a);
+    lang_error_position(b, &line_b, &col_b);
+    if (ran_a || ran_b || !same(&batched, &single) || batched.len != 13
+     || strcmp(lang_error(a), lang_error(b)) != 0 || line_a != 14 || line_a != line_b
+     || col_a != col_b || lang_statement_count(a) != 13 || lang_statement_count(b) != 13)
+    {
+        fprintf(stderr, "wrong failure: %u results, line %d:%d, %s\n", batched.len, line_a, col_a,
+                lang_error(a));
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    lang_ctx_free(a);
+    lang_ctx_free(b);
+
+    fprintf(stderr, "skipping the right operand of && and || in a run\n");
+    len = 0;
+    for (int i = 0; i < 20; i++)
+        len += snprintf(src + len, cap - len, "%d && 1 / %d;\n%d || 1 / %d;\n", i % 2, i % 2,
+                        1 - i % 2, i % 2);
+    if (!run(src, false, &batched, &a) || !run(src, true, &single, &b)
+     || !same(&batched, &single) || batched.len != 40)
+    {
+        fprintf(stderr, "wrong results: %u, %s\n", batched.len, lang_error(a));
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    lang_ctx_free(a);
+    lang_ctx_free(b);
+    free(src);
+
+    return status;
+}
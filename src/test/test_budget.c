@@ -0,0 +1,185 @@
+
+#include "lang.h"
+#include "value.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint32_t results;
+
+static void count_result(void* user, uint64_t statement, const Value* v)
+{
+    (void)user, (void)statement, (void)v;
+    results++;
+}
+
+static uint32_t errors;
+
+static void count_error(void* user, const LangDiagnostic* d)
+{
+    (void)user, (void)d;
+    errors++;
+}
+
+static LangCtx* ctx_new(LangOptions opts)
+{
+    LangCtx* ctx = lang_ctx_new(&opts);
+    lang_set_result_handler(ctx, count_result, NULL);
+    lang_set_error_handler(ctx, count_error, NULL);
+    results = errors = 0;
+    return ctx;
+}
+
+static bool eval(LangCtx* ctx, const char* src)
+{
+    return lang_eval_buffer(ctx, src, strlen(src));
+}
+
+/* src fails with an error mentioning what, and ctx runs the next call with
+ * its full budget again */
+static bool check_fails(LangOptions opts, const char* src, const char* what)
+{
+    LangCtx* ctx = ctx_new(opts);
+    bool ok = !eval(ctx, src) && strstr(lang_error(ctx), what);
+    if (!ok)
+        fprintf(stderr, "expected \"%s\" from %s, got \"%s\"\n", what, src, lang_error(ctx));
+    if (ok && !eval(ctx, "1 + 2;")) {
+        fprintf(stderr, "a later call failed: %s\n", lang_error(ctx));
+        ok = false;
+    }
+    lang_ctx_free(ctx);
+    return ok;
+}
+
+static char* repeat(const char* head, const char* s, uint32_t n, const char* tail)
+{
+    const size_t len = strlen(s);
+    char* out = malloc(strlen(head) + len * n + strlen(tail) + 1);
+    char* c = out + sprintf(out, "%s", head);
+    for (uint32_t i = 0; i < n; i++, c += len)
+        memcpy(c, s, len);
+    strcpy(c, tail);
+    return out;
+}
+
+static const char* forever = "fn f(n int) int { while n > 0 { n = n + 1; } return n; } f(1);";
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    const LangOptions none = LANG_OPTIONS_INIT;
+    LangOptions opts;
+
+    fprintf(stderr, "checking the operation budget\n");
+    opts = none;
+    opts.max_ops = 100000;
+    bool ok = check_fails(opts, forever, "operation budget");
+    // a program within the budget runs, one that isn't stops at it
+    LangCtx* ctx = ctx_new(opts);
+    ok = ok && eval(ctx, "i int = 0; while i < 1000 { i = i + 1; } i;") && results == 1;
+    ok = ok && !eval(ctx, "while i < 1000000 { i = i + 1; } i;") && results == 1;
+    lang_ctx_free(ctx);
+    if (ok) {
+        fprintf(stderr, "OK\n");
+    } else {
+        status = EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "checking the time budget\n");
+    opts = none;
+    opts.timeout_ms = 100;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ok = check_fails(opts, forever, "time budget");
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    const double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    if (ok && ms < 2000) {
+        fprintf(stderr, "OK\n");
+    } else {
+        fprintf(stderr, "stopped after %.0f ms\n", ms);
+        status = EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "checking the depth budget\n");
+    opts = none;
+    opts.max_depth = 100;
+    char* deep = repeat("", "(", 1000, "1");
+    char* deep_src = repeat(deep, ")", 1000, ";");
+    char* shallow = repeat("x int = 1; ", "x + ", 1000, "1;");
+    ctx = ctx_new(opts);
+    ok = check_fails(opts, deep_src, "nested deeper") && eval(ctx, shallow);
+    lang_ctx_free(ctx);
+    if (ok) {
+        fprintf(stderr, "OK\n");
+    } else {
+        status = EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "checking the memory budget\n");
+    opts = none;
+    opts.max_memory = 4 << 20;
+    char* wide = repeat("x int = 1; ", "x + ", 1000000, "1;");
+    ok = check_fails(opts, wide, "memory budget");
+    opts.max_memory = 256 << 20;
+    ctx = ctx_new(opts);
+    ok = ok && eval(ctx, wide);
+    lang_ctx_free(ctx);
+    if (ok) {
+        fprintf(stderr, "OK\n");
+    } else {
+        status = EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "checking the memory budget on reduction threads\n");
+    // with 4 threads the terms are reduced in parallel, and the memos of
+    // the workers need about 10 MB on top of what 1 thread needs
+    char* terms = malloc(100000 * 24 + 64);
+    char* c = terms + sprintf(terms, "x int = 1; ");
+    for (int i = 0; i < 100000; i++)
+        c += sprintf(c, "x * %d + ", i + 2);
+    strcpy(c, "1;");
+    opts = none;
+    opts.max_memory = 57 << 20;
+    opts.threads    = 1;
+    ctx = ctx_new(opts);
+    ok = eval(ctx, terms);
+    lang_ctx_free(ctx);
+    opts.threads = 4;
+    ok = ok && check_fails(opts, terms, "memory budget");
+    opts.max_memory = 256 << 20;
+    ctx = ctx_new(opts);
+    ok = ok && eval(ctx, terms);
+    lang_ctx_free(ctx);
+    if (ok) {
+        fprintf(stderr, "OK\n");
+    } else {
+        status = EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "checking that error recovery stops at a budget\n");
+    opts = none;
+    opts.max_ops    = 100000;
+    opts.max_errors = 100;
+    ctx = ctx_new(opts);
+    char* after = repeat(forever, " 1 + 1;", 10, "");
+    ok = !eval(ctx, after) && errors == 0 && results == 0
+      && strstr(lang_error(ctx), "operation budget");
+    lang_ctx_free(ctx);
+    if (ok) {
+        fprintf(stderr, "OK\n");
+    } else {
+        fprintf(stderr, "%u errors and %u results after the budget ran out\n", errors, results);
+        status = EXIT_FAILURE;
+    }
+
+    free(deep);
+    free(deep_src);
+    free(shallow);
+    free(wide);
+    free(after);
+    free(terms);
+    return status;
+}
@@ -0,0 +1,119 @@
+
+#include "lang.h"
+#include "value.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void print_result(void* user, uint64_t statement, const Value* v)
+{
+    (void)statement;
+    FILE* out = user;
+    fprintf(out, "result: ");
+    value_print(out, v);
+    fprintf(out, "\n");
+}
+
+/* Runs src in the interpreter and as compiled C, true if both print the same */
+static bool same_output(const char* src, enum overflow_policy policy, int threads)
+{
+    char c_path[64], bin_path[64], out_path[64], cmd[512];
+    snprintf(c_path, sizeof c_path, "/tmp/test_emit_c_%d.c", (int)getpid());
+    snprintf(bin_path, sizeof bin_path, "/tmp/test_emit_c_%d", (int)getpid());
+    snprintf(out_path, sizeof out_path, "/tmp/test_emit_c_%d.out", (int)getpid());
+
+    char* expect = NULL;
+    size_t expect_len = 0;
+    FILE* results = open_memstream(&expect, &expect_len);
+    LangOptions opts = LANG_OPTIONS_INIT;
+    opts.overflow     = policy;
+    opts.threads      = threads;
+    opts.keep_program = true;
+    LangCtx* ctx = lang_ctx_new(&opts);
+    lang_set_result_handler(ctx, print_result, results);
+    bool ok = lang_eval_buffer(ctx, src, strlen(src));
+    fclose(results);
+
+    FILE* c = fopen(c_path, "w");
+    ok = ok && c && lang_emit_c(ctx, c);
+    if (c)
+        fclose(c);
+    if (!ok)
+        fprintf(stderr, "%s\n", lang_error(ctx));
+    lang_ctx_free(ctx);
+
+    snprintf(cmd, sizeof cmd, "cc -O2 -Wall -Werror -o %s %s -lm && %s 2> %s",
+             bin_path, c_path, bin_path, out_path);
+    ok = ok && system(cmd) == 0;
+
+    char got[4096] = {0};
+    FILE* out = fopen(out_path, "r");
+    if (out) {
+        size_t n = fread(got, 1, sizeof got - 1, out);
+        got[n] = '\0';
+        fclose(out);
+    }
+    ok = ok && strcmp(got, expect) == 0;
+    if (!ok)
+        fprintf(stderr, "expected:\n%sgot:\n%s", expect, got);
+
+    free(expect);
+    unlink(c_path);
+    unlink(bin_path);
+    unlink(out_path);
+    return ok;
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+
+    if (system("cc --version > /dev/null 2>&1") != 0) {
+        fprintf(stderr, "no C compiler, skipping\n");
+        return status;
+    }
+
+    fprintf(stderr, "comparing compiled programs with the interpreter\n");
+    static const char* mixed =
+        "a int = 7; b float = a; a * 3 + 1; b / 2; (a << 2) | 1; a < b;"
+        "a % 3 - 10 / 4; b * b - a; 2.5 * 2 == 5; 0.1 + 0.2;";
+    static const char* overflow =
+        "x int = 9223372036854775807; x + 1; x * 2; 0 - x - 2; x;";
+    if (!same_output(mixed, OVERFLOW_ERROR, 1)
+     || !same_output(overflow, OVERFLOW_WRAP, 1)
+     || !same_output(overflow, OVERFLOW_SATURATE, 1)
+     || !same_output(overflow, OVERFLOW_PROMOTE, 1))
+    {
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "compiling prefix operators and short-circuit && and ||\n");
+    static const char* logic =
+        "z int = 0; y int = 4; z != 0 && 10 / z; (y != 0 && 8 / y) + (z == 0 || 1 / z);"
+        "10 / y; !z + ~y; y > 2 && (z != 0 || 0.5); !2.5;";
+    if (!same_output(logic, OVERFLOW_ERROR, 1)) {
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "compiling a chain reduced in parallel\n");
+    size_t cap = 200000;
+    char* chain = malloc(cap);
+    size_t len = 0;
+    for (int i = 1; i <= 10000; i++)
+        len += snprintf(chain + len, cap - len, "%s%d", i == 1 ? "" : i % 3 ? " + " : " - ", i);
+    snprintf(chain + len, cap - len, "; 1.5 + 2;");
+    if (!same_output(chain, OVERFLOW_ERROR, 4)) {
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    free(chain);
+
+    return status;
+}
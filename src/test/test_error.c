@@ -59,5 +59,19 @@ int main()
 
     error_clear(&err);
 
+    fprintf(stderr, "Pushing many messages\n");
+    for (int i = 0; i < 1000000; i++)
+        error_push_(&err, "message %d", i);
+    char buf[64];
+    const size_t len = error_format(&err, buf, sizeof buf);
+    if (strncmp(buf, "message 999999\n - message 999998\n - ", 36) == 0 && len > 1000000) {
+        fprintf(stderr, "OK\n");
+    } else {
+        fprintf(stderr, "wrong messages: %s\n", buf);
+        status = EXIT_FAILURE;
+    }
+
+    error_clear(&err);
+
     return status;
 }
@@ -0,0 +1,298 @@
+
+#include "expr.h"
+#include "expr_code.h"
+#include "str.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static ExprId lit(Error* err, ExprArena* a, int64_t i)
+{
+    const Value v = {.type = VALUE_INTEGER, .i64 = i};
+    return expr_literal(err, a, &v);
+}
+
+static ExprId str_lit(Error* err, ExprArena* a, const char* s)
+{
+    Value v;
+    if (!str_make(err, &a->strs, s, strlen(s), false, &v))
+        return EXPR_NONE;
+    return expr_literal(err, a, &v);
+}
+
+/* t0 op t1 op ... with products as terms, a float term at float_at unless it
+ * is negative, and INT64_MAX as the first term if overflow is set */
+static ExprId long_chain(Error* err, ExprArena* a, enum operator op, long float_at, bool overflow)
+{
+    ExprId chain = lit(err, a, overflow ? INT64_MAX : 7);
+    for (long i = 1; i < 20000; i++) {
+        ExprId term = expr_binary(err, a, OP_MUL, lit(err, a, i % 97), lit(err, a, i % 5));
+        if (i == float_at) {
+            const Value f = {.type = VALUE_FLOATING, .f64 = 0.25};
+            term = expr_literal(err, a, &f);
+        }
+        enum operator o = op == OP_ADD && i % 3 == 0 ? OP_SUB : op;
+        chain = expr_binary(err, a, o, chain, term);
+    }
+    return chain;
+}
+
+/* Evaluates the same chain serially and on 4 threads in fresh arenas */
+static bool parallel_matches(enum operator op, long float_at, bool overflow)
+{
+    Value v[2];
+    bool ok[2];
+    for (int i = 0; i < 2; i++) {
+        Error err = ERROR_INIT;
+        ExprArena a = EXPR_ARENA_INIT;
+        a.threads = i == 0 ? 1 : 4;
+        ok[i] = expr_eval(&err, &a, long_chain(&err, &a, op, float_at, overflow), &v[i]);
+        error_clear(&err);
+        expr_arena_free(&a);
+    }
+    if (ok[0] != ok[1])
+        return false;
+    if (!ok[0])
+        return true;
+    return v[0].type == v[1].type
+        && (v[0].type == VALUE_INTEGER ? v[0].i64 == v[1].i64 : v[0].f64 == v[1].f64);
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    Error err = ERROR_INIT;
+    ExprArena a = EXPR_ARENA_INIT;
+
+    fprintf(stderr, "checking that equal nodes share an id\n");
+    // (1 + 2) * (1 + 2)
+    ExprId one = lit(&err, &a, 1);
+    ExprId two = lit(&err, &a, 2);
+    ExprId sum_a = expr_binary(&err, &a, OP_ADD, one, two);
+    ExprId sum_b = expr_binary(&err, &a, OP_ADD, lit(&err, &a, 1), lit(&err, &a, 2));
+    ExprId swapped = expr_binary(&err, &a, OP_ADD, two, one);
+    ExprId prod = expr_binary(&err, &a, OP_MUL, sum_a, sum_b);
+    const Value f = {.type = VALUE_FLOATING, .f64 = 1.0};
+    ExprId one_f = expr_literal(&err, &a, &f);
+    if (!error_empty(&err)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    if (sum_a != sum_b || swapped == sum_a || one_f == one || a.len != 6) {
+        fprintf(stderr, "wrong deduplication, %u nodes\n", a.len);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "checking memoized evaluation\n");
+    Value v;
+    if (!expr_eval(&err, &a, prod, &v) || v.type != VALUE_INTEGER || v.i64 != 9
+     || a.evaluated != 2)
+    {
+        fprintf(stderr, "wrong result or evaluation count\n");
+        status = EXIT_FAILURE;
+    } else if (!expr_eval(&err, &a, sum_b, &v) || v.i64 != 3
+            || a.evaluated != 2 || a.memo_hits != 1)
+    {
+        fprintf(stderr, "shared node evaluated twice\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "checking a deep chain\n");
+    ExprId chain = one;
+    for (int i = 0; i < 100000; i++)
+        chain = expr_binary(&err, &a, OP_ADD, chain, lit(&err, &a, i % 7));
+    if (!expr_eval(&err, &a, chain, &v) || v.i64 != 299996) {
+        fprintf(stderr, "wrong result for chain\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "checking parallel chains against serial evaluation\n");
+    if (!parallel_matches(OP_ADD, -1, false)
+     || !parallel_matches(OP_ADD, 12345, false)
+     || !parallel_matches(OP_ADD, -1, true)
+     || !parallel_matches(OP_BXOR, -1, false)
+     || !parallel_matches(OP_BOR, 3, false))
+    {
+        fprintf(stderr, "parallel result differs\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "checking evaluation errors\n");
+    ExprId zero = lit(&err, &a, 0);
+    if (expr_eval(&err, &a, expr_binary(&err, &a, OP_DIV, one, zero), &v) || error_empty(&err)) {
+        fprintf(stderr, "division by zero not reported\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    error_clear(&err);
+
+    fprintf(stderr, "checking inferred types\n");
+    ExprId mixed = expr_binary(&err, &a, OP_ADD, one, one_f);
+    ExprId promoted = expr_binary(&err, &a, OP_MUL, sum_a, one_f);
+    ExprNode* p = expr_node(&a, promoted);
+    if (mixed == EXPR_NONE || promoted == EXPR_NONE
+     || expr_node(&a, mixed)->lhs != one_f || expr_node(&a, mixed)->type != VALUE_FLOATING
+     || expr_node(&a, p->lhs)->op != OP_TO_FLOAT || expr_node(&a, p->lhs)->lhs != sum_a
+     || !expr_eval(&err, &a, promoted, &v) || v.type != VALUE_FLOATING || v.f64 != 3.0)
+    {
+        fprintf(stderr, "no conversion inserted\n");
+        status = EXIT_FAILURE;
+    } else if (expr_binary(&err, &a, OP_BAND, one_f, one) != EXPR_NONE || error_empty(&err)) {
+        fprintf(stderr, "type error not reported\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    error_clear(&err);
+
+    fprintf(stderr, "checking types only known at run time\n");
+    ExprArena b = EXPR_ARENA_INIT;
+    b.overflow = OVERFLOW_PROMOTE;
+    ExprId big = expr_binary(&err, &b, OP_MUL, lit(&err, &b, INT64_MAX), lit(&err, &b, 2));
+    ExprId cmp = expr_binary(&err, &b, OP_GT, big, lit(&err, &b, 0));
+    if (big == EXPR_NONE || expr_node(&b, big)->type != EXPR_DYNAMIC || b.dynamic != 1
+     || expr_node(&b, cmp)->type != VALUE_INTEGER
+     || !expr_eval(&err, &b, big, &v) || v.type != VALUE_FLOATING)
+    {
+        fprintf(stderr, "wrong dynamic type\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    error_clear(&err);
+    expr_arena_free(&b);
+
+    fprintf(stderr, "running a copy of compiled code\n");
+    // (3 + 4) * (3 + 4) + (long + "ab" == long "ab") + (z != 0 && 10 / z) + !z
+    ExprArena c = EXPR_ARENA_INIT;
+    const char* text = "a string too long for a Value";
+    ExprId sum  = expr_binary(&err, &c, OP_ADD, lit(&err, &c, 3), lit(&err, &c, 4));
+    ExprId cat  = expr_binary(&err, &c, OP_ADD, str_lit(&err, &c, text), str_lit(&err, &c, "ab"));
+    ExprId eq   = expr_binary(&err, &c, OP_EQ, cat,
+                              str_lit(&err, &c, "a string too long for a Valueab"));
+    ExprId z    = lit(&err, &c, 0);
+    ExprId test = expr_binary(&err, &c, OP_AND, expr_binary(&err, &c, OP_NE, z, lit(&err, &c, 0)),
+                              expr_binary(&err, &c, OP_DIV, lit(&err, &c, 10), z));
+    ExprId root = expr_binary(&err, &c, OP_MUL, sum, sum);
+    root = expr_binary(&err, &c, OP_ADD, root, eq);
+    root = expr_binary(&err, &c, OP_ADD, root, test);
+    root = expr_binary(&err, &c, OP_ADD, root, expr_binary(&err, &c, OP_NOT, z, z));
+    const ExprCode* code = root == EXPR_NONE ? NULL : expr_compile(&err, &c, root);
+    ExprCode* copy = code ? malloc(code->size) : NULL;
+    Value* vals = code ? malloc(code->len * sizeof *vals) : NULL;
+    bool ran = false;
+    if (copy) {
+        memcpy(copy, code, code->size);
+        // the block handed out is reused by the next compile
+        ran = expr_compile(&err, &c, cat) && expr_code_run(&err, copy, &c, vals);
+    }
+    if (!ran || copy->bytes < strlen(text) * 2 || vals[copy->len - 1].type != VALUE_INTEGER
+     || vals[copy->len - 1].i64 != 51 || c.evaluated != 0)
+    {
+        error_print(&err);
+        fprintf(stderr, "the copy did not compute 51 on its own\n");
+        status = EXIT_FAILURE;
+    } else if (!expr_eval(&err, &c, root, &v) || v.i64 != 51 || !expr_node(&c, sum)->evaluated
+            || expr_node(&c, expr_node(&c, test)->rhs)->evaluated)
+    {
+        fprintf(stderr, "wrong memoization after running the code\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    free(copy);
+    free(vals);
+    error_clear(&err);
+    expr_arena_free(&c);
+
+    fprintf(stderr, "running the code of a long statement twice\n");
+    // s + (0 + s) + (1 + s) + ... with s = 5 + 1, and z != 0 && 10 / z
+    // halfway. Nothing is memoized until expr_eval, which agrees
+    ExprArena d = EXPR_ARENA_INIT;
+    d.threads = 1;
+    const long terms = 12000;
+    ExprId s     = expr_binary(&err, &d, OP_ADD, lit(&err, &d, 5), lit(&err, &d, 1));
+    ExprId nil   = lit(&err, &d, 0);
+    ExprId guard = expr_binary(&err, &d, OP_AND, expr_binary(&err, &d, OP_NE, nil, nil),
+                               expr_binary(&err, &d, OP_DIV, lit(&err, &d, 10), nil));
+    ExprId total = s;
+    int64_t expect = 6;
+    for (long i = 0; i < terms; i++) {
+        total = expr_binary(&err, &d, OP_ADD, total,
+                            expr_binary(&err, &d, OP_ADD, lit(&err, &d, i % 8), s));
+        expect += i % 8 + 6;
+        if (i == terms / 2)
+            total = expr_binary(&err, &d, OP_ADD, total, guard);
+    }
+    const ExprCode* long_code = total == EXPR_NONE ? NULL : expr_compile(&err, &d, total);
+    Value* results = long_code ? malloc(long_code->len * sizeof *results) : NULL;
+    bool twice = results != NULL;
+    for (int run = 0; twice && run < 2; run++) {
+        twice = expr_code_run(&err, long_code, &d, results)
+             && results[long_code->len - 1].i64 == expect;
+    }
+    if (!twice || d.evaluated != 0) {
+        error_print(&err);
+        fprintf(stderr, "the code did not compute %" PRId64 " twice\n", expect);
+        status = EXIT_FAILURE;
+    } else if (!expr_eval(&err, &d, total, &v) || v.i64 != expect
+            || expr_node(&d, expr_node(&d, guard)->rhs)->evaluated
+            || d.evaluated != (uint64_t)terms + 12)
+    {
+        error_print(&err);
+        fprintf(stderr, "got %" PRId64 " computing %" PRIu64 " nodes\n", v.i64, d.evaluated);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    free(results);
+    error_clear(&err);
+    expr_arena_free(&d);
+
+    fprintf(stderr, "finding nodes by hash across table growth\n");
+    // ints and floats with the same bits hash apart but have to be told
+    // apart by type where their buckets collide
+    ExprArena h = EXPR_ARENA_INIT;
+    enum { HASHED = 50000 };
+    ExprId* ids = malloc(3 * HASHED * sizeof *ids);
+    for (int i = 0; i < HASHED; i++) {
+        Value f = {.type = VALUE_FLOATING};
+        const int64_t bits = i;
+        memcpy(&f.f64, &bits, sizeof bits);
+        ids[3 * i]     = lit(&err, &h, i);
+        ids[3 * i + 1] = expr_literal(&err, &h, &f);
+        ids[3 * i + 2] = expr_binary(&err, &h, OP_SUB, ids[3 * i], lit(&err, &h, i / 2));
+    }
+    const uint32_t len = h.len;
+    bool same = error_empty(&err) && h.bucket_count >= 2 * len && len >= 2 * HASHED;
+    for (int i = 0; same && i < HASHED; i++) {
+        Value f = {.type = VALUE_FLOATING};
+        const int64_t bits = i;
+        memcpy(&f.f64, &bits, sizeof bits);
+        same = lit(&err, &h, i) == ids[3 * i] && expr_literal(&err, &h, &f) == ids[3 * i + 1]
+            && ids[3 * i] != ids[3 * i + 1]
+            && expr_binary(&err, &h, OP_SUB, ids[3 * i], lit(&err, &h, i / 2)) == ids[3 * i + 2];
+    }
+    if (!same || h.len != len) {
+        fprintf(stderr, "node lost or duplicated after %u buckets\n", h.bucket_count);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    free(ids);
+    error_clear(&err);
+    expr_arena_free(&h);
+
+    expr_arena_free(&a);
+    return status;
+}
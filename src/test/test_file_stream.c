@@ -2,6 +2,49 @@
 #include "file_stream.h"
 #include <string.h>
 #include <stdio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int check_sentinel(Error* err, const char* name, Mfile* m)
+{
+    while (mfile_get(m) != EOF)
+        /* NOOP */;
+    if (m->pos != m->size || mfile_curchar(m) != '\0') {
+        error_push(err, "%s: cursor did not stop at sentinel", name);
+        return -1;
+    }
+    for (size_t i = 0; i < MFILE_PAD; i++) {
+        if (m->data[m->size + i] != '\0') {
+            error_push(err, "%s: padding byte %zu is not zero", name, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Reads the file the way the tokenizer does and checks that bytes the cursor
+ * left behind still read back. Runs in a child, so its peak RSS is its own */
+static int stream_file(const char* path, size_t size)
+{
+    Error err = ERROR_INIT;
+    Mfile* m = mfile_open_mode(&err, (char*)path, MFILE_MODE_URING);
+    if (!m) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    size_t n = 0;
+    int c;
+    while ((c = mfile_get(m)) != EOF) {
+        if (c != 'a' + (int)(n++ % 26))
+            return EXIT_FAILURE;
+        mfile_checkpoint(m);
+    }
+    int ok = n == size && m->released > 0 && m->data[0] == 'a'
+          && m->data[size / 2] == 'a' + (int)(size / 2 % 26);
+    mfile_close(&err, m);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
 int main(int argc, char** argv)
 {
@@ -24,7 +67,9 @@ int main(int argc, char** argv)
     while (!mfile_eof(m) && n < 12) {
         str[n++] = mfile_get(m);
     }
-    if (strncmp("the brown fox", str, n) != 0) {
+    // the first 12 bytes of test.txt, which starts with a capital T and the
+    // quoted "quick" that the tokenizer tests read as a string
+    if (n != 12 || strncmp("The \"quick\" ", str, n) != 0) {
         error_push(&err, "mfile_get test failed");
         error_print(&err);
         status = EXIT_FAILURE;
@@ -32,6 +77,14 @@ int main(int argc, char** argv)
         fprintf(stderr, "OK\n");
     }
 
+    fprintf(stderr, "checking sentinel after copied file\n");
+    if (check_sentinel(&err, "test.txt", m) != 0) {
+        error_print(&err);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
     fprintf(stderr, "attempting to close\n");
     mfile_close(&err, m);
     if (!error_empty(&err)) {
@@ -42,5 +95,71 @@ int main(int argc, char** argv)
         fprintf(stderr, "OK\n");
     }
 
+    // page sized file, the sentinel has to come from the extra mapping. The
+    // streamed mode gets a file that spans several chunks
+    for (int mode = 0; mode < MFILE_MODE_COUNT; mode++) {
+        fprintf(stderr, "checking sentinel after %s file\n", mfile_mode_name(mode));
+        char path[] = "/tmp/test_file_stream_XXXXXX";
+        int fd = mkstemp(path);
+        size_t size = mode == MFILE_MODE_URING ? 2 * MFILE_CHUNK + 100 : MFILE_COPY_THRESHOLD;
+        char* buf = malloc(size);
+        memset(buf, 'x', size);
+        if (fd == -1 || write(fd, buf, size) != (ssize_t)size) {
+            perror("mkstemp/write");
+            return EXIT_FAILURE;
+        }
+        free(buf);
+        close(fd);
+        m = mfile_open_mode(&err, path, mode);
+        if (!error_empty(&err) || check_sentinel(&err, path, m) != 0) {
+            error_print(&err);
+            status = EXIT_FAILURE;
+        } else if (m->size != size) {
+            fprintf(stderr, "%s: read %zu of %zu bytes\n", path, m->size, size);
+            status = EXIT_FAILURE;
+        } else {
+            fprintf(stderr, "OK\n");
+        }
+        if (m)
+            mfile_close(&err, m);
+        unlink(path);
+    }
+
+    fprintf(stderr, "checking peak memory while streaming a large file\n");
+    char big[] = "/tmp/test_file_stream_XXXXXX";
+    int fd = mkstemp(big);
+    const size_t big_size = 8 * MFILE_WINDOW;
+    char* chunk = malloc(MFILE_CHUNK);
+    for (size_t off = 0; off < big_size; off += MFILE_CHUNK) {
+        for (size_t i = 0; i < MFILE_CHUNK; i++)
+            chunk[i] = 'a' + (off + i) % 26;
+        if (fd == -1 || write(fd, chunk, MFILE_CHUNK) != MFILE_CHUNK) {
+            perror("mkstemp/write");
+            return EXIT_FAILURE;
+        }
+    }
+    free(chunk);
+    close(fd);
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(stream_file(big, big_size));
+    int child;
+    struct rusage ru;
+    // ru_maxrss is in KiB. Up to two windows stay behind the cursor between
+    // checkpoints, which with the binary itself is well within half the file
+    if (wait4(pid, &child, 0, &ru) != pid || !WIFEXITED(child)
+     || WEXITSTATUS(child) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "%s: streaming failed\n", big);
+        status = EXIT_FAILURE;
+    } else if ((size_t)ru.ru_maxrss * 1024 > big_size / 2) {
+        fprintf(stderr, "%s: peak RSS %ld KiB for a %zu KiB file\n", big, ru.ru_maxrss,
+                big_size / 1024);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    unlink(big);
+
     return status;
 }
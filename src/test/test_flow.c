@@ -0,0 +1,150 @@
+
+#include "expr.h"
+#include "flow.h"
+#include "symbols.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static ExprArena a = EXPR_ARENA_INIT;
+static SymbolTable syms = SYMBOL_TABLE_INIT;
+static Flow f = FLOW_INIT;
+static Error err = ERROR_INIT;
+
+static ExprId lit(int64_t i)
+{
+    const Value v = {.type = VALUE_INTEGER, .i64 = i};
+    return expr_literal(&err, &a, &v);
+}
+
+static Symbol* define(const char* name, int64_t i)
+{
+    Symbol* s = symbol_define(&err, &syms, name, strlen(name));
+    s->type  = VALUE_INTEGER;
+    s->value = lit(i);
+    return s;
+}
+
+static ExprId var(Symbol* s)
+{
+    const uint32_t slot = flow_slot(&err, &f, &a, s);
+    return f.vars[slot].node;
+}
+
+static ExprId bin(enum operator op, ExprId l, ExprId r)
+{
+    return expr_binary(&err, &a, op, l, r);
+}
+
+static uint32_t open_stmt(enum flow_stmt_kind kind, ExprId cond)
+{
+    const FlowStmt s = {.kind = kind, .root = cond};
+    return flow_add(&err, &f, &s);
+}
+
+static void assign(Symbol* s, ExprId root)
+{
+    const uint32_t slot = flow_slot(&err, &f, &a, s);
+    const FlowStmt st = {.kind = FLOW_ASSIGN, .root = root, .slot = slot, .at = s->name};
+    flow_add(&err, &f, &st);
+}
+
+/* Index of the first instruction computing node, UINT32_MAX if none */
+static uint32_t find_eval(ExprId node)
+{
+    for (uint32_t i = 0; i < f.code_len; i++) {
+        if ((f.code[i].op == FLOW_EVAL || f.code[i].op == FLOW_EVAL_ONCE)
+         && f.code[i].node == node)
+        {
+            return i;
+        }
+    }
+    return UINT32_MAX;
+}
+
+/* Index of the branch of the while at stmt */
+static uint32_t find_branch(uint32_t stmt)
+{
+    for (uint32_t i = 0; i < f.code_len; i++) {
+        if (f.code[i].op == FLOW_BRANCH && f.code[i].stmt == stmt)
+            return i;
+    }
+    return UINT32_MAX;
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    a.overflow = OVERFLOW_WRAP; // so + and * can't fail and may be moved
+
+    fprintf(stderr, "checking nested loops and hoisting\n");
+    // while i < 3 { j = 0; while j < 4 { s = s + i * k + j; j = j + 1; } i = i + 1; }
+    Symbol* i = define("i", 0);
+    Symbol* j = define("j", 0);
+    Symbol* s = define("s", 0);
+    Symbol* k = define("k", 5);
+    const uint32_t outer = open_stmt(FLOW_WHILE, bin(OP_LT, var(i), lit(3)));
+    assign(j, lit(0));
+    const uint32_t inner = open_stmt(FLOW_WHILE, bin(OP_LT, var(j), lit(4)));
+    const ExprId ik = bin(OP_MUL, var(i), var(k));
+    const ExprId k3 = bin(OP_MUL, var(k), lit(3));
+    assign(s, bin(OP_ADD, bin(OP_ADD, var(s), ik), bin(OP_ADD, var(j), bin(OP_SUB, k3, k3))));
+    assign(j, bin(OP_ADD, var(j), lit(1)));
+    flow_close(&f, inner);
+    assign(i, bin(OP_ADD, var(i), lit(1)));
+    flow_close(&f, outer);
+    if (!error_empty(&err) || !flow_compile(&err, &f, &a) || !flow_run(&err, &f, &a, NULL, NULL, NULL)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    if (!flow_finish(&err, &f, &a) || a.nodes[s->value].value.i64 != 78
+     || a.nodes[i->value].value.i64 != 3 || i->var != EXPR_NONE || k->value != lit(5))
+    {
+        fprintf(stderr, "wrong result: s = %lld\n", (long long)a.nodes[s->value].value.i64);
+        status = EXIT_FAILURE;
+    } else if (find_eval(ik) > find_branch(inner) || find_eval(ik) < find_branch(outer)
+            || find_eval(k3) > find_branch(outer) || f.code[find_eval(k3)].op != FLOW_EVAL_ONCE
+            || f.hoisted < 2)
+    {
+        fprintf(stderr, "invariant nodes not hoisted\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    flow_free(&f);
+
+    fprintf(stderr, "checking that nodes that can fail stay in place\n");
+    // if 0 { x = 1 / z; } while n > 0 { x = 1 / z; n = n - 1; }
+    Symbol* x = define("x", 0);
+    Symbol* z = define("z", 0);
+    Symbol* n = define("n", 2);
+    const uint32_t dead = open_stmt(FLOW_IF, lit(0));
+    assign(x, bin(OP_DIV, lit(1), var(z)));
+    flow_else(&f, dead);
+    flow_close(&f, dead);
+    const uint32_t loop = open_stmt(FLOW_WHILE, bin(OP_GT, var(n), lit(0)));
+    assign(x, bin(OP_DIV, lit(1), var(z)));
+    const uint32_t failing = f.len - 1;
+    assign(n, bin(OP_SUB, var(n), lit(1)));
+    flow_close(&f, loop);
+    if (!flow_compile(&err, &f, &a)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    if (flow_run(&err, &f, &a, NULL, NULL, NULL) || error_empty(&err) || f.failed_at != f.stmts[failing].at
+     || a.nodes[n->var].value.i64 != 2)
+    {
+        fprintf(stderr, "division moved out of the loop or not reported\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    error_clear(&err);
+    flow_finish(&err, &f, &a);
+    flow_free(&f);
+
+    symbol_table_free(&syms);
+    expr_arena_free(&a);
+    return status;
+}
@@ -0,0 +1,121 @@
+
+#include "expr.h"
+#include "file_stream.h"
+#include "func.h"
+#include "parser.h"
+#include "symbols.h"
+#include "tokenizer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static ExprArena a = EXPR_ARENA_INIT;
+static SymbolTable syms = SYMBOL_TABLE_INIT;
+static FuncTable funcs = FUNC_TABLE_INIT;
+static Value last;
+
+static void keep_result(void* user, uint64_t statement, const Value* v)
+{
+    (void)user, (void)statement;
+    last = *v;
+}
+
+/* Parses and runs src, leaves the error in err */
+static bool run(Error* err, const char* src)
+{
+    Mfile* m = mfile_open_buffer(err, src, strlen(src));
+    if (!m)
+        return false;
+    TokenStream ts = tokenstream_attach(err, m);
+    Parser p = {
+        .ts        = &ts,
+        .exprs     = &a,
+        .syms      = &syms,
+        .funcs     = &funcs,
+        .on_result = keep_result,
+    };
+    bool ok = error_empty(err) && parser_run(err, &p);
+    tokenstream_close(&ts);
+    mfile_close(NULL, m);
+    return ok;
+}
+
+static bool result_is(const char* src, int64_t expect)
+{
+    Error err = ERROR_INIT;
+    last = (Value){.type = VALUE_TYPE_COUNT};
+    if (!run(&err, src)) {
+        error_print(&err);
+        error_clear(&err);
+        return false;
+    }
+    if (last.type != VALUE_INTEGER || last.i64 != expect) {
+        fprintf(stderr, "%s: expected %lld\n", src, (long long)expect);
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+
+    fprintf(stderr, "inlining small functions\n");
+    const uint32_t before = a.len;
+    if (!result_is("fn sq(x int) int { y int = x * x; return y + 1; } sq(6);", 37)
+     || !result_is("sq(2) + sq(3);", 15))
+    {
+        status = EXIT_FAILURE;
+    } else if (funcs.funcs[0].inline_root == EXPR_NONE || funcs.inlined != 3 || funcs.calls != 0) {
+        fprintf(stderr, "sq was not inlined\n");
+        status = EXIT_FAILURE;
+    } else if (!result_is("sq(6);", 37) || a.len > before + 32) {
+        fprintf(stderr, "inlined calls not deduplicated: %u nodes\n", a.len - before);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "running recursive calls on the frame stack\n");
+    if (!result_is("fn fib(n int) int { if n < 2 { return n; } return fib(n - 1) + fib(n - 2); }"
+                   "fib(20);", 6765)
+     || !result_is("fn sum(n int) int { a int = n * 2; if n == 0 { return 0; }"
+                   " b int = sum(n - 1); return a + b; } sum(4);", 20)
+     || !result_is("fn swap(a int, b int) int { if a == 0 { return b; } return swap(b - 1, a); }"
+                   "swap(3, 5);", 2))
+    {
+        status = EXIT_FAILURE;
+    } else if (funcs.funcs[1].inline_root != EXPR_NONE || funcs.frames_len != 0
+            || funcs.values_len != 0 || funcs.frames_cap > 64)
+    {
+        fprintf(stderr, "frames left behind or grown per call: %u of %u\n",
+                funcs.frames_len, funcs.frames_cap);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "bounding recursion depth\n");
+    funcs.max_depth = 100;
+    Error err = ERROR_INIT;
+    if (run(&err, "fn deep(n int) int { if n == 0 { return 0; } return 1 + deep(n - 1); }"
+                  "deep(1000);")
+     || error_empty(&err))
+    {
+        fprintf(stderr, "deep recursion not stopped\n");
+        status = EXIT_FAILURE;
+    } else if (error_clear(&err), funcs.frames_len != 0 || funcs.values_len != 0
+            || !result_is("deep(99);", 99) || !result_is("deep(50);", 50))
+    {
+        fprintf(stderr, "call stack broken after hitting the limit\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    symbol_table_free(&syms);
+    func_table_free(&funcs);
+    expr_arena_free(&a);
+    return status;
+}
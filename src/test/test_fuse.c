@@ -0,0 +1,175 @@
+
+#include "error.h"
+#include "fuse.h"
+#include "lang.h"
+#include "operator.h"
+#include "str.h"
+#include "value.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const int64_t ints[] = {
+    0, 1, -1, 2, 3, 7, -7, 31, 1000003, INT64_MAX, INT64_MIN, INT64_MAX / 2, INT64_MIN + 1,
+};
+static const double floats[] = {0.0, 1.0, -1.0, 0.5, 3.0, -2.25, 1e300, -1e300};
+
+#define INTS   (sizeof ints / sizeof *ints)
+#define FLOATS (sizeof floats / sizeof *floats)
+
+static Value pick(enum value_type type, unsigned i)
+{
+    if (type == VALUE_FLOATING)
+        return (Value){.type = VALUE_FLOATING, .f64 = floats[i % FLOATS]};
+    return (Value){.type = VALUE_INTEGER, .i64 = ints[i % INTS]};
+}
+
+static bool same_value(const Value* a, const Value* b)
+{
+    return a->type == b->type && memcmp(&a->i64, &b->i64, sizeof a->i64) == 0;
+}
+
+/* Every generated kernel against its operators run one at a time */
+static bool check_kernels(void)
+{
+    struct str_table strs = {0};
+    for (uint32_t k = 0; k < fused_count; k++) {
+        const struct fused_info* f = &fused_table[k];
+        for (int policy = 0; policy < OVERFLOW_POLICY_COUNT; policy++) {
+            for (unsigned i = 0; i < 2000; i++) {
+                const Value x = pick(f->lt, i), y = pick(f->rt, i / 13), z = pick(f->zt, i / 169);
+                Value t1 = {0}, out1 = {0}, t2 = {0}, out2 = {0};
+                Error e1 = ERROR_INIT, e2 = ERROR_INIT;
+                const bool ok1 = f->kernel(&e1, policy, &strs, &x, &y, &z, &t1, &out1);
+                const bool ok2 = fused_slow_(&e2, policy, &strs, f, &x, &y, &z, &t2, &out2);
+                const bool same = ok1 == ok2
+                               && (ok1 ? same_value(&t1, &t2) && same_value(&out1, &out2)
+                                       : error_empty(&e1) == error_empty(&e2));
+                error_clear(&e1);
+                error_clear(&e2);
+                if (!same) {
+                    fprintf(stderr, "kernel %u (%s then %s) differs for operands %u\n", k,
+                            op_table[f->inner].str, op_table[f->outer].str, i);
+                    str_table_free(&strs);
+                    return false;
+                }
+            }
+        }
+    }
+    str_table_free(&strs);
+    return true;
+}
+
+#define MAX_RESULTS 16
+
+struct results {
+    Value values[MAX_RESULTS];
+    uint32_t len;
+    char error[256];
+};
+
+static void keep_result(void* user, uint64_t statement, const Value* v)
+{
+    (void)statement;
+    struct results* r = user;
+    if (r->len < MAX_RESULTS)
+        r->values[r->len++] = *v;
+}
+
+static void run(const char* src, enum overflow_policy policy, struct results* r)
+{
+    LangOptions opts = LANG_OPTIONS_INIT;
+    opts.overflow = policy;
+    LangCtx* ctx = lang_ctx_new(&opts);
+    *r = (struct results){0};
+    lang_set_result_handler(ctx, keep_result, r);
+    if (!lang_eval_buffer(ctx, src, strlen(src)))
+        snprintf(r->error, sizeof r->error, "%s", lang_error(ctx));
+    lang_ctx_free(ctx);
+}
+
+static const char* programs[] = {
+    "fn f(n int) int { h int = 7; while n > 0 { h = (h * 31 + 12345) % 1000003;"
+    " h = h + (n % 3 == 0); n = n - 1; } return h; } f(5000);",
+    "fn g(n int) float { acc float = 0.0; x float = 1.0;"
+    " while n > 0 { acc = acc + x / 3.0; x = x * 0.5 + 1.0; n = n - 1; } return acc; } g(5000);",
+    // overflows in the middle of a fused pair
+    "fn h(n int) int { x int = 3; while n > 0 { x = x * 7 + 1; n = n - 1; } return x; } h(100);",
+    // division by zero in a fused pair
+    "fn d(n int) int { s int = 0; while n > 0 - 3 { s = s + 100 % n; n = n - 1; } return s; } d(5);",
+    // nested && and || with hoisted operands, and the jumps of their tests
+    "i int = 0; if i < 2 { (1 > 0) && ((2 > 1) && (3 > 1)); }",
+    "fn c(n int) int { s int = 0; while n > 0 { s = s + ((1 > 0) && ((2 > 1) && (n % 3 > 0)));"
+    " s = s + ((n < 0) || (n % 2 - 1 == 0)); n = n - 1; } return s; } c(9);",
+};
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    Error err = ERROR_INIT;
+
+    fprintf(stderr, "checking %u generated kernels against their operators\n", fused_count);
+    if (check_kernels()) {
+        fprintf(stderr, "OK\n");
+    } else {
+        status = EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "running loops with and without fused kernels\n");
+    char path[64];
+    snprintf(path, sizeof path, "/tmp/test_fuse_%d.profile", (int)getpid());
+    const uint32_t count = sizeof programs / sizeof *programs;
+    bool same = true;
+    for (uint32_t i = 0; i < count; i++) {
+        for (int policy = 0; policy < OVERFLOW_POLICY_COUNT; policy++) {
+            struct results fused, plain;
+            run(programs[i], policy, &fused);
+            if (!opcount_start(&err, path)) {
+                error_print(&err);
+                return EXIT_FAILURE;
+            }
+            run(programs[i], policy, &plain);
+            if (policy == OVERFLOW_ERROR && !opcount_write(&err)) {
+                error_print(&err);
+                return EXIT_FAILURE;
+            }
+            opcount_free();
+            bool ok = fused.len == plain.len && strcmp(fused.error, plain.error) == 0;
+            for (uint32_t k = 0; ok && k < fused.len; k++)
+                ok = same_value(&fused.values[k], &plain.values[k]);
+            if (!ok) {
+                fprintf(stderr, "program %u differs under policy %d: %s / %s\n", i, policy,
+                        fused.error, plain.error);
+                same = false;
+            }
+        }
+    }
+
+    // the profile adds up the runs, and has the pairs of the loops
+    FILE* f = fopen(path, "r");
+    char line[256];
+    unsigned long mul_add = 0, mod_add = 0, n;
+    while (f && fgets(line, sizeof line, f)) {
+        if (sscanf(line, "pair * int int + lhs int %lu", &n) == 1)
+            mul_add += n;
+        if (sscanf(line, "pair %% int int + rhs int %lu", &n) == 1)
+            mod_add += n;
+    }
+    if (f)
+        fclose(f);
+    unlink(path);
+    if (!same) {
+        status = EXIT_FAILURE;
+    } else if (mul_add <= 5000 || mul_add >= 5100 || mod_add != 6) {
+        fprintf(stderr, "wrong pair counts in the profile: %lu * then +, %lu %% then +\n",
+                mul_add, mod_add);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    return status;
+}
@@ -0,0 +1,236 @@
+
+#include "lang.h"
+#include "value.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct results {
+    Value last;
+    uint64_t statement;
+    int count;
+};
+
+static void keep_result(void* user, uint64_t statement, const Value* v)
+{
+    struct results* r = user;
+    r->last = *v;
+    r->statement = statement;
+    r->count++;
+}
+
+static bool eval(LangCtx* ctx, const char* src)
+{
+    return lang_eval_buffer(ctx, src, strlen(src));
+}
+
+struct dynamic {
+    int line[8], col[8];
+    enum operator op[8];
+    int count;
+};
+
+static void keep_dynamic(void* user, int line, int col, enum operator op)
+{
+    struct dynamic* d = user;
+    if (d->count < 8) {
+        d->line[d->count] = line;
+        d->col[d->count]  = col;
+        d->op[d->count]   = op;
+    }
+    d->count++;
+}
+
+struct job {
+    enum overflow_policy policy;
+    int64_t expect;
+    bool ok;
+};
+
+/* Each thread has its own context and overflow policy */
+static void* run_job(void* arg)
+{
+    struct job* j = arg;
+    LangOptions opts = LANG_OPTIONS_INIT;
+    opts.overflow = j->policy;
+    opts.threads  = 1;
+    LangCtx* ctx = lang_ctx_new(&opts);
+    if (!ctx)
+        return NULL;
+    struct results r = {0};
+    lang_set_result_handler(ctx, keep_result, &r);
+    j->ok = true;
+    for (int i = 0; i < 1000 && j->ok; i++) {
+        j->ok = eval(ctx, "x int = 9223372036854775807; x + 1;")
+             && r.last.type == VALUE_INTEGER && r.last.i64 == j->expect;
+    }
+    lang_ctx_free(ctx);
+    return NULL;
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+
+    fprintf(stderr, "keeping variables across calls\n");
+    LangCtx* ctx = lang_ctx_new(NULL);
+    struct results r = {0};
+    lang_set_result_handler(ctx, keep_result, &r);
+    if (!eval(ctx, "a int = 6;") || !eval(ctx, "b float = a * 2; b + 0.5;")
+     || r.count != 1 || r.last.type != VALUE_FLOATING || r.last.f64 != 12.5
+     || r.statement != 2 || lang_statement_count(ctx) != 3
+     || strcmp(lang_error(ctx), "") != 0)
+    {
+        fprintf(stderr, "wrong result: %s\n", lang_error(ctx));
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "running if and while statements\n");
+    LangCtx* loops = lang_ctx_new(NULL);
+    struct results lr = {0};
+    lang_set_result_handler(loops, keep_result, &lr);
+    int loop_line = 0, loop_col;
+    if (!eval(loops, "i int = 0; s int = 0;\n"
+                     "while i < 10 { if i % 2 { s = s + i; } else { s = s - 1; } i = i + 1; }\n"
+                     "if s > 100 { 0; } else if s > 10 { s; } else { 1; }")
+     || lr.count != 1 || lr.last.i64 != 20 || lr.statement != 6)
+    {
+        fprintf(stderr, "wrong result: %s\n", lang_error(loops));
+        status = EXIT_FAILURE;
+    } else if (eval(loops, "while i > 0 {\n i = i - 1;\n 10 / (i - 5);\n}")
+            || (lang_error_position(loops, &loop_line, &loop_col), loop_line != 3)
+            || !eval(loops, "i;") || lr.last.i64 != 5)
+    {
+        fprintf(stderr, "error inside a loop not reported at line 3: %d\n", loop_line);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    lang_ctx_free(loops);
+
+    fprintf(stderr, "using prefix operators and short-circuit && and ||\n");
+    LangCtx* logic = lang_ctx_new(NULL);
+    struct results gr = {0};
+    lang_set_result_handler(logic, keep_result, &gr);
+    static const struct {
+        const char* src;
+        int64_t expect;
+    } logic_cases[] = {
+        {"!1;", 0},
+        {"!0;", 1},
+        {"~1;", -2},
+        {"!0.0;", 1},
+        {"!!7 + ~~5;", 6},
+        {"1 + ~0 * 2;", -1},
+        {"z int = 0; z != 0 && 10 / z;", 0},
+        {"z == 0 || 10 / z;", 1},
+        {"!(z != 0 && 10 / z) && !z;", 1},
+        {"n int = 0; i int = 0;\n"
+         "while i < 3 { if z != 0 && 10 / z > 1 { n = n + 10; } if !z || 1 / z { n = n + 1; }\n"
+         "i = i + 1; }\nn;", 3},
+        {"fn f(a int) int { return a != 0 && 10 / a > 1; } f(0) + f(5);", 1},
+        // nested with constant operands, which are all hoisted
+        {"k int = 0; if k < 2 { (1 > 0) && ((2 > 1) && (3 > 1)); }", 1},
+        {"w int = 0; while w < 2 { (1 < 0) || ((2 < 1) || (3 > 1)); w = w + 1; }", 1},
+        {"fn g(a int) int { return (1 > 0) && ((2 > 1) && (3 > 1)); } g(0);", 1},
+    };
+    for (size_t i = 0; i < sizeof logic_cases / sizeof *logic_cases; i++) {
+        if (!eval(logic, logic_cases[i].src) || gr.last.type != VALUE_INTEGER
+         || gr.last.i64 != logic_cases[i].expect)
+        {
+            fprintf(stderr, "wrong result for \"%s\": %s\n", logic_cases[i].src,
+                    lang_error(logic));
+            status = EXIT_FAILURE;
+        }
+    }
+    const char* logic_bad[] = {"1 !2;", "~1.5;", "z == 0 && 10 / z;", "&& 1;"};
+    for (size_t i = 0; i < sizeof logic_bad / sizeof *logic_bad; i++) {
+        if (eval(logic, logic_bad[i])) {
+            fprintf(stderr, "no error for \"%s\"\n", logic_bad[i]);
+            status = EXIT_FAILURE;
+        }
+    }
+    lang_ctx_free(logic);
+    if (status == EXIT_SUCCESS)
+        fprintf(stderr, "OK\n");
+
+    fprintf(stderr, "reporting operations typed at run time\n");
+    struct dynamic dyn = {0};
+    LangOptions promote = LANG_OPTIONS_INIT;
+    promote.overflow = OVERFLOW_PROMOTE;
+    LangCtx* dynamic = lang_ctx_new(&promote);
+    lang_set_dynamic_handler(dynamic, keep_dynamic, &dyn);
+    // x * 2 is reported once, the comparison is always an integer
+    if (!eval(dynamic, "x int = 5;\ny int = x * 2 + 1;\nx * 2 < 3.5;")
+     || dyn.count != 2
+     || dyn.line[0] != 2 || dyn.col[0] != 11 || dyn.op[0] != OP_MUL
+     || dyn.line[1] != 2 || dyn.col[1] != 15 || dyn.op[1] != OP_ADD)
+    {
+        fprintf(stderr, "wrong operations reported: %d\n", dyn.count);
+        status = EXIT_FAILURE;
+    }
+    lang_ctx_free(dynamic);
+    dyn.count = 0;
+    LangCtx* typed = lang_ctx_new(NULL);
+    lang_set_dynamic_handler(typed, keep_dynamic, &dyn);
+    if (!eval(typed, "x int = 5;\ny int = x * 2 + 1;") || dyn.count != 0) {
+        fprintf(stderr, "statically typed operations reported: %d\n", dyn.count);
+        status = EXIT_FAILURE;
+    } else if (status == EXIT_SUCCESS) {
+        fprintf(stderr, "OK\n");
+    }
+    lang_ctx_free(typed);
+
+    fprintf(stderr, "reporting errors instead of exiting\n");
+    const char* bad[] = {"a / 0;", "c;", "if;", "while;", "a int = 1 +;", "(1"};
+    for (size_t i = 0; i < sizeof bad / sizeof *bad; i++) {
+        int line, col;
+        bool ok = eval(ctx, bad[i]);
+        lang_error_position(ctx, &line, &col);
+        if (ok || lang_error(ctx)[0] == '\0' || line != 1) {
+            fprintf(stderr, "no error for \"%s\"\n", bad[i]);
+            status = EXIT_FAILURE;
+        }
+    }
+    if (!eval(ctx, "a;") || r.last.i64 != 6) {
+        fprintf(stderr, "context broken after errors\n");
+        status = EXIT_FAILURE;
+    }
+    lang_ctx_reset(ctx);
+    if (eval(ctx, "a;")) {
+        fprintf(stderr, "variable kept after reset\n");
+        status = EXIT_FAILURE;
+    }
+    lang_ctx_free(ctx);
+    if (status == EXIT_SUCCESS)
+        fprintf(stderr, "OK\n");
+
+    fprintf(stderr, "running contexts on several threads\n");
+    struct job jobs[] = {
+        {OVERFLOW_WRAP,     INT64_MIN, false},
+        {OVERFLOW_SATURATE, INT64_MAX, false},
+        {OVERFLOW_WRAP,     INT64_MIN, false},
+        {OVERFLOW_SATURATE, INT64_MAX, false},
+    };
+    pthread_t threads[sizeof jobs / sizeof *jobs];
+    for (size_t i = 0; i < sizeof jobs / sizeof *jobs; i++)
+        pthread_create(&threads[i], NULL, run_job, &jobs[i]);
+    bool all_ok = true;
+    for (size_t i = 0; i < sizeof jobs / sizeof *jobs; i++) {
+        pthread_join(threads[i], NULL);
+        all_ok = all_ok && jobs[i].ok;
+    }
+    if (!all_ok) {
+        fprintf(stderr, "a thread got the wrong result\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    return status;
+}
@@ -0,0 +1,94 @@
+
+#include "mem.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHARED_BLOCKS 1000
+#define SHARED_SIZE 100
+
+struct sharer {
+    struct mem_budget* budget;
+    void* blocks[SHARED_BLOCKS];
+    int got;
+};
+
+/* Allocates blocks until the shared budget refuses one */
+static void* share_run(void* arg)
+{
+    struct sharer* s = arg;
+    mem_budget_share(s->budget);
+    for (s->got = 0; s->got < SHARED_BLOCKS; s->got++) {
+        s->blocks[s->got] = mem_alloc(MEM_EXPR, SHARED_SIZE);
+        if (!s->blocks[s->got])
+            break;
+    }
+    return NULL;
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    size_t base = mem_report(stderr);
+
+    fprintf(stderr, "allocating in every flavour\n");
+    char* a = mem_alloc(MEM_TOKEN, 10);
+    int* b  = mem_calloc(MEM_EXPR, 4, sizeof *b);
+    char* c = mem_aligned_alloc(MEM_LEXER, 64, 128);
+    if (!a || !b || !c || b[3] != 0 || ((uintptr_t)c & 63) != 0) {
+        fprintf(stderr, "bad allocation\n");
+        status = EXIT_FAILURE;
+    }
+    memcpy(a, "123456789", 10);
+    a = mem_realloc(MEM_TOKEN, a, 4096);
+    if (!a || strcmp(a, "123456789") != 0) {
+        fprintf(stderr, "realloc lost the contents\n");
+        status = EXIT_FAILURE;
+    }
+    memset(c, 0xff, 128);
+
+#ifdef MEM_TRACKING
+    fprintf(stderr, "checking outstanding allocations\n");
+    if (mem_report(stderr) != base + 3) {
+        fprintf(stderr, "expected 3 live allocations\n");
+        status = EXIT_FAILURE;
+    }
+#endif
+
+    mem_free(a);
+    mem_free(b);
+    mem_free(c);
+    mem_free(NULL);
+    if (mem_report(stderr) != base) {
+        fprintf(stderr, "allocations left after freeing\n");
+        status = EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "charging one budget from several threads\n");
+    static struct sharer sharers[4];
+    pthread_t threads[4];
+    mem_budget_start(2500 * SHARED_SIZE);
+    for (int t = 0; t < 4; t++) {
+        sharers[t].budget = mem_budget_current();
+        pthread_create(&threads[t], NULL, share_run, &sharers[t]);
+    }
+    int got = 0;
+    for (int t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+        got += sharers[t].got;
+    }
+    if (!mem_budget_stop() || got != 2500) {
+        fprintf(stderr, "threads got %d blocks within a budget of 2500\n", got);
+        status = EXIT_FAILURE;
+    }
+    for (int t = 0; t < 4; t++) {
+        for (int i = 0; i < sharers[t].got; i++)
+            mem_free(sharers[t].blocks[i]);
+    }
+
+    if (status == EXIT_SUCCESS)
+        fprintf(stderr, "OK\n");
+    return status;
+}
@@ -0,0 +1,107 @@
+
+#include "error.h"
+#include "lang.h"
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    Error err = ERROR_INIT;
+
+    fprintf(stderr, "attributing samples to the statements of a loop\n");
+    const char* prog =
+        "fn spin(n int) int {\n"
+        "    s int = 0;\n"
+        "    while n > 0 {\n"
+        "        s = s + n % 7;\n"
+        "        n = n - 1;\n"
+        "    }\n"
+        "    return s;\n"
+        "}\n"
+        "spin(3000000);\n";
+    LangCtx* ctx = lang_ctx_new(NULL);
+    if (!ctx || !profile_start(&err, 2000)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t0);
+    const bool ran = lang_eval_buffer(ctx, prog, strlen(prog));
+    profile_stop();
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+    const double cpu = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    lang_ctx_free(ctx);
+    if (!ran) {
+        fprintf(stderr, "program failed\n");
+        return EXIT_FAILURE;
+    }
+
+    char path[64];
+    snprintf(path, sizeof path, "/tmp/test_profile_%d.folded", (int)getpid());
+    FILE* report = tmpfile();
+    if (!report || !profile_write(&err, report, path)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    profile_free();
+
+    // the hottest statement is in the loop
+    char line[256];
+    rewind(report);
+    int row = 0;
+    int hot = 0;
+    while (fgets(line, sizeof line, report) && ++row < 3) {
+        // the CPU time is measured, not the samples times the rate asked for,
+        // which the timer may not deliver
+        double reported;
+        if (row == 1 && (sscanf(line, "profile: %*u samples over %lf s", &reported) != 1
+                         || reported < cpu * 0.8 || reported > cpu * 1.2))
+        {
+            fprintf(stderr, "wrong CPU time, took %.2f s: %s", cpu, line);
+            status = EXIT_FAILURE;
+        }
+    }
+    if (row != 3 || !strstr(line, " spin ")
+     || sscanf(line, "%*f%% %*f%% %d:", &hot) != 1
+     || hot < 3 || hot > 5)
+    {
+        fprintf(stderr, "wrong hottest statement: %s", row == 3 ? line : "(none)\n");
+        status = EXIT_FAILURE;
+    }
+    fclose(report);
+
+    // every stack starts at the top level call, most are in the loop
+    FILE* folded = fopen(path, "r");
+    unsigned long total = 0, loop = 0, count;
+    while (folded && fgets(line, sizeof line, folded)) {
+        const char* last = strrchr(line, ' ');
+        if (strncmp(line, "main:9:1;", 9) != 0 || !last || sscanf(last, "%lu", &count) != 1) {
+            fprintf(stderr, "malformed stack: %s", line);
+            status = EXIT_FAILURE;
+            break;
+        }
+        total += count;
+        if (strncmp(line + 9, "spin:3:", 7) == 0 || strncmp(line + 9, "spin:4:", 7) == 0
+         || strncmp(line + 9, "spin:5:", 7) == 0)
+        {
+            loop += count;
+        }
+    }
+    if (folded)
+        fclose(folded);
+    unlink(path);
+    if (total < 20 || loop * 10 < total * 8) {
+        fprintf(stderr, "%lu of %lu samples in the loop\n", loop, total);
+        status = EXIT_FAILURE;
+    }
+    if (status == EXIT_SUCCESS)
+        fprintf(stderr, "OK\n");
+
+    return status;
+}
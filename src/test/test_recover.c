@@ -0,0 +1,202 @@
+
+#include "file_stream.h"
+#include "lang.h"
+#include "value.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SEEN 4096
+
+struct seen {
+    int64_t values[MAX_SEEN];
+    uint32_t len;
+    LangDiagnostic errors[MAX_SEEN];
+    uint32_t errors_len;
+};
+
+static void keep_result(void* user, uint64_t statement, const Value* v)
+{
+    (void)statement;
+    struct seen* s = user;
+    if (s->len < MAX_SEEN)
+        s->values[s->len++] = v->i64;
+}
+
+static void keep_error(void* user, const LangDiagnostic* d)
+{
+    struct seen* s = user;
+    if (s->errors_len < MAX_SEEN) {
+        s->errors[s->errors_len] = *d;
+        s->errors[s->errors_len++].message = NULL;
+    }
+}
+
+static bool run(const char* src, uint32_t max_errors, bool pipeline, struct seen* s)
+{
+    LangOptions opts = LANG_OPTIONS_INIT;
+    opts.max_errors = max_errors;
+    opts.pipeline   = pipeline;
+    LangCtx* ctx = lang_ctx_new(&opts);
+    memset(s, 0, sizeof *s);
+    lang_set_result_handler(ctx, keep_result, s);
+    lang_set_error_handler(ctx, keep_error, s);
+    const bool ok = lang_eval_buffer(ctx, src, strlen(src));
+    lang_ctx_free(ctx);
+    return ok;
+}
+
+/* Statements of the random programs. The bad ones don't declare anything,
+ * so a program runs the same as its good statements alone */
+static const struct piece {
+    const char* src;
+    int kind; // enum lang_error_kind, or -1 for a good statement
+} pieces[] = {
+    {"x + %d;\n", -1},
+    {"x * 3 + %d;\n", -1},
+    {"(x + 1) * %d;\n", -1},
+    {"if x > 0 { x + %d; }\n", -1},
+    {"x + @ %d;\n", LANG_ERROR_LEX},
+    {"\"a;b\" $ %d;\n", LANG_ERROR_LEX},
+    {"x + %d +;\n", LANG_ERROR_SYNTAX},
+    {"while x < 0 { y + %d; }\n", LANG_ERROR_SYNTAX},
+    {"if x { x + %d \"}\"; }\n", LANG_ERROR_SYNTAX},
+    {"%d / 0;\n", LANG_ERROR_RUNTIME},
+    {"if x > 0 { x / (%d - %d); }\n", LANG_ERROR_RUNTIME},
+};
+
+#define PIECES (sizeof pieces / sizeof *pieces)
+
+/* Random programs with and without their bad statements, the good ones
+ * must give the same results and every bad one an error of its kind */
+static bool check_random(bool pipeline)
+{
+    static char all[1 << 16], good[1 << 16];
+    static struct seen a, g;
+    uint32_t seed = 12345;
+    for (int round = 0; round < 200; round++) {
+        size_t al = snprintf(all, sizeof all, "x int = 7;\n");
+        size_t gl = snprintf(good, sizeof good, "x int = 7;\n");
+        int kinds[64], bad = 0;
+        for (int i = 0; i < 60; i++) {
+            seed = seed * 1103515245 + 12345;
+            const struct piece* p = &pieces[(seed >> 16) % PIECES];
+            const int n = i;
+            al += snprintf(all + al, sizeof all - al, p->src, n, n);
+            if (p->kind < 0)
+                gl += snprintf(good + gl, sizeof good - gl, p->src, n, n);
+            else
+                kinds[bad++] = p->kind;
+        }
+        const bool ok = run(all, 1000, pipeline, &a);
+        if (!run(good, 1000, pipeline, &g) || g.errors_len != 0) {
+            fprintf(stderr, "round %d: the good statements failed\n", round);
+            return false;
+        }
+        bool same = ok == (bad == 0) && a.len == g.len && a.errors_len == (uint32_t)bad;
+        for (uint32_t i = 0; same && i < a.len; i++)
+            same = a.values[i] == g.values[i];
+        for (uint32_t i = 0; same && i < a.errors_len; i++) {
+            const LangDiagnostic* d = &a.errors[i];
+            same = (int)d->kind == kinds[i] && d->begin < d->end && d->end <= al
+                && (i == 0 || d->begin >= a.errors[i - 1].end);
+        }
+        if (!same) {
+            fprintf(stderr, "round %d: %u results and %u errors, expected %u and %d in\n%s",
+                    round, a.len, a.errors_len, g.len, bad, all);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    struct seen s;
+
+    fprintf(stderr, "checking that a statement after an error still runs\n");
+    const char* src = "x int = 2;\nx + @;\nx + 1;\n1 / 0;\nx + 2;\nx + ;\nx + 3;\n";
+    const bool ok = run(src, 10, false, &s);
+    if (ok || s.len != 3 || s.values[0] != 3 || s.values[2] != 5 || s.errors_len != 3
+     || s.errors[0].kind != LANG_ERROR_LEX || s.errors[0].line != 2 || s.errors[0].col != 5
+     || s.errors[0].statement != 1 || s.errors[0].begin != 11 || s.errors[0].end != 18
+     || s.errors[1].kind != LANG_ERROR_RUNTIME || s.errors[1].statement != 3
+     || s.errors[2].kind != LANG_ERROR_SYNTAX || s.errors[2].line != 6)
+    {
+        fprintf(stderr, "wrong results or errors: %u results, %u errors\n", s.len, s.errors_len);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "checking the error cap\n");
+    run(src, 2, false, &s);
+    if (s.errors_len != 2 || s.len != 1) {
+        fprintf(stderr, "ran on past the cap: %u results, %u errors\n", s.len, s.errors_len);
+        status = EXIT_FAILURE;
+    } else if (run(src, 0, false, &s), s.errors_len != 0 || s.len != 0) {
+        fprintf(stderr, "max_errors 0 didn't stop at the first error\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "checking recovery from a statement longer than the window\n");
+    // skipping the bad statement drops the pages behind it, and the line of
+    // the next error is counted over them
+    char path[] = "/tmp/test_recover_XXXXXX";
+    const int fd = mkstemp(path);
+    const char head[] = "1 + @ \"", tail[] = "\";\n1 + 2;\n1 + @;\n";
+    const size_t len = sizeof head - 1 + 3 * MFILE_WINDOW + sizeof tail - 1;
+    char* text = malloc(len);
+    for (size_t i = 0; i < len; i++)
+        text[i] = i % 64 ? 'y' : ';';
+    memcpy(text, head, sizeof head - 1);
+    memcpy(text + len - (sizeof tail - 1), tail, sizeof tail - 1);
+    if (fd == -1 || write(fd, text, len) != (ssize_t)len) {
+        perror("mkstemp/write");
+        return EXIT_FAILURE;
+    }
+    free(text);
+    close(fd);
+    static const enum mfile_mode modes[] = {MFILE_MODE_SEQUENTIAL, MFILE_MODE_URING};
+    bool resumed = true;
+    for (size_t i = 0; i < 2 * sizeof modes / sizeof *modes; i++) {
+        LangOptions opts = LANG_OPTIONS_INIT;
+        opts.max_errors = 10;
+        opts.pipeline   = i % 2;
+        opts.io_mode    = modes[i / 2];
+        LangCtx* ctx = lang_ctx_new(&opts);
+        memset(&s, 0, sizeof s);
+        lang_set_result_handler(ctx, keep_result, &s);
+        lang_set_error_handler(ctx, keep_error, &s);
+        lang_eval_file(ctx, path);
+        lang_ctx_free(ctx);
+        if (s.len != 1 || s.values[0] != 3 || s.errors_len != 2
+         || s.errors[0].kind != LANG_ERROR_LEX || s.errors[1].line != 3)
+        {
+            fprintf(stderr, "%s%s: %u results, %u errors\n", mfile_mode_name(opts.io_mode),
+                    opts.pipeline ? " pipelined" : "", s.len, s.errors_len);
+            resumed = false;
+        }
+    }
+    unlink(path);
+    if (resumed) {
+        fprintf(stderr, "OK\n");
+    } else {
+        status = EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "checking random programs with bad statements\n");
+    if (check_random(false) && check_random(true)) {
+        fprintf(stderr, "OK\n");
+    } else {
+        status = EXIT_FAILURE;
+    }
+
+    return status;
+}
@@ -0,0 +1,86 @@
+
+#include "results.h"
+#include "value.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ROWS (2 * RESULT_BLOCK_ROWS + 123)
+
+static Value row_value(uint64_t i)
+{
+    if (i % 3 == 0)
+        return (Value){.type = VALUE_FLOATING, .f64 = i / 7.0};
+    return (Value){.type = VALUE_INTEGER, .i64 = (int64_t)(i * 2654435761u) - INT64_MAX};
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    Error err = ERROR_INIT;
+    char path[64];
+    snprintf(path, sizeof path, "/tmp/test_results_%d.bin", (int)getpid());
+
+    fprintf(stderr, "writing %d rows\n", ROWS);
+    ResultWriter* w = result_writer_open(&err, path);
+    for (uint64_t i = 0; w && i < ROWS; i++) {
+        const Value v = row_value(i);
+        result_write_value(&err, w, i * 2, &v);
+    }
+    if (w) {
+        result_write_error(&err, w, ROWS * 2, 12, 34);
+        result_writer_close(&err, w);
+    }
+    if (!error_empty(&err)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "OK\n");
+
+    fprintf(stderr, "reading them back from the mapping\n");
+    ResultFile f;
+    ResultBlock b;
+    uint64_t row = 0;
+    int blocks = 0;
+    bool error_seen = false;
+    if (!result_file_map(&err, &f, path)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    while (result_file_next(&err, &f, &b)) {
+        blocks++;
+        if (((uintptr_t)b.payload | (uintptr_t)b.statement) % 8 != 0) {
+            fprintf(stderr, "misaligned columns\n");
+            status = EXIT_FAILURE;
+        }
+        for (uint32_t i = 0; i < b.rows; i++, row++) {
+            if (b.tag[i] == RESULT_ERROR) {
+                error_seen = row == ROWS && b.statement[i] == ROWS * 2
+                          && b.payload[i] == ((uint64_t)12 << 32 | 34);
+                continue;
+            }
+            const Value want = row_value(row);
+            const Value got  = result_value(&b, i);
+            if (b.statement[i] != row * 2 || got.type != want.type
+             || memcmp(&got.i64, &want.i64, sizeof got.i64) != 0)
+            {
+                fprintf(stderr, "row %llu differs\n", (unsigned long long)row);
+                status = EXIT_FAILURE;
+                break;
+            }
+        }
+    }
+    result_file_unmap(&f);
+    unlink(path);
+    if (!error_empty(&err) || row != ROWS + 1 || blocks != 3 || !error_seen) {
+        error_print(&err);
+        fprintf(stderr, "read %llu rows in %d blocks\n", (unsigned long long)row, blocks);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    return status;
+}
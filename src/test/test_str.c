@@ -0,0 +1,116 @@
+
+#include "lang.h"
+#include "str.h"
+#include "value.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static Value last;
+
+static void keep_result(void* user, uint64_t statement, const Value* v)
+{
+    (void)user, (void)statement;
+    last = *v;
+}
+
+static bool is(const Value* v, const char* expect)
+{
+    size_t len;
+    const char* bytes = str_bytes(NULL, v, &len);
+    return v->type == VALUE_STRING && bytes && len == strlen(expect)
+        && memcmp(bytes, expect, len) == 0;
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    Error err = ERROR_INIT;
+    StrTable t = STR_TABLE_INIT;
+
+    fprintf(stderr, "storing short strings inline and long ones in place\n");
+    static const char src[] = "a literal too long to be inline";
+    Value small, big, again;
+    if (!str_make(&err, &t, "hello", 5, true, &small)
+     || !str_make(&err, &t, src, sizeof src - 1, true, &big)
+     || !str_make(&err, &t, src, sizeof src - 1, false, &again))
+    {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    if (small.small_len != 5 || t.len != 1 || big.str->bytes != src || again.str != big.str
+     || !is(&small, "hello") || !is(&big, src))
+    {
+        fprintf(stderr, "literal copied or not interned\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "appending in linear time with ropes\n");
+    Value s = {.type = VALUE_STRING};
+    const Value piece = small;
+    const int n = 100000;
+    for (int i = 0; i < n && str_concat(&err, &t, &s, &piece, &s); i++)
+        ;
+    size_t len;
+    const char* bytes = str_bytes(&err, &s, &len);
+    if (!bytes || len != 5u * n || memcmp(bytes + len - 10, "hellohello", 10) != 0
+     || t.flattened != 1 || t.ropes > (uint64_t)n)
+    {
+        fprintf(stderr, "wrong rope: %zu bytes, %llu flattened\n", len,
+                (unsigned long long)t.flattened);
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "comparing interned strings\n");
+    Value head, tail, joined, other;
+    bool eq = false;
+    int cmp = 0;
+    if (!str_make(&err, &t, "a literal too ", 14, false, &head)
+     || !str_make(&err, &t, "long to be inline", 17, false, &tail)
+     || !str_concat(&err, &t, &head, &tail, &joined)
+     || !str_equal(&err, &joined, &big, &eq)
+     || !str_make(&err, &t, "a literal too long to be inlinf", 31, false, &other)
+     || !str_compare(&err, &big, &other, &cmp))
+    {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    if (!eq || joined.str->interned != big.str || cmp >= 0) {
+        fprintf(stderr, "equal strings not interned or wrongly ordered\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    str_table_free(&t);
+
+    fprintf(stderr, "running string programs\n");
+    LangCtx* ctx = lang_ctx_new(NULL);
+    lang_set_result_handler(ctx, keep_result, NULL);
+    const char* prog =
+        "fn rep(s str, n int) str { r str = \"\"; while n > 0 { r = r + s; n = n - 1; } return r; }\n"
+        "line str = \"report line number \" + \"one\\n\";\n";
+    if (!lang_eval_buffer(ctx, prog, strlen(prog))
+     || !lang_eval_buffer(ctx, "rep(line, 3);", 13)
+     || !is(&last, "report line number one\nreport line number one\nreport line number one\n")
+     || !lang_eval_buffer(ctx, "rep(\"ab\", 2) == \"abab\";", 23)
+     || last.type != VALUE_INTEGER || last.i64 != 1)
+    {
+        fprintf(stderr, "wrong result: %s\n", lang_error(ctx));
+        status = EXIT_FAILURE;
+    } else if (lang_eval_buffer(ctx, "\"a\" + 1;", 8) || lang_eval_buffer(ctx, "x float = \"a\";", 14)
+            || lang_eval_buffer(ctx, "\"\\q\";", 5))
+    {
+        fprintf(stderr, "string mixed with numbers or bad escape accepted\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+    lang_ctx_free(ctx);
+
+    return status;
+}
@@ -0,0 +1,71 @@
+
+#include "token_ring.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_SLOTS (TOKEN_RING_SIZE * 64 + 7)
+
+static void* produce(void* arg)
+{
+    TokenRing* r = arg;
+    for (uint64_t i = 0; i < N_SLOTS; i++) {
+        struct token_slot s = {.start = i, .len = (uint32_t)i * 3, .type = i % 11};
+        if (!token_ring_push(r, s))
+            return NULL;
+    }
+    token_ring_publish(r);
+    return NULL;
+}
+
+/* Pushes until the consumer closes the ring */
+static void* produce_forever(void* arg)
+{
+    TokenRing* r = arg;
+    struct token_slot s = {0};
+    while (token_ring_push(r, s))
+        s.start++;
+    return NULL;
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    Error err = ERROR_INIT;
+
+    fprintf(stderr, "passing %d slots between threads\n", N_SLOTS);
+    TokenRing* r = token_ring_new(&err);
+    if (!r) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    pthread_t t;
+    pthread_create(&t, NULL, produce, r);
+    uint64_t i;
+    for (i = 0; i < N_SLOTS; i++) {
+        struct token_slot s;
+        token_ring_pop(r, &s);
+        if (s.start != i || s.len != (uint32_t)i * 3 || s.type != i % 11) {
+            fprintf(stderr, "slot %lu out of order: got %lu\n", i, s.start);
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    pthread_join(t, NULL);
+    token_ring_free(r);
+    if (status == EXIT_SUCCESS)
+        fprintf(stderr, "OK\n");
+
+    fprintf(stderr, "closing ring with a blocked producer\n");
+    r = token_ring_new(&err);
+    pthread_create(&t, NULL, produce_forever, r);
+    struct token_slot s;
+    for (i = 0; i < 10; i++)
+        token_ring_pop(r, &s);
+    token_ring_close(r);
+    pthread_join(t, NULL);
+    token_ring_free(r);
+    fprintf(stderr, "OK\n");
+
+    return status;
+}
@@ -1,7 +1,57 @@
 
+#include <stdio.h>
 #include <stdlib.h>
 #include "error.h"
 #include "file_stream.h"
+#include "tokenizer.h"
+
+static const enum token_type expected[] = {
+    TOKEN_IDENTIFIER, TOKEN_IDENTIFIER, TOKEN_OPERATOR, TOKEN_INTEGER,
+    TOKEN_OPERATOR, TOKEN_PAREN_OPEN, TOKEN_FLOATING, TOKEN_PAREN_CLOSE,
+    TOKEN_STATEMENT_END, TOKEN_IF, TOKEN_STATEMENT_END, TOKEN_EOF,
+};
+#define EXPECTED (sizeof expected / sizeof *expected)
+
+/* Peeks every distance at every position and checks against expected */
+static int check_lookahead(const char* path, bool pipelined)
+{
+    Error err = ERROR_INIT;
+    Mfile* m = mfile_open(&err, (char*)path);
+    TokenStream ts = pipelined ? tokenstream_attach_pipelined(&err, m)
+                               : tokenstream_attach(&err, m);
+    if (!error_empty(&err)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    const char* start = NULL;
+    for (size_t i = 0; i < EXPECTED; i++) {
+        for (uint32_t k = 0; k < TOKENSTREAM_LOOKAHEAD; k++) {
+            size_t j = i + k < EXPECTED ? i + k : EXPECTED - 1;
+            if (tokenstream_peek(&ts, k)->type != expected[j]) {
+                fprintf(stderr, "token %zu, peek %u: wrong type\n", i, k);
+                status = EXIT_FAILURE;
+            }
+        }
+        if (tokenstream_cur(&ts) != tokenstream_peek(&ts, 0)) {
+            fprintf(stderr, "token %zu: peek(0) is not the current token\n", i);
+            status = EXIT_FAILURE;
+        }
+        if (start && tokenstream_cur(&ts)->start <= start) {
+            fprintf(stderr, "token %zu: out of order\n", i);
+            status = EXIT_FAILURE;
+        }
+        start = tokenstream_cur(&ts)->start;
+        if (i + 1 < EXPECTED && !tokenstream_advance(&err, &ts)) {
+            error_print(&err);
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    tokenstream_close(&ts);
+    mfile_close(&err, m);
+    return status;
+}
 
 int main(int argc, char** argv)
 {
@@ -22,6 +72,19 @@ int main(int argc, char** argv)
         status = EXIT_FAILURE;
     }
 
+    const char* path = "lookahead.txt";
+    FILE* f = fopen(path, "w");
+    fputs("i int = 12 * (3.5); if;", f);
+    fclose(f);
+    for (int pipelined = 0; pipelined < 2; pipelined++) {
+        fprintf(stderr, "checking %s lookahead\n", pipelined ? "pipelined" : "serial");
+        if (check_lookahead(path, pipelined) != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+        } else {
+            fprintf(stderr, "OK\n");
+        }
+    }
+    remove(path);
 
     return status;
 }
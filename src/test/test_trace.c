@@ -0,0 +1,77 @@
+
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPANS 10000 // more than one chunk
+
+static void* worker(void* arg)
+{
+    (void)arg;
+    trace_thread_name("worker");
+    for (int i = 0; i < SPANS; i++)
+        trace_end(trace_begin("work"));
+    return NULL;
+}
+
+static int count(const char* text, const char* needle)
+{
+    int n = 0;
+    for (const char* p = text; (p = strstr(p, needle)); p++)
+        n++;
+    return n;
+}
+
+int main()
+{
+    int status = EXIT_SUCCESS;
+    const char* path = "trace_test.json";
+
+    fprintf(stderr, "checking that disabled spans are not recorded\n");
+    TraceSpan off = trace_begin("off");
+    trace_end(off);
+    if (off.name != NULL) {
+        fprintf(stderr, "span recorded while tracing is off\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    fprintf(stderr, "recording spans on two threads\n");
+    trace_start();
+    trace_thread_name("main");
+    TraceSpan outer = trace_begin("outer \"quoted\"");
+    pthread_t t;
+    pthread_create(&t, NULL, worker, NULL);
+    pthread_join(t, NULL);
+    trace_end(outer);
+
+    Error err = ERROR_INIT;
+    if (!trace_write(&err, path)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    trace_free();
+
+    FILE* f = fopen(path, "r");
+    static char text[4 << 20];
+    size_t len = fread(text, 1, sizeof text - 1, f);
+    text[len] = '\0';
+    fclose(f);
+    remove(path);
+
+    if (count(text, "\"name\":\"work\"") != SPANS
+     || count(text, "\"name\":\"outer \\\"quoted\\\"\"") != 1
+     || count(text, "\"ph\":\"M\"") != 2
+     || count(text, "\"name\":\"off\"") != 0)
+    {
+        fprintf(stderr, "unexpected trace contents\n");
+        status = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "OK\n");
+    }
+
+    return status;
+}
@@ -0,0 +1,127 @@
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "mem.h"
+#include "token_ring.h"
+#include "trace.h"
+
+#define TOKEN_RING_SPIN 256
+
+static void futex_wait(_Atomic uint32_t* addr, uint32_t val)
+{
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t* addr)
+{
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+TokenRing* token_ring_new(Error* err)
+{
+    TokenRing* r = mem_aligned_alloc(MEM_LEXER, CACHE_LINE, sizeof *r);
+    if (!r) {
+        error_push(err, "failed to allocate token ring: %s", strerror(errno));
+        return NULL;
+    }
+    memset(r, 0, sizeof *r);
+    return r;
+}
+
+void token_ring_free(TokenRing* r)
+{
+    if (!r)
+        return;
+    error_clear(&r->err);
+    mem_free(r);
+}
+
+/* The store and the load of the waiting flag are both seq_cst, so either the
+ * sleeper sees the new index before it sleeps or we see its flag */
+void token_ring_publish_tail_(TokenRing* r)
+{
+    atomic_store(&r->tail, r->tail_local);
+    if (atomic_load(&r->consumer_waiting))
+        futex_wake(&r->tail);
+}
+
+void token_ring_publish_head_(TokenRing* r)
+{
+    atomic_store(&r->head, r->head_local);
+    if (atomic_load(&r->producer_waiting))
+        futex_wake(&r->head);
+}
+
+bool token_ring_wait_space_(TokenRing* r)
+{
+    // the consumer might be waiting for the slots we have not published
+    token_ring_publish_tail_(r);
+
+    for (int spin = 0; ; spin++) {
+        if (atomic_load_explicit(&r->closed, memory_order_acquire))
+            return false;
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (r->tail_local - head != TOKEN_RING_SIZE) {
+            r->head_cache = head;
+            return true;
+        }
+        if (spin < TOKEN_RING_SPIN) {
+            cpu_relax();
+            continue;
+        }
+        atomic_store(&r->producer_waiting, 1);
+        if (atomic_load(&r->head) == head && !atomic_load(&r->closed)) {
+            TraceSpan span = trace_begin("ring full");
+            futex_wait(&r->head, head);
+            trace_end(span);
+        }
+        atomic_store_explicit(&r->producer_waiting, 0, memory_order_relaxed);
+    }
+}
+
+void token_ring_wait_data_(TokenRing* r)
+{
+    // the producer might be waiting for the slots we have not released
+    token_ring_publish_head_(r);
+
+    for (int spin = 0; ; spin++) {
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (tail != r->head_local) {
+            r->tail_cache = tail;
+            return;
+        }
+        if (spin < TOKEN_RING_SPIN) {
+            cpu_relax();
+            continue;
+        }
+        atomic_store(&r->consumer_waiting, 1);
+        if (atomic_load(&r->tail) == tail) {
+            TraceSpan span = trace_begin("ring empty");
+            futex_wait(&r->tail, tail);
+            trace_end(span);
+        }
+        atomic_store_explicit(&r->consumer_waiting, 0, memory_order_relaxed);
+    }
+}
+
+void token_ring_close(TokenRing* r)
+{
+    atomic_store(&r->closed, 1);
+    // head has to change so a producer that is just about to sleep on the
+    // old value returns from futex_wait. The index is unused after closing
+    atomic_fetch_add(&r->head, 1);
+    futex_wake(&r->head);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+
+/* Single producer single consumer ring of compact tokens, used to run the
+ * lexer on its own thread. The producer and consumer indices live on separate
+ * cache lines and are published in batches, so the lines only bounce once per
+ * TOKEN_RING_BATCH tokens. Either side spins briefly and then sleeps on a
+ * futex when the ring is full or empty. */
+
+#define CACHE_LINE 64
+#define TOKEN_RING_SIZE 4096 // power of two
+#define TOKEN_RING_MASK (TOKEN_RING_SIZE - 1)
+#define TOKEN_RING_BATCH 64
+
+#define TOKEN_SLOT_ERROR 1 // ring->err holds the error for this token
+
+struct token_slot {
+    uint64_t start; // offset into Mfile.data
+    uint32_t len;
+    uint16_t type;
+    uint8_t op;
+    uint8_t flags;
+};
+
+typedef struct token_ring {
+    // written by the consumer
+    _Alignas(CACHE_LINE) _Atomic uint32_t head;
+    uint32_t head_local;
+    uint32_t tail_cache;
+
+    // written by the producer
+    _Alignas(CACHE_LINE) _Atomic uint32_t tail;
+    uint32_t tail_local;
+    uint32_t head_cache;
+
+    // rarely written
+    _Alignas(CACHE_LINE) _Atomic uint32_t consumer_waiting;
+    _Atomic uint32_t producer_waiting;
+    _Atomic uint32_t closed; // consumer is gone, producer should stop
+    Error err;
+
+    _Alignas(CACHE_LINE) struct token_slot slots[TOKEN_RING_SIZE];
+} TokenRing;
+
+/* Allocates a cache line aligned, empty ring */
+TokenRing* token_ring_new(Error* err);
+void token_ring_free(TokenRing* r);
+
+/* Slow paths, see token_ring.c */
+bool token_ring_wait_space_(TokenRing* r);
+void token_ring_wait_data_(TokenRing* r);
+void token_ring_publish_tail_(TokenRing* r);
+void token_ring_publish_head_(TokenRing* r);
+
+/* Producer: make pushed slots visible to the consumer */
+static inline void token_ring_publish(TokenRing* r)
+{
+    if (r->tail_local != atomic_load_explicit(&r->tail, memory_order_relaxed))
+        token_ring_publish_tail_(r);
+}
+
+/* Producer: queue a slot, blocks while the ring is full. Returns false if the
+ * consumer closed the ring. Slots are published every TOKEN_RING_BATCH pushes
+ * or by token_ring_publish */
+static inline bool token_ring_push(TokenRing* r, struct token_slot s)
+{
+    if (__builtin_expect(r->tail_local - r->head_cache == TOKEN_RING_SIZE, 0)) {
+        if (!token_ring_wait_space_(r))
+            return false;
+    }
+    r->slots[r->tail_local & TOKEN_RING_MASK] = s;
+    r->tail_local++;
+    if ((r->tail_local & (TOKEN_RING_BATCH - 1)) == 0)
+        token_ring_publish_tail_(r);
+    return true;
+}
+
+/* Consumer: take the next slot, blocks while the ring is empty */
+static inline void token_ring_pop(TokenRing* r, struct token_slot* out)
+{
+    if (__builtin_expect(r->head_local == r->tail_cache, 0))
+        token_ring_wait_data_(r);
+    *out = r->slots[r->head_local & TOKEN_RING_MASK];
+    r->head_local++;
+    if ((r->head_local & (TOKEN_RING_BATCH - 1)) == 0)
+        token_ring_publish_head_(r);
+}
+
+/* Consumer: stop the producer, it returns false from its next blocking push */
+void token_ring_close(TokenRing* r);
@@ -3,12 +3,16 @@
 #include "file_stream.h"
 #include "tokenizer.h"
 #include "printable.h"
+#include "token_ring.h"
+#include "trace.h"
+#include "mem.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,7 +24,7 @@
 static const bool is_operator[256] = {
     ['+'] = 1, ['-'] = 1, ['*'] = 1, ['/'] = 1, ['='] = 1, ['%'] = 1,
     ['&'] = 1, ['|'] = 1, ['<'] = 1, ['>'] = 1, ['!'] = 1, ['^'] = 1,
-    ['('] = 1, [')'] = 1, ['~'] = 1
+    ['~'] = 1
 };
 
 static void token_read_operator(Error* err, Mfile* m, Token* t)
@@ -28,9 +32,15 @@ static void token_read_operator(Error* err, Mfile* m, Token* t)
     (void)err;
     t->type = TOKEN_OPERATOR;
     t->start = mfile_cur(m);
-    while (!mfile_eof(m) && is_operator[(unsigned char)mfile_get(m)])
-        /* NOOP */;
-    mfile_decr_pos(m);
+
+    const int a = mfile_curchar(m);
+    mfile_inc_pos(m);
+    const int b = mfile_curchar(m);
+    int len;
+    t->op = operator_lex(a, b, &len);
+    if (len == 2)
+        mfile_inc_pos(m);
+
     t->end = mfile_cur(m);
 }
 
@@ -39,9 +49,6 @@ static void token_read_number(Error* err, Mfile* m, Token* t)
     (void)err;
     t->start = mfile_cur(m);
 
-    if (mfile_curchar(m) == '-') {
-        mfile_inc_pos(m);
-    }
     mfile_skip(m, isdigit);
     if (mfile_curchar(m) == '.') {
         t->type = TOKEN_FLOATING;
@@ -60,11 +67,14 @@ static void token_read_string(Error* err, Mfile* m, Token* t)
 
     mfile_inc_pos(m);
     bool escaped = false;
-    while (!mfile_eof(m) && (mfile_curchar(m) != '"' || escaped)) {
-        escaped = mfile_get(m) == '\\';
+    int c;
+    while ((c = mfile_curchar(m)) != '\0' && (c != '"' || escaped)) {
+        escaped = c == '\\' && !escaped;
+        mfile_inc_pos(m);
     }
-    if (mfile_curchar(m) != '"') {
-        error_push(err, "expected '\"', got %c", PRINTABLE(*(mfile_cur(m))));
+    if (c != '"') {
+        error_push(err, "expected '\"', got %s",
+                mfile_eof(m) ? PRINTABLE(EOF) : PRINTABLE(c));
         return;
     }
     mfile_inc_pos(m);
@@ -84,27 +94,26 @@ static void token_read_keyword_or_identifier(Error* err, Mfile* m, Token* t)
     t->end = mfile_cur(m);
 
 #define IS_KEYWORD(s) \
-    (memcmp(t->start, s, \
-            MIN((ssize_t)(sizeof(s)-1), (ssize_t)(t->end - t->start))) == 0)
+    (t->end - t->start == sizeof(s) - 1 && memcmp(t->start, s, sizeof(s) - 1) == 0)
     if (IS_KEYWORD("if")) {
         t->type = TOKEN_IF;
+    } else if (IS_KEYWORD("else")) {
+        t->type = TOKEN_ELSE;
     } else if (IS_KEYWORD("while")) {
-        fprintf(stderr, "while statements not implemented\n");
-        exit(1);
+        t->type = TOKEN_WHILE;
+    } else if (IS_KEYWORD("fn")) {
+        t->type = TOKEN_FN;
+    } else if (IS_KEYWORD("return")) {
+        t->type = TOKEN_RETURN;
     } else {
         t->type = TOKEN_IDENTIFIER;
     }
 #undef IS_KEYWORD
 }
 
-Token* token_read(Error* err, Mfile* m)
+void token_read_into(Error* err, Mfile* m, Token* t)
 {
-    Token* t = calloc(1, sizeof *t);
-    if (!t) {
-        error_push(err, "failed to allocate token: %s", strerror(errno));
-        return NULL;
-    }
-
+    mfile_checkpoint(m);
     mfile_skip(m, isspace);
     const int c = mfile_curchar(m);
 
@@ -127,17 +136,36 @@ Token* token_read(Error* err, Mfile* m)
         t->start = mfile_cur(m);
         mfile_inc_pos(m);
         t->end = mfile_cur(m);
+    } else if (c == '{') {
+        t->type = TOKEN_BLOCK_OPEN;
+        t->start = mfile_cur(m);
+        mfile_inc_pos(m);
+        t->end = mfile_cur(m);
+    } else if (c == '}') {
+        t->type = TOKEN_BLOCK_CLOSE;
+        t->start = mfile_cur(m);
+        mfile_inc_pos(m);
+        t->end = mfile_cur(m);
+    } else if (c == ',') {
+        t->type = TOKEN_COMMA;
+        t->start = mfile_cur(m);
+        mfile_inc_pos(m);
+        t->end = mfile_cur(m);
     } else if (isdigit(c)) {  // signs are handled by parser.c
         token_read_number(err, m, t);
     } else if (is_operator[c]) {
         token_read_operator(err, m, t);
-    } else if (c == EOF) {
+    } else if (c == '\0' && mfile_eof(m)) {
         t->type = TOKEN_EOF;
+        t->start = mfile_cur(m);
+        t->end = mfile_cur(m);
+        mfile_error(err, m);
     } else {
+        t->type = TOKEN_UNKNOWN;
+        t->start = mfile_cur(m);
+        t->end = t->start + 1;
         error_push(err, "unexpected character: %s (0x%02x)", PRINTABLE(c), c);
     }
-
-    return t;
 }
 
 void token_print(Error* err, Token* t)
@@ -160,18 +188,130 @@ void token_print(Error* err, Token* t)
     fprintf(stderr, "\"]\n");
 }
 
-char* token_str(Token* t)
+struct token_pipe {
+    TokenRing* ring;
+    Mfile* m;
+    pthread_t thread;
+    struct mem_budget* budget; // of the thread that started the pipe
+};
+/* Lexer thread, runs until TOKEN_EOF, the first error or until the consumer
+ * closes the ring */
+static void* token_pipe_run(void* arg)
 {
-    static __thread char buf[512];
-    memcpy(buf, t->start, t->end - t->start);
-    buf[t->start - t->end] = '\0';
-    return buf;
+    struct token_pipe* p = arg;
+    Mfile* m = p->m;
+
+    mem_budget_share(p->budget);
+    trace_thread_name("lexer");
+    TraceSpan span = trace_begin("lex");
+    for (;;) {
+        Error err = ERROR_INIT;
+        Token t = {.start = NULL, .end = NULL, .type = TOKEN_UNKNOWN, .op = OP_NONE};
+        token_read_into(&err, m, &t);
+
+        struct token_slot slot = {
+            .start = (t.start ? t.start : mfile_cur(m)) - m->data,
+            .len   = t.end && t.start ? t.end - t.start : 0,
+            .type  = t.type,
+            .op    = t.op,
+            .flags = 0,
+        };
+        if (!error_empty(&err)) {
+            // published together with the slot below
+            p->ring->err = err;
+            slot.flags   = TOKEN_SLOT_ERROR;
+        }
+        if (!token_ring_push(p->ring, slot))
+            break;
+        if (slot.flags || t.type == TOKEN_EOF) {
+            token_ring_publish(p->ring);
+            break;
+        }
+        if (t.type == TOKEN_STATEMENT_END || t.type == TOKEN_BLOCK_CLOSE) {
+            // a statement is complete, don't let it sit in the batch while
+            // the lexer blocks on slow input
+            token_ring_publish(p->ring);
+            trace_end(span);
+            span = trace_begin("lex");
+        }
+    }
+    trace_end(span);
+    return NULL;
+}
+
+static void token_pipe_read(Error* err, struct token_pipe* p, Token* t)
+{
+    struct token_slot slot;
+    token_ring_pop(p->ring, &slot);
+    t->type  = slot.type;
+    t->op    = slot.op;
+    t->start = p->m->data + slot.start;
+    t->end   = t->start + slot.len;
+    if (slot.flags & TOKEN_SLOT_ERROR) {
+        error_append(err, &p->ring->err);
+    }
+}
+
+#define AHEAD_MASK (TOKENSTREAM_LOOKAHEAD - 1)
+
+/* Lexes one more token onto the end of the ring */
+static void tokenstream_fill(TokenStream* ts)
+{
+    Token* t = &ts->ahead[(ts->head + ts->len) & AHEAD_MASK];
+    if (ts->done) {
+        *t = ts->ahead[(ts->head + ts->len - 1) & AHEAD_MASK];
+        ts->len++;
+        return;
+    }
+
+    Error err = ERROR_INIT;
+    *t = (Token){.start = NULL, .end = NULL, .type = TOKEN_UNKNOWN, .op = OP_NONE};
+    if (ts->pipe) {
+        token_pipe_read(&err, ts->pipe, t);
+    } else {
+        token_read_into(&err, ts->m, t);
+    }
+    if (!t->start) {
+        t->start = t->end = mfile_cur(ts->m);
+    }
+    if (!error_empty(&err)) {
+        ts->pending    = err;
+        ts->pending_at = ts->len;
+        ts->done       = true;
+    }
+    if (t->type == TOKEN_EOF) {
+        ts->done = true;
+    }
+    ts->len++;
+}
+
+/* Hands over the held back error once its token is current */
+static bool tokenstream_check(Error* err, TokenStream* ts)
+{
+    if (error_empty(&ts->pending) || ts->pending_at != 0)
+        return true;
+    error_append(err, &ts->pending);
+    ts->failed = true;
+    return false;
+}
+
+Token* tokenstream_peek(TokenStream* ts, uint32_t k)
+{
+    assert(k < TOKENSTREAM_LOOKAHEAD);
+    while (ts->len <= k)
+        tokenstream_fill(ts);
+    return &ts->ahead[(ts->head + k) & AHEAD_MASK];
 }
 
 bool tokenstream_advance(Error* err, TokenStream* ts)
 {
-    ts->cur = token_read(err, ts->m);
-    if (!error_empty(err)) {
+    ts->head = (ts->head + 1) & AHEAD_MASK;
+    ts->len--;
+    if (!error_empty(&ts->pending))
+        ts->pending_at--;
+    if (ts->len == 0)
+        tokenstream_fill(ts);
+    if (!tokenstream_check(err, ts)) {
         error_push(err, "failed");
         return false;
     }
@@ -180,19 +320,137 @@ bool tokenstream_advance(Error* err, TokenStream* ts)
 
 TokenStream tokenstream_attach(Error* err, Mfile* m)
 {
-    TokenStream ts = {.cur = NULL, .m = m};
-    ts.cur = token_read(err, m);
+    TokenStream ts = {.m = m, .pending = ERROR_INIT};
+    tokenstream_fill(&ts);
+    tokenstream_check(err, &ts);
+    return ts;
+}
+
+/* Starts the lexer thread of a stream that has none */
+static bool tokenstream_pipe(Error* err, TokenStream* ts)
+{
+    struct token_pipe* p = mem_calloc(MEM_LEXER, 1, sizeof *p);
+    if (!p) {
+        error_push(err, "failed to allocate token pipe: %s", strerror(errno));
+        return false;
+    }
+    p->m = ts->m;
+    p->budget = mem_budget_current();
+    p->ring = token_ring_new(err);
+    if (!p->ring) {
+        mem_free(p);
+        return false;
+    }
+    int ok = pthread_create(&p->thread, NULL, token_pipe_run, p);
+    if (ok != 0) {
+        error_push(err, "failed to start lexer thread: %s", strerror(ok));
+        token_ring_free(p->ring);
+        mem_free(p);
+        return false;
+    }
+    ts->pipe = p;
+    return true;
+}
+
+TokenStream tokenstream_attach_pipelined(Error* err, Mfile* m)
+{
+    TokenStream ts = {.m = m, .pending = ERROR_INIT};
+    if (!tokenstream_pipe(err, &ts))
+        return ts;
+    tokenstream_fill(&ts);
+    tokenstream_check(err, &ts);
     return ts;
 }
 
+void tokenstream_detach(TokenStream* ts)
+{
+    struct token_pipe* p = ts->pipe;
+    if (!p)
+        return;
+    token_ring_close(p->ring);
+    pthread_join(p->thread, NULL);
+    token_ring_free(p->ring);
+    mem_free(p);
+    ts->pipe = NULL;
+}
+
+void tokenstream_close(TokenStream* ts)
+{
+    tokenstream_detach(ts);
+    error_clear(&ts->pending);
+}
+
 Token* tokenstream_cur(TokenStream* ts)
 {
-    return ts->cur;
+    return &ts->ahead[ts->head];
+}
+
+/* Moves m past the end of a statement as tokenstream_skip_statement does,
+ * one byte at a time. An unterminated string runs to the end of input */
+static void skip_statement_bytes(Mfile* m, uint32_t blocks)
+{
+    bool string = false, escaped = false;
+    int c;
+    while ((c = mfile_get(m)) != EOF) {
+        mfile_checkpoint(m);
+        if (string) {
+            string  = c != '"' || escaped;
+            escaped = c == '\\' && !escaped;
+        } else if (c == '"') {
+            string = true;
+        } else if (c == '{') {
+            blocks++;
+        } else if (c == '}' && blocks > 0) {
+            if (--blocks == 0)
+                return;
+        } else if (c == ';' && blocks == 0) {
+            return;
+        }
+    }
+}
+
+/* Throws away the lexed tokens and what the lexer thread holds, and lexes
+ * again from the end of the statement the failed token is in */
+static bool tokenstream_relex(Error* err, TokenStream* ts, uint32_t blocks)
+{
+    Mfile* m = ts->m;
+    const bool pipelined = ts->pipe != NULL;
+    const size_t bad = tokenstream_cur(ts)->start - m->data;
+    tokenstream_close(ts);
+    *ts = (TokenStream){.m = m, .pending = ERROR_INIT};
+
+    // pages the streamed modes dropped behind the cursor are read back in
+    m->pos = bad + 1;
+    skip_statement_bytes(m, blocks);
+    if (pipelined && !tokenstream_pipe(err, ts))
+        return false;
+    tokenstream_fill(ts);
+    if (!tokenstream_check(err, ts)) {
+        error_push(err, "failed");
+        return false;
+    }
+    return true;
 }
 
-Token* tokenstream_get(Error* err, TokenStream* ts)
+bool tokenstream_skip_statement(Error* err, TokenStream* ts, uint32_t blocks)
 {
-    Token* cur = tokenstream_cur(ts);
-    tokenstream_advance(err, ts);
-    return cur;
+    for (;;) {
+        const Token* t = tokenstream_cur(ts);
+        if (t->type == TOKEN_EOF)
+            return true;
+        if (ts->failed)
+            return tokenstream_relex(err, ts, blocks);
+        if (t->type == TOKEN_BLOCK_OPEN) {
+            blocks++;
+        } else if (t->type == TOKEN_BLOCK_CLOSE && blocks > 0) {
+            if (--blocks == 0)
+                return tokenstream_advance(err, ts);
+        } else if (t->type == TOKEN_STATEMENT_END && blocks == 0) {
+            return tokenstream_advance(err, ts);
+        }
+        // a lexer error before the end is part of the skipped statement
+        Error skipped = ERROR_INIT;
+        tokenstream_advance(&skipped, ts);
+        error_clear(&skipped);
+    }
 }
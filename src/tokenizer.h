@@ -1,6 +1,7 @@
 #pragma once
 
 #include "file_stream.h"
+#include "operator.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -10,17 +11,24 @@ enum token_type {
     TOKEN_STRING,        // "[^"]*"
     TOKEN_INTEGER,       // [0-9]+
     TOKEN_FLOATING,      // [0-9]+\.[0-9]*
-    TOKEN_OPERATOR,      // '+' | '-' | '*' | '/'
+    TOKEN_OPERATOR,      // see enum operator
     TOKEN_STATEMENT_END, // ';'
     TOKEN_PAREN_OPEN, 
     TOKEN_PAREN_CLOSE,
+    TOKEN_BLOCK_OPEN,    // '{'
+    TOKEN_BLOCK_CLOSE,   // '}'
+    TOKEN_COMMA,         // ','
     TOKEN_IF,
+    TOKEN_ELSE,
+    TOKEN_WHILE,
+    TOKEN_FN,
+    TOKEN_RETURN,
     TOKEN_EOF,
     TOKEN_UNKNOWN,
     TOKEN_TYPE_COUNT
 };
 
-static const char* token_type_str[TOKEN_TYPE_COUNT] = {
+static const char* const token_type_str[TOKEN_TYPE_COUNT] = {
     [TOKEN_IDENTIFIER]    = "TOKEN_IDENTIFIER",
     [TOKEN_STRING]        = "TOKEN_STRING",
     [TOKEN_INTEGER]       = "TOKEN_INTEGER",
@@ -28,7 +36,14 @@ static const char* token_type_str[TOKEN_TYPE_COUNT] = {
     [TOKEN_OPERATOR]      = "TOKEN_OPERATOR",
     [TOKEN_PAREN_OPEN]    = "TOKEN_PAREN_OPEN",
     [TOKEN_PAREN_CLOSE]   = "TOKEN_PAREN_CLOSE",
+    [TOKEN_BLOCK_OPEN]    = "TOKEN_BLOCK_OPEN",
+    [TOKEN_BLOCK_CLOSE]   = "TOKEN_BLOCK_CLOSE",
+    [TOKEN_COMMA]         = "TOKEN_COMMA",
     [TOKEN_IF]            = "TOKEN_IF",
+    [TOKEN_ELSE]          = "TOKEN_ELSE",
+    [TOKEN_WHILE]         = "TOKEN_WHILE",
+    [TOKEN_FN]            = "TOKEN_FN",
+    [TOKEN_RETURN]        = "TOKEN_RETURN",
     [TOKEN_STATEMENT_END] = "TOKEN_STATEMENT_END",
     [TOKEN_EOF]           = "TOKEN_EOF",
     [TOKEN_UNKNOWN]       = "TOKEN_UNKNOWN",
@@ -37,18 +52,63 @@ static const char* token_type_str[TOKEN_TYPE_COUNT] = {
 typedef struct token {
     char* start;
     char* end;
-    uint32_t type;
+    uint16_t type;
+    uint16_t op; // enum operator if type is TOKEN_OPERATOR
 } Token;
 
-char* token_str(Token* t);
+void token_read_into(Error* err, Mfile* m, Token* t);
+
+/* Prints a token's text with printf: printf(TOKEN_FMT, TOKEN_ARG(t)) */
+#define TOKEN_FMT "%.*s"
+#define TOKEN_ARG(t) (int)((t)->end - (t)->start), (t)->start
 void token_print(Error* err, Token* t);
 
+struct token_pipe;
+
+#define TOKENSTREAM_LOOKAHEAD 32 // power of two
+
+/* Tokens already lexed are kept by value in a small ring, so the parser can
+ * look a few tokens ahead, or over a whole short statement (see batch.h),
+ * without allocating or moving the byte cursor back.
+ * A lexer error is held back until the token it belongs to becomes current */
 typedef struct token_stream {
-    Token* cur;
+    Token ahead[TOKENSTREAM_LOOKAHEAD]; // ahead[head] is the current token
+    uint32_t head;
+    uint32_t len;            // tokens in ahead, at least 1 once attached
+    bool done;               // TOKEN_EOF or an error was lexed
+    Error pending;           // lexer error for the token pending_at ahead
+    uint32_t pending_at;
+    bool failed;             // the current token is one the lexer failed on
     Mfile* m;
+    struct token_pipe* pipe; // NULL if tokens are read on the calling thread
 } TokenStream;
 
 TokenStream tokenstream_attach(Error* err, Mfile* m);
+
+/* Like tokenstream_attach, but lexes on a separate thread that runs ahead of
+ * the parser. m must not be touched by the caller until tokenstream_detach */
+TokenStream tokenstream_attach_pipelined(Error* err, Mfile* m);
+
+/* Stops the lexer thread of a pipelined stream, the current token stays
+ * valid */
+void        tokenstream_detach(TokenStream* ts);
+
+/* Detaches and drops any error that was lexed but not reached */
+void        tokenstream_close(TokenStream* ts);
+
+/* Moves to the next token. Pushes to err if the lexer failed on it */
 bool        tokenstream_advance(Error* err, TokenStream* ts);
 Token*      tokenstream_cur(TokenStream* ts);
-Token*      tokenstream_get(Error* err, TokenStream* ts);
+
+/* Panic mode recovery: skips the rest of a statement whose current token is
+ * blocks levels of '{' deep, up to and including its ';', or the '}' that
+ * closes its outermost block. If the lexer failed on the current token, the
+ * end is looked for in the bytes after the token's first one, outside of
+ * string literals, and lexing starts over from there. Pushes to err if the
+ * lexer fails on the first token after the statement */
+bool        tokenstream_skip_statement(Error* err, TokenStream* ts, uint32_t blocks);
+
+/* Token k places after the current one, k < TOKENSTREAM_LOOKAHEAD. Valid
+ * until the next tokenstream_advance. Past the end of input, or past a token
+ * the lexer failed on, this is a copy of that last token */
+Token*      tokenstream_peek(TokenStream* ts, uint32_t k);
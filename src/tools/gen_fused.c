@@ -0,0 +1,305 @@
+
+/* Generates fused_kernels.c from operator profiles written by
+ * lang --op-profile, see fuse.h:
+ *
+ *    gen_fused [-n COUNT] -o <out.c> <profile>...
+ *
+ * The counts of all profiles are added up and the COUNT (default 8) most
+ * frequent pairs this tool knows how to fuse get a kernel. Pairs of strings,
+ * of mixed operand types or with shifts are left to the unfused
+ * instructions. */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PAIRS 4096
+
+enum kind {
+    PLAIN,   // expr of a and b
+    CHECKED, // arith_*_i64 function of a and b that reports overflow
+    DIVIDE,  // expr of a and b, b == 0 and b == -1 are left to the slow path
+    CONVERT, // expr of a
+};
+
+enum type { INT, FLOAT, TYPES };
+
+static const char* type_str[TYPES]  = {"int", "float"};
+static const char* type_enum[TYPES] = {"VALUE_INTEGER", "VALUE_FLOATING"};
+static const char* type_c[TYPES]    = {"int64_t", "double"};
+static const char* type_field[TYPES] = {"i64", "f64"};
+
+struct impl {
+    enum kind kind; // of a NULL expr: not fused
+    const char* expr;
+    enum type result;
+};
+
+struct gen_op {
+    const char* str;  // as in op_table
+    const char* name; // enum operator
+    struct impl impl[TYPES];
+};
+
+static const struct gen_op ops[] = {
+    {"+",  "OP_ADD", {{CHECKED, "arith_add_i64", INT}, {PLAIN, "a + b", FLOAT}}},
+    {"-",  "OP_SUB", {{CHECKED, "arith_sub_i64", INT}, {PLAIN, "a - b", FLOAT}}},
+    {"*",  "OP_MUL", {{CHECKED, "arith_mul_i64", INT}, {PLAIN, "a * b", FLOAT}}},
+    {"/",  "OP_DIV", {{DIVIDE, "a / b", INT},          {PLAIN, "a / b", FLOAT}}},
+    {"%",  "OP_MOD", {{DIVIDE, "a % b", INT},          {0}}},
+    {"==", "OP_EQ",  {{PLAIN, "a == b", INT},          {PLAIN, "a == b", INT}}},
+    {"!=", "OP_NE",  {{PLAIN, "a != b", INT},          {PLAIN, "a != b", INT}}},
+    {"<",  "OP_LT",  {{PLAIN, "a < b", INT},           {PLAIN, "a < b", INT}}},
+    {"<=", "OP_LE",  {{PLAIN, "a <= b", INT},          {PLAIN, "a <= b", INT}}},
+    {">",  "OP_GT",  {{PLAIN, "a > b", INT},           {PLAIN, "a > b", INT}}},
+    {">=", "OP_GE",  {{PLAIN, "a >= b", INT},          {PLAIN, "a >= b", INT}}},
+    {"&&", "OP_AND", {{PLAIN, "a != 0 && b != 0", INT}, {PLAIN, "a != 0 && b != 0", INT}}},
+    {"||", "OP_OR",  {{PLAIN, "a != 0 || b != 0", INT}, {PLAIN, "a != 0 || b != 0", INT}}},
+    {"&",  "OP_BAND", {{PLAIN, "a & b", INT},          {0}}},
+    {"|",  "OP_BOR", {{PLAIN, "a | b", INT},           {0}}},
+    {"^",  "OP_BXOR", {{PLAIN, "a ^ b", INT},          {0}}},
+    {"float", "OP_TO_FLOAT", {{CONVERT, "(double)a", FLOAT}, {0}}},
+};
+
+#define OPS_LEN (sizeof ops / sizeof *ops)
+
+struct pair {
+    const struct gen_op* inner;
+    const struct gen_op* outer;
+    enum type t;  // of both inner operands
+    enum type zt;
+    bool inner_rhs;
+    uint64_t count;
+};
+
+static struct pair pairs[MAX_PAIRS];
+static uint32_t pairs_len;
+static uint64_t total;
+
+static const struct gen_op* op_find(const char* s)
+{
+    for (size_t i = 0; i < OPS_LEN; i++) {
+        if (strcmp(ops[i].str, s) == 0)
+            return &ops[i];
+    }
+    return NULL;
+}
+
+static int type_find(const char* s)
+{
+    for (int t = 0; t < TYPES; t++) {
+        if (strcmp(type_str[t], s) == 0)
+            return t;
+    }
+    return -1;
+}
+
+/* Adds a pair of the profile, false if it can't be fused */
+static bool pair_add(const char* inner, const char* lt, const char* rt, const char* outer,
+                     const char* side, const char* zt, uint64_t count)
+{
+    struct pair p = {
+        .inner = op_find(inner),
+        .outer = op_find(outer),
+        .t = type_find(lt),
+        .zt = type_find(zt),
+        .inner_rhs = strcmp(side, "rhs") == 0,
+        .count = count,
+    };
+    if (!p.inner || !p.outer || (int)p.t < 0 || (int)p.zt < 0 || type_find(rt) != (int)p.t
+     || !p.inner->impl[p.t].expr)
+    {
+        return false;
+    }
+    // the outer operands have one type, t is converted by a node of its own
+    const enum type tt = p.inner->impl[p.t].result;
+    if (tt != p.zt || !p.outer->impl[tt].expr || p.outer->impl[tt].kind == CONVERT)
+        return false;
+    for (uint32_t i = 0; i < pairs_len; i++) {
+        struct pair* q = &pairs[i];
+        if (q->inner == p.inner && q->outer == p.outer && q->t == p.t && q->zt == p.zt
+         && q->inner_rhs == p.inner_rhs)
+        {
+            q->count += count;
+            return true;
+        }
+    }
+    if (pairs_len == MAX_PAIRS)
+        return false;
+    pairs[pairs_len++] = p;
+    return true;
+}
+
+static bool read_profile(const char* path)
+{
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[256];
+    for (int n = 1; fgets(line, sizeof line, in); n++) {
+        char kind[8], inner[8], lt[8], rt[8], outer[8], side[8], zt[8];
+        uint64_t count;
+        if (line[0] == '#' || line[0] == '\n' || strncmp(line, "op ", 3) == 0)
+            continue;
+        if (sscanf(line, "%7s %7s %7s %7s %7s %7s %7s %" SCNu64, kind, inner, lt, rt, outer, side,
+                   zt, &count) != 8 || strcmp(kind, "pair") != 0)
+        {
+            fprintf(stderr, "malformed line %d of %s\n", n, path);
+            fclose(in);
+            return false;
+        }
+        total += count;
+        pair_add(inner, lt, rt, outer, side, zt, count);
+    }
+    fclose(in);
+    return true;
+}
+
+static int by_count(const void* a, const void* b)
+{
+    const uint64_t x = ((const struct pair*)a)->count;
+    const uint64_t y = ((const struct pair*)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Statements computing res = lhs op rhs over operands of type t */
+static void emit_op(FILE* out, uint32_t k, const struct gen_op* op, enum type t,
+                    const char* lhs, const char* rhs, const char* res)
+{
+    const struct impl* im = &op->impl[t];
+    fprintf(out, "    %s %s;\n    {\n", type_c[im->result], res);
+    fprintf(out, "        const %s a = %s, b = %s;\n", type_c[t], lhs, rhs);
+    switch (im->kind) {
+    case PLAIN:
+        fprintf(out, "        %s = %s;\n", res, im->expr);
+        break;
+    case CHECKED:
+        fprintf(out, "        ovf |= %s(a, b, &%s);\n", im->expr, res);
+        break;
+    case DIVIDE:
+        fprintf(out, "        if (__builtin_expect(b == 0 || b == -1, 0))\n"
+                     "            return fused_slow_(err, policy, strs, &fused_table[%" PRIu32 "], "
+                     "x, y, z, t, out);\n", k);
+        fprintf(out, "        %s = %s;\n", res, im->expr);
+        break;
+    case CONVERT:
+        fprintf(out, "        (void)b;\n        %s = %s;\n", res, im->expr);
+        break;
+    }
+    fprintf(out, "    }\n");
+}
+
+static void emit_kernel(FILE* out, uint32_t k, const struct pair* p)
+{
+    const enum type tt = p->inner->impl[p->t].result;
+    const bool checked = p->inner->impl[p->t].kind == CHECKED || p->outer->impl[tt].kind == CHECKED;
+    char zv[16];
+    snprintf(zv, sizeof zv, "z->%s", type_field[p->zt]);
+    char xv[16], yv[16];
+    snprintf(xv, sizeof xv, "x->%s", type_field[p->t]);
+    snprintf(yv, sizeof yv, "y->%s", type_field[p->t]);
+
+    char inner[32];
+    if (p->inner->impl[p->t].kind == CONVERT)
+        snprintf(inner, sizeof inner, "%s(%s)", p->inner->str, type_str[p->t]);
+    else
+        snprintf(inner, sizeof inner, "(%s %s %s)", type_str[p->t], p->inner->str, type_str[p->t]);
+    fprintf(out, "/* %s %s %s, %.1f%% of the pairs profiled */\n",
+            p->inner_rhs ? type_str[p->zt] : inner, p->outer->str,
+            p->inner_rhs ? inner : type_str[p->zt], total ? 100.0 * p->count / total : 0.0);
+    fprintf(out, "static bool fused_%" PRIu32 "(FUSED_PARAMS)\n{\n", k);
+    fprintf(out, "    (void)err, (void)policy, (void)strs;\n");
+    if (checked)
+        fprintf(out, "    bool ovf = false;\n");
+    emit_op(out, k, p->inner, p->t, xv, yv, "u");
+    emit_op(out, k, p->outer, tt, p->inner_rhs ? zv : "u", p->inner_rhs ? "u" : zv, "v");
+    if (checked) {
+        fprintf(out, "    if (__builtin_expect(ovf && policy != OVERFLOW_WRAP, 0))\n"
+                     "        return fused_slow_(err, policy, strs, &fused_table[%" PRIu32 "], "
+                     "x, y, z, t, out);\n", k);
+    }
+    const enum type vt = p->outer->impl[tt].result;
+    fprintf(out, "    *t   = (Value){.type = %s, .%s = u};\n", type_enum[tt], type_field[tt]);
+    fprintf(out, "    *out = (Value){.type = %s, .%s = v};\n", type_enum[vt], type_field[vt]);
+    fprintf(out, "    return true;\n}\n\n");
+}
+
+static bool write_kernels(const char* path, uint32_t n)
+{
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fprintf(out,
+        "/* Generated by tools/gen_fused, do not edit. See fuse.h */\n\n"
+        "#include <stdbool.h>\n#include <stdint.h>\n\n"
+        "#include \"arith.h\"\n#include \"error.h\"\n#include \"fuse.h\"\n"
+        "#include \"operator.h\"\n#include \"value.h\"\n\n"
+        "#define FUSED_PARAMS                                                         \\\n"
+        "    Error* err, enum overflow_policy policy, struct str_table* strs,         \\\n"
+        "    const Value* x, const Value* y, const Value* z, Value* t, Value* out\n\n");
+    for (uint32_t k = 0; k < n; k++)
+        emit_kernel(out, k, &pairs[k]);
+    fprintf(out, "const struct fused_info fused_table[] = {\n");
+    for (uint32_t k = 0; k < n; k++) {
+        const struct pair* p = &pairs[k];
+        fprintf(out, "    {%s, %s, %s, %s, %s, %s, fused_%" PRIu32 "},\n", p->inner->name,
+                type_enum[p->t], type_enum[p->t], p->outer->name, type_enum[p->zt],
+                p->inner_rhs ? "true" : "false", k);
+    }
+    if (n == 0)
+        fprintf(out, "    {0},\n");
+    fprintf(out, "};\n\nconst uint32_t fused_count = %" PRIu32 ";\n", n);
+    bool ok = !ferror(out);
+    if (fclose(out) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+    return ok;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr, "usage: %s [-n COUNT] -o <out.c> <profile>...\n", argv0);
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = NULL;
+    long n = 8;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            char* end;
+            n = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || n < 0 || n > MAX_PAIRS) {
+                fprintf(stderr, "bad kernel count: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!path || i == argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (; i < argc; i++) {
+        if (!read_profile(argv[i]))
+            return EXIT_FAILURE;
+    }
+    qsort(pairs, pairs_len, sizeof *pairs, by_count);
+    if ((uint32_t)n > pairs_len)
+        n = pairs_len;
+    return write_kernels(path, n) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
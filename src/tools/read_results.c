@@ -0,0 +1,61 @@
+
+/* Prints a file written by lang --results-out, one row per line:
+ *
+ *     <statement> int <value>
+ *     <statement> float <value>
+ *     <statement> error <line>:<column>
+ *
+ *    read_results <file>
+ *
+ * Floats are printed with %.17g so they read back to the same double. */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "results.h"
+#include "value.h"
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Error err = ERROR_INIT;
+    ResultFile f;
+    if (!result_file_map(&err, &f, argv[1])) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+
+    ResultBlock b;
+    while (result_file_next(&err, &f, &b)) {
+        for (uint32_t i = 0; i < b.rows; i++) {
+            const Value v = result_value(&b, i);
+            switch (b.tag[i]) {
+            case RESULT_INTEGER:
+                printf("%" PRIu64 " int %" PRId64 "\n", b.statement[i], v.i64);
+                break;
+            case RESULT_FLOATING:
+                printf("%" PRIu64 " float %.17g\n", b.statement[i], v.f64);
+                break;
+            case RESULT_ERROR:
+                printf("%" PRIu64 " error %" PRIu64 ":%" PRIu64 "\n", b.statement[i],
+                       b.payload[i] >> 32, b.payload[i] & UINT32_MAX);
+                break;
+            default:
+                printf("%" PRIu64 " unknown tag %u\n", b.statement[i], b.tag[i]);
+                break;
+            }
+        }
+    }
+    result_file_unmap(&f);
+    if (!error_empty(&err)) {
+        error_print(&err);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
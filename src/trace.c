@@ -0,0 +1,184 @@
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "mem.h"
+#include "trace.h"
+
+#define TRACE_CHUNK_EVENTS 4096
+
+struct trace_event {
+    const char* name;
+    uint64_t start;
+    uint64_t dur;
+};
+
+struct trace_chunk {
+    struct trace_chunk* next;
+    uint32_t len;
+    struct trace_event events[TRACE_CHUNK_EVENTS];
+};
+
+/* Owned by one thread until trace_write */
+struct trace_buffer {
+    struct trace_buffer* next;
+    long tid;
+    const char* thread_name;
+    struct trace_chunk* first;
+    struct trace_chunk* last;
+    uint64_t dropped; // events lost to failed allocations
+};
+
+bool trace_enabled = false;
+
+static uint64_t trace_epoch;
+static _Atomic(struct trace_buffer*) trace_buffers;
+static _Thread_local struct trace_buffer* trace_local;
+
+uint64_t trace_now_(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void trace_start(void)
+{
+    trace_epoch   = trace_now_();
+    trace_enabled = true;
+}
+
+static struct trace_buffer* trace_buffer_get(void)
+{
+    if (trace_local)
+        return trace_local;
+
+    struct trace_buffer* b = mem_calloc(MEM_TRACE, 1, sizeof *b);
+    if (!b)
+        return NULL;
+    b->tid = syscall(SYS_gettid);
+
+    b->next = atomic_load_explicit(&trace_buffers, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&trace_buffers, &b->next, b,
+                memory_order_release, memory_order_relaxed))
+        ;
+    trace_local = b;
+    return b;
+}
+
+void trace_record_(TraceSpan s, uint64_t end)
+{
+    struct trace_buffer* b = trace_buffer_get();
+    if (!b)
+        return;
+
+    struct trace_chunk* c = b->last;
+    if (!c || c->len == TRACE_CHUNK_EVENTS) {
+        c = mem_alloc(MEM_TRACE, sizeof *c);
+        if (!c) {
+            b->dropped++;
+            return;
+        }
+        c->next = NULL;
+        c->len  = 0;
+        if (b->last)
+            b->last->next = c;
+        else
+            b->first = c;
+        b->last = c;
+    }
+    c->events[c->len++] = (struct trace_event){
+        .name  = s.name,
+        .start = s.start - trace_epoch,
+        .dur   = end - s.start,
+    };
+}
+
+void trace_thread_name(const char* name)
+{
+    if (!trace_enabled)
+        return;
+    struct trace_buffer* b = trace_buffer_get();
+    if (b)
+        b->thread_name = name;
+}
+
+static void trace_write_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+bool trace_write(Error* err, const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        error_push(err, "failed to open trace file %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    const long pid = getpid();
+    uint64_t dropped = 0;
+    const char* sep = "\n";
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    struct trace_buffer* b = atomic_load_explicit(&trace_buffers, memory_order_acquire);
+    for (; b; b = b->next) {
+        if (b->thread_name) {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,"
+                       "\"args\":{\"name\":", sep, pid, b->tid);
+            trace_write_string(f, b->thread_name);
+            fprintf(f, "}}");
+            sep = ",\n";
+        }
+        for (struct trace_chunk* c = b->first; c; c = c->next) {
+            for (uint32_t i = 0; i < c->len; i++) {
+                const struct trace_event* e = &c->events[i];
+                fprintf(f, "%s{\"name\":", sep);
+                trace_write_string(f, e->name);
+                // microseconds, the unit of the format
+                fprintf(f, ",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}",
+                        pid, b->tid, e->start / 1000.0, e->dur / 1000.0);
+                sep = ",\n";
+            }
+        }
+        dropped += b->dropped;
+    }
+    fprintf(f, "\n],\"otherData\":{\"dropped_events\":%llu}}\n", (unsigned long long)dropped);
+
+    if (ferror(f) | (fclose(f) != 0)) {
+        error_push(err, "failed to write trace file %s", path);
+        return false;
+    }
+    return true;
+}
+
+void trace_free(void)
+{
+    trace_enabled = false;
+    struct trace_buffer* b = atomic_exchange(&trace_buffers, NULL);
+    while (b) {
+        struct trace_buffer* next = b->next;
+        struct trace_chunk* c = b->first;
+        while (c) {
+            struct trace_chunk* cn = c->next;
+            mem_free(c);
+            c = cn;
+        }
+        mem_free(b);
+        b = next;
+    }
+    trace_local = NULL;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+
+/* Timeline tracing in Chrome trace-event format, for Perfetto or
+ * chrome://tracing. Every thread appends complete events to its own buffer,
+ * which is registered on first use with a single compare-and-swap, so
+ * recording never takes a lock. trace_write dumps all buffers once the other
+ * threads are done.
+ *
+ * When tracing is off a span costs one predictable branch in trace_begin,
+ * trace_end only tests the span it was handed. */
+
+extern bool trace_enabled;
+
+typedef struct trace_span {
+    const char* name; // NULL if tracing was off when the span began
+    uint64_t start;   // ns
+} TraceSpan;
+
+uint64_t trace_now_(void);
+void     trace_record_(TraceSpan s, uint64_t end);
+
+/* Starts tracing, timestamps are relative to this call */
+void trace_start(void);
+
+/* name must be a string literal, or live until trace_write */
+static inline TraceSpan trace_begin(const char* name)
+{
+    if (__builtin_expect(trace_enabled, 0))
+        return (TraceSpan){.name = name, .start = trace_now_()};
+    return (TraceSpan){.name = NULL, .start = 0};
+}
+
+static inline void trace_end(TraceSpan s)
+{
+    if (__builtin_expect(s.name != NULL, 0))
+        trace_record_(s, trace_now_());
+}
+
+/* Labels the calling thread's track */
+void trace_thread_name(const char* name);
+
+/* Writes every recorded event to path as a JSON trace. Threads that recorded
+ * events must not be running */
+bool trace_write(Error* err, const char* path);
+
+/* Frees all buffers and stops tracing */
+void trace_free(void);
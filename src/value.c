@@ -0,0 +1,52 @@
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "str.h"
+#include "value.h"
+
+static const char* value_type_str[VALUE_TYPE_COUNT] = {
+    [VALUE_INTEGER]  = "VALUE_INTEGER",
+    [VALUE_FLOATING] = "VALUE_FLOATING",
+    [VALUE_STRING]   = "VALUE_STRING",
+};
+
+const char* value_type_name(enum value_type type)
+{
+    return type < VALUE_TYPE_COUNT ? value_type_str[type] : "(bad value type)";
+}
+
+enum value_type value_type_parse(const char* name, size_t len)
+{
+    if (len == 3 && memcmp(name, "int", 3) == 0)
+        return VALUE_INTEGER;
+    if (len == 5 && memcmp(name, "float", 5) == 0)
+        return VALUE_FLOATING;
+    if (len == 3 && memcmp(name, "str", 3) == 0)
+        return VALUE_STRING;
+    return VALUE_TYPE_COUNT;
+}
+
+void value_print(FILE* out, const Value* v)
+{
+    switch (v->type) {
+    case VALUE_INTEGER:
+        fprintf(out, "%" PRId64, v->i64);
+        break;
+    case VALUE_FLOATING:
+        fprintf(out, "%lf", v->f64);
+        break;
+    case VALUE_STRING: {
+        size_t len;
+        const char* bytes = str_bytes(NULL, v, &len);
+        if (bytes)
+            fwrite(bytes, 1, len, out);
+        else
+            fprintf(out, "(out of memory)");
+        break;}
+    default:
+        fprintf(out, "(bad value)");
+        break;
+    }
+}
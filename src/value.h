@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum value_type {
+    VALUE_INTEGER,
+    VALUE_FLOATING,
+    VALUE_STRING,   // see str.h
+    VALUE_TYPE_COUNT
+};
+
+/* Longest string stored in the Value itself */
+#define VALUE_SMALL_STR 11
+
+/* Value.small_len of a longer string, which is held in Value.str */
+#define VALUE_LONG_STR UINT8_MAX
+
+/* A zeroed Value of any type is 0, 0.0 or "" */
+typedef struct value {
+    enum value_type type;
+    // VALUE_STRING: a short string is small_len bytes from small on, running
+    // on into the union, with the rest zeroed
+    uint8_t small_len;
+    char small[3];
+    union {
+        int64_t i64;
+        double f64;
+        struct str* str;
+    };
+} Value;
+
+const char* value_type_name(enum value_type type);
+
+/* Type called name in source code, VALUE_TYPE_COUNT if there is none */
+enum value_type value_type_parse(const char* name, size_t len);
+
+/* Zero of type */
+static inline Value value_zero(enum value_type type)
+{
+    return (Value){.type = type};
+}
+
+void value_print(FILE* out, const Value* v);